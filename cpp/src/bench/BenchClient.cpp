@@ -0,0 +1,124 @@
+/*======================================================================
+COIS-4310H - BenchClient
+Name: BenchClient.cpp
+Purpose: Helpers shared by the benchmarks for connecting load clients
+	to a running server, and reading the server's resource usage.
+
+Compilation: Please use the provided Make file (make bench)
+----------------------------------------------------------------------*/
+
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+extern "C" {
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+}
+#include "BenchClient.hpp"
+
+// Monotonic clock in nanoseconds
+int64_t now_ns(void)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		       std::chrono::steady_clock::now().time_since_epoch())
+		.count();
+}
+
+// Pull a field out of the server's /proc status file
+std::string proc_status_field(int pid, const std::string &field)
+{
+	std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+	std::string line;
+	while (std::getline(status, line)) {
+		if (line.compare(0, field.size(), field) == 0) {
+			std::string value = line.substr(field.size() + 1);
+			value.erase(0, value.find_first_not_of(" \t"));
+			return value;
+		}
+	}
+	return "?";
+}
+
+// Print the server's resident memory and thread count (if pid is set)
+void report_server(int pid, const std::string &when)
+{
+	if (pid <= 0)
+		return;
+	std::cout << when << ": server VmRSS " << proc_status_field(pid, "VmRSS")
+		  << ", threads " << proc_status_field(pid, "Threads")
+		  << std::endl;
+}
+
+// Write the whole buffer to a (non-blocking) socket
+bool write_all(int socket, const uint8_t *data, size_t len)
+{
+	while (len > 0) {
+		ssize_t sent = send(socket, data, len, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+			    errno == EINTR) {
+				pollfd pfd = { .fd = socket, .events = POLLOUT };
+				poll(&pfd, 1, 100);
+				continue;
+			}
+			return false;
+		}
+		data += sent;
+		len -= sent;
+	}
+	return true;
+}
+
+// Open a non-blocking connection to the server, and send a login request
+// for username. Exits if the server can't be reached.
+int connect_and_log_in(const std::string &username)
+{
+	sockaddr_in address = { .sin_family = AF_INET,
+				.sin_port = htons(SERVER_PORT) };
+	if (inet_pton(AF_INET, SERVER_ADDRESS, &(address.sin_addr)) <= 0) {
+		std::cerr << "Error building IPV4 Address." << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	int client_socket = socket(AF_INET, SOCK_STREAM, 0);
+	if (client_socket < 0 ||
+	    connect(client_socket, (sockaddr *)&address, sizeof(sockaddr_in)) <
+		    0) {
+		std::cerr << "Unable to open connection for " << username
+			  << ": " << std::strerror(errno) << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	fcntl(client_socket, F_SETFL, fcntl(client_socket, F_GETFL) | O_NONBLOCK);
+	MessageLayer ml;
+	MessageHeader &header = ml.set_version_number(3)
+					.set_source_username(username)
+					.set_dest_username("server")
+					.set_message_type(MessageTypes::LOGIN)
+					.build();
+	write_all(client_socket, header.data(), header.size());
+	return client_socket;
+}
+
+// Build a version 3 message from source to destination
+std::vector<uint8_t> build_load_message(uint16_t packet_number,
+					const std::string &source,
+					const std::string &destination,
+					const std::vector<uint8_t> &payload)
+{
+	MessageLayer ml;
+	MessageHeader &header = ml.set_packet_number(packet_number)
+					.set_version_number(3)
+					.set_source_username(source)
+					.set_dest_username(destination)
+					.set_message_type(MessageTypes::MESSAGE)
+					.set_frame_flags(frame_flag_ack_ranges)
+					.calculate_data_packet_checksum(payload)
+					.set_data_packet_length(payload.size())
+					.build();
+	return build_message(header, payload);
+}
@@ -0,0 +1,35 @@
+/*======================================================================
+COIS-4310H - BenchClient Header
+Name: BenchClient.hpp
+Purpose: Helpers shared by the benchmarks for connecting load clients
+	to a running server, and reading the server's resource usage.
+
+Compilation: Please use the provided Make file (make bench)
+----------------------------------------------------------------------*/
+
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "MessageLayer.hpp"
+
+#define SERVER_ADDRESS "127.0.0.1"
+#define SERVER_PORT 34551
+
+// Monotonic clock in nanoseconds
+int64_t now_ns(void);
+// Pull a field out of the server's /proc status file
+std::string proc_status_field(int pid, const std::string &field);
+// Print the server's resident memory and thread count (if pid is set)
+void report_server(int pid, const std::string &when);
+// Write the whole buffer to a (non-blocking) socket
+bool write_all(int socket, const uint8_t *data, size_t len);
+// Open a non-blocking connection to the server, and send a login request
+// for username. Exits if the server can't be reached.
+int connect_and_log_in(const std::string &username);
+// Build a version 3 message from source to destination (from a sender
+// that understands ACK ranges)
+std::vector<uint8_t> build_load_message(uint16_t packet_number,
+					const std::string &source,
+					const std::string &destination,
+					const std::vector<uint8_t> &payload);
@@ -0,0 +1,210 @@
+/*======================================================================
+COIS-4310H - BroadcastLatency
+Name: BroadcastLatency.cpp
+Purpose: Measure how long a broadcast takes to reach the whole room, as
+	the room grows. One client sends broadcasts one at a time, waiting
+	for every other member of the room to receive each one, and the
+	time until the first and the last member has it is reported for
+	each room size.
+
+Usage: ./BroadcastLatency [max_room] [broadcasts]
+	e.g. ./MessageServer --epoll 4 --fan_out 3 & ./BroadcastLatency 4096
+
+Description of Parameters
+	max_room: largest room to measure; rooms of 16, 64, 256, ... users
+		are measured up to this size (default 2048)
+	broadcasts: number of broadcasts timed in each room (default 200)
+
+	Every connection uses a file descriptor in both this process and the
+	server, so raise the open file limit (ulimit -n) for large rooms.
+
+Compilation: Please use the provided Make file (make bench)
+----------------------------------------------------------------------*/
+
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <algorithm>
+extern "C" {
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+}
+#include "MessageLayer.hpp"
+#include "BenchClient.hpp"
+
+// Receive state of one room member
+struct Member {
+	int socket;
+	MessageHeader header;
+	size_t header_received = 0;
+	size_t data_remaining = 0;
+};
+
+// Name of the member sending the broadcasts
+static const std::string sender_username = "bcast0";
+
+// Counters updated by the receiving thread
+static std::atomic<uint64_t> logins_received(0);
+static std::atomic<uint64_t> broadcasts_received(0);
+static std::atomic<int64_t> first_receive_ns(0);
+static std::atomic<int64_t> last_receive_ns(0);
+static std::atomic<bool> running(true);
+
+// Count the frames in the bytes just read from a member
+static void consume(Member &member, const uint8_t *data, size_t len)
+{
+	while (len > 0) {
+		if (member.data_remaining > 0) {
+			size_t skip = std::min(len, member.data_remaining);
+			member.data_remaining -= skip;
+			data += skip;
+			len -= skip;
+			continue;
+		}
+		size_t take = std::min(len, member.header.size() -
+						    member.header_received);
+		std::memcpy(member.header.data() + member.header_received,
+			    data, take);
+		member.header_received += take;
+		data += take;
+		len -= take;
+		if (member.header_received < member.header.size())
+			continue;
+		member.header_received = 0;
+		uint8_t type = member.header[message_type_begin];
+		member.data_remaining = ntohs(*(
+			(uint16_t *)&(member.header[data_packet_length_begin])));
+		if (type == MessageTypes::LOGIN) {
+			++logins_received;
+		} else if (type == MessageTypes::MESSAGE &&
+			   std::memcmp(&(member.header[source_username_begin]),
+				       sender_username.c_str(),
+				       sender_username.size() + 1) == 0) {
+			int64_t now = now_ns();
+			int64_t unset = 0;
+			first_receive_ns.compare_exchange_strong(unset, now);
+			last_receive_ns = now;
+			++broadcasts_received;
+		}
+	}
+}
+
+// Drain every member's connection, counting what arrives
+static void receiver(int epoll_fd)
+{
+	std::vector<epoll_event> events(256);
+	std::vector<uint8_t> buffer(1 << 16);
+	while (running) {
+		int count = epoll_wait(epoll_fd, events.data(), events.size(),
+				       100);
+		for (int i = 0; i < count; ++i) {
+			Member &member = *(Member *)events[i].data.ptr;
+			while (true) {
+				ssize_t got = read(member.socket, buffer.data(),
+						   buffer.size());
+				if (got <= 0)
+					break;
+				consume(member, buffer.data(), got);
+			}
+		}
+	}
+}
+
+// Value at the passed percentile of the sorted samples
+static double percentile(const std::vector<int64_t> &sorted, double p)
+{
+	size_t index = (size_t)(p / 100.0 * (sorted.size() - 1));
+	return sorted[index] / 1000.0;
+}
+
+int main(int argc, char **argv)
+{
+	size_t max_room = argc > 1 ? std::stoul(argv[1]) : 2048;
+	size_t broadcasts = argc > 2 ? std::stoul(argv[2]) : 200;
+	int epoll_fd = epoll_create1(0);
+	std::thread receive_thread(receiver, epoll_fd);
+	std::vector<Member *> room;
+	std::vector<uint8_t> payload(64, 'b');
+	uint16_t packet_number = 0;
+
+	std::cout << "room size, first delivery us (mean), "
+		     "whole room us (mean, p50, p99)"
+		  << std::endl;
+	for (size_t room_size = 16; room_size <= max_room; room_size *= 4) {
+		// Grow the room, the sender is always the first member.
+		while (room.size() < room_size) {
+			Member *member = new Member();
+			std::string username =
+				room.empty() ? sender_username :
+					       "member" + std::to_string(room.size());
+			member->socket = connect_and_log_in(username);
+			epoll_event event;
+			event.events = EPOLLIN;
+			event.data.ptr = member;
+			epoll_ctl(epoll_fd, EPOLL_CTL_ADD, member->socket, &event);
+			room.push_back(member);
+		}
+		while (logins_received < room.size())
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		// Let the "entered the room" broadcasts settle.
+		std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+		std::vector<int64_t> first, whole;
+		for (size_t i = 0; i < broadcasts; ++i) {
+			uint64_t expected =
+				broadcasts_received + (room_size - 1);
+			auto message = build_load_message(
+				packet_number++, sender_username, "all",
+				payload);
+			first_receive_ns = 0;
+			int64_t start = now_ns();
+			if (!write_all(room[0]->socket, message.data(),
+				       message.size())) {
+				std::cerr << "Sender lost its connection."
+					  << std::endl;
+				exit(EXIT_FAILURE);
+			}
+			// Give up on this broadcast if it stalls
+			while (broadcasts_received < expected &&
+			       now_ns() - start < 5000000000LL)
+				std::this_thread::yield();
+			if (broadcasts_received < expected) {
+				std::cerr << "Broadcast " << i << " only reached "
+					  << room_size - 1 -
+						     (expected - broadcasts_received)
+					  << " of " << room_size - 1 << " members."
+					  << std::endl;
+				broadcasts_received = expected;
+				continue;
+			}
+			first.push_back(first_receive_ns - start);
+			whole.push_back(last_receive_ns - start);
+		}
+		if (whole.empty())
+			continue;
+		std::sort(whole.begin(), whole.end());
+		double first_mean = 0, whole_mean = 0;
+		for (size_t i = 0; i < whole.size(); ++i) {
+			first_mean += first[i] / 1000.0 / whole.size();
+			whole_mean += whole[i] / 1000.0 / whole.size();
+		}
+		std::cout << std::fixed << std::setprecision(1) << room_size
+			  << ", " << first_mean << ", " << whole_mean << ", "
+			  << percentile(whole, 50) << ", "
+			  << percentile(whole, 99) << std::endl;
+	}
+
+	running = false;
+	receive_thread.join();
+	for (auto member : room) {
+		close(member->socket);
+		delete member;
+	}
+	return 0;
+}
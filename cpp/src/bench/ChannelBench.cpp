@@ -0,0 +1,115 @@
+/*======================================================================
+COIS-4310H - ChannelBench
+Name: ChannelBench.cpp
+Purpose: Throughput and bytes on the wire of small messages, each
+	encrypted as a stream of its own (as the client used to), and as
+	the chunks of one channel for the whole session (see
+	Crypto::ChannelEncryptor). Each message is encrypted and decrypted
+	again, the way a sender and receiver would.
+
+Usage: ./ChannelBench [messages]
+	messages: messages of each size sent each way (default 200000)
+
+Compilation: Please use the provided Make file (make bench)
+----------------------------------------------------------------------*/
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cstdlib>
+#include "MessageLayer.hpp"
+#include "CryptoLayer.hpp"
+
+static Crypto::StreamKey key;
+
+// Each message a stream of its own, with its header in front of it
+static bool per_message(const std::string &message, std::vector<uint8_t> &cipher,
+			std::vector<uint8_t> &clear, size_t &wire_size)
+{
+	Crypto::StreamEncryptor encryptor;
+	Crypto::StreamDecryptor decryptor;
+	bool final;
+	wire_size = Crypto::stream_header_size + message.size() +
+		    Crypto::chunk_overhead;
+	return encryptor.begin(key, cipher.data()) &&
+	       encryptor.push((const uint8_t *)message.data(), message.size(),
+			      true, cipher.data() + Crypto::stream_header_size) &&
+	       decryptor.begin(key, cipher.data()) &&
+	       decryptor.pull(cipher.data() + Crypto::stream_header_size,
+			      wire_size - Crypto::stream_header_size,
+			      clear.data(), final) &&
+	       final;
+}
+
+// Each message the next chunk of the session's channel
+static bool channel(Crypto::ChannelEncryptor &encryptor,
+		    Crypto::ChannelDecryptor &decryptor,
+		    const std::string &message, std::vector<uint8_t> &cipher,
+		    std::vector<uint8_t> &clear, size_t &wire_size)
+{
+	bool start = encryptor.starting();
+	size_t clear_len;
+	bool end;
+	wire_size = encryptor.encrypted_size(message.size());
+	return encryptor.push(key, (const uint8_t *)message.data(),
+			      message.size(), true, cipher.data()) &&
+	       decryptor.pull(key, cipher.data(), wire_size, start,
+			      clear.data(), clear_len, end) &&
+	       end && clear_len == message.size();
+}
+
+static void run(size_t messages, size_t size)
+{
+	std::string message(size, 'x');
+	std::vector<uint8_t> cipher(Crypto::stream_header_size + size +
+				    Crypto::chunk_overhead);
+	std::vector<uint8_t> clear(cipher.size());
+	for (int way = 0; way < 2; ++way) {
+		Crypto::ChannelEncryptor encryptor;
+		Crypto::ChannelDecryptor decryptor;
+		uint64_t wire = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < messages; ++i) {
+			size_t wire_size;
+			if (!(way == 0 ?
+				      per_message(message, cipher, clear,
+						  wire_size) :
+				      channel(encryptor, decryptor, message,
+					      cipher, clear, wire_size))) {
+				std::cerr << "Unable to encrypt and decrypt."
+					  << std::endl;
+				exit(EXIT_FAILURE);
+			}
+			// Every frame has a header in front of it
+			wire += std::tuple_size<MessageHeader>::value + wire_size;
+		}
+		double seconds = std::chrono::duration<double>(
+					 std::chrono::steady_clock::now() - start)
+					 .count();
+		std::cout << std::setw(8) << size << std::left << std::setw(14)
+			  << (way == 0 ? "  per message" : "  channel")
+			  << std::right << std::fixed << std::setprecision(0)
+			  << std::setw(14) << messages / seconds
+			  << std::setprecision(1) << std::setw(16)
+			  << (double)wire / messages << std::endl;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	size_t messages = argc > 1 ? std::stoul(argv[1]) : 200000;
+	if (sodium_init() < 0) {
+		std::cerr << "Unable to initialize libsodium." << std::endl;
+		return EXIT_FAILURE;
+	}
+	randombytes_buf(key.data(), key.size());
+	std::cout << std::setw(8) << "bytes" << std::left << std::setw(14)
+		  << "  encrypted" << std::right << std::setw(14)
+		  << "messages/s" << std::setw(16) << "wire bytes/msg"
+		  << std::endl;
+	for (size_t size : { 20, 200, 1000 })
+		run(messages, size);
+	return 0;
+}
@@ -0,0 +1,245 @@
+/*======================================================================
+COIS-4310H - ControlLatency
+Name: ControlLatency.cpp
+Purpose: Measure how long a client's ACKs take to come back while its
+	connection is busy with room traffic. A few clients broadcast at a
+	steady rate, and one member of the room that reads no faster than a
+	set rate (far slower) sends a message to another member every few
+	milliseconds, timing each one until the server's ACK for it has
+	been read. Reported are the ACK round trips (p50, p99, max) and the
+	broadcasts the member got through at the same time.
+
+	The server writes its ACKs ahead of the broadcasts waiting for the
+	member (see OutboundQueue); before it did, they waited behind them.
+
+Usage: ./ControlLatency [seconds] [flooders] [broadcasts] [rate] [bytes]
+			[server_pid]
+	e.g. ./MessageServer --epoll & ./ControlLatency 5 4 2000 2 1024 $!
+
+Description of Parameters
+	seconds: how long to send for (default 5)
+	flooders: number of clients broadcasting (default 4)
+	broadcasts: broadcasts a second each of them sends (default 2000)
+	rate: MiB a second the member reads (default 2)
+	bytes: size of each broadcast's data packet (default 1024)
+	server_pid: pid of the running server, to read its memory usage
+		from /proc (optional). The server is also sent SIGUSR1 at
+		the end, so it prints how long frames waited in its queues.
+
+Compilation: Please use the provided Make file (make bench)
+----------------------------------------------------------------------*/
+
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <csignal>
+#include <algorithm>
+extern "C" {
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+}
+#include "MessageLayer.hpp"
+#include "BenchClient.hpp"
+
+// How often the member sends a message to be ACKed (ms)
+static const int64_t constexpr message_every_ms = 10;
+// Bytes the member's socket buffers, so what waits for it waits on the
+// server
+static const int constexpr member_buffer = 16384;
+
+// When each of the member's messages was sent, by packet number
+static std::vector<std::atomic<int64_t> > sent_ns(65536);
+// Round trips of the ACKs the member has read (ns)
+static std::vector<int64_t> round_trips;
+static std::atomic<uint64_t> broadcasts_received(0);
+static std::atomic<bool> flooding(true);
+static std::atomic<bool> running(true);
+
+// Drain the connections of the flooders and the recipient, so only the
+// member falls behind.
+static void drain(int epoll_fd)
+{
+	std::vector<epoll_event> events(64);
+	std::vector<uint8_t> buffer(1 << 16);
+	while (running) {
+		int count = epoll_wait(epoll_fd, events.data(), events.size(),
+				       100);
+		for (int i = 0; i < count; ++i)
+			while (read(events[i].data.fd, buffer.data(),
+				    buffer.size()) > 0)
+				;
+	}
+}
+
+// Broadcast the passed number a second, a few at a time
+static void flood(int socket, const std::string &username, size_t per_second,
+		  size_t bytes)
+{
+	std::vector<uint8_t> payload(bytes, 'b');
+	uint16_t packet_number = 0;
+	while (flooding) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		for (size_t i = 0; i < per_second / 100; ++i) {
+			auto message = build_load_message(
+				packet_number++, username, "all", payload);
+			if (!write_all(socket, message.data(), message.size()))
+				return;
+		}
+	}
+}
+
+// Read no more than rate bytes a second, timing the ACKs
+static void member_reader(int socket, size_t rate)
+{
+	MessageHeader header;
+	size_t header_received = 0;
+	size_t data_remaining = 0;
+	std::vector<uint8_t> buffer(rate / 100 + 1);
+	while (running) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		ssize_t got = read(socket, buffer.data(), buffer.size());
+		const uint8_t *data = buffer.data();
+		while (got > 0) {
+			if (data_remaining > 0) {
+				size_t skip =
+					std::min((size_t)got, data_remaining);
+				data_remaining -= skip;
+				data += skip;
+				got -= skip;
+				continue;
+			}
+			size_t take = std::min((size_t)got,
+					       header.size() - header_received);
+			std::memcpy(header.data() + header_received, data,
+				    take);
+			header_received += take;
+			data += take;
+			got -= take;
+			if (header_received < header.size())
+				continue;
+			header_received = 0;
+			data_remaining = ntohs(*(
+				(uint16_t *)&(header[data_packet_length_begin])));
+			uint8_t type = header[message_type_begin];
+			if (type == MessageTypes::ACK) {
+				const uint8_t *number =
+					&(header[packet_number_begin]);
+				uint16_t packet_number =
+					(number[0] << 8) | number[1];
+				round_trips.push_back(now_ns() -
+						      sent_ns[packet_number]);
+			} else if (type == MessageTypes::MESSAGE) {
+				++broadcasts_received;
+			}
+		}
+	}
+}
+
+// Value at the passed percentile of the sorted samples (ms)
+static double percentile(const std::vector<int64_t> &sorted, double p)
+{
+	size_t index = (size_t)(p / 100.0 * (sorted.size() - 1));
+	return sorted[index] / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+	int64_t seconds = argc > 1 ? std::stol(argv[1]) : 5;
+	size_t flooders = argc > 2 ? std::stoul(argv[2]) : 4;
+	size_t broadcasts = argc > 3 ? std::stoul(argv[3]) : 2000;
+	size_t rate = (argc > 4 ? std::stoul(argv[4]) : 2) << 20;
+	size_t bytes = argc > 5 ? std::stoul(argv[5]) : 1024;
+	int server_pid = argc > 6 ? std::stoi(argv[6]) : 0;
+
+	int epoll_fd = epoll_create1(0);
+	std::vector<int> flood_sockets;
+	for (size_t i = 0; i <= flooders; ++i) {
+		int socket = connect_and_log_in(
+			i == flooders ? "c_recipient" :
+					"c_flooder" + std::to_string(i));
+		epoll_event event;
+		event.events = EPOLLIN;
+		event.data.fd = socket;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket, &event);
+		flood_sockets.push_back(socket);
+	}
+	int member = connect_and_log_in("c_member");
+	setsockopt(member, SOL_SOCKET, SO_RCVBUF, &member_buffer,
+		   sizeof(member_buffer));
+	std::thread drain_thread(drain, epoll_fd);
+	// Let the logins settle, and throw the "entered the room" broadcasts
+	// away.
+	std::this_thread::sleep_for(std::chrono::milliseconds(500));
+	std::vector<uint8_t> discard(1 << 16);
+	while (read(member, discard.data(), discard.size()) > 0)
+		;
+
+	std::thread reader(member_reader, member, rate);
+	std::vector<std::thread> flood_threads;
+	for (size_t i = 0; i < flooders; ++i)
+		flood_threads.emplace_back(flood, flood_sockets[i],
+					   "c_flooder" + std::to_string(i),
+					   broadcasts, bytes);
+	// Messages to the recipient, ACKed one at a time (they don't ask
+	// for ranges).
+	std::vector<uint8_t> payload(64, 'm');
+	MessageLayer ml;
+	uint16_t packet_number = 0;
+	int64_t start = now_ns();
+	while (now_ns() - start < seconds * 1000000000LL) {
+		MessageHeader &header =
+			ml.set_packet_number(packet_number)
+				.set_version_number(3)
+				.set_source_username("c_member")
+				.set_dest_username("c_recipient")
+				.set_message_type(MessageTypes::MESSAGE)
+				.calculate_data_packet_checksum(payload)
+				.set_data_packet_length(payload.size())
+				.build();
+		auto message = build_message(header, payload);
+		sent_ns[packet_number++] = now_ns();
+		write_all(member, message.data(), message.size());
+		std::this_thread::sleep_for(
+			std::chrono::milliseconds(message_every_ms));
+	}
+	// Give the last of the member's ACKs a chance to arrive.
+	std::this_thread::sleep_for(std::chrono::milliseconds(500));
+	double elapsed = (now_ns() - start) / 1e9;
+	flooding = false;
+	for (auto &thread : flood_threads)
+		thread.join();
+	// Drain the ACKs for the last of the broadcasts.
+	std::this_thread::sleep_for(std::chrono::milliseconds(500));
+	running = false;
+	reader.join();
+	drain_thread.join();
+
+	std::sort(round_trips.begin(), round_trips.end());
+	std::cout << flooders << " flooders of " << broadcasts << " " << bytes
+		  << " byte broadcasts/s, member reading " << (rate >> 20)
+		  << " MiB/s" << std::endl;
+	std::cout << "ACKs " << round_trips.size() << " of " << packet_number;
+	if (!round_trips.empty())
+		std::cout << std::fixed << std::setprecision(2)
+			  << ", round trip p50 " << percentile(round_trips, 50)
+			  << " ms, p99 " << percentile(round_trips, 99)
+			  << " ms, max " << round_trips.back() / 1e6 << " ms";
+	std::cout << std::endl
+		  << "Broadcasts read by the member: " << std::setprecision(0)
+		  << broadcasts_received / elapsed << "/s" << std::endl;
+	report_server(server_pid, "At the end");
+	if (server_pid > 0)
+		kill(server_pid, SIGUSR1);
+	for (int socket : flood_sockets)
+		close(socket);
+	close(member);
+	close(epoll_fd);
+	return 0;
+}
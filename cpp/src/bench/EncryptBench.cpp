@@ -0,0 +1,99 @@
+/*======================================================================
+COIS-4310H - EncryptBench
+Name: EncryptBench.cpp
+Purpose: Throughput of, and heap allocations made by, encrypting and
+	decrypting a message as a whole stream in a single chunk; through
+	the functions that return a new vector or string in a tuple, and
+	through those that work in buffers of our own.
+
+Usage: ./EncryptBench [calls]
+	calls: messages of each size encrypted and decrypted (default 200000)
+
+	Allocations are counted by replacing the global operator new.
+
+Compilation: Please use the provided Make file (make bench)
+----------------------------------------------------------------------*/
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+#include "CryptoLayer.hpp"
+
+static size_t allocations = 0;
+
+void *operator new(size_t size)
+{
+	++allocations;
+	void *memory = std::malloc(size == 0 ? 1 : size);
+	if (memory == nullptr)
+		throw std::bad_alloc();
+	return memory;
+}
+
+void operator delete(void *memory) noexcept
+{
+	std::free(memory);
+}
+
+static Crypto::StreamKey key;
+
+static void run(size_t calls, size_t size, bool own_buffers)
+{
+	std::string message(size, 'x');
+	std::vector<uint8_t> cipher(Crypto::encrypted_size(size));
+	std::vector<uint8_t> clear(cipher.size());
+	size_t before = allocations;
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < calls; ++i) {
+		bool worked;
+		if (own_buffers) {
+			size_t clear_len;
+			worked = Crypto::encrypt((const uint8_t *)message.data(),
+						 size, key, cipher.data()) &&
+				 Crypto::decrypt(cipher.data(), cipher.size(),
+						 key, clear.data(), clear_len) &&
+				 clear_len == size;
+		} else {
+			auto encrypted = Crypto::encrypt(message, key);
+			auto decrypted =
+				Crypto::decrypt(std::get<1>(encrypted), key);
+			worked = std::get<0>(decrypted) &&
+				 std::get<1>(decrypted).size() == size;
+		}
+		if (!worked) {
+			std::cerr << "Unable to encrypt and decrypt." << std::endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+	double seconds = std::chrono::duration<double>(
+				 std::chrono::steady_clock::now() - start)
+				 .count();
+	std::cout << std::setw(8) << size << std::left << std::setw(16)
+		  << (own_buffers ? "  own buffers" : "  tuples") << std::right
+		  << std::fixed << std::setprecision(1) << std::setw(12)
+		  << calls * size / seconds / 1e6 << std::setprecision(2)
+		  << std::setw(16) << (double)(allocations - before) / calls
+		  << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+	size_t calls = argc > 1 ? std::stoul(argv[1]) : 200000;
+	if (sodium_init() < 0) {
+		std::cerr << "Unable to initialize libsodium." << std::endl;
+		return EXIT_FAILURE;
+	}
+	randombytes_buf(key.data(), key.size());
+	std::cout << std::setw(8) << "bytes" << std::left << std::setw(16)
+		  << "  into" << std::right << std::setw(12) << "MB/s"
+		  << std::setw(16) << "allocs/call" << std::endl;
+	for (size_t size : { 64, 1024, 16384 }) {
+		run(calls, size, false);
+		run(calls, size, true);
+	}
+	return 0;
+}
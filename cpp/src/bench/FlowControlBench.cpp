@@ -0,0 +1,289 @@
+/*======================================================================
+COIS-4310H - FlowControlBench
+Name: FlowControlBench.cpp
+Purpose: Throughput from a sender to a recipient that reads slower than
+	it is sent to, through a running server. The sender sends messages
+	to the recipient from a SendWindow (as the client does) as fast as
+	the window lets it, while the recipient reads no more than a set
+	rate. The frames the recipient gets in each interval are reported,
+	and whether it was cut off, first with the sender ignoring the
+	CREDIT the server grants it (as clients did before there was any),
+	then honouring it.
+
+	Ignoring it, the recipient's queue on the server fills and they are
+	cut off (see OutboundQueue); honouring it, the sender is held back
+	to about the rate the recipient reads at.
+
+Usage: ./FlowControlBench [seconds] [rate] [bytes] [server_pid]
+	e.g. ./MessageServer --epoll & ./FlowControlBench 5 2000 512 $!
+
+Description of Parameters
+	seconds: how long each run sends for (default 5)
+	rate: frames a second the recipient reads (default 2000)
+	bytes: size of each message's data packet (default 512)
+	server_pid: pid of the running server, to read its memory usage
+		from /proc (optional). The server is also sent SIGUSR1 after
+		each run, so it prints the frames it has shed.
+
+Compilation: Please use the provided Make file (make bench)
+----------------------------------------------------------------------*/
+
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <algorithm>
+extern "C" {
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+}
+#include "MessageLayer.hpp"
+#include "FrameReader.hpp"
+#include "BenchClient.hpp"
+#include "../client/SendWindow.hpp"
+
+// Intervals the recipient's frames are counted in (ms)
+static const int64_t constexpr interval_ms = 250;
+// Bytes the recipient's socket buffers, so the server's queue for it
+// fills rather than the kernel's
+static const int constexpr recipient_buffer = 16384;
+
+// Frames from the sender the recipient has read, and whether the server
+// has cut them off
+static std::atomic<uint64_t> received(0);
+static std::atomic<bool> cut_off(false);
+static std::atomic<bool> running(true);
+
+// Write the whole of a frame to the sender's socket, one writer at a time.
+static std::mutex socket_mutex;
+static bool send_whole(int socket, const uint8_t *data, size_t len)
+{
+	std::lock_guard<std::mutex> lock(socket_mutex);
+	return write_all(socket, data, len);
+}
+
+// The sender's reading end; take in ACKs (and CREDIT, if honoured), and
+// send frames again as their timeouts pass.
+static void ack_reader(int socket, SendWindow &window, bool honour_credit)
+{
+	FrameReader reader;
+	FrameView frame;
+	while (running) {
+		int timeout = window.next_timeout_ms();
+		pollfd readable = { socket, POLLIN, 0 };
+		if (timeout < 0 || timeout > 10)
+			timeout = 10;
+		if (poll(&readable, 1, timeout) == 0) {
+			window.retransmit_expired();
+			continue;
+		}
+		if (reader.read_from(socket) <= 0)
+			continue;
+		while (reader.next(frame)) {
+			uint8_t type = frame.header.get_message_type();
+			if (type == MessageTypes::CREDIT && honour_credit &&
+			    frame.data_packet.size() == sizeof(CreditPacket)) {
+				window.set_credit(
+					read_credit(frame.data_packet.data()));
+			} else if (type == MessageTypes::ACK) {
+				const MessageHeaderView &header = frame.header;
+				AckRange ranges[max_ack_ranges];
+				size_t count = header.get_ack_ranges(ranges);
+				if (count == 0) {
+					ranges[0].first =
+						header.get_sequence_number();
+					ranges[0].last = ranges[0].first;
+					count = 1;
+				}
+				for (size_t i = 0; i < count; ++i) {
+					uint64_t sequence = ranges[i].first;
+					do
+						window.ack(sequence);
+					while (sequence++ != ranges[i].last);
+				}
+			} else if (type == MessageTypes::NACK) {
+				// Held back by the server (over its rate
+				// limits, if any are set)
+				uint32_t wait_ms = 0;
+				if (frame.data_packet.size() ==
+				    sizeof(RetryPacket))
+					wait_ms = read_retry(
+						frame.data_packet.data());
+				window.nack(frame.header.get_sequence_number(),
+					    wait_ms);
+			}
+		}
+	}
+}
+
+// Send the recipient messages as fast as the window lets us
+static void sender(SendWindow &window, const std::string &source,
+		   const std::string &destination, size_t bytes)
+{
+	MessageLayer ml;
+	std::vector<uint8_t> data(bytes, 'f');
+	for (uint64_t sequence = 1; running; ++sequence) {
+		MessageHeader &header =
+			ml.set_message_type(MessageTypes::MESSAGE)
+				.set_version_number(3)
+				.set_frame_flags(frame_flag_ack_ranges)
+				.set_sequence_number(sequence)
+				.set_source_username(source)
+				.set_dest_username(destination)
+				.calculate_data_packet_checksum(data)
+				.set_data_packet_length(data.size())
+				.build();
+		PooledBytes frame =
+			build_message<std::vector<uint8_t>, PooledBytes>(header,
+									 data);
+		if (!window.add(sequence, std::move(frame)))
+			return;
+	}
+}
+
+// Read no more than rate frames a second, counting the sender's
+static void recipient(int socket, size_t rate, size_t frame_size)
+{
+	MessageHeader header;
+	size_t header_received = 0;
+	size_t data_remaining = 0;
+	std::vector<uint8_t> buffer(frame_size * rate / (1000 / 10) + 1);
+	while (running) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		ssize_t got = read(socket, buffer.data(), buffer.size());
+		if (got == 0 || (got < 0 && errno != EAGAIN)) {
+			cut_off = true;
+			return;
+		}
+		const uint8_t *data = buffer.data();
+		while (got > 0) {
+			if (data_remaining > 0) {
+				size_t skip =
+					std::min((size_t)got, data_remaining);
+				data_remaining -= skip;
+				data += skip;
+				got -= skip;
+				continue;
+			}
+			size_t take = std::min((size_t)got,
+					       header.size() - header_received);
+			std::memcpy(header.data() + header_received, data,
+				    take);
+			header_received += take;
+			data += take;
+			got -= take;
+			if (header_received < header.size())
+				continue;
+			header_received = 0;
+			data_remaining = ntohs(*(
+				(uint16_t *)&(header[data_packet_length_begin])));
+			uint8_t type = header[message_type_begin];
+			if (type == MessageTypes::MESSAGE &&
+			    std::memcmp(&(header[source_username_begin]),
+					"server", sizeof("server")) != 0)
+				++received;
+		}
+	}
+}
+
+static void run(int run_number, bool honour_credit, int64_t seconds,
+		size_t rate, size_t bytes, int server_pid)
+{
+	std::string prefix = "f" + std::to_string(run_number) + "_";
+	int recipient_socket = connect_and_log_in(prefix + "recipient");
+	setsockopt(recipient_socket, SOL_SOCKET, SO_RCVBUF, &recipient_buffer,
+		   sizeof(recipient_buffer));
+	int sender_socket = connect_and_log_in(prefix + "sender");
+	// Let both logins (and the "entered the room" broadcasts) settle,
+	// and throw the broadcasts away.
+	std::this_thread::sleep_for(std::chrono::milliseconds(500));
+	std::vector<uint8_t> discard(1 << 16);
+	while (read(recipient_socket, discard.data(), discard.size()) > 0)
+		;
+	while (read(sender_socket, discard.data(), discard.size()) > 0)
+		;
+	received = 0;
+	cut_off = false;
+	running = true;
+
+	SendWindow window(1024, [sender_socket](const PooledBytes &frame) {
+		return send_whole(sender_socket, frame.data(), frame.size());
+	});
+	std::thread read_thread(recipient, recipient_socket, rate,
+				MessageHeader().size() + bytes);
+	std::thread acks(ack_reader, sender_socket, std::ref(window),
+			 honour_credit);
+	std::thread send_thread(sender, std::ref(window), prefix + "sender",
+				prefix + "recipient", bytes);
+	// Frames a second the recipient got in each interval, once it was
+	// going (after the first)
+	std::vector<double> rates;
+	uint64_t last = 0;
+	int64_t cut_off_at = -1;
+	int64_t start = now_ns();
+	for (int64_t elapsed = 0; elapsed < seconds * 1000;
+	     elapsed += interval_ms) {
+		std::this_thread::sleep_for(
+			std::chrono::milliseconds(interval_ms));
+		uint64_t now = received;
+		if (elapsed > 0)
+			rates.push_back((now - last) * 1000.0 / interval_ms);
+		last = now;
+		if (cut_off && cut_off_at < 0)
+			cut_off_at = (now_ns() - start) / 1000000;
+	}
+	running = false;
+	window.close();
+	send_thread.join();
+	acks.join();
+	read_thread.join();
+
+	std::sort(rates.begin(), rates.end());
+	SendWindowStats stats = window.stats();
+	std::cout << std::setw(10) << (honour_credit ? "honoured" : "ignored")
+		  << std::setw(10) << stats.sent << std::setw(10) << received
+		  << std::fixed << std::setprecision(0) << std::setw(10)
+		  << rates.front() << std::setw(10)
+		  << rates[rates.size() / 2] << std::setw(10) << rates.back()
+		  << std::setw(10) << stats.credit_waits << std::setw(10)
+		  << stats.credit_probes << std::setw(12);
+	if (cut_off_at >= 0)
+		std::cout << std::to_string(cut_off_at) + " ms" << std::endl;
+	else
+		std::cout << "never" << std::endl;
+	report_server(server_pid, "  at the end of the run");
+	if (server_pid > 0)
+		kill(server_pid, SIGUSR1);
+	close(sender_socket);
+	close(recipient_socket);
+	// Let the server log them out before the next run.
+	std::this_thread::sleep_for(std::chrono::milliseconds(500));
+}
+
+int main(int argc, char **argv)
+{
+	int64_t seconds = argc > 1 ? std::stol(argv[1]) : 5;
+	size_t rate = argc > 2 ? std::stoul(argv[2]) : 2000;
+	size_t bytes = argc > 3 ? std::stoul(argv[3]) : 512;
+	int server_pid = argc > 4 ? std::stoi(argv[4]) : 0;
+	std::cout << seconds << " s of " << bytes
+		  << " byte messages to a recipient reading " << rate
+		  << " frames/s" << std::endl;
+	std::cout << std::setw(10) << "credit" << std::setw(10) << "sent"
+		  << std::setw(10) << "received" << std::setw(10) << "min/s"
+		  << std::setw(10) << "median/s" << std::setw(10) << "max/s"
+		  << std::setw(10) << "waits" << std::setw(10) << "probes"
+		  << std::setw(12) << "cut off" << std::endl;
+	run(0, false, seconds, rate, bytes, server_pid);
+	run(1, true, seconds, rate, bytes, server_pid);
+	return 0;
+}
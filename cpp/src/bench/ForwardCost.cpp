@@ -0,0 +1,169 @@
+/*======================================================================
+COIS-4310H - ForwardCost
+Name: ForwardCost.cpp
+Purpose: Heap allocations made, and time taken, to pass one message on
+	the way the server does; the message is taken out of a FrameReader,
+	built into an outbound frame (and ACKed), queued for the recipient,
+	and written to the recipient's socket. Also with the recipient using
+	another header version, so the frame is encoded again for them.
+
+Usage: ./ForwardCost [messages] [data packet size]
+	messages: number of messages forwarded (default 200000)
+	data packet size: bytes in each data packet (default 200)
+
+	Allocations are counted by replacing the global operator new (so
+	buffers served from the BufferPool don't count, but the pool
+	taking more memory does), and the pool's hit rate is shown too.
+
+Compilation: Please use the provided Make file (make bench)
+----------------------------------------------------------------------*/
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+extern "C" {
+#include <unistd.h>
+#include <sys/socket.h>
+}
+#include "MessageLayer.hpp"
+#include "FrameReader.hpp"
+#include "../server/OutboundQueue.hpp"
+#include "../server/Server.hpp"
+
+// Defined by the server proper, counted by the OutboundQueue.
+IoStats io_stats;
+
+static size_t allocations = 0;
+
+void *operator new(size_t size)
+{
+	++allocations;
+	void *memory = std::malloc(size == 0 ? 1 : size);
+	if (memory == nullptr)
+		throw std::bad_alloc();
+	return memory;
+}
+
+void operator delete(void *memory) noexcept
+{
+	std::free(memory);
+}
+
+// The messages as a client would send them, back to back.
+static std::vector<uint8_t> build_stream(size_t messages, size_t size)
+{
+	std::vector<uint8_t> stream;
+	MessageLayer ml;
+	std::string message(size, 'x');
+	for (size_t i = 0; i < messages; ++i) {
+		ml.get_internal_header().fill(0);
+		MessageHeader &header =
+			ml.set_message_type(MessageTypes::MESSAGE)
+				.set_version_number(header_version_crc32c)
+				.set_packet_number((uint16_t)i)
+				.set_source_username("alice")
+				.set_dest_username("bob")
+				.set_data_packet_length(message.size())
+				.calculate_data_packet_checksum(message)
+				.build();
+		std::vector<uint8_t> frame = build_message(header, message);
+		stream.insert(stream.end(), frame.begin(), frame.end());
+	}
+	return stream;
+}
+
+// Read and throw away everything sent to the recipient.
+static void drain(int socket)
+{
+	std::vector<uint8_t> buffer(1 << 16);
+	while (read(socket, buffer.data(), buffer.size()) > 0)
+		;
+}
+
+// Forward every message in stream to a recipient using version, and
+// report the allocations made per message.
+static void run(const std::string &name, const std::vector<uint8_t> &stream,
+		size_t messages, uint8_t version)
+{
+	int sockets[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) < 0) {
+		std::cerr << "Unable to create a socket pair." << std::endl;
+		return;
+	}
+	std::thread recipient(drain, sockets[1]);
+	OutboundQueue sender_queue;
+	OutboundQueue recipient_queue;
+	FrameReader reader;
+	FrameView frame;
+	MessageLayer ack_ml;
+	// The reads, as the reactor would make them
+	static const size_t constexpr read_size = 16384;
+	size_t before = allocations;
+	BufferPoolStats pool_before = BufferPool::stats();
+	auto start = std::chrono::steady_clock::now();
+	for (size_t fed = 0; fed < stream.size(); fed += read_size) {
+		reader.feed(stream.data() + fed,
+			    std::min(read_size, stream.size() - fed));
+		while (reader.next(frame)) {
+			bool wake_writer;
+			// ACK the sender
+			MessageHeader &ack =
+				ack_ml.set_message_type(MessageTypes::ACK)
+					.set_version_number(version)
+					.set_packet_number(
+						frame.header.get_packet_number())
+					.set_dest_username("alice")
+					.set_data_packet_length(0)
+					.build();
+			sender_queue.push(
+				build_frame<std::array<uint8_t, 0> >(ack, {}),
+				wake_writer);
+			// Pass the message on
+			VersionedFrame message(
+				build_frame(frame.header, frame.data_packet));
+			recipient_queue.push(message.for_version(version),
+					     wake_writer);
+		}
+		recipient_queue.write_to(sockets[0], true);
+		while (sender_queue.gather() > 0)
+			sender_queue.consume(SIZE_MAX);
+	}
+	double seconds = std::chrono::duration<double>(
+				 std::chrono::steady_clock::now() - start)
+				 .count();
+	size_t made = allocations - before;
+	BufferPoolStats pool = BufferPool::stats();
+	uint64_t requests = pool.requests - pool_before.requests;
+	shutdown(sockets[0], SHUT_WR);
+	recipient.join();
+	close(sockets[0]);
+	close(sockets[1]);
+	std::cout << std::left << std::setw(28) << name << std::right
+		  << std::setw(18) << std::fixed << std::setprecision(2)
+		  << (double)made / messages << std::setw(14)
+		  << std::setprecision(0) << messages / seconds << std::setw(12)
+		  << std::setprecision(1)
+		  << (requests ? 100.0 * (pool.hits - pool_before.hits) / requests :
+				 0.0)
+		  << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+	size_t messages = argc > 1 ? std::stoul(argv[1]) : 200000;
+	size_t size = argc > 2 ? std::stoul(argv[2]) : 200;
+	std::vector<uint8_t> stream = build_stream(messages, size);
+	std::cout << messages << " messages of " << size
+		  << " bytes, forwarded and ACKed" << std::endl;
+	std::cout << std::left << std::setw(28) << "recipient" << std::right
+		  << std::setw(18) << "allocations/msg" << std::setw(14)
+		  << "messages/s" << std::setw(12) << "pool hit %" << std::endl;
+	run("same version", stream, messages, header_version_crc32c);
+	run("another version", stream, messages, header_version_xxh3);
+	return 0;
+}
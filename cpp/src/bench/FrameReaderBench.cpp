@@ -0,0 +1,180 @@
+/*======================================================================
+COIS-4310H - FrameReaderBench
+Name: FrameReaderBench.cpp
+Purpose: Frames decoded per read() syscall under pipelined load. A
+	writer thread pushes a stream of messages (small chat sized data
+	packets) down one end of a socket pair as fast as it can, and the
+	other end takes them in two ways; a FrameReader reading as much as
+	the socket has each time, and the old way of reading a header and
+	then its data packet with a read() each.
+
+Usage: ./FrameReaderBench [messages]
+	messages: number of messages sent through each reader
+		(default 200000)
+
+Compilation: Please use the provided Make file (make bench)
+----------------------------------------------------------------------*/
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <thread>
+#include <chrono>
+extern "C" {
+#include <unistd.h>
+#include <sys/socket.h>
+}
+#include "MessageLayer.hpp"
+#include "FrameReader.hpp"
+
+// The whole stream of messages, back to back, as a client would pipeline
+// them.
+static std::vector<uint8_t> build_stream(size_t messages)
+{
+	std::vector<uint8_t> stream;
+	MessageLayer ml;
+	for (size_t i = 0; i < messages; ++i) {
+		// 16 to 255 bytes of chat
+		std::string message(16 + (i * 37) % 240, 'a' + i % 26);
+		ml.get_internal_header().fill(0);
+		MessageHeader &header =
+			ml.set_message_type(MessageTypes::MESSAGE)
+				.set_version_number(header_version_crc32c)
+				.set_packet_number((uint16_t)i)
+				.set_source_username("alice")
+				.set_dest_username("all")
+				.set_data_packet_length(message.size())
+				.calculate_data_packet_checksum(message)
+				.build();
+		std::vector<uint8_t> frame = build_message(header, message);
+		stream.insert(stream.end(), frame.begin(), frame.end());
+	}
+	return stream;
+}
+
+// Write the whole stream to socket, in large chunks.
+static void write_stream(int socket, const std::vector<uint8_t> &stream)
+{
+	static const size_t constexpr chunk = 1 << 16;
+	size_t written = 0;
+	while (written < stream.size()) {
+		ssize_t sent = write(socket, stream.data() + written,
+				     std::min(chunk, stream.size() - written));
+		if (sent <= 0) {
+			std::cerr << "Unable to write the stream." << std::endl;
+			return;
+		}
+		written += sent;
+	}
+}
+
+// Read all of len bytes into data, counting each read() in reads.
+static bool read_fully(int socket, uint8_t *data, size_t len,
+		       uint64_t &reads)
+{
+	while (len > 0) {
+		++reads;
+		ssize_t read_size = read(socket, data, len);
+		if (read_size <= 0)
+			return false;
+		data += read_size;
+		len -= read_size;
+	}
+	return true;
+}
+
+struct Result {
+	uint64_t frames;
+	uint64_t reads;
+	double seconds;
+};
+
+// Take in messages from socket with a FrameReader.
+static Result frame_reader(int socket, size_t messages)
+{
+	Result result = { 0, 0, 0 };
+	FrameReader reader;
+	FrameView frame;
+	auto start = std::chrono::steady_clock::now();
+	while (result.frames < messages) {
+		if (reader.read_from(socket) <= 0)
+			break;
+		while (reader.next(frame))
+			if (frame.valid &&
+			    frame.header.verify_data_packet_checksum(
+				    frame.data_packet))
+				++result.frames;
+	}
+	result.seconds = std::chrono::duration<double>(
+				 std::chrono::steady_clock::now() - start)
+				 .count();
+	result.reads = reader.read_count();
+	return result;
+}
+
+// Take in messages from socket a header, and then a data packet, at a
+// time.
+static Result header_then_data(int socket, size_t messages)
+{
+	Result result = { 0, 0, 0 };
+	MessageLayer ml;
+	MessageHeader &header = ml.get_internal_header();
+	std::vector<uint8_t> data_package;
+	auto start = std::chrono::steady_clock::now();
+	while (result.frames < messages) {
+		if (!read_fully(socket, header.data(), header.size(),
+				result.reads))
+			break;
+		ml.verify_checksum();
+		data_package.resize(ml.get_data_packet_length());
+		if (!read_fully(socket, data_package.data(),
+				data_package.size(), result.reads))
+			break;
+		if (ml.valid && ml.verify_data_packet_checksum(data_package))
+			++result.frames;
+	}
+	result.seconds = std::chrono::duration<double>(
+				 std::chrono::steady_clock::now() - start)
+				 .count();
+	return result;
+}
+
+// Send the stream through a fresh socket pair, into reader.
+template <typename Reader>
+static void run(const std::string &name, const std::vector<uint8_t> &stream,
+		size_t messages, Reader reader)
+{
+	int sockets[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) < 0) {
+		std::cerr << "Unable to create a socket pair." << std::endl;
+		return;
+	}
+	std::thread writer(write_stream, sockets[0], std::cref(stream));
+	Result result = reader(sockets[1], messages);
+	writer.join();
+	close(sockets[0]);
+	close(sockets[1]);
+	std::cout << std::left << std::setw(20) << name << std::right
+		  << std::setw(10) << result.frames << std::setw(10)
+		  << result.reads << std::setw(16) << std::fixed
+		  << std::setprecision(2)
+		  << (double)result.frames / result.reads << std::setw(14)
+		  << std::setprecision(0) << result.frames / result.seconds
+		  << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+	size_t messages = argc > 1 ? std::stoul(argv[1]) : 200000;
+	std::vector<uint8_t> stream = build_stream(messages);
+	std::cout << messages << " messages, " << stream.size() / messages
+		  << " bytes each on average" << std::endl;
+	std::cout << std::left << std::setw(20) << "reader" << std::right
+		  << std::setw(10) << "frames" << std::setw(10) << "reads"
+		  << std::setw(16) << "frames/read" << std::setw(14)
+		  << "frames/s" << std::endl;
+	run("header then data", stream, messages, header_then_data);
+	run("FrameReader", stream, messages, frame_reader);
+	return 0;
+}
@@ -0,0 +1,241 @@
+/*======================================================================
+COIS-4310H - LossyLinkBench
+Name: LossyLinkBench.cpp
+Purpose: Throughput of the client's SendWindow over a lossy link. A shim
+	stands in for the server at the other end of a socket pair; it
+	throws away a share of the frames sent to it (no ACK or NACK, as if
+	they were lost), and ACKs the rest after a delay (the round trip).
+	Frames are only ever counted once, however many times they are
+	sent. Run with several loss rates and window sizes, and lastly with
+	a window of more frames than there are packet numbers (sent with
+	64 bit sequence numbers, that the shim ACKs).
+
+	(Before the SendWindow, the client only sent a frame again on a
+	NACK, so a single lost frame was never recovered.)
+
+Usage: ./LossyLinkBench [messages] [round trip ms]
+	messages: frames sent in each run (default 20000)
+	round trip ms: delay before each ACK (default 2)
+
+Compilation: Please use the provided Make file (make bench)
+----------------------------------------------------------------------*/
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <random>
+#include <chrono>
+#include <cerrno>
+#include <algorithm>
+extern "C" {
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+}
+#include "MessageLayer.hpp"
+#include "FrameReader.hpp"
+#include "../client/SendWindow.hpp"
+
+static int64_t now_ms(void)
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+		       std::chrono::steady_clock::now().time_since_epoch())
+		.count();
+}
+
+// Write the whole of a frame to socket, one writer at a time.
+static std::mutex socket_mutex;
+static bool send_whole(int socket, const uint8_t *data, size_t len)
+{
+	std::lock_guard<std::mutex> lock(socket_mutex);
+	while (len > 0) {
+		ssize_t sent = send(socket, data, len, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent <= 0)
+			return false;
+		data += sent;
+		len -= sent;
+	}
+	return true;
+}
+
+// The server's end; drop a share (loss) of the frames, and ACK the rest
+// after the delay, until told to stop. Counts the frames that got
+// through in unique, each once.
+static void shim(int socket, double loss, int64_t delay_ms, size_t messages,
+		 std::atomic<size_t> &unique, std::atomic<bool> &stop)
+{
+	std::mt19937 random(4310);
+	std::uniform_real_distribution<double> chance(0, 1);
+	std::vector<bool> delivered(messages, false);
+	// ACKs waiting to be sent, and when
+	std::deque<std::pair<int64_t, uint64_t> > acks;
+	// ACKs due, not yet written. (Written without blocking, as the server
+	// does, so the client is never kept from sending by our waiting on
+	// it to read.)
+	std::vector<uint8_t> unsent;
+	FrameReader reader;
+	FrameView frame;
+	MessageLayer ack_ml;
+	while (!stop) {
+		int64_t now = now_ms();
+		while (!acks.empty() && acks.front().first <= now) {
+			ack_ml.set_message_type(MessageTypes::ACK)
+				.set_version_number(header_version_crc32c)
+				.set_data_packet_length(0)
+				.set_frame_flags(0)
+				.set_sequence_number(acks.front().second);
+			MessageHeader &ack = ack_ml.build();
+			unsent.insert(unsent.end(), ack.begin(), ack.end());
+			acks.pop_front();
+		}
+		if (!unsent.empty()) {
+			ssize_t written =
+				send(socket, unsent.data(), unsent.size(),
+				     MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (written < 0 && errno != EAGAIN)
+				return;
+			if (written > 0)
+				unsent.erase(unsent.begin(),
+					     unsent.begin() + written);
+		}
+		pollfd readable = { socket, POLLIN, 0 };
+		if (!unsent.empty())
+			readable.events |= POLLOUT;
+		if (poll(&readable, 1, acks.empty() ? 10 : 1) <= 0 ||
+		    !(readable.revents & POLLIN))
+			continue;
+		if (reader.read_from(socket) <= 0)
+			return;
+		while (reader.next(frame)) {
+			if (chance(random) < loss)
+				continue;
+			uint32_t index = 0;
+			for (size_t i = 0; i < 4; ++i)
+				index = (index << 8) | frame.data_packet.data()[i];
+			if (index < messages && !delivered[index]) {
+				delivered[index] = true;
+				++unique;
+			}
+			acks.emplace_back(now_ms() + delay_ms,
+					  frame.header.get_sequence_number());
+		}
+	}
+}
+
+// The client's reading end; take in ACKs, and send frames again as
+// their timeouts pass.
+static void ack_reader(int socket, SendWindow &window, std::atomic<bool> &stop)
+{
+	FrameReader reader;
+	FrameView frame;
+	while (!stop) {
+		int timeout = window.next_timeout_ms();
+		pollfd readable = { socket, POLLIN, 0 };
+		if (poll(&readable, 1, timeout < 0 || timeout > 10 ? 10 : timeout) ==
+		    0) {
+			window.retransmit_expired();
+			continue;
+		}
+		if (reader.read_from(socket) <= 0)
+			return;
+		while (reader.next(frame))
+			window.ack(frame.header.get_sequence_number());
+	}
+}
+
+static void run(size_t messages, size_t window_size, double loss,
+		int64_t delay_ms)
+{
+	int sockets[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) < 0) {
+		std::cerr << "Unable to create a socket pair." << std::endl;
+		return;
+	}
+	int client = sockets[0];
+	SendWindow window(window_size, [client](const PooledBytes &frame) {
+		return send_whole(client, frame.data(), frame.size());
+	});
+	std::atomic<size_t> unique(0);
+	std::atomic<bool> stop(false);
+	std::thread server(shim, sockets[1], loss, delay_ms, messages,
+			   std::ref(unique), std::ref(stop));
+	std::thread reader(ack_reader, client, std::ref(window),
+			   std::ref(stop));
+	MessageLayer ml;
+	std::vector<uint8_t> data(200, 'x');
+	// Most frames waiting to be acknowledged at once
+	size_t peak = 0;
+	int64_t start = now_ms();
+	for (size_t i = 0; i < messages; ++i) {
+		for (size_t byte = 0; byte < 4; ++byte)
+			data[byte] = i >> (24 - 8 * byte);
+		MessageHeader &header =
+			ml.set_message_type(MessageTypes::MESSAGE)
+				.set_version_number(header_version_crc32c)
+				.set_sequence_number(i + 1)
+				.set_source_username("alice")
+				.set_dest_username("all")
+				.calculate_data_packet_checksum(data)
+				.set_data_packet_length(data.size())
+				.build();
+		if (!window.add(i + 1,
+				build_message<std::vector<uint8_t>, PooledBytes>(
+					header, data))) {
+			std::cerr << "Unable to send." << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		peak = std::max(peak, window.in_flight());
+	}
+	// Until every frame is acknowledged
+	while (window.in_flight() > 0)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	double seconds = (now_ms() - start) / 1000.0;
+	stop = true;
+	shutdown(sockets[0], SHUT_RDWR);
+	shutdown(sockets[1], SHUT_RDWR);
+	server.join();
+	reader.join();
+	close(sockets[0]);
+	close(sockets[1]);
+	if (unique != messages) {
+		std::cerr << "Only " << unique << " of " << messages
+			  << " frames got through." << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	SendWindowStats stats = window.stats();
+	std::cout << std::setw(8) << std::fixed << std::setprecision(1)
+		  << loss * 100 << std::setw(8) << window.capacity()
+		  << std::setprecision(0) << std::setw(12) << messages / seconds
+		  << std::setw(10) << stats.timeouts << std::setw(10)
+		  << stats.fast_retransmits << std::setprecision(1)
+		  << std::setw(10) << stats.srtt_ms << std::setw(10)
+		  << stats.rto_ms << std::setw(10) << peak << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+	size_t messages = argc > 1 ? std::stoul(argv[1]) : 20000;
+	int64_t delay_ms = argc > 2 ? std::stol(argv[2]) : 2;
+	std::cout << messages << " frames of 200 bytes, " << delay_ms
+		  << " ms round trip" << std::endl;
+	std::cout << std::setw(8) << "loss %" << std::setw(8) << "window"
+		  << std::setw(12) << "frames/s" << std::setw(10) << "timeouts"
+		  << std::setw(10) << "fast" << std::setw(10) << "srtt ms"
+		  << std::setw(10) << "rto ms" << std::setw(10) << "peak"
+		  << std::endl;
+	for (double loss : { 0.0, 0.001, 0.01, 0.05 })
+		for (size_t window_size : { 8, 64, 256 })
+			run(messages, window_size, loss, delay_ms);
+	// Far more in flight than there are packet numbers (over a link with
+	// a longer round trip, to fill the window)
+	std::cout << "300000 frames, 500 ms round trip" << std::endl;
+	run(300000, 1 << 17, 0.001, 500);
+	return 0;
+}
@@ -0,0 +1,91 @@
+/*======================================================================
+COIS-4310H - RateLimitBench
+Name: RateLimitBench.cpp
+Purpose: Cost, and accuracy, of the server's rate limit check (see
+	RateLimiter). Threads, each standing in for a user's receive thread
+	with a RateLimiter of its own, check messages as fast as they can;
+	first with no limits set, then against their own buckets alone, and
+	then against the server's too (shared by every thread), at rates
+	high enough that every message is let through, reporting the time
+	each check takes. Lastly the rates are set low, and the messages let
+	through are compared with what the rates allow.
+
+Usage: ./RateLimitBench [threads] [seconds]
+
+Description of Parameters
+	threads: most threads checking at once (default 4)
+	seconds: how long each run is (default 1)
+
+Compilation: Please use the provided Make file (make bench)
+----------------------------------------------------------------------*/
+
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <string>
+#include "BenchClient.hpp"
+#include "../server/RateLimiter.hpp"
+
+// Size of each message checked (bytes)
+static const size_t constexpr message_bytes = 1024;
+
+// Have threads check messages for seconds; each thread's checks made, and
+// let through, are added to the totals.
+static void run(const std::string &name, size_t threads, int64_t seconds)
+{
+	start_rate_limits();
+	std::atomic<uint64_t> checks(0);
+	std::atomic<uint64_t> admitted(0);
+	std::vector<std::thread> workers;
+	int64_t start = now_ns();
+	for (size_t t = 0; t < threads; ++t) {
+		workers.emplace_back([&] {
+			RateLimiter limiter;
+			uint64_t made = 0;
+			uint64_t let_through = 0;
+			while (now_ns() - start < seconds * 1000000000LL) {
+				for (size_t i = 0; i < 1000; ++i)
+					let_through +=
+						limiter.admit(message_bytes);
+				made += 1000;
+			}
+			checks += made;
+			admitted += let_through;
+		});
+	}
+	for (auto &worker : workers)
+		worker.join();
+	double elapsed = (now_ns() - start) / 1e9;
+	std::cout << std::setw(28) << name << std::setw(9) << threads
+		  << std::fixed << std::setprecision(1) << std::setw(12)
+		  << elapsed * 1e9 * threads / checks << std::setw(14)
+		  << admitted / elapsed << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+	size_t max_threads = argc > 1 ? std::stoul(argv[1]) : 4;
+	int64_t seconds = argc > 2 ? std::stol(argv[2]) : 1;
+	std::cout << std::setw(28) << "limits" << std::setw(9) << "threads"
+		  << std::setw(12) << "ns/check" << std::setw(14)
+		  << "admitted/s" << std::endl;
+	// Rates no thread gets near
+	const uint64_t unlimited = 1ULL << 40;
+	for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+		rate_limits = { 0, 0, 0, 0 };
+		run("none", threads, seconds);
+		rate_limits = { unlimited, unlimited, 0, 0 };
+		run("user", threads, seconds);
+		rate_limits = { unlimited, unlimited, unlimited, unlimited };
+		run("user and global", threads, seconds);
+	}
+	// 1000 messages a second each, and 2000 of them (of 1 KiB) all told;
+	// a second's worth may go at once.
+	rate_limits = { 1000, 0, 0, 0 };
+	run("user 1000/s", 1, seconds);
+	rate_limits = { 1000, 0, 0, 2000 * message_bytes };
+	run("user 1000/s, global 2000/s", max_threads, seconds);
+	return 0;
+}
@@ -0,0 +1,163 @@
+/*======================================================================
+COIS-4310H - ReceivePipelineBench
+Name: ReceivePipelineBench.cpp
+Purpose: Frames a client can decrypt and deliver in order each second;
+	decrypted inline on the thread reading them (as the client used
+	to), and through an OrderedPipeline with 1, 2 and 4 workers. Once
+	with 32 KiB file chunks (each encrypted on its own, so any worker
+	may decrypt them), and once with 1000 byte messages on the channels
+	of 8 senders (each sender's decrypted in order, by one worker).
+	Every frame is checked to be delivered in the order it was given.
+
+Usage: ./ReceivePipelineBench [frames]
+	frames: frames of each kind (default 20000)
+
+Compilation: Please use the provided Make file (make bench)
+----------------------------------------------------------------------*/
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <cstdlib>
+#include "CryptoLayer.hpp"
+#include "BufferPool.hpp"
+#include "../client/OrderedPipeline.hpp"
+
+static Crypto::StreamKey key;
+static const size_t constexpr senders = 8;
+
+// A frame received, and what became of it
+struct Frame {
+	size_t index;
+	const std::vector<uint8_t> *cipher;
+	bool start;
+	size_t sender;
+	PooledBytes clear;
+	bool decrypted;
+};
+
+// Everything a run needs, set up ahead of time; the frames as they
+// arrive, and each sender's end of their channel.
+struct Stream {
+	bool channels;
+	std::vector<std::vector<uint8_t> > ciphers;
+	std::vector<Crypto::ChannelDecryptor> decryptors;
+};
+
+static Stream build_stream(size_t frames, bool channels)
+{
+	Stream stream;
+	stream.channels = channels;
+	size_t size = channels ? 1000 : 32768;
+	std::vector<uint8_t> clear(size, 'x');
+	std::vector<Crypto::ChannelEncryptor> encryptors(senders);
+	for (size_t i = 0; i < frames; ++i) {
+		Crypto::ChannelEncryptor &encryptor = encryptors[i % senders];
+		stream.ciphers.emplace_back(channels ?
+						    encryptor.encrypted_size(size) :
+						    Crypto::encrypted_size(size));
+		if (!(channels ? encryptor.push(key, clear.data(), size, true,
+						stream.ciphers.back().data()) :
+				 Crypto::encrypt(clear.data(), size, key,
+						 stream.ciphers.back().data()))) {
+			std::cerr << "Unable to encrypt." << std::endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+	return stream;
+}
+
+static void decrypt(Stream &stream, Frame &frame)
+{
+	size_t clear_len;
+	bool end;
+	frame.clear.resize(frame.cipher->size());
+	frame.decrypted =
+		stream.channels ?
+			stream.decryptors[frame.sender].pull(
+				key, frame.cipher->data(), frame.cipher->size(),
+				frame.start, frame.clear.data(), clear_len,
+				end) :
+			Crypto::decrypt(frame.cipher->data(),
+					frame.cipher->size(), key,
+					frame.clear.data(), clear_len);
+}
+
+// Frames delivered, and whether they all were, in order
+static size_t delivered;
+static void deliver(Frame &frame)
+{
+	if (!frame.decrypted || frame.index != delivered++) {
+		std::cerr << "Frame " << frame.index << " delivered wrong."
+			  << std::endl;
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Decrypt and deliver every frame of the stream, inline if workers is 0.
+static void run(const std::string &name, size_t workers, bool channels,
+		size_t frames)
+{
+	Stream stream = build_stream(frames, channels);
+	stream.decryptors.resize(senders);
+	delivered = 0;
+	auto start = std::chrono::steady_clock::now();
+	{
+		std::unique_ptr<OrderedPipeline<Frame> > pipeline;
+		if (workers > 0)
+			pipeline.reset(new OrderedPipeline<Frame>(
+				workers,
+				[&stream](Frame &frame, size_t) {
+					decrypt(stream, frame);
+				},
+				deliver));
+		for (size_t i = 0; i < frames; ++i) {
+			Frame frame;
+			frame.index = i;
+			frame.cipher = &stream.ciphers[i];
+			frame.sender = i % senders;
+			frame.start = i < senders;
+			if (workers == 0) {
+				decrypt(stream, frame);
+				deliver(frame);
+			} else {
+				size_t lane = channels ? frame.sender : i;
+				pipeline->submit(std::move(frame), lane);
+			}
+		}
+		// Delivers the rest on the way out
+	}
+	double seconds = std::chrono::duration<double>(
+				 std::chrono::steady_clock::now() - start)
+				 .count();
+	std::cout << std::left << std::setw(28) << name << std::right
+		  << std::setw(10) << (workers == 0 ? "inline" :
+						      std::to_string(workers))
+		  << std::fixed << std::setprecision(0) << std::setw(14)
+		  << frames / seconds << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+	size_t frames = argc > 1 ? std::stoul(argv[1]) : 20000;
+	if (sodium_init() < 0) {
+		std::cerr << "Unable to initialize libsodium." << std::endl;
+		return EXIT_FAILURE;
+	}
+	randombytes_buf(key.data(), key.size());
+	std::cout << std::thread::hardware_concurrency() << " cores"
+		  << std::endl;
+	std::cout << std::left << std::setw(28) << "frames" << std::right
+		  << std::setw(10) << "workers" << std::setw(14) << "frames/s"
+		  << std::endl;
+	for (bool channels : { false, true })
+		for (size_t workers : { 0, 1, 2, 4 })
+			run(channels ? "1000 B channel messages" :
+				       "32 KiB file chunks",
+			    workers, channels, frames);
+	return 0;
+}
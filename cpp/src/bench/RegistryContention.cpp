@@ -0,0 +1,153 @@
+/*======================================================================
+COIS-4310H - RegistryContention
+Name: RegistryContention.cpp
+Purpose: Contention benchmark of the server's client registry. Threads
+	hammer a registry with the server's mix of operations; PM lookups,
+	the occasional broadcast walking every client, and logins and
+	logouts, and the lookup throughput and login latency are compared
+	between the registry as it was (a single reader preferring rwlock
+	over one map) and the sharded, writer preferring registry.
+
+Usage: ./RegistryContention [threads] [users] [seconds]
+
+Description of Parameters
+	threads: number of threads using the registry at once (default 8)
+	users: number of users logged in throughout (default 10000)
+	seconds: how long each registry is run for (default 2)
+
+	Each thread does, per 1000 operations, 10 broadcasts, 40 logouts and
+	logins (of a user of its own), and the rest PM lookups.
+
+Compilation: Please use the provided Make file (make bench)
+----------------------------------------------------------------------*/
+
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <random>
+#include <algorithm>
+#include "BenchClient.hpp"
+#include "../server/ClientRegistry.hpp"
+
+// Stand in for a MessagingClient; lookups touch it, as queueing does.
+struct BenchUser {
+	std::atomic<uint64_t> frames;
+	BenchUser(void) : frames(0)
+	{
+	}
+	BenchUser(BenchUser &&) : frames(0)
+	{
+	}
+};
+
+// What one thread got done
+struct ThreadResult {
+	uint64_t lookups = 0;
+	uint64_t broadcasts = 0;
+	std::vector<int64_t> login_ns;
+};
+
+static void run_thread(ClientRegistry<BenchUser> &registry, size_t id,
+		       size_t users, const std::atomic<bool> &running,
+		       ThreadResult &result)
+{
+	std::minstd_rand random(id + 1);
+	std::vector<std::string> usernames;
+	for (size_t i = 0; i < users; ++i)
+		usernames.push_back("user" + std::to_string(i));
+	std::string own_username = "churn" + std::to_string(id);
+	auto add_own = [&] {
+		registry.insert(
+			own_username, [] { return BenchUser(); },
+			[](BenchUser &) {});
+	};
+	add_own();
+	while (running) {
+		unsigned op = random() % 1000;
+		if (op < 10) {
+			for (size_t shard = 0; shard < registry.shard_count();
+			     ++shard) {
+				registry.for_each_in_shard(
+					shard, [](const NameView &,
+						  BenchUser &user) {
+						++user.frames;
+					});
+			}
+			++result.broadcasts;
+		} else if (op < 50) {
+			int64_t start = now_ns();
+			registry.erase(own_username);
+			add_own();
+			result.login_ns.push_back(now_ns() - start);
+		} else {
+			registry.find(usernames[random() % users],
+				      [](BenchUser &user) { ++user.frames; });
+			++result.lookups;
+		}
+	}
+}
+
+// Run the workload against registry, and print how it went.
+static void measure(const std::string &name,
+		    ClientRegistry<BenchUser> &registry, size_t threads,
+		    size_t users, int seconds)
+{
+	for (size_t i = 0; i < users; ++i)
+		registry.insert(
+			"user" + std::to_string(i), [] { return BenchUser(); },
+			[](BenchUser &) {});
+	std::atomic<bool> running(true);
+	std::vector<ThreadResult> results(threads);
+	std::vector<std::thread> workers;
+	for (size_t i = 0; i < threads; ++i)
+		workers.push_back(std::thread(run_thread, std::ref(registry), i,
+					      users, std::cref(running),
+					      std::ref(results[i])));
+	std::this_thread::sleep_for(std::chrono::seconds(seconds));
+	running = false;
+	for (auto &worker : workers)
+		worker.join();
+
+	uint64_t lookups = 0, broadcasts = 0;
+	std::vector<int64_t> login_ns;
+	for (auto &result : results) {
+		lookups += result.lookups;
+		broadcasts += result.broadcasts;
+		login_ns.insert(login_ns.end(), result.login_ns.begin(),
+				result.login_ns.end());
+	}
+	std::sort(login_ns.begin(), login_ns.end());
+	auto login_us = [&](double p) {
+		if (login_ns.empty())
+			return 0.0;
+		return login_ns[(size_t)(p / 100 * (login_ns.size() - 1))] /
+		       1000.0;
+	};
+	std::cout << std::fixed << std::setprecision(1) << name << ": "
+		  << lookups / seconds << " lookups/s, "
+		  << broadcasts / seconds << " broadcasts/s, "
+		  << login_ns.size() / seconds << " logins/s, login p50 "
+		  << login_us(50) << "us p99 " << login_us(99) << "us max "
+		  << login_us(100) << "us" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+	size_t threads = argc > 1 ? std::stoul(argv[1]) : 8;
+	size_t users = argc > 2 ? std::stoul(argv[2]) : 10000;
+	int seconds = argc > 3 ? std::stoi(argv[3]) : 2;
+	std::cout << threads << " threads, " << users << " users" << std::endl;
+	{
+		// The single rwlock SharedClients used to have
+		ClientRegistry<BenchUser> registry(1, false);
+		measure("single rwlock", registry, threads, users, seconds);
+	}
+	{
+		ClientRegistry<BenchUser> registry(64);
+		measure("64 shards    ", registry, threads, users, seconds);
+	}
+	return 0;
+}
@@ -0,0 +1,247 @@
+/*======================================================================
+COIS-4310H - ServerLoad
+Name: ServerLoad.cpp
+Purpose: Load generator for comparing the server modes. Logs in a large
+	number of idle connections, reports the resident memory and thread
+	count of the server once they are all connected, and then measures
+	message throughput while a few of the connections send private
+	messages to the others.
+
+Usage: ./ServerLoad [connections] [senders] [messages] [server_pid]
+	e.g. ./MessageServer --epoll 4 & ./ServerLoad 10000 16 10000 $!
+
+Description of Parameters
+	connections: number of clients to log in (default 1000)
+	senders: how many of the clients send messages (default 8)
+	messages: number of messages sent by each sender (default 1000)
+	server_pid: pid of the running server, to read its memory usage
+		from /proc (optional). The server is also sent SIGUSR1
+		before and after the messages are sent, so it prints the
+		system calls it made per delivered message.
+
+	Every connection uses a file descriptor in both this process and the
+	server, so raise the open file limit (ulimit -n) for large runs.
+
+	Each sender keeps no more than max_in_flight messages on their way
+	to its recipient (as a client's send window would), well within
+	the frames the server queues for a client before it sheds or cuts
+	them off (see OutboundQueue).
+
+Compilation: Please use the provided Make file (make bench)
+----------------------------------------------------------------------*/
+
+#include <iostream>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <csignal>
+extern "C" {
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+}
+#include "MessageLayer.hpp"
+#include "BenchClient.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+// Receive state of one load connection
+struct Peer {
+	int socket;
+	MessageHeader header;
+	size_t header_received = 0;
+	size_t data_remaining = 0;
+	// Messages from the load senders received
+	std::atomic<uint64_t> delivered{ 0 };
+};
+
+// Most messages a sender has on their way to its recipient
+static const uint64_t constexpr max_in_flight = 1024;
+
+// Counters updated by the receiving thread
+static std::atomic<uint64_t> logins_received(0);
+static std::atomic<uint64_t> frames_received(0);
+static std::atomic<uint64_t> acks_received(0);
+static std::atomic<uint64_t> messages_delivered(0);
+static std::atomic<int64_t> last_receive_ns(0);
+static std::atomic<bool> running(true);
+
+// Count the frames in the bytes just read from a peer
+static void consume(Peer &peer, const uint8_t *data, size_t len)
+{
+	while (len > 0) {
+		if (peer.data_remaining > 0) {
+			size_t skip = std::min(len, peer.data_remaining);
+			peer.data_remaining -= skip;
+			data += skip;
+			len -= skip;
+			continue;
+		}
+		size_t wanted = peer.header.size() - peer.header_received;
+		size_t take = std::min(len, wanted);
+		std::memcpy(peer.header.data() + peer.header_received, data,
+			    take);
+		peer.header_received += take;
+		data += take;
+		len -= take;
+		if (peer.header_received < peer.header.size())
+			continue;
+		peer.header_received = 0;
+		++frames_received;
+		uint8_t type = peer.header[message_type_begin];
+		peer.data_remaining = ntohs(
+			*((uint16_t *)&(peer.header[data_packet_length_begin])));
+		if (type == MessageTypes::LOGIN) {
+			++logins_received;
+		} else if (type == MessageTypes::ACK) {
+			++acks_received;
+		} else if (type == MessageTypes::MESSAGE &&
+			   std::memcmp(&(peer.header[source_username_begin]),
+				       "load", 4) == 0) {
+			++messages_delivered;
+			++peer.delivered;
+		}
+	}
+}
+
+// Drain every connection, counting what arrives
+static void receiver(int epoll_fd)
+{
+	std::vector<epoll_event> events(256);
+	std::vector<uint8_t> buffer(1 << 16);
+	while (running) {
+		int count = epoll_wait(epoll_fd, events.data(), events.size(),
+				       100);
+		for (int i = 0; i < count; ++i) {
+			Peer &peer = *(Peer *)events[i].data.ptr;
+			while (true) {
+				ssize_t got = read(peer.socket, buffer.data(),
+						   buffer.size());
+				if (got <= 0)
+					break;
+				consume(peer, buffer.data(), got);
+				last_receive_ns = now_ns();
+			}
+		}
+	}
+}
+
+// Wait until nothing has arrived for quiet_ms milliseconds
+static void wait_for_quiet(int quiet_ms)
+{
+	while (now_ns() - last_receive_ns < (int64_t)quiet_ms * 1000000)
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+}
+
+// Send messages private messages from the peer to the destination user,
+// received by recipient; no more than max_in_flight of them at once.
+static void sender(Peer *peer, std::string username, std::string destination,
+		   Peer *recipient, size_t messages)
+{
+	std::vector<uint8_t> payload(64, 'x');
+	uint64_t already = recipient->delivered;
+	for (size_t i = 0; i < messages; ++i) {
+		// Give up if deliveries stall for a few seconds
+		int64_t waiting_since = now_ns();
+		while (i - (recipient->delivered - already) >= max_in_flight) {
+			if (now_ns() - waiting_since > 5000000000LL)
+				return;
+			std::this_thread::sleep_for(
+				std::chrono::microseconds(100));
+		}
+		auto frame =
+			build_load_message(i, username, destination, payload);
+		if (!write_all(peer->socket, frame.data(), frame.size())) {
+			std::cerr << "Sender lost its connection." << std::endl;
+			return;
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	size_t connections = argc > 1 ? std::stoul(argv[1]) : 1000;
+	size_t senders = argc > 2 ? std::stoul(argv[2]) : 8;
+	size_t messages = argc > 3 ? std::stoul(argv[3]) : 1000;
+	int server_pid = argc > 4 ? std::stoi(argv[4]) : 0;
+	if (senders > connections / 2)
+		senders = connections / 2;
+
+	int epoll_fd = epoll_create1(0);
+	last_receive_ns = now_ns();
+	std::thread receive_thread(receiver, epoll_fd);
+
+	report_server(server_pid, "Before connecting");
+	// Log in every connection
+	std::vector<Peer *> peers;
+	auto connect_start = Clock::now();
+	for (size_t i = 0; i < connections; ++i) {
+		Peer *peer = new Peer();
+		peer->socket = connect_and_log_in("load" + std::to_string(i));
+		epoll_event event;
+		event.events = EPOLLIN;
+		event.data.ptr = peer;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, peer->socket, &event);
+		peers.push_back(peer);
+	}
+	while (logins_received < connections)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	double connect_secs = std::chrono::duration<double>(Clock::now() -
+							    connect_start)
+				      .count();
+	// Let the "entered the room" broadcasts settle.
+	wait_for_quiet(1000);
+	std::cout << "Logged in " << connections << " connections in "
+		  << connect_secs << "s" << std::endl;
+	report_server(server_pid, "Idle connections");
+
+	// Have the server print (and reset) its I/O counters, so the
+	// next report covers just the messages sent below.
+	if (server_pid > 0)
+		kill(server_pid, SIGUSR1);
+
+	// Message throughput
+	uint64_t expected = messages_delivered + senders * messages;
+	uint64_t frames_before = frames_received;
+	uint64_t acks_before = acks_received;
+	std::vector<std::thread> sender_threads;
+	auto send_start = Clock::now();
+	for (size_t i = 0; i < senders; ++i) {
+		size_t destination = (i + senders) % connections;
+		sender_threads.push_back(std::thread(
+			sender, peers[i], "load" + std::to_string(i),
+			"load" + std::to_string(destination),
+			peers[destination], messages));
+	}
+	for (auto &thread : sender_threads)
+		thread.join();
+	// Give up if deliveries stall for a few seconds
+	last_receive_ns = now_ns();
+	while (messages_delivered < expected &&
+	       now_ns() - last_receive_ns < 5000000000LL)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	double send_secs =
+		std::chrono::duration<double>(Clock::now() - send_start)
+			.count();
+	uint64_t delivered = senders * messages - (expected - messages_delivered);
+	std::cout << "Delivered " << delivered << "/" << senders * messages
+		  << " messages in " << send_secs << "s ("
+		  << (uint64_t)(delivered / send_secs) << " messages/s, "
+		  << (frames_received - frames_before)
+		  << " frames received including "
+		  << (acks_received - acks_before) << " ACKs)" << std::endl;
+	report_server(server_pid, "After sending");
+	if (server_pid > 0)
+		kill(server_pid, SIGUSR1);
+
+	running = false;
+	receive_thread.join();
+	for (auto peer : peers) {
+		close(peer->socket);
+		delete peer;
+	}
+	return 0;
+}
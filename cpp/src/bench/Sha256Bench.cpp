@@ -0,0 +1,145 @@
+/*======================================================================
+COIS-4310H - Sha256Bench
+Name: Sha256Bench.cpp
+Purpose: Cycles per byte of each SHA-256 backend this CPU supports, of
+	picosha2, and of the faster checksums of the newer header versions
+	(CRC32C and xxHash3), for the sizes the MessageLayer hashes; a 134
+	byte header, and data packets from small chat messages up to the 64
+	KiB maximum.
+	Then the same for batches of headers through hash_many, for each
+	number of lanes it supports on this CPU.
+
+Usage: ./Sha256Bench [iterations]
+	iterations: hashes timed for each size (default 20000)
+
+	Cycles are read from the time stamp counter, which ticks at the
+	CPU's nominal frequency (turbo clocks make the numbers look better
+	than they are, so compare backends rather than absolute values).
+
+Compilation: Please use the provided Make file (make bench)
+----------------------------------------------------------------------*/
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include "Sha256.hpp"
+#include "Checksum.hpp"
+#include "picosha2.hpp"
+extern "C" {
+#include <x86intrin.h>
+}
+
+// Keeps the hashing from being optimised away
+static volatile uint8_t sink;
+
+// Cycles per byte of running hash over size bytes
+template <typename Hash>
+static double cycles_per_byte(size_t size, size_t iterations, Hash hash)
+{
+	std::vector<uint8_t> data(size, 0xa5);
+	uint8_t digest[sha256_digest_size];
+	// Warm up
+	for (size_t i = 0; i < iterations / 10 + 1; ++i)
+		hash(data, digest);
+	uint64_t start = __rdtsc();
+	for (size_t i = 0; i < iterations; ++i) {
+		data[0] = (uint8_t)i;
+		hash(data, digest);
+		sink = digest[0];
+	}
+	uint64_t cycles = __rdtsc() - start;
+	return (double)cycles / iterations / size;
+}
+
+int main(int argc, char **argv)
+{
+	size_t iterations = argc > 1 ? std::stoul(argv[1]) : 20000;
+	const size_t sizes[] = { 134, 256, 1024, 4096, 65535 };
+	std::cout << "Best backend for this CPU: "
+		  << Sha256::name(Sha256::best_backend()) << std::endl;
+	std::cout << std::setw(10) << "bytes" << std::setw(10) << "picosha2";
+	for (int b = SHA256_SCALAR; b <= SHA256_SHA_NI; ++b)
+		std::cout << std::setw(10) << Sha256::name((Sha256Backend)b);
+	std::cout << std::setw(10) << "crc32c" << std::setw(10) << "xxh3";
+	std::cout << "   (cycles/byte)" << std::endl;
+	for (size_t size : sizes) {
+		// Keep the big sizes from taking forever
+		size_t count = std::max((size_t)100, iterations * 134 / size);
+		std::cout << std::setw(10) << size << std::fixed
+			  << std::setprecision(2) << std::setw(10)
+			  << cycles_per_byte(size, count,
+					     [](const std::vector<uint8_t> &data,
+						uint8_t *digest) {
+						     picosha2::hash256(
+							     data.begin(),
+							     data.end(), digest,
+							     digest + sha256_digest_size);
+					     });
+		for (int b = SHA256_SCALAR; b <= SHA256_SHA_NI; ++b) {
+			Sha256Backend backend = (Sha256Backend)b;
+			if (!Sha256::supported(backend)) {
+				std::cout << std::setw(10) << "-";
+				continue;
+			}
+			Sha256 sha(backend);
+			std::cout << std::setw(10)
+				  << cycles_per_byte(
+					     size, count,
+					     [&](const std::vector<uint8_t> &data,
+						 uint8_t *digest) {
+						     sha.reset();
+						     sha.update(data.data(),
+								data.size())
+							     .finish(digest);
+					     });
+		}
+		const ChecksumAlgorithm algorithms[] = { CHECKSUM_CRC32C,
+							 CHECKSUM_XXH3 };
+		for (ChecksumAlgorithm algorithm : algorithms)
+			std::cout << std::setw(10)
+				  << cycles_per_byte(
+					     size, count,
+					     [&](const std::vector<uint8_t> &data,
+						 uint8_t *digest) {
+						     Checksum::calculate(
+							     algorithm,
+							     data.data(),
+							     data.size(), digest);
+					     });
+		std::cout << std::endl;
+	}
+	// Batches of 64 headers, as a busy connection's read buffer holds.
+	const size_t header_size = 134, batch_headers = 64;
+	std::vector<uint8_t> headers(header_size * batch_headers, 0xa5);
+	std::vector<const uint8_t *> pointers;
+	for (size_t i = 0; i < batch_headers; ++i)
+		pointers.push_back(headers.data() + i * header_size);
+	std::vector<uint8_t> digests(batch_headers * sha256_digest_size);
+	std::cout << "hash_many of " << batch_headers << " " << header_size
+		  << " byte headers (best is " << Sha256::lanes()
+		  << " lanes)" << std::endl;
+	const size_t batches[] = { 1, 8, 16 };
+	for (size_t batch : batches) {
+		if (!Sha256::lanes_supported(batch))
+			continue;
+		size_t rounds = iterations / batch_headers + 1;
+		for (size_t i = 0; i < rounds / 10 + 1; ++i)
+			Sha256::hash_many(pointers.data(), batch_headers,
+					  header_size, digests.data(), batch);
+		uint64_t start = __rdtsc();
+		for (size_t i = 0; i < rounds; ++i) {
+			headers[0] = (uint8_t)i;
+			Sha256::hash_many(pointers.data(), batch_headers,
+					  header_size, digests.data(), batch);
+			sink = digests[0];
+		}
+		uint64_t cycles = __rdtsc() - start;
+		std::cout << std::setw(10) << batch << " lanes"
+			  << std::setw(10)
+			  << (double)cycles / (rounds * batch_headers *
+					       header_size)
+			  << " cycles/byte" << std::endl;
+	}
+	return 0;
+}
@@ -0,0 +1,272 @@
+/*======================================================================
+COIS-4310H - SlowConsumerLatency
+Name: SlowConsumerLatency.cpp
+Purpose: Measure how long broadcasts take to reach the healthy members
+	of a room while some of the others have stopped reading. One client
+	broadcasts a steady stream of messages, a share of the room never
+	reads a byte, and the time from each broadcast being sent until each
+	healthy member has it is reported (p50, p99, max), along with the
+	server's memory use, for each share of stalled members. The stalled
+	members are sent messages of their own now and then as well.
+
+	The stalled members' queues on the server fill up; their broadcasts
+	are shed, and they are cut off once nothing else will do (see
+	OutboundQueue). Their sockets are closed after each run.
+
+Usage: ./SlowConsumerLatency [room] [broadcasts] [bytes] [server_pid]
+	e.g. ./MessageServer --epoll & ./SlowConsumerLatency 64 20000 1024 $!
+
+Description of Parameters
+	room: number of members in the room, besides the sender (default 64)
+	broadcasts: number of broadcasts sent in each run (default 20000)
+	bytes: size of each broadcast's data packet (default 1024)
+	server_pid: pid of the running server, to read its memory usage
+		from /proc (optional). The server is also sent SIGUSR1 after
+		each run, so it prints the frames it has shed.
+
+Compilation: Please use the provided Make file (make bench)
+----------------------------------------------------------------------*/
+
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <csignal>
+#include <algorithm>
+extern "C" {
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+}
+#include "MessageLayer.hpp"
+#include "BenchClient.hpp"
+
+// Receive state of one healthy member (or the sender, reading its ACKs)
+struct Member {
+	int socket;
+	MessageHeader header;
+	size_t header_received = 0;
+	size_t data_remaining = 0;
+	// Latencies of the broadcasts received (ns)
+	std::vector<int64_t> latencies;
+};
+
+// Broadcasts in flight; the sender waits for the healthy members to have
+// one before sending another this many later.
+static const size_t constexpr in_flight = 64;
+// Every this many broadcasts, the sender also sends one of the stalled
+// members a message of their own.
+static const size_t constexpr direct_every = 4;
+
+// When each broadcast was sent, by packet number
+static std::vector<std::atomic<int64_t> > sent_ns(65536);
+// Broadcast receptions by the healthy members, all told
+static std::atomic<uint64_t> received(0);
+static std::atomic<uint64_t> logins_received(0);
+static std::atomic<bool> running(true);
+static std::string sender_username;
+
+// Time the broadcasts in the bytes just read from a member
+static void consume(Member &member, const uint8_t *data, size_t len)
+{
+	while (len > 0) {
+		if (member.data_remaining > 0) {
+			size_t skip = std::min(len, member.data_remaining);
+			member.data_remaining -= skip;
+			data += skip;
+			len -= skip;
+			continue;
+		}
+		size_t take = std::min(len, member.header.size() -
+						    member.header_received);
+		std::memcpy(member.header.data() + member.header_received,
+			    data, take);
+		member.header_received += take;
+		data += take;
+		len -= take;
+		if (member.header_received < member.header.size())
+			continue;
+		member.header_received = 0;
+		uint8_t type = member.header[message_type_begin];
+		member.data_remaining = ntohs(*(
+			(uint16_t *)&(member.header[data_packet_length_begin])));
+		if (type == MessageTypes::LOGIN) {
+			++logins_received;
+		} else if (type == MessageTypes::MESSAGE &&
+			   std::memcmp(&(member.header[source_username_begin]),
+				       sender_username.c_str(),
+				       sender_username.size() + 1) == 0) {
+			const uint8_t *number =
+				&(member.header[packet_number_begin]);
+			uint16_t packet_number = (number[0] << 8) | number[1];
+			member.latencies.push_back(now_ns() -
+						   sent_ns[packet_number]);
+			++received;
+		}
+	}
+}
+
+// Drain every healthy member's connection
+static void receiver(int epoll_fd)
+{
+	std::vector<epoll_event> events(256);
+	std::vector<uint8_t> buffer(1 << 16);
+	while (running) {
+		int count = epoll_wait(epoll_fd, events.data(), events.size(),
+				       100);
+		for (int i = 0; i < count; ++i) {
+			Member &member = *(Member *)events[i].data.ptr;
+			while (true) {
+				ssize_t got = read(member.socket, buffer.data(),
+						   buffer.size());
+				if (got <= 0)
+					break;
+				consume(member, buffer.data(), got);
+			}
+		}
+	}
+}
+
+// Value at the passed percentile of the sorted samples (us)
+static double percentile(const std::vector<int64_t> &sorted, double p)
+{
+	size_t index = (size_t)(p / 100.0 * (sorted.size() - 1));
+	return sorted[index] / 1000.0;
+}
+
+// Broadcast to a room of room_size, with stalled_percent of them never
+// reading, and report the latencies to the rest.
+static void run(int run_number, size_t room_size, size_t stalled_percent,
+		size_t broadcasts, size_t bytes, int server_pid)
+{
+	std::string prefix = "r" + std::to_string(run_number) + "_";
+	size_t stalled_count = room_size * stalled_percent / 100;
+	size_t healthy_count = room_size - stalled_count;
+	int epoll_fd = epoll_create1(0);
+	sender_username = prefix + "sender";
+	received = 0;
+	logins_received = 0;
+	running = true;
+	// The sender is read from too, or its ACKs would stall it.
+	std::vector<Member *> members;
+	std::vector<int> stalled;
+	for (size_t i = 0; i <= healthy_count; ++i) {
+		Member *member = new Member();
+		member->socket = connect_and_log_in(
+			i == 0 ? sender_username :
+				 prefix + "healthy" + std::to_string(i));
+		epoll_event event;
+		event.events = EPOLLIN;
+		event.data.ptr = member;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, member->socket, &event);
+		members.push_back(member);
+	}
+	for (size_t i = 0; i < stalled_count; ++i)
+		stalled.push_back(connect_and_log_in(prefix + "stalled" +
+						     std::to_string(i)));
+	std::thread receive_thread(receiver, epoll_fd);
+	while (logins_received < members.size())
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	// Let the "entered the room" broadcasts settle.
+	std::this_thread::sleep_for(std::chrono::milliseconds(500));
+	received = 0;
+
+	std::vector<uint8_t> payload(bytes, 's');
+	// Of every frame the sender sends, in order
+	uint16_t packet_number = 0;
+	int64_t start = now_ns();
+	for (size_t i = 0; i < broadcasts; ++i) {
+		// Wait for the healthy members to have caught up
+		if (i >= in_flight) {
+			uint64_t expected = (i - in_flight + 1) * healthy_count;
+			int64_t waited_from = now_ns();
+			while (received < expected &&
+			       now_ns() - waited_from < 5000000000LL)
+				std::this_thread::yield();
+			if (received < expected) {
+				std::cerr << "Healthy members stopped "
+					     "receiving broadcasts."
+					  << std::endl;
+				exit(EXIT_FAILURE);
+			}
+		}
+		auto message = build_load_message(packet_number,
+						  sender_username, "all",
+						  payload);
+		sent_ns[packet_number] = now_ns();
+		if (!write_all(members[0]->socket, message.data(),
+			       message.size())) {
+			std::cerr << "Sender lost its connection." << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		++packet_number;
+		// Messages to them directly, that aren't shed like the
+		// broadcasts are
+		if (i % direct_every == 0 && stalled_count > 0) {
+			size_t to = i / direct_every % stalled_count;
+			message = build_load_message(
+				packet_number++, sender_username,
+				prefix + "stalled" + std::to_string(to),
+				payload);
+			write_all(members[0]->socket, message.data(),
+				  message.size());
+		}
+	}
+	uint64_t expected = broadcasts * healthy_count;
+	while (received < expected && now_ns() - start < 60000000000LL)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	double seconds = (now_ns() - start) / 1e9;
+	running = false;
+	receive_thread.join();
+
+	std::vector<int64_t> latencies;
+	for (size_t i = 1; i < members.size(); ++i)
+		latencies.insert(latencies.end(), members[i]->latencies.begin(),
+				 members[i]->latencies.end());
+	std::sort(latencies.begin(), latencies.end());
+	std::cout << std::fixed << std::setprecision(1) << std::setw(10)
+		  << stalled_percent << std::setw(10) << healthy_count
+		  << std::setw(12) << broadcasts / seconds << std::setw(10)
+		  << 100.0 * latencies.size() / expected;
+	if (!latencies.empty())
+		std::cout << std::setw(10) << percentile(latencies, 50)
+			  << std::setw(10) << percentile(latencies, 99)
+			  << std::setw(10) << latencies.back() / 1000.0;
+	std::cout << std::endl;
+	report_server(server_pid, "  before the stalled members leave");
+	if (server_pid > 0)
+		kill(server_pid, SIGUSR1);
+
+	for (auto member : members) {
+		close(member->socket);
+		delete member;
+	}
+	for (int socket : stalled)
+		close(socket);
+	close(epoll_fd);
+	// Let the server log everyone out before the next run.
+	std::this_thread::sleep_for(std::chrono::milliseconds(500));
+}
+
+int main(int argc, char **argv)
+{
+	size_t room_size = argc > 1 ? std::stoul(argv[1]) : 64;
+	size_t broadcasts = argc > 2 ? std::stoul(argv[2]) : 20000;
+	size_t bytes = argc > 3 ? std::stoul(argv[3]) : 1024;
+	int server_pid = argc > 4 ? std::stoi(argv[4]) : 0;
+	std::cout << broadcasts << " broadcasts of " << bytes << " bytes to "
+		  << room_size << " members" << std::endl;
+	std::cout << std::setw(10) << "stalled %" << std::setw(10) << "healthy"
+		  << std::setw(12) << "bcasts/s" << std::setw(10) << "got %"
+		  << std::setw(10) << "p50 us" << std::setw(10) << "p99 us"
+		  << std::setw(10) << "max us" << std::endl;
+	int run_number = 0;
+	for (size_t stalled_percent : { 0, 10, 25, 50 })
+		run(run_number++, room_size, stalled_percent, broadcasts, bytes,
+		    server_pid);
+	return 0;
+}
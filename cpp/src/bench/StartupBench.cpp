@@ -0,0 +1,122 @@
+/*======================================================================
+COIS-4310H - StartupBench
+Name: StartupBench.cpp
+Purpose: How long a client takes from being given its password to being
+	logged in with the room's key ready; deriving the key first and then
+	connecting (as the client used to), connecting and logging in while
+	the key is derived in the background (cold start), and with the key
+	already in the key cache (warm start).
+
+Usage: ./StartupBench [runs]
+	e.g. ./MessageServer & ./StartupBench 5
+
+Description of Parameters
+	runs: startups timed each way (default 5)
+
+Compilation: Please use the provided Make file (make bench)
+----------------------------------------------------------------------*/
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <future>
+#include <cerrno>
+#include <cstdlib>
+#include <algorithm>
+extern "C" {
+#include <unistd.h>
+#include <poll.h>
+}
+#include "MessageLayer.hpp"
+#include "CryptoLayer.hpp"
+#include "BenchClient.hpp"
+
+static const std::string password = "startup bench password";
+
+// Wait for the server to accept the login sent on socket.
+static void wait_for_login(int socket)
+{
+	MessageHeader header;
+	size_t got = 0;
+	while (got < header.size()) {
+		pollfd readable = { socket, POLLIN, 0 };
+		poll(&readable, 1, -1);
+		ssize_t read_size =
+			read(socket, header.data() + got, header.size() - got);
+		if (read_size > 0)
+			got += read_size;
+		else if (read_size == 0 || errno != EAGAIN)
+			break;
+	}
+	if (got < header.size() ||
+	    header[message_type_begin] != MessageTypes::LOGIN) {
+		std::cerr << "The server didn't accept the login." << std::endl;
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Derive the key, from the key cache if there is one
+static std::tuple<bool, Crypto::StreamKey>
+derive(const std::string &cache_path)
+{
+	if (cache_path.empty())
+		return Crypto::derive_key_from_password(password);
+	return Crypto::derive_key_from_password(password, cache_path);
+}
+
+// Milliseconds from being given the password to being logged in with
+// the key, one way or another.
+static double startup(const std::string &username, bool background,
+		      const std::string &cache_path)
+{
+	int64_t start = now_ns();
+	auto derived = std::async(background ? std::launch::async :
+					       std::launch::deferred,
+				  derive, cache_path);
+	// Derived before connecting, unless it's in the background
+	if (!background)
+		derived.wait();
+	int socket = connect_and_log_in(username);
+	wait_for_login(socket);
+	if (!std::get<0>(derived.get())) {
+		std::cerr << "Unable to derive the key." << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	double ms = (now_ns() - start) / 1e6;
+	close(socket);
+	return ms;
+}
+
+static void run(const std::string &name, size_t runs, bool background,
+		const std::string &cache_path)
+{
+	double total = 0;
+	double best = 1e9;
+	for (size_t i = 0; i < runs; ++i) {
+		double ms = startup("startup" + std::to_string(getpid()) + "_" +
+					    std::to_string(i),
+				    background, cache_path);
+		total += ms;
+		best = std::min(best, ms);
+	}
+	std::cout << std::left << std::setw(32) << name << std::right
+		  << std::fixed << std::setprecision(1) << std::setw(12)
+		  << total / runs << std::setw(12) << best << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+	size_t runs = argc > 1 ? std::stoul(argv[1]) : 5;
+	std::string cache_path =
+		"/tmp/StartupBenchKeyCache." + std::to_string(getpid());
+	std::cout << std::left << std::setw(32) << "startup" << std::right
+		  << std::setw(12) << "mean ms" << std::setw(12) << "best ms"
+		  << std::endl;
+	run("derive, then log in", runs, false, "");
+	run("log in while deriving (cold)", runs, true, "");
+	// The first start fills the cache
+	Crypto::derive_key_from_password(password, cache_path);
+	run("key cached (warm)", runs, true, cache_path);
+	unlink(cache_path.c_str());
+	return 0;
+}
@@ -4,11 +4,17 @@ Name: Client.cpp
 Written By: Trevor Gilbert & Adam Melaney
 Purpose: This is a client for a messenger application, that will use 2
 	threads to to listen and send to a server. 
+	Files sent to us are written to the downloads directory, in the
+	working directory.
 
-Usage: ./MessageClient
+Usage: ./MessageClient [--key_cache] [--window frames]
 
 Description of Parameters
-	None
+	--key_cache: keep the key derived from the password in
+		~/.message_client_keys (readable only by you), so it needn't be
+		derived again the next time the same password is used
+	--window: the most frames sent ahead of the server's acknowledgements
+		(default 64, at most 1048576)
 
 Compilation: Please use the provided Make file that will make both the
 	client and the server.
@@ -23,27 +29,98 @@ a shared header for transit. Also requires the CryptoLayer Class.
 #include <unordered_map>
 #include <string>
 #include <cstring>
+#include <cstdio>
+#include <cerrno>
 #include <atomic>
 #include <mutex>
 #include <random>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <fstream>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <memory>
+#include <sstream>
 extern "C" {
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <poll.h>
 }
 #include "MessageLayer.hpp"
+#include "FrameReader.hpp"
+#include "BufferPool.hpp"
 #include "CryptoLayer.hpp"
+#include "OrderedPipeline.hpp"
+#include "SendWindow.hpp"
 
-#define VERSION 3
+// Header version, and so checksum algorithm (CRC32C), we use. The server
+// answers in kind, and still accepts version 3 (SHA-256) from old clients.
+#define VERSION header_version_crc32c
 #define SERVER_ADDRESS "0.0.0.0"
 #define SERVER_PORT 34551
 
-// Mutex to protect our Unordered Map from multithreaded use
+// Mutex guarding what both threads keep of messages and files being sent
 std::mutex messages_mutex;
-// List of sent messages
-static std::unordered_map<uint16_t, std::vector<uint8_t> > client_messages;
+// Frames sent but not yet acknowledged, sent again until they are. Only
+// the sending and receiving threads touch it (see SendWindow).
+static std::unique_ptr<SendWindow> send_window;
+// Frames the window has room for (see --window)
+static size_t window_size = 64;
+// Held while a frame is written to the socket, so frames written by both
+// threads never end up interleaved.
+static std::mutex socket_mutex;
+
+// Bytes of a file sent in each FILE_CHUNK frame, and the most chunks sent
+// ahead of the server's acknowledgements.
+static const size_t constexpr file_chunk_size = 32768;
+static const size_t constexpr file_window = 16;
+// In front of each chunk (encrypted along with it) are the details of the
+// file; the chunk's offset and the file's size (8 bytes each, network byte
+// order), and the length of the file's name (1 byte) followed by the name.
+static const size_t constexpr file_details_size = 17;
+// Directory (in the working directory) files sent to us are written to
+static const char *const download_directory = "downloads";
+// Most names tried for a file sent to us, if ones before it are taken
+static const int constexpr download_names = 100;
+
+// A file being sent
+struct OutgoingFile {
+	// Chunks sent but not yet acknowledged; the offset each starts at,
+	// and its sequence number.
+	std::map<uint64_t, uint64_t> in_flight;
+	// Bytes of the file sent so far
+	uint64_t sent;
+	// The file's size and modification time, to tell whether it has
+	// changed before a transfer is resumed.
+	uint64_t size;
+	uint64_t modified;
+	// Where how far the file has got (every byte before the first
+	// unacknowledged chunk) is recorded, to resume from if the transfer
+	// is interrupted, and the record, kept open for rewriting.
+	std::string resume_path;
+	int resume_record;
+	// Who it is being sent to
+	std::string recipient;
+	// Set when the server reports the recipient doesn't exist, to stop
+	// sending.
+	bool stopped;
+	// Bytes the server has acknowledged, from the start of the file
+	uint64_t acknowledged(void) const
+	{
+		return in_flight.empty() ? sent : in_flight.begin()->first;
+	}
+};
+// The file being sent, if any. Guarded by messages_mutex, and signalled
+// whenever one of its chunks is acknowledged.
+static OutgoingFile *outgoing_file = nullptr;
+static std::condition_variable file_acknowledged;
 
 // Live thread of execution. Joined on exit
 static std::thread client_thread;
@@ -53,8 +130,27 @@ static std::atomic<bool> is_running;
 // The client socket file descriptor. Global
 static int client_socket_fd;
 
-// Encryption key for the room
-static Crypto::StreamKey encryption_key;
+// Encryption key for the room, derived from the password in the
+// background while we connect and log in. Whether it could be derived,
+// and the key.
+static std::shared_future<std::tuple<bool, Crypto::StreamKey> > derived_key;
+// Where derived keys are cached (see --key_cache), if anywhere
+static std::string key_cache_path;
+
+// Our channels (see Crypto::ChannelEncryptor) to each user we have sent a
+// message to, and to the room ("all"). Guarded by messages_mutex.
+static std::unordered_map<std::string, Crypto::ChannelEncryptor> send_channels;
+// Our username, once it has been given
+static std::string our_username;
+// Frames from a channel we have lost our place in, between each request
+// for it to be started over.
+static const size_t constexpr resync_every = 16;
+
+// The room's encryption key, waiting for it to be derived if need be.
+static const Crypto::StreamKey &encryption_key(void)
+{
+	return std::get<1>(derived_key.get());
+}
 
 // This function is multipurposed. It is used by the sig handler to cleanup on ^c
 // It is also called when the program is closing normally.
@@ -81,8 +177,567 @@ void close_thread(int signum)
 	exit(0);
 }
 
+// Write the whole of a frame to the server. Returns false if it couldn't
+// be.
+static bool send_whole(const uint8_t *data, size_t len)
+{
+	const std::lock_guard<std::mutex> lock(socket_mutex);
+	while (len > 0) {
+		ssize_t sent = send(client_socket_fd, data, len, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent <= 0)
+			return false;
+		data += sent;
+		len -= sent;
+	}
+	return true;
+}
+
+// Sends (and sends again) the frames in the send window
+static bool transmit_frame(const PooledBytes &frame)
+{
+	return send_whole(frame.data(), frame.size());
+}
+
+static void write_u64(uint8_t *bytes, uint64_t value)
+{
+	for (size_t i = 0; i < 8; ++i)
+		bytes[i] = value >> (56 - 8 * i);
+}
+
+static uint64_t read_u64(const uint8_t *bytes)
+{
+	uint64_t value = 0;
+	for (size_t i = 0; i < 8; ++i)
+		value = (value << 8) | bytes[i];
+	return value;
+}
+
+// Bytes in front of the data packet of a frame
+static const size_t constexpr header_size =
+	std::tuple_size<MessageHeader>::value;
+
+// A chunk of the file being sent was acknowledged; record how far the
+// file has got, for resuming from. messages_mutex must be held.
+static void file_chunk_acknowledged(uint64_t sequence)
+{
+	OutgoingFile &transfer = *outgoing_file;
+	for (auto chunk = transfer.in_flight.begin();
+	     chunk != transfer.in_flight.end(); ++chunk) {
+		if (chunk->second != sequence)
+			continue;
+		transfer.in_flight.erase(chunk);
+		// Written over in one go, so the record is never left half
+		// written if we are killed.
+		char record[64];
+		int len = snprintf(record, sizeof(record), "%20llu %20llu %20llu\n",
+				   (unsigned long long)transfer.size,
+				   (unsigned long long)transfer.modified,
+				   (unsigned long long)transfer.acknowledged());
+		if (transfer.resume_record >= 0 &&
+		    pwrite(transfer.resume_record, record, len, 0) != len)
+			std::cerr << "Unable to record how far "
+				  << transfer.resume_path << " has got."
+				  << std::endl;
+		file_acknowledged.notify_all();
+		return;
+	}
+}
+
+// The frame with the sequence number was acknowledged; clear it from the
+// send window (it may have been sent again, and acknowledged twice).
+static void packet_acknowledged(uint64_t sequence)
+{
+	if (!send_window->ack(sequence))
+		return;
+	// Critical section that must be run under lock
+	// Grab Ownership of the Mutex and lock
+	const std::lock_guard<std::mutex> lock(messages_mutex);
+	if (outgoing_file != nullptr)
+		file_chunk_acknowledged(sequence);
+	// Mutex Guard will deconstruct when leaving scope, thus freeing lock on mutex
+}
+
+// The sequence number of one of our frames an ACK or NACK from the server
+// is about; the one given, or if the server sent the packet number alone,
+// the frame in the send window with it.
+static uint64_t sequence_of(const MessageHeaderView &header, uint64_t given)
+{
+	if (header.get_frame_flags() & frame_flag_sequence)
+		return given;
+	return send_window->extend((uint16_t)given);
+}
+
+// A frame from the server, on its way through the receive pipeline (see
+// OrderedPipeline); decrypted by a worker, then acted on in the order it
+// arrived.
+struct ReceivedFrame {
+	MessageHeader header;
+	// The data packet, left where the FrameReader read it
+	SharedBytes data;
+	size_t data_len;
+	// What the worker made of it; the decrypted data packet (of a file
+	// chunk), or what is to be output of the message it is part of, and
+	// whether the sender is to be asked to start their channel over.
+	PooledBytes clear;
+	size_t clear_len;
+	bool decrypted;
+	std::string output;
+	bool resync;
+	MessageHeaderView view(void) const
+	{
+		return MessageHeaderView(header.data());
+	}
+	DataPacketView data_packet(void) const
+	{
+		return DataPacketView(data.get(), data_len);
+	}
+};
+
+// Decrypt a chunk of a file being sent to us; every chunk is encrypted on
+// its own, so they are decrypted by whichever worker is free.
+static void decrypt_file_chunk(ReceivedFrame &frame)
+{
+	frame.clear.resize(frame.data_len);
+	frame.decrypted = Crypto::decrypt(frame.data.get(), frame.data_len,
+					  encryption_key(), frame.clear.data(),
+					  frame.clear_len) &&
+			  frame.clear_len >= file_details_size;
+}
+
+// The directory files sent to us are written to, created the first time
+// it's needed; -1 if it can't be. It's never followed if it is a link.
+static int download_directory_fd(void)
+{
+	static int directory = -1;
+	if (directory < 0) {
+		mkdir(download_directory, 0755);
+		directory = open(download_directory,
+				 O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	}
+	return directory;
+}
+
+// Give a file sent to us, that has arrived whole as part_path, its name in
+// the download directory; or if a file already has it, "name.1",
+// "name.2" and so on. Nothing there is ever replaced. Returns false if it
+// couldn't be, otherwise name is the one it was given.
+static bool place_received_file(int directory, const std::string &part_path,
+				std::string &name)
+{
+	std::string candidate = name;
+	for (int i = 1; i <= download_names; ++i) {
+		// A link fails, rather than replacing, if the name is taken.
+		if (linkat(directory, part_path.c_str(), directory,
+			   candidate.c_str(), 0) == 0) {
+			unlinkat(directory, part_path.c_str(), 0);
+			name = candidate;
+			return true;
+		}
+		if (errno != EEXIST)
+			return false;
+		candidate = name + "." + std::to_string(i);
+	}
+	return false;
+}
+
+// A file being sent to us
+struct IncomingFile {
+	// The file (name.part) it is being written to; -1 once it has
+	// arrived whole, when any more of it are copies of chunks already
+	// written.
+	int file;
+	// Where this transfer of it started; everything before it is in the
+	// file already (from an earlier one, that this one is resuming).
+	uint64_t from;
+	// Offsets of the chunks written since, and the bytes in them
+	std::set<uint64_t> chunks;
+	uint64_t written;
+};
+
+// Files being sent to us, by sender and name
+typedef std::unordered_map<std::string, IncomingFile> IncomingFiles;
+
+// Write a chunk of a file being sent to us to disk, as name.part in the
+// download directory until every chunk has arrived, when it is given its
+// name (see place_received_file). Chunks are written where they belong in
+// the file, whatever order they arrive in (one held back by the server
+// arrives after those behind it), so a transfer that is resumed part way
+// through carries on where it left off. Names starting with '.', or with
+// a '/' in them, are refused, and no link in the directory is followed.
+static void receive_file_chunk(const ReceivedFrame &frame,
+			       IncomingFiles &incoming_files)
+{
+	std::string source = frame.view().get_source_username().str();
+	if (!frame.decrypted) {
+		std::cout << "File from " << source << " not able to decrypt."
+			  << std::endl;
+		return;
+	}
+	const uint8_t *clear_txt = frame.clear.data();
+	size_t clear_len = frame.clear_len;
+	uint64_t offset = read_u64(clear_txt);
+	uint64_t size = read_u64(clear_txt + 8);
+	size_t name_len = clear_txt[16];
+	size_t chunk_len = clear_len - file_details_size - name_len;
+	std::string name((char *)clear_txt + file_details_size,
+			 std::min(name_len, clear_len - file_details_size));
+	// Only ever write to a file of that name in the download directory
+	if (file_details_size + name_len > clear_len || name.empty() ||
+	    name[0] == '.' || name.find('/') != std::string::npos ||
+	    name.find('\0') != std::string::npos || offset > size ||
+	    chunk_len > size - offset) {
+		std::cout << "Bad file chunk from " << source << "." << std::endl;
+		return;
+	}
+	int directory = download_directory_fd();
+	if (directory < 0) {
+		std::cout << "Unable to open " << download_directory
+			  << std::endl;
+		return;
+	}
+	std::string part_path = name + ".part";
+	std::string key = source + "/" + name;
+	auto found = incoming_files.find(key);
+	if (found != incoming_files.end() && found->second.file < 0) {
+		if (offset != 0)
+			return;
+		// Sent again, from the start
+		incoming_files.erase(found);
+		found = incoming_files.end();
+	}
+	if (found == incoming_files.end()) {
+		// A new file, unless it is carrying on from the chunks
+		// received earlier. A new one is always created afresh (any
+		// left over from before is removed first, never written
+		// through).
+		if (offset == 0)
+			unlinkat(directory, part_path.c_str(), 0);
+		int file = openat(directory, part_path.c_str(),
+				  O_WRONLY | O_CREAT | O_NOFOLLOW |
+					  (offset == 0 ? O_EXCL : 0),
+				  0644);
+		if (file < 0) {
+			std::cout << "Unable to write " << part_path << std::endl;
+			return;
+		}
+		// Resumed from no further than the file has got
+		struct stat status;
+		IncomingFile incoming;
+		incoming.file = file;
+		incoming.from = 0;
+		if (fstat(file, &status) == 0)
+			incoming.from =
+				std::min<uint64_t>(offset, status.st_size);
+		incoming.written = 0;
+		found = incoming_files.emplace(key, incoming).first;
+		std::cout << (offset == 0 ? "Receiving " : "Resuming ") << name
+			  << " (" << size << " bytes) from " << source
+			  << std::endl;
+	} else if (offset == 0 && found->second.chunks.count(0) > 0) {
+		// Sent again from the start
+		found->second.chunks.clear();
+		found->second.written = 0;
+		if (ftruncate(found->second.file, 0) < 0)
+			std::cout << "Unable to write " << part_path
+				  << std::endl;
+	}
+	IncomingFile &incoming = found->second;
+	const uint8_t *chunk = clear_txt + file_details_size + name_len;
+	if (pwrite(incoming.file, chunk, chunk_len, offset) !=
+	    (ssize_t)chunk_len)
+		std::cout << "Unable to write " << part_path << std::endl;
+	// Resumed from further back than was thought
+	incoming.from = std::min(incoming.from, offset);
+	if (incoming.chunks.insert(offset).second)
+		incoming.written += chunk_len;
+	// Every chunk, from where this transfer started
+	if (incoming.from + incoming.written == size) {
+		// (Anything after the end was left from an earlier file.)
+		if (ftruncate(incoming.file, size) < 0)
+			std::cout << "Unable to write " << part_path
+				  << std::endl;
+		close(incoming.file);
+		incoming.file = -1;
+		incoming.chunks.clear();
+		if (place_received_file(directory, part_path, name))
+			std::cout << "Received " << download_directory << "/"
+				  << name << " from " << source << std::endl;
+		else
+			std::cout << "Unable to write " << name << std::endl;
+	}
+}
+
+// Start the line a message from the source of the header is output on.
+static void print_message_start(const MessageHeaderView &ml,
+				std::ostream &out)
+{
+	if (ml.get_dest_username() == "all")
+		out << "(Room) " << ml.get_source_username() << " says > ";
+	else
+		out << ml.get_source_username() << " whispers to you > ";
+}
+
+// An encrypted message from another user that is still arriving (see
+// send_message).
+struct IncomingMessage {
+	Crypto::StreamDecryptor decryptor;
+	// Whether the start of the message has been output, and whether a
+	// part of it failed to decrypt (the rest of it is then ignored).
+	bool started;
+	bool failed;
+	IncomingMessage(void) : started(false), failed(false)
+	{
+	}
+};
+
+// Decrypt the next part of an encrypted message, and output it to out as
+// soon as it is decrypted; a message is never held whole, however long.
+// Each sender's messages arrive in order, and one at a time, so the parts
+// are matched up by sender.
+static void
+receive_message(const MessageHeaderView &ml, const DataPacketView &data_package,
+		std::unordered_map<std::string, IncomingMessage> &incoming,
+		std::vector<uint8_t> &clear_txt, std::ostream &out)
+{
+	std::string source = ml.get_source_username().str();
+	auto found = incoming.find(source);
+	bool first = found == incoming.end();
+	if (first)
+		found = incoming.emplace(source, IncomingMessage()).first;
+	IncomingMessage &message = found->second;
+	const uint8_t *chunk = data_package.data();
+	size_t chunk_len = data_package.size();
+	// The first part starts with the stream header
+	if (first) {
+		message.failed =
+			chunk_len < Crypto::stream_header_size ||
+			!message.decryptor.begin(encryption_key(), chunk);
+		if (!message.failed) {
+			chunk += Crypto::stream_header_size;
+			chunk_len -= Crypto::stream_header_size;
+		}
+	}
+	bool final = false;
+	if (!message.failed) {
+		clear_txt.resize(chunk_len);
+		// The stream must end exactly where the frames do
+		message.failed = !message.decryptor.pull(chunk, chunk_len,
+							 clear_txt.data(),
+							 final) ||
+				 final == ml.get_more_fragments();
+		if (message.failed) {
+			if (message.started)
+				out << std::endl;
+			out << "Message from " << source
+			    << " not able to decrypt." << std::endl;
+		} else {
+			if (!message.started)
+				print_message_start(ml, out);
+			message.started = true;
+			out.write((const char *)clear_txt.data(),
+				  chunk_len - Crypto::chunk_overhead);
+			if (final)
+				out << std::endl;
+			else
+				out << std::flush;
+		}
+	} else if (first) {
+		out << "Message from " << source << " not able to decrypt."
+		    << std::endl;
+	}
+	// The last part of the message, whether it worked or not
+	if (!ml.get_more_fragments())
+		incoming.erase(found);
+}
+
+// Our end of another user's channel to us, or to the room (see
+// receive_channel_message).
+struct ReceiveChannel {
+	Crypto::ChannelDecryptor decryptor;
+	// Whether a message is part way through being output
+	bool started;
+	// Frames lost to us since we lost our place in the channel
+	size_t missed;
+	ReceiveChannel(void) : started(false), missed(0)
+	{
+	}
+};
+
+// Ask the source of the header to start their channel (to the room, or to
+// us) over. Not acknowledged by the server, it's asked again if the
+// channel doesn't start over.
+static void request_resync(const MessageHeaderView &ml)
+{
+	std::string which = ml.get_dest_username() == "all" ? "all" : "";
+	MessageLayer resync_ml;
+	MessageHeader &header =
+		resync_ml.set_packet_number(0)
+			.set_version_number(VERSION)
+			.set_source_username(our_username)
+			.set_dest_username(ml.get_source_username().str())
+			.set_message_type(MessageTypes::RESYNC)
+			.calculate_data_packet_checksum(which)
+			.set_data_packet_length(which.size())
+			.build();
+	std::vector<uint8_t> frame = build_message(header, which);
+	if (!send_whole(frame.data(), frame.size()))
+		is_running = false;
+}
+
+// Decrypt the next chunk of a user's channel to us (or the room), and
+// output it to out as soon as it is decrypted. Each sender's chunks
+// arrive in order, so a chunk that fails to decrypt means one was lost
+// (or we have joined part way through); resync is set when the sender is
+// to be asked to start the channel over, and everything until they do is
+// lost to us.
+static void
+receive_channel_message(const MessageHeaderView &ml,
+			const DataPacketView &data_package,
+			std::unordered_map<std::string, ReceiveChannel> &channels,
+			std::vector<uint8_t> &clear_txt, std::ostream &out,
+			bool &resync)
+{
+	std::string source = ml.get_source_username().str();
+	ReceiveChannel &channel =
+		channels[source +
+			 (ml.get_dest_username() == "all" ? " all" : " direct")];
+	bool was_in_sync = channel.decryptor.in_sync();
+	bool end = false;
+	size_t clear_len = 0;
+	clear_txt.resize(data_package.size());
+	if (!channel.decryptor.pull(
+		    encryption_key(), data_package.data(), data_package.size(),
+		    ml.get_frame_flags() & frame_flag_channel_start,
+		    clear_txt.data(), clear_len, end)) {
+		if (channel.started)
+			out << std::endl;
+		channel.started = false;
+		if (was_in_sync)
+			out << "Missed messages from " << source
+			    << ", asking them to start over." << std::endl;
+		// Ask straight away, and again every so often until they do.
+		resync = channel.missed++ % resync_every == 0;
+		return;
+	}
+	channel.missed = 0;
+	if (!channel.started)
+		print_message_start(ml, out);
+	channel.started = !end;
+	out.write((const char *)clear_txt.data(), clear_len);
+	if (end)
+		out << std::endl;
+	else
+		out << std::flush;
+}
+
+// What each receive worker keeps of the frames in its lanes; the messages
+// part way through arriving, the channels to us, where each part is
+// decrypted to, and where its output goes until it is delivered.
+struct ReceiveLanes {
+	std::unordered_map<std::string, IncomingMessage> incoming;
+	std::unordered_map<std::string, ReceiveChannel> channels;
+	std::vector<uint8_t> clear_txt;
+	std::ostringstream out;
+};
+
+// Workers decrypting the frames received, at most one per core (and no
+// more than four).
+static size_t receive_worker_count(void)
+{
+	return std::max(1u, std::min(4u, std::thread::hardware_concurrency()));
+}
+
+// The work done on a frame by a receive worker; decrypting it, and
+// working out what is to be output for it.
+static void work_on_frame(ReceivedFrame &frame, ReceiveLanes &lanes)
+{
+	MessageHeaderView ml = frame.view();
+	if (ml.get_message_type() == MessageTypes::FILE_CHUNK) {
+		decrypt_file_chunk(frame);
+		return;
+	}
+	if (ml.get_frame_flags() & frame_flag_channel)
+		receive_channel_message(ml, frame.data_packet(), lanes.channels,
+					lanes.clear_txt, lanes.out,
+					frame.resync);
+	else
+		receive_message(ml, frame.data_packet(), lanes.incoming,
+				lanes.clear_txt, lanes.out);
+	frame.output = lanes.out.str();
+	lanes.out.str("");
+}
+
+// Act on a frame from the server, in the order it arrived, once any work
+// on it is done.
+static void deliver_frame(ReceivedFrame &frame, IncomingFiles &incoming_files)
+{
+	MessageHeaderView ml = frame.view();
+	DataPacketView data_package = frame.data_packet();
+	switch (ml.get_message_type()) {
+	// Message Type - Login Request
+	case (MessageTypes::LOGIN):
+		std::cout << "You have logged in." << std::endl;
+		break;
+	// Message Type - Error
+	case (MessageTypes::ERROR): {
+		std::string error = build_string_safe(
+			(char *)data_package.data(), data_package.size());
+		// Put the error message to console.
+		std::cout << "Error - " << error << std::endl;
+		// Stop sending any file to a user who doesn't exist, it will
+		// only fail too. Any other error is about something else.
+		const std::lock_guard<std::mutex> lock(messages_mutex);
+		if (outgoing_file != nullptr &&
+		    error == missing_user_error(outgoing_file->recipient)) {
+			outgoing_file->stopped = true;
+			file_acknowledged.notify_all();
+		}
+	} break;
+	// Message Type - Who
+	case (MessageTypes::WHO):
+		// Put the message to console.
+		std::cout << "Users - "
+			  << build_string_safe((char *)data_package.data(),
+					       data_package.size())
+			  << std::endl;
+		break;
+	// Message Type - Message
+	case (MessageTypes::MESSAGE):
+		// Check if its an unencrypted server message
+		if (ml.get_source_username() == "server") {
+			print_message_start(ml, std::cout);
+			std::cout << build_string_safe(
+					     (char *)data_package.data(),
+					     data_package.size())
+				  << std::endl;
+			break;
+		}
+		// Else its been decrypted, output what came of it.
+		std::cout << frame.output << std::flush;
+		if (frame.resync)
+			request_resync(ml);
+		break;
+	// Message Type - A chunk of a file
+	case (MessageTypes::FILE_CHUNK):
+		receive_file_chunk(frame, incoming_files);
+		break;
+	// Message Type - Disconnect
+	case (MessageTypes::DISCONNECT):
+		std::cout << "Server has disconnected you." << std::endl;
+		is_running = false;
+		break;
+	default:
+		break;
+	}
+}
+
 // This function is run by the thread that will receive messages from the server.
-// It will wait for a message to be received and then act upon it.
+// It will wait for a message to be received and then act upon it. Frames
+// are decrypted by a few workers, and acted on in the order they arrived
+// (see OrderedPipeline), so reading from the server never waits for them
+// to be decrypted.
 void message_receiver()
 {
 	// Largely taken from https://devarea.com/linux-handling-signals-in-a-multithreaded-application/
@@ -93,20 +748,41 @@ void message_receiver()
 	pthread_sigmask(SIG_BLOCK, &mask, NULL);
 	// Attach our closing handler to SIGUSR1
 	signal(SIGUSR1, close_thread);
-	size_t read_size;
-	MessageHeader header;
+	// Messages coming in from the server, however they are split up
+	// across reads.
+	FrameReader reader;
+	FrameView frame;
+	// Files being received, by sender and name, and how far each has got.
+	IncomingFiles incoming_files;
+	// Each worker's own lanes. A sender's messages to us (or the room)
+	// are always decrypted by the same worker, in the order they came;
+	// file chunks by any worker.
+	std::vector<ReceiveLanes> lanes(receive_worker_count());
+	size_t file_lane = 0;
+	OrderedPipeline<ReceivedFrame> pipeline(
+		lanes.size(),
+		[&lanes](ReceivedFrame &received, size_t worker) {
+			work_on_frame(received, lanes[worker]);
+		},
+		[&incoming_files](ReceivedFrame &received) {
+			deliver_frame(received, incoming_files);
+		});
+	std::hash<std::string> lane_hash;
 	while (true) {
-		// Clear out the message header
-		header.fill(0);
-
 		// Check if other thread is still running
 		if (!is_running) {
 			return;
 		}
 
-		// Wait for a new message from the server
-		read_size =
-			read(client_socket_fd, header.data(), header.size());
+		// Wait for more from the server, or for a frame sent to it
+		// to go unacknowledged for too long (when it is sent again).
+		pollfd readable = { client_socket_fd, POLLIN, 0 };
+		if (poll(&readable, 1, send_window->next_timeout_ms()) == 0) {
+			if (!send_window->retransmit_expired())
+				is_running = false;
+			continue;
+		}
+		ssize_t read_size = reader.read_from(client_socket_fd);
 		// Check if other thread is still running
 		if (!is_running) {
 			std::cout << "Running" << std::endl;
@@ -114,253 +790,198 @@ void message_receiver()
 		}
 
 		// Check if socket is dead
-		if (read_size == 0) {
+		if (read_size <= 0) {
 			std::cerr << "Socket is closed." << std::endl;
 			is_running = false;
+			send_window->close();
 			return;
 		}
-		// Check if size is correct
-		else if (read_size < (ssize_t)header.size()) {
-			std::cerr << "Unable to read the right amount of data."
-				  << std::endl;
-			continue;
-		}
-
-		// React to message!
-
-		// Pass the header to the message layer
-		MessageLayer ml(header);
 
-		// Is the header with a valid sum?
-		if (!ml.valid) {
-			std::cerr << "Server header sum is bad." << std::endl;
-			continue;
-		}
-
-		// Create a vector to hold the second data package if needed
-		std::vector<uint8_t> data_package(ml.get_data_packet_length());
-
-		// What type of message is it? And how to handle it.
-		switch (ml.get_message_type()) {
-		// Message Type - Login Request
-		case (MessageTypes::LOGIN):
-			std::cout << "You have logged in." << std::endl;
-			break;
-		// Message Type - Error
-		case (MessageTypes::ERROR):
-			// Wait for a new message from the server
-			read_size = read(client_socket_fd, data_package.data(),
-					 data_package.size());
-
-			// Check if other thread is still running
-			if (!is_running) {
-				return;
-			}
-
-			// Check if socket is dead
-			if (read_size == 0) {
-				std::cerr << "Socket is closed." << std::endl;
-				is_running = false;
-				return;
-			}
-
-			// Check if size is correct
-			else if (read_size <
-				 (ssize_t)ml.get_data_packet_length()) {
-				std::cerr
-					<< "Unable to read the right amount of data."
-					<< std::endl;
+		// React to every message that is complete!
+		while (reader.next(frame)) {
+			// Is the header with a valid sum?
+			if (!frame.valid) {
+				std::cerr << "Server header sum is bad."
+					  << std::endl;
 				continue;
 			}
-
-			// Put the error message to console.
-			std::cout << "Error - "
-				  << build_string_safe(
-					     (char *)data_package.data(),
-					     ml.get_data_packet_length())
-				  << std::endl;
-
-			break;
-
-		// Message Type - Who
-		case (MessageTypes::WHO):
-			// Wait for a new message from the server
-			read_size = read(client_socket_fd, data_package.data(),
-					 data_package.size());
-
-			// Check if other thread is still running
-			if (!is_running) {
-				return;
-			}
-
-			// Check if socket is dead
-			if (read_size == 0) {
-				std::cerr << "Socket is closed." << std::endl;
-				is_running = false;
-				return;
-			}
-
-			// Check if size is correct
-			else if (read_size <
-				 (ssize_t)ml.get_data_packet_length()) {
-				std::cerr
-					<< "Unable to read the right amount of data."
-					<< std::endl;
+			const MessageHeaderView &ml = frame.header;
+			const DataPacketView &data_package = frame.data_packet;
+			// The lane it is worked on in, if there's work to
+			// be done on it.
+			size_t lane = OrderedPipeline<ReceivedFrame>::no_work;
+
+			// What type of message is it? And how to handle it.
+			switch (ml.get_message_type()) {
+			// Message Type - Message Acknowledge
+			case (MessageTypes::ACK): {
+				// Ranges of frames acknowledged together, or
+				// the one.
+				AckRange ranges[max_ack_ranges];
+				size_t count = ml.get_ack_ranges(ranges);
+				if (count == 0) {
+					ranges[0].first =
+						ml.get_sequence_number();
+					ranges[0].last = ranges[0].first;
+					count = 1;
+				}
+				for (size_t i = 0; i < count; ++i) {
+					uint64_t sequence = sequence_of(
+						ml, ranges[i].first);
+					uint64_t last =
+						sequence_of(ml, ranges[i].last);
+					// (Nothing real is this long)
+					if (last - sequence > UINT16_MAX)
+						continue;
+					do
+						packet_acknowledged(sequence);
+					while (sequence++ != last);
+				}
 				continue;
 			}
-
-			// Put the message to console.
-			std::cout << "Users - "
-				  << build_string_safe(
-					     (char *)data_package.data(),
-					     ml.get_data_packet_length())
-				  << std::endl;
-
-			break;
-
-		// Message Type - Message Acknowledge
-		case (MessageTypes::ACK): {
-			// Critical section that must be run under lock
-			// Grab Ownership of the Mutex and lock
-			const std::lock_guard<std::mutex> lock(messages_mutex);
-			// Clear the acknowledged packet from our list
-			if (client_messages.erase(ml.get_packet_number()) ==
-			    0) {
-				std::cerr
-					<< "Server acknowledged a packet already acknowledged."
-					<< std::endl;
+			// Message Type - Message No Acknowledge
+			case (MessageTypes::NACK): {
+				// Send it again, unless it has since been
+				// acknowledged (sent again on a timeout); once
+				// the wait asked for has passed, if it was held
+				// back (see build_retry).
+				uint32_t wait_ms = 0;
+				if (data_package.size() ==
+					    sizeof(RetryPacket) &&
+				    ml.verify_data_packet_checksum(
+					    data_package))
+					wait_ms = read_retry(
+						data_package.data());
+				send_window->nack(
+					sequence_of(ml,
+						    ml.get_sequence_number()),
+					wait_ms);
+				continue;
 			}
-
-			// Mutex Guard will deconstruct when leaving scope, thus freeing lock on mutex
-		}
-			continue;
-			break;
-		// Message Type - Message
-		case (MessageTypes::MESSAGE): {
-			// Wait for a new message from the server
-			read_size = read(client_socket_fd, data_package.data(),
-					 data_package.size());
-
-			// Check if other thread is still running
-			if (!is_running) {
-				return;
+			// Message Type - How many frames we may send ahead
+			// of the server's ACKs
+			case (MessageTypes::CREDIT):
+				if (data_package.size() !=
+					    sizeof(CreditPacket) ||
+				    !ml.verify_data_packet_checksum(
+					    data_package))
+					continue;
+				send_window->set_credit(
+					read_credit(data_package.data()));
+				continue;
+			// Message Type - Start a channel of ours over
+			case (MessageTypes::RESYNC): {
+				std::string which = build_string_safe(
+					(char *)data_package.data(),
+					data_package.size());
+				const std::lock_guard<std::mutex> lock(
+					messages_mutex);
+				auto channel = send_channels.find(
+					which == "all" ?
+						which :
+						ml.get_source_username().str());
+				if (channel != send_channels.end())
+					channel->second.restart();
+				continue;
 			}
-
-			// Check if socket is dead
-			if (read_size == 0) {
-				std::cerr << "Socket is closed." << std::endl;
-				is_running = false;
-				return;
+			// Message Type - Message, decrypted in the sender's
+			// lane (unless it's from the server).
+			case (MessageTypes::MESSAGE): {
+				if (ml.get_source_username() == "server")
+					break;
+				std::string source =
+					ml.get_source_username().str();
+				if (ml.get_frame_flags() & frame_flag_channel)
+					source += ml.get_dest_username() == "all" ?
+							  " all" :
+							  " direct";
+				lane = lane_hash(source);
+				break;
 			}
-
-			// Check if size is correct
-			else if (read_size <
-				 (ssize_t)ml.get_data_packet_length()) {
-				std::cerr
-					<< "Unable to read the right amount of data."
-					<< std::endl;
+			// Message Type - A chunk of a file, decrypted by any
+			// worker.
+			case (MessageTypes::FILE_CHUNK):
+				lane = file_lane++;
+				break;
+			// Output in turn
+			case (MessageTypes::LOGIN):
+			case (MessageTypes::ERROR):
+			case (MessageTypes::WHO):
+			case (MessageTypes::DISCONNECT):
+				break;
+			// Unsupported Message Type
+			default:
+				std::cerr << "Unsupported Message Type."
+					  << std::endl;
 				continue;
 			}
-
-			// Check if its an unencrypted server message
-			if (ml.get_source_username() == "server") {
-				// Output message from server
-				if (ml.get_dest_username() == "all")
-					std::cout
-						<< "(Room) "
-						<< ml.get_source_username()
-						<< " says > "
-						<< build_string_safe(
-							   (char *)data_package
-								   .data(),
-							   ml.get_data_packet_length())
-						<< std::endl;
-				else
-					std::cout
-						<< ml.get_source_username()
-						<< " whispers to you > "
-						<< build_string_safe(
-							   (char *)data_package
-								   .data(),
-							   ml.get_data_packet_length())
-						<< std::endl;
+			ReceivedFrame received;
+			std::copy(ml.data(), ml.data() + header_size,
+				  received.header.begin());
+			received.data = data_package.share();
+			received.data_len = data_package.size();
+			received.decrypted = false;
+			received.resync = false;
+			pipeline.submit(std::move(received), lane);
+			// Nothing more is coming
+			if (ml.get_message_type() == MessageTypes::DISCONNECT) {
+				pipeline.drain();
+				send_window->close();
+				return;
 			}
-			// Else its an encrypted message
-			else {
-				// Decrypt the message
-				// Returns a tuple with a bool as value 0 and a string value 1
-				auto decrypted_message = Crypto::decrypt(
-					data_package, encryption_key);
-
-				// Check if key was able decrypt message
-				if (std::get<0>(decrypted_message) == false) {
-					std::cout << "Message from "
-						  << ml.get_source_username()
-						  << " not able to decrypt."
-						  << std::endl;
-					continue;
-				}
+		}
+	}
+}
 
-				// Output message
-				if (ml.get_dest_username() == "all")
-					std::cout << "(Room) "
-						  << ml.get_source_username()
-						  << " says > "
-						  << std::get<1>(
-							     decrypted_message)
-						  << std::endl;
-				else
-					std::cout << ml.get_source_username()
-						  << " whispers to you > "
-						  << std::get<1>(
-							     decrypted_message)
-						  << std::endl;
-			}
+// Connect to the server, and start the thread that receives from it.
+static void connect_to_server(void)
+{
+	// Client socket setup loosely followed from:
+	//     https://www.geeksforgeeks.org/socket-programming-cc/
+	// Build the socket to listen on
+	client_socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+	// Make sure socket descriptor initialization was successful.
+	if (client_socket_fd == 0) {
+		std::cerr << "Failed to Initialize client socket descriptor."
+			  << std::endl;
+		exit(EXIT_FAILURE);
+	}
 
-			break;
-		}
-		// Message Type - Disconnect
-		case (MessageTypes::DISCONNECT):
-			std::cout << "Server has disconnected you."
-				  << std::endl;
-			is_running = false;
-			return;
-			break;
-		// Message Type No Acknowledge
-		case (MessageTypes::NACK): {
-			// Critical section that must be run under lock
-			// Grab Ownership of the Mutex and lock
-			const std::lock_guard<std::mutex> lock(messages_mutex);
+	// Build our address
+	sockaddr_in address = { .sin_family = AF_INET,
+				.sin_port = htons(SERVER_PORT) };
 
-			// Find the location to the packet
-			auto full_message =
-				client_messages.find(ml.get_packet_number());
-			// Check if we found the packet.
-			if (full_message == client_messages.end()) {
-				std::cerr
-					<< "Server Sent a NACK for a packet we don't have."
-					<< std::endl;
-				is_running = false;
-				return;
-			}
+	if (inet_pton(AF_INET, SERVER_ADDRESS, &(address.sin_addr)) <= 0) {
+		std::cerr << "Error building IPV4 Address." << std::endl;
+		exit(EXIT_FAILURE);
+	}
 
-			// Send the vector to the server. With no flags. Check to make sure sent.
-			if (send(client_socket_fd,
-				 (full_message->second).data(),
-				 (full_message->second).size(), 0) == -1) {
-				is_running = false;
-				return;
-			}
+	// Create a connection to the server.
+	if (connect(client_socket_fd, (sockaddr *)&address,
+		    sizeof(sockaddr_in)) < 0) {
+		std::cerr << "Error could not connect to server." << std::endl;
+		exit(EXIT_FAILURE);
+	}
 
-			// Mutex Guard will deconstruct when leaving scope, thus freeing lock on mutex
-		} break;
-		// Unsupported Message Type
-		default:
-			std::cerr << "Unsupported Message Type." << std::endl;
-		}
+	// Create a thread to receive
+	client_thread = std::thread(message_receiver);
+	// Check if thread was created
+	if (!client_thread.joinable()) {
+		std::cerr << "Error could not create thread." << std::endl;
+		exit(EXIT_FAILURE);
 	}
 }
 
+// Derive the room's key from the password, from the key cache if we have
+// one.
+static std::tuple<bool, Crypto::StreamKey>
+derive_room_key(const std::string &password)
+{
+	if (key_cache_path.empty())
+		return Crypto::derive_key_from_password(password);
+	return Crypto::derive_key_from_password(password, key_cache_path);
+}
+
 // This function
 void console_help()
 {
@@ -373,6 +994,12 @@ void console_help()
 	std::cout
 		<< "message all <message>         - send a message to the room"
 		<< std::endl;
+	std::cout
+		<< "send <username> <file>        - send a file to username"
+		<< std::endl;
+	std::cout
+		<< "send all <file>               - send a file to the room"
+		<< std::endl;
 	std::cout
 		<< "who                             - find out who is in the room"
 		<< std::endl;
@@ -381,6 +1008,229 @@ void console_help()
 		<< std::endl;
 }
 
+// Put the header in front of the data packet already in full_message,
+// and send it, kept in the send window until the server acknowledges it
+// (waiting for room in the window first, if it's full). Returns false if
+// it couldn't be sent.
+static bool send_frame(const MessageHeader &header, PooledBytes &full_message)
+{
+	uint64_t sequence = MessageHeaderView(header).get_sequence_number();
+	std::copy(header.begin(), header.end(), full_message.begin());
+	return send_window->add(sequence, std::move(full_message));
+}
+
+// Encrypt the message on our channel to the recipient (see
+// Crypto::ChannelEncryptor), and send it a chunk at a time. A message too
+// long for one data packet is sent as several frames, each carrying a
+// chunk of it, and all but the last flagged as having more to follow; only
+// a chunk is encrypted at a time, however long the message is. The frame
+// that starts the channel (over) has the stream header in front of its
+// chunk. Every frame is kept until the server acknowledges it. Returns
+// false if it couldn't be sent.
+static bool send_message(MessageLayer &header_1, const std::string &username,
+			 const std::string &recipient,
+			 const std::string &message, uint64_t &sequence)
+{
+	size_t sent = 0;
+	do {
+		size_t len =
+			std::min(Crypto::max_chunk_size, message.size() - sent);
+		bool final = sent + len == message.size();
+		PooledBytes full_message;
+		bool start;
+		// The channel may be restarted by the receiving thread, so
+		// the chunk is encrypted under the lock, straight into the
+		// frame's data packet.
+		{
+			const std::lock_guard<std::mutex> lock(messages_mutex);
+			Crypto::ChannelEncryptor &channel =
+				send_channels[recipient];
+			start = channel.starting();
+			full_message.resize(header_size +
+					    channel.encrypted_size(len));
+			if (!channel.push(encryption_key(),
+					  (const uint8_t *)message.data() + sent,
+					  len, final,
+					  full_message.data() + header_size)) {
+				std::cerr << "Unable to encrypt" << std::endl;
+				return false;
+			}
+		}
+		DataPacketView data_packet(full_message.data() + header_size,
+					   full_message.size() - header_size);
+		MessageHeader &header =
+			header_1.set_version_number(VERSION)
+				.set_source_username(username)
+				.set_dest_username(recipient)
+				.set_message_type(MessageTypes::MESSAGE)
+				.set_frame_flags(
+					frame_flag_channel |
+					frame_flag_ack_ranges |
+					(start ? frame_flag_channel_start : 0) |
+					(final ? 0 : frame_flag_more_fragments))
+				.set_sequence_number(sequence)
+				.calculate_data_packet_checksum(data_packet)
+				.set_data_packet_length(data_packet.size())
+				.build();
+		if (!send_frame(header, full_message))
+			return false;
+
+		// Update the sequence number
+		sequence++;
+		sent += len;
+	} while (sent < message.size());
+	return true;
+}
+
+// How far the file has got, from an earlier attempt at sending it that
+// was interrupted; nothing if there wasn't one, or the file has changed
+// since.
+static uint64_t resume_point(const OutgoingFile &transfer)
+{
+	std::ifstream record(transfer.resume_path);
+	uint64_t size, modified, acknowledged;
+	if (record >> size >> modified >> acknowledged &&
+	    size == transfer.size && modified == transfer.modified &&
+	    acknowledged <= size)
+		return acknowledged;
+	return 0;
+}
+
+// Send the file at path to the recipient, read from disk a chunk at a
+// time; each chunk is encrypted on its own, with the details of the file
+// in front of it, and sent as one FILE_CHUNK frame. Only file_window
+// chunks are sent ahead of the server's acknowledgements, so the file is
+// never held in memory, however big it is. Sending starts over from the
+// last acknowledged chunk if an earlier attempt was interrupted. Returns
+// false if the connection to the server has failed.
+static bool send_file(MessageLayer &header_1, const std::string &username,
+		      const std::string &recipient, const std::string &path,
+		      uint64_t &sequence)
+{
+	// The name it is sent under, without the directory
+	std::string name = path.substr(path.find_last_of('/') + 1);
+	if (name.empty() || name.size() > UINT8_MAX) {
+		std::cout << "Unable to send " << path
+			  << ", the name is not valid." << std::endl;
+		return true;
+	}
+	int file = open(path.c_str(), O_RDONLY);
+	struct stat status;
+	if (file < 0 || fstat(file, &status) < 0 || !S_ISREG(status.st_mode)) {
+		std::cout << "Unable to open " << path << std::endl;
+		if (file >= 0)
+			close(file);
+		return true;
+	}
+	OutgoingFile transfer;
+	transfer.recipient = recipient;
+	transfer.stopped = false;
+	transfer.size = status.st_size;
+	transfer.modified = status.st_mtime;
+	transfer.resume_path = "." + name + "." + recipient + ".resume";
+	transfer.sent = resume_point(transfer);
+	transfer.resume_record =
+		open(transfer.resume_path.c_str(), O_WRONLY | O_CREAT, 0644);
+	if (transfer.sent > 0)
+		std::cout << "Resuming " << name << " from byte "
+			  << transfer.sent << std::endl;
+	{
+		const std::lock_guard<std::mutex> lock(messages_mutex);
+		outgoing_file = &transfer;
+	}
+	// Each chunk, with the details of the file in front of it
+	size_t details_size = file_details_size + name.size();
+	std::vector<uint8_t> clear_txt(details_size + file_chunk_size);
+	write_u64(clear_txt.data() + 8, transfer.size);
+	clear_txt[16] = name.size();
+	std::copy(name.begin(), name.end(), clear_txt.begin() + 17);
+	bool connected = true;
+	do {
+		// Wait until there is room for another chunk
+		{
+			std::unique_lock<std::mutex> lock(messages_mutex);
+			while (is_running && !transfer.stopped &&
+			       transfer.in_flight.size() >= file_window)
+				file_acknowledged.wait_for(
+					lock, std::chrono::milliseconds(100));
+		}
+		if (!is_running) {
+			connected = false;
+			break;
+		}
+		if (transfer.stopped) {
+			std::cout << "Stopped sending " << name
+				  << ", send it again to resume." << std::endl;
+			break;
+		}
+		uint64_t offset = transfer.sent;
+		size_t len = std::min<uint64_t>(file_chunk_size,
+						transfer.size - offset);
+		if (pread(file, clear_txt.data() + details_size, len, offset) !=
+		    (ssize_t)len) {
+			std::cout << "Unable to read " << path
+				  << ", it may have changed." << std::endl;
+			break;
+		}
+		write_u64(clear_txt.data(), offset);
+		// The frame, with the chunk encrypted straight into its data
+		// packet.
+		PooledBytes full_message(header_size +
+					 Crypto::encrypted_size(details_size + len));
+		DataPacketView data_packet(full_message.data() + header_size,
+					   full_message.size() - header_size);
+		if (!Crypto::encrypt(clear_txt.data(), details_size + len,
+				     encryption_key(),
+				     full_message.data() + header_size)) {
+			std::cerr << "Unable to encrypt" << std::endl;
+			connected = false;
+			break;
+		}
+		MessageHeader &header =
+			header_1.set_version_number(VERSION)
+				.set_source_username(username)
+				.set_dest_username(recipient)
+				.set_message_type(MessageTypes::FILE_CHUNK)
+				.set_frame_flags(frame_flag_ack_ranges)
+				.set_sequence_number(sequence)
+				.calculate_data_packet_checksum(data_packet)
+				.set_data_packet_length(data_packet.size())
+				.build();
+		{
+			const std::lock_guard<std::mutex> lock(messages_mutex);
+			transfer.in_flight[offset] = sequence;
+			transfer.sent += len;
+		}
+		if (!send_frame(header, full_message)) {
+			connected = false;
+			break;
+		}
+
+		// Update the sequence number
+		sequence++;
+	} while (transfer.sent < transfer.size);
+	// Wait for the rest of the file to be acknowledged
+	{
+		std::unique_lock<std::mutex> lock(messages_mutex);
+		while (connected && is_running && !transfer.stopped &&
+		       !transfer.in_flight.empty())
+			file_acknowledged.wait_for(
+				lock, std::chrono::milliseconds(100));
+		if (transfer.in_flight.empty() &&
+		    transfer.sent == transfer.size) {
+			// Nothing left to resume
+			unlink(transfer.resume_path.c_str());
+			std::cout << "Sent " << name << " (" << transfer.size
+				  << " bytes) to " << recipient << std::endl;
+		}
+		outgoing_file = nullptr;
+	}
+	if (transfer.resume_record >= 0)
+		close(transfer.resume_record);
+	close(file);
+	return connected && is_running;
+}
+
 // This function is used for the thread running the send portion of the client.
 // It will get input from the user and create a message from it to send to the
 // server.
@@ -394,31 +1244,28 @@ void message_sender()
 	std::string password;
 	std::size_t position;
 	std::size_t position2;
-	std::uint16_t packet_number = 0;
+	// Sequence number of the next frame sent (its low 16 bits being the
+	// packet number)
+	uint64_t sequence = 0;
 
 	// Get username from the user
 	std::cout << "What will your username be(31 Max):";
 	std::cin >> username;
+	our_username = username;
 
 	// Get the password from the user
 	std::cout << "Enter the password for the server:";
 	std::cin >> password;
-	auto derived_key = Crypto::derive_key_from_password(password);
-
-	// Check if key was successfully derived
-	if (std::get<0>(derived_key) == false) {
-		std::cerr << "Failure to derive key" << std::endl;
-		// Cleanup and exit
-		cleanup_on_exit(EXIT_FAILURE);
-	}
-
-	// Set the global encryption_key with our derived key
-	// Returns a tuple with a bool as value 0 and a Streamkey as value 1
-	encryption_key = std::get<1>(derived_key);
+	// Derive the key in the background, it takes a while (unless it's
+	// cached); we connect and log in meanwhile.
+	derived_key =
+		std::async(std::launch::async, derive_room_key, password)
+			.share();
+	connect_to_server();
 
 	// Create message header for login
 	MessageLayer header_1;
-	MessageHeader &header = header_1.set_packet_number(packet_number)
+	MessageHeader &header = header_1.set_packet_number(sequence)
 					.set_version_number(VERSION)
 					.set_source_username(username)
 					.set_dest_username("server")
@@ -426,17 +1273,24 @@ void message_sender()
 					.set_data_packet_length(0)
 					.build();
 
-	// Update the packet number
-	packet_number++;
-	// Send the message to the server. With no flags. Check to make sure sent.
-	if (send(client_socket_fd, (void *)(header.data()), header.size(), 0) ==
-	    -1) {
+	// Update the sequence number
+	sequence++;
+	// Send the message to the server. Check to make sure sent.
+	if (!send_whole(header.data(), header.size())) {
 		std::cerr << "Failure to send login through socket"
 			  << std::endl;
 		// Cleanup and exit
 		cleanup_on_exit(EXIT_FAILURE);
 	}
 
+	// Check if key was successfully derived
+	// (a tuple with a bool as value 0 and a Streamkey as value 1)
+	if (std::get<0>(derived_key.get()) == false) {
+		std::cerr << "Failure to derive key" << std::endl;
+		// Cleanup and exit
+		cleanup_on_exit(EXIT_FAILURE);
+	}
+
 	// Display the instructions for input.
 	console_help();
 
@@ -473,22 +1327,22 @@ void message_sender()
 				// Create a who packet
 				MessageHeader &header =
 					header_1.set_packet_number(
-							packet_number)
+							sequence)
 						.set_version_number(VERSION)
 						.set_source_username(username)
 						.set_dest_username("server")
 						.set_message_type(
 							MessageTypes::WHO)
+						.set_frame_flags(0)
 						.set_data_packet_length(0)
 						.build();
 
-				// Update the packet number
-				packet_number++;
+				// Not acknowledged, so the sequence number
+				// isn't used up; the send window's follow on
+				// from one another.
 
-				// Send the message to the server. With no flags. Check to make sure sent.
-				if (send(client_socket_fd,
-					 (void *)(header.data()), header.size(),
-					 0) == -1) {
+				// Send the message to the server. Check to make sure sent.
+				if (!send_whole(header.data(), header.size())) {
 					// Cleanup and exit
 					cleanup_on_exit(EXIT_FAILURE);
 				}
@@ -503,22 +1357,22 @@ void message_sender()
 
 				MessageHeader &header =
 					header_1.set_packet_number(
-							packet_number)
+							sequence)
 						.set_version_number(VERSION)
 						.set_source_username(username)
 						.set_dest_username("server")
 						.set_message_type(
 							MessageTypes::DISCONNECT)
+						.set_frame_flags(0)
 						.set_data_packet_length(0)
 						.build();
 
-				// Update the packet number
-				packet_number++;
+				// Not acknowledged, so the sequence number
+				// isn't used up; the send window's follow on
+				// from one another.
 
-				// Send the message to the server. With no flags. Check to make sure sent.
-				if (send(client_socket_fd,
-					 (void *)(header.data()), header.size(),
-					 0) == -1) {
+				// Send the message to the server. Check to make sure sent.
+				if (!send_whole(header.data(), header.size())) {
 					// Cleanup and exit
 					cleanup_on_exit(EXIT_FAILURE);
 				}
@@ -577,71 +1431,40 @@ void message_sender()
 			// Make the string  resemble a cstring
 			message.append("\0");
 
-			// Encrypt the message
-			// Returns a tuple with a bool as value 0 and a vector value 1
-			auto encrypted_message =
-				Crypto::encrypt(message, encryption_key);
-
-			// Check if encryption was able to be completed.
-			if (std::get<0>(encrypted_message) == false) {
-				std::cerr << "Unable to encrypt" << std::endl;
+			// Encrypt the message and send it
+			if (!send_message(header_1, username, recipient,
+					  message, sequence)) {
+				// Cleanup and exit
 				cleanup_on_exit(EXIT_FAILURE);
 			}
 
-			// Create an personal message
-			MessageHeader &header =
-				header_1.set_packet_number(packet_number)
-					.set_version_number(VERSION)
-					.set_source_username(username)
-					.set_dest_username(recipient)
-					.set_message_type(MessageTypes::MESSAGE)
-					.calculate_data_packet_checksum(std::get<
-									1>(
-						encrypted_message)) // Add the checksum for the data
-					.set_data_packet_length(
-						std::get<1>(encrypted_message)
-							.size())
-					.build();
-
-			// Concatenate the vectors to a super vector
-			auto full_message = build_message(
-				header, std::get<1>(encrypted_message));
-
-			// Critical Section that must be run under lock
-			{
-				// Grab Ownership of the Mutex and lock
-				const std::lock_guard<std::mutex> lock(
-					messages_mutex);
-
-				// See if the Packet Num is already active
-				if (client_messages.find(packet_number) !=
-				    client_messages.end()) {
-					std::cerr
-						<< "Unable to add Message to list, packet # already in use."
-						<< std::endl;
-					cleanup_on_exit(EXIT_FAILURE);
-				}
-				// Otherwise add the full packet to the list
-				else {
-					client_messages.insert(std::make_pair(
-						packet_number, full_message));
-				}
-				// Leave scope to remove the lock
+			// Sent, so iterate to the next user command.
+			continue;
+		}
+		// Is it a send (a file) command?
+		else if (input.compare(0, position, "send") == 0) {
+			// Find the second space (the one after username)
+			position2 = input.find(" ", position + 1);
+			// No second space, or nothing after it
+			if (position2 == std::string::npos ||
+			    input.size() < (position2 + 2)) {
+				std::cout
+					<< "You did not specify a file. Type 'help' for options."
+					<< std::endl;
+				continue;
 			}
-			// Send the vector to the server. With no flags. Check to make sure sent.
-			if (send(client_socket_fd, full_message.data(),
-				 full_message.size(), 0) == -1) {
+			// The same whether personal or all
+			recipient = input.substr(position + 1,
+						 position2 - position - 1);
+			if (!send_file(header_1, username, recipient,
+				       input.substr(position2 + 1),
+				       sequence)) {
 				// Cleanup and exit
 				cleanup_on_exit(EXIT_FAILURE);
 			}
-
-			// Update the packet number
-			packet_number++;
-
-			// Sent, so iterate to the next user command.
 			continue;
 		}
-		// Contains a space but the command is not message. Must not be proper
+		// Contains a space but the command is not message or send. Must not be proper
 		else {
 			std::cout
 				<< "That is not a proper command. Type 'help' for options."
@@ -651,45 +1474,28 @@ void message_sender()
 	}
 }
 
-int main(void)
+int main(int argc, char **argv)
 {
 	// Attach our cleanup handler to SIGINT
 	signal(SIGINT, cleanup_on_exit);
 	is_running = true;
-	// Client socket setup loosely followed from:
-	//     https://www.geeksforgeeks.org/socket-programming-cc/
-	// Build the socket to listen on
-	client_socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-	// Make sure socket descriptor initialization was successful.
-	if (client_socket_fd == 0) {
-		std::cerr << "Failed to Initialize client socket descriptor."
-			  << std::endl;
-		exit(EXIT_FAILURE);
-	}
-
-	// Build our address
-	sockaddr_in address = { .sin_family = AF_INET,
-				.sin_port = htons(SERVER_PORT) };
-
-	if (inet_pton(AF_INET, SERVER_ADDRESS, &(address.sin_addr)) <= 0) {
-		std::cerr << "Error building IPV4 Address." << std::endl;
-		exit(EXIT_FAILURE);
-	}
-
-	// Create a connection to the server.
-	if (connect(client_socket_fd, (sockaddr *)&address,
-		    sizeof(sockaddr_in)) < 0) {
-		std::cerr << "Error could not connect to server." << std::endl;
-		exit(EXIT_FAILURE);
-	}
-
-	// Create a thread to receive
-	client_thread = std::thread(message_receiver);
-	// Check if thread was created
-	if (!client_thread.joinable()) {
-		std::cerr << "Error could not create thread." << std::endl;
-		exit(EXIT_FAILURE);
+	for (int i = 1; i < argc; ++i) {
+		const char *home = getenv("HOME");
+		if (std::string(argv[i]) == "--key_cache" && home != nullptr) {
+			key_cache_path =
+				std::string(home) + "/.message_client_keys";
+		} else if (std::string(argv[i]) == "--window" &&
+			   i + 1 < argc && atoi(argv[i + 1]) > 0) {
+			window_size = atoi(argv[++i]);
+		} else {
+			std::cerr
+				<< "Usage: ./MessageClient [--key_cache] [--window frames]"
+				<< std::endl;
+			exit(EXIT_FAILURE);
+		}
 	}
-	// This one will be the sender
+	send_window.reset(new SendWindow(window_size, transmit_frame));
+	// This one will be the sender (and connects to the server once it
+	// has started deriving the key).
 	message_sender();
 }
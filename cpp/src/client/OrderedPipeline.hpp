@@ -0,0 +1,173 @@
+/*======================================================================
+COIS-4310H - OrderedPipeline
+Name: OrderedPipeline.hpp
+Purpose: Two stage pipeline for the frames a client receives. The slow
+	part of each job (decrypting it) is done by a small pool of worker
+	threads, and the jobs are then delivered (e.g. output) one at a
+	time, in the order they were submitted, however the work finished.
+	Each job is given a lane; jobs in the same lane are worked on by
+	the same worker, one after another in order, so they may share
+	state (e.g. the channel a sender's frames are decrypted with).
+	Jobs in different lanes are worked on in parallel.
+
+	Jobs are delivered by whichever thread finds the next one ready
+	(the worker that finished it, or the submitter), never by two at
+	once. Submitting blocks while too many jobs are in flight, so a
+	burst of frames can't build up without limit behind the workers.
+
+Compilation: Please use the provided Make file that will make both the
+	client and the server.
+----------------------------------------------------------------------*/
+
+#pragma once
+#include <deque>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include <condition_variable>
+
+template <typename Job> class OrderedPipeline {
+	// A job, and whether its work has been done
+	struct Slot {
+		Job job;
+		bool done;
+		Slot(Job &&job, bool done) : job(std::move(job)), done(done)
+		{
+		}
+	};
+	struct Worker {
+		std::thread thread;
+		// Sequence numbers of the jobs given to the worker, in order
+		std::deque<uint64_t> queue;
+		std::condition_variable wake;
+	};
+	std::function<void(Job &, size_t)> work;
+	std::function<void(Job &)> deliver;
+	std::mutex pipeline_lock;
+	// Jobs not yet delivered, in the order submitted; the first has
+	// sequence number first_sequence. (Elements of a deque stay where
+	// they are as others are added and removed at the ends, so a worker
+	// can work on its job without the lock.)
+	std::deque<Slot> in_flight;
+	uint64_t first_sequence;
+	size_t max_in_flight;
+	std::vector<std::unique_ptr<Worker> > workers;
+	// Whether a thread is delivering jobs
+	bool delivering;
+	bool stopping;
+	// Signalled when a job is delivered
+	std::condition_variable delivered;
+
+	// Deliver every job at the front that is ready, unless another
+	// thread already is. (pipeline_lock must be held by lock)
+	void deliver_ready(std::unique_lock<std::mutex> &lock)
+	{
+		if (delivering)
+			return;
+		delivering = true;
+		while (!in_flight.empty() && in_flight.front().done) {
+			Job job(std::move(in_flight.front().job));
+			in_flight.pop_front();
+			++first_sequence;
+			lock.unlock();
+			deliver(job);
+			lock.lock();
+			delivered.notify_all();
+		}
+		delivering = false;
+		delivered.notify_all();
+	}
+	// Loop run by each worker thread.
+	void work_loop(Worker &worker, size_t index)
+	{
+		std::unique_lock<std::mutex> lock(pipeline_lock);
+		while (true) {
+			worker.wake.wait(lock, [this, &worker] {
+				return stopping || !worker.queue.empty();
+			});
+			if (worker.queue.empty())
+				return;
+			Slot &slot =
+				in_flight[worker.queue.front() - first_sequence];
+			worker.queue.pop_front();
+			lock.unlock();
+			work(slot.job, index);
+			lock.lock();
+			slot.done = true;
+			deliver_ready(lock);
+		}
+	}
+
+    public:
+	// Lane of a job with no work to be done, only delivered in turn.
+	static const size_t constexpr no_work = SIZE_MAX;
+	// Start worker_count (at least 1) workers, that call work with each
+	// job and the index of the worker (so each worker can keep state
+	// of its own), and have deliver called with each job in turn. No
+	// more than max_in_flight jobs are let in at a time.
+	OrderedPipeline(size_t worker_count,
+			std::function<void(Job &, size_t)> work,
+			std::function<void(Job &)> deliver,
+			size_t max_in_flight = 256)
+		: work(work), deliver(deliver), first_sequence(0),
+		  max_in_flight(max_in_flight), delivering(false),
+		  stopping(false)
+	{
+		for (size_t i = 0; i < std::max<size_t>(worker_count, 1); ++i)
+			workers.emplace_back(new Worker());
+		for (size_t i = 0; i < workers.size(); ++i)
+			workers[i]->thread =
+				std::thread(&OrderedPipeline::work_loop, this,
+					    std::ref(*workers[i]), i);
+	}
+	// Do not allow assignment operations, and copy construction
+	OrderedPipeline(OrderedPipeline const &) = delete;
+	void operator=(OrderedPipeline const &) = delete;
+	// Deliver everything submitted, then stop the workers.
+	~OrderedPipeline(void)
+	{
+		drain();
+		{
+			std::lock_guard<std::mutex> lock(pipeline_lock);
+			stopping = true;
+			for (auto &worker : workers)
+				worker->wake.notify_one();
+		}
+		for (auto &worker : workers)
+			worker->thread.join();
+	}
+	// Number of workers, and so of lanes worked on at once
+	size_t worker_count(void) const
+	{
+		return workers.size();
+	}
+	// Add a job in the lane (or no_work), to be delivered after every
+	// job submitted before it.
+	void submit(Job &&job, size_t lane)
+	{
+		std::unique_lock<std::mutex> lock(pipeline_lock);
+		delivered.wait(lock, [this] {
+			return in_flight.size() < max_in_flight;
+		});
+		in_flight.emplace_back(std::move(job), lane == no_work);
+		if (lane == no_work) {
+			deliver_ready(lock);
+			return;
+		}
+		Worker &worker = *workers[lane % workers.size()];
+		worker.queue.push_back(first_sequence + in_flight.size() - 1);
+		worker.wake.notify_one();
+	}
+	// Wait until every job submitted has been delivered.
+	void drain(void)
+	{
+		std::unique_lock<std::mutex> lock(pipeline_lock);
+		delivered.wait(lock, [this] {
+			return in_flight.empty() && !delivering;
+		});
+	}
+};
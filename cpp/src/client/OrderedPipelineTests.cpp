@@ -0,0 +1,111 @@
+/*======================================================================
+COIS-4310H - OrderedPipelineTests
+Name: OrderedPipelineTests.cpp
+Purpose: Test that the OrderedPipeline delivers jobs one at a time, in
+	the order they were submitted, however long each one's work takes
+	and whichever lane it is in; that jobs in the same lane are worked
+	on by the same worker in order; and that submitting blocks while
+	max_in_flight jobs have not been delivered.
+
+Usage: ./OrderedPipelineTests
+	(No output means the tests passed)
+	if there are assertion errors, the tests failed.
+
+Description of Parameters
+	None
+
+Creation: Please use the provided Make file that will make both the
+	client and the server.
+----------------------------------------------------------------------*/
+
+#include <cassert>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <vector>
+#include "OrderedPipeline.hpp"
+
+struct Job {
+	uint64_t sequence;
+	size_t lane;
+	// Microseconds its work takes
+	int64_t work_us;
+};
+
+static const size_t constexpr workers = 4;
+static const size_t constexpr lanes = 7;
+static const uint64_t constexpr jobs = 2000;
+
+int main(void)
+{
+	// Jobs in several lanes (and some with no work), their work taking
+	// random times, are delivered in the order submitted.
+	std::vector<uint64_t> delivered;
+	std::atomic<int> delivering(0);
+	// The last job worked on in each lane, and the worker that did so
+	std::vector<int64_t> last_in_lane(lanes, -1);
+	std::vector<size_t> lane_worker(lanes, SIZE_MAX);
+	{
+		OrderedPipeline<Job> pipeline(
+			workers,
+			[&](Job &job, size_t worker) {
+				assert(worker < workers);
+				// Lanes are only touched by their own worker.
+				assert(lane_worker[job.lane] == SIZE_MAX ||
+				       lane_worker[job.lane] == worker);
+				lane_worker[job.lane] = worker;
+				assert(last_in_lane[job.lane] <
+				       (int64_t)job.sequence);
+				last_in_lane[job.lane] = job.sequence;
+				std::this_thread::sleep_for(
+					std::chrono::microseconds(job.work_us));
+			},
+			[&](Job &job) {
+				assert(delivering++ == 0);
+				delivered.push_back(job.sequence);
+				--delivering;
+			},
+			64);
+		assert(pipeline.worker_count() == workers);
+		std::mt19937 random(4310);
+		for (uint64_t sequence = 0; sequence < jobs; ++sequence) {
+			size_t lane = random() % (lanes + 1);
+			Job job = { sequence, lane, (int64_t)(random() % 300) };
+			if (lane == lanes)
+				lane = OrderedPipeline<Job>::no_work;
+			pipeline.submit(std::move(job), lane);
+		}
+		pipeline.drain();
+		assert(delivered.size() == jobs);
+	}
+	for (uint64_t sequence = 0; sequence < jobs; ++sequence)
+		assert(delivered[sequence] == sequence);
+
+	// With max_in_flight jobs not yet delivered, submitting blocks until
+	// one is.
+	std::atomic<bool> release(false);
+	std::atomic<uint64_t> delivered_count(0);
+	OrderedPipeline<Job> blocked(
+		1,
+		[&](Job &, size_t) {
+			while (!release)
+				std::this_thread::sleep_for(
+					std::chrono::milliseconds(1));
+		},
+		[&](Job &) { ++delivered_count; }, 4);
+	for (uint64_t sequence = 0; sequence < 4; ++sequence)
+		blocked.submit({ sequence, 0, 0 }, 0);
+	std::atomic<bool> returned(false);
+	std::thread submitter([&] {
+		blocked.submit({ 4, 0, 0 }, 0);
+		returned = true;
+	});
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	assert(!returned && delivered_count == 0);
+	release = true;
+	submitter.join();
+	assert(delivered_count >= 1);
+	blocked.drain();
+	assert(delivered_count == 5);
+}
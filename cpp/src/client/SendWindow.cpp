@@ -0,0 +1,375 @@
+/*======================================================================
+COIS-4310H - SendWindow
+Name: SendWindow.cpp
+Purpose: The frames a client has sent the server that it hasn't yet had
+	an ACK for, kept to be sent again until it does. A fixed ring of
+	slots, indexed by 64 bit sequence number, that no more than capacity
+	sequence numbers can be ahead of the oldest unacknowledged frame in;
+	the sender waits for room when it is full, and when the credit the
+	server has granted (see set_credit) is used up, sending a frame now
+	and then regardless so the server can grant more (like TCP's persist
+	timer).
+
+	Frames are sent again on a NACK, when their retransmission timeout
+	passes, and (fast retransmit) when the oldest is still waiting after
+	fast_retransmit_acks later frames have been acknowledged. The
+	timeout is worked out from the round trip times measured, as TCP
+	does (RFC 6298, with Karn's rule that frames sent more than once
+	aren't measured), and doubles every time it passes without an ACK.
+
+Compilation: Please use the provided Make file that will make both the
+	client and the server.
+----------------------------------------------------------------------*/
+
+#include <chrono>
+#include <cstdlib>
+#include <algorithm>
+#include "MessageLayer.hpp"
+#include "SendWindow.hpp"
+
+static const int64_t constexpr ns_per_ms = 1000000;
+
+static int64_t now_ns(void)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		       std::chrono::steady_clock::now().time_since_epoch())
+		.count();
+}
+
+// Smallest power of two no less than capacity (and no more than the
+// most there can be).
+static size_t ring_size(size_t capacity)
+{
+	size_t size = 1;
+	while (size < capacity && size < SendWindow::max_capacity)
+		size <<= 1;
+	return size;
+}
+
+SendWindow::SendWindow(size_t capacity,
+		       std::function<bool(const PooledBytes &)> transmit)
+	: slots(new Slot[ring_size(capacity)]),
+	  mask(ring_size(capacity) - 1), transmit(transmit), base(0), head(0),
+	  started(false), credit(UINT64_MAX), waiting_for_room(false),
+	  closed(false), srtt(0),
+	  rttvar(0), rto(initial_rto_ms * ns_per_ms), acks_past_base(0),
+	  scan_from(0), sent(0), acknowledged(0), timeouts(0),
+	  fast_retransmits(0), nack_retransmits(0), nack_waits(0),
+	  credit_waits(0),
+	  credit_probes(0)
+{
+	for (size_t i = 0; i <= mask; ++i)
+		slots[i].live = false;
+}
+
+size_t SendWindow::capacity(void) const
+{
+	return (size_t)mask + 1;
+}
+
+// Whether there is room (and credit) for the frame with the sequence
+// number.
+bool SendWindow::has_room(uint64_t sequence) const
+{
+	uint64_t ahead = sequence - base.load();
+	return ahead <= mask && ahead < credit.load();
+}
+
+// Keep the frame, with the sequence number, and send it, waiting for room
+// in the window first if need be. Returns false if it couldn't be sent,
+// or the window was closed.
+bool SendWindow::add(uint64_t sequence, PooledBytes &&frame)
+{
+	if (!started) {
+		// The window starts at the first frame (nothing can be
+		// acknowledged before it is sent). Empty all the while.
+		head = sequence;
+		base = sequence;
+		started = true;
+	}
+	if (!has_room(sequence)) {
+		if (sequence - base <= mask)
+			++credit_waits;
+		std::unique_lock<std::mutex> lock(room_lock);
+		waiting_for_room = true;
+		while (!closed && !has_room(sequence)) {
+			// Out of credit, the frame goes anyway now and then
+			// (if there's room for it), as the server only grants
+			// more in answer to a frame.
+			if (room.wait_for(lock, std::chrono::milliseconds(
+							credit_probe_ms)) ==
+				    std::cv_status::timeout &&
+			    sequence - base <= mask) {
+				++credit_probes;
+				break;
+			}
+		}
+		waiting_for_room = false;
+	}
+	if (closed)
+		return false;
+	Slot &slot = slots[sequence & mask];
+	slot.frame = std::move(frame);
+	slot.sequence = sequence;
+	slot.sent_at = now_ns();
+	slot.transmissions = 1;
+	slot.held_until = 0;
+	// Handed over to the reader
+	slot.live.store(true, std::memory_order_release);
+	head.store(sequence + 1, std::memory_order_release);
+	++sent;
+	// The reader won't touch the frame but to send it again (or let it
+	// go once it is acknowledged, which it can't be before it is sent).
+	return transmit(slot.frame);
+}
+
+// The slot of the unacknowledged frame with that sequence number, if
+// there is one.
+SendWindow::Slot *SendWindow::find(uint64_t sequence)
+{
+	uint64_t first = base.load(std::memory_order_relaxed);
+	uint64_t last = head.load(std::memory_order_acquire);
+	if (sequence - first >= last - first)
+		return nullptr;
+	Slot &slot = slots[sequence & mask];
+	if (!slot.live.load(std::memory_order_acquire) ||
+	    slot.sequence != sequence)
+		return nullptr;
+	return &slot;
+}
+
+// The sequence number in the window (nearest its middle) with the packet
+// number as its low 16 bits; for ACKs and NACKs that have the packet
+// number alone.
+uint64_t SendWindow::extend(uint16_t packet_number) const
+{
+	uint64_t first = base.load(std::memory_order_relaxed);
+	uint64_t last = head.load(std::memory_order_acquire);
+	return extend_packet_number(packet_number, first + (last - first) / 2);
+}
+
+// The first frame from scan_from on sent just once, if there is one,
+// moving scan_from up to it.
+SendWindow::Slot *SendWindow::first_sent_once(void)
+{
+	uint64_t first = base.load(std::memory_order_relaxed);
+	uint64_t last = head.load(std::memory_order_acquire);
+	if (sequence_before(scan_from, first))
+		scan_from = first;
+	for (; scan_from != last; ++scan_from) {
+		Slot &slot = slots[scan_from & mask];
+		if (slot.live.load(std::memory_order_acquire) &&
+		    slot.transmissions == 1 && slot.held_until == 0)
+			return &slot;
+	}
+	return nullptr;
+}
+
+// How long the frame in the slot waits for an ACK before it is sent again
+// (ns); doubling with every time it has been sent.
+int64_t SendWindow::timeout(const Slot &slot) const
+{
+	return std::min(rto << std::min<uint32_t>(slot.transmissions - 1, 16),
+			max_rto_ms * ns_per_ms);
+}
+
+// When the frame in the slot is to be sent again (ns); when the server
+// asked, or else when its timeout passes.
+int64_t SendWindow::due(const Slot &slot) const
+{
+	return slot.held_until != 0 ? slot.held_until :
+				      slot.sent_at + timeout(slot);
+}
+
+// Send the frame in the slot again
+bool SendWindow::retransmit(Slot &slot, int64_t now)
+{
+	// Looked after from now on in resent
+	if (slot.transmissions++ == 1 && slot.held_until == 0)
+		resent.push_back(slot.sequence);
+	slot.held_until = 0;
+	slot.sent_at = now;
+	return transmit(slot.frame);
+}
+
+// Take in a round trip time measured (RFC 6298)
+void SendWindow::sample(int64_t rtt)
+{
+	if (srtt == 0) {
+		srtt = rtt;
+		rttvar = rtt / 2;
+	} else {
+		rttvar = (3 * rttvar + std::abs(srtt - rtt)) / 4;
+		srtt = (7 * srtt + rtt) / 8;
+	}
+	rto = std::min(std::max(srtt + std::max<int64_t>(ns_per_ms, 4 * rttvar),
+				min_rto_ms * ns_per_ms),
+		       max_rto_ms * ns_per_ms);
+}
+
+// Move base past every frame that has been acknowledged.
+void SendWindow::advance(void)
+{
+	uint64_t first = base.load(std::memory_order_relaxed);
+	uint64_t last = head.load(std::memory_order_acquire);
+	while (first != last &&
+	       !slots[first & mask].live.load(std::memory_order_acquire))
+		++first;
+	base.store(first, std::memory_order_seq_cst);
+	acks_past_base = 0;
+	// Wake the sender if it's waiting for the room made.
+	if (waiting_for_room) {
+		std::lock_guard<std::mutex> lock(room_lock);
+		room.notify_one();
+	}
+}
+
+// The frame with the sequence number was acknowledged. Returns false if
+// it wasn't waiting to be.
+bool SendWindow::ack(uint64_t sequence)
+{
+	Slot *slot = find(sequence);
+	if (slot == nullptr)
+		return false;
+	// Only frames sent once say how long the round trip took; there's
+	// no knowing which sending of the others was acknowledged (nor how
+	// long the server held one back).
+	if (slot->transmissions == 1 && slot->held_until == 0)
+		sample(now_ns() - slot->sent_at);
+	PooledBytes().swap(slot->frame);
+	// Handed back to the sender
+	slot->live.store(false, std::memory_order_release);
+	++acknowledged;
+	if (sequence == base.load(std::memory_order_relaxed)) {
+		advance();
+		return true;
+	}
+	// A later frame got through while the oldest is still waiting; it
+	// has likely been lost.
+	if (++acks_past_base == fast_retransmit_acks) {
+		Slot *oldest = find(base.load(std::memory_order_relaxed));
+		if (oldest != nullptr) {
+			++fast_retransmits;
+			retransmit(*oldest, now_ns());
+		}
+	}
+	return true;
+}
+
+// The frame with the sequence number was corrupted on the way, send it
+// again; or held back by the server, send it again once wait_ms has
+// passed. Returns false if it isn't one we have.
+bool SendWindow::nack(uint64_t sequence, uint32_t wait_ms)
+{
+	Slot *slot = find(sequence);
+	if (slot == nullptr)
+		return false;
+	if (wait_ms == 0) {
+		++nack_retransmits;
+		return retransmit(*slot, now_ns());
+	}
+	// Looked after from now on in resent
+	if (slot->transmissions == 1 && slot->held_until == 0)
+		resent.push_back(sequence);
+	slot->held_until = now_ns() + wait_ms * ns_per_ms;
+	++nack_waits;
+	return true;
+}
+
+// Send every frame whose timeout has passed again, the timeout doubling
+// with every time it has been sent. Returns false if one couldn't be sent.
+bool SendWindow::retransmit_expired(void)
+{
+	int64_t now = now_ns();
+	Slot *slot;
+	while ((slot = first_sent_once()) != nullptr &&
+	       now - slot->sent_at >= timeout(*slot)) {
+		++timeouts;
+		if (!retransmit(*slot, now))
+			return false;
+	}
+	for (size_t i = 0; i < resent.size();) {
+		slot = find(resent[i]);
+		// Since acknowledged
+		if (slot == nullptr) {
+			resent[i] = resent.back();
+			resent.pop_back();
+			continue;
+		}
+		if (now >= due(*slot)) {
+			// (Not a timeout, if the server asked for it)
+			if (slot->held_until == 0)
+				++timeouts;
+			if (!retransmit(*slot, now))
+				return false;
+		}
+		++i;
+	}
+	return true;
+}
+
+// Milliseconds until the next timeout passes (-1 if there is nothing
+// waiting).
+int SendWindow::next_timeout_ms(void)
+{
+	int64_t now = now_ns();
+	int64_t next = -1;
+	Slot *slot = first_sent_once();
+	if (slot != nullptr)
+		next = std::max<int64_t>(
+			slot->sent_at + timeout(*slot) - now, 0);
+	for (size_t i = 0; i < resent.size();) {
+		slot = find(resent[i]);
+		if (slot == nullptr) {
+			resent[i] = resent.back();
+			resent.pop_back();
+			continue;
+		}
+		int64_t left = std::max<int64_t>(due(*slot) - now, 0);
+		if (next < 0 || left < next)
+			next = left;
+		++i;
+	}
+	// Rounded up, so it has passed when poll() returns.
+	return next < 0 ? -1 : (int)((next + ns_per_ms - 1) / ns_per_ms);
+}
+
+// The server granted credit for that many frames to be waiting to be
+// acknowledged at once; the sender waits for them to be, before adding
+// more (but for a frame every credit_probe_ms).
+void SendWindow::set_credit(uint32_t frames)
+{
+	credit.store(frames);
+	if (waiting_for_room) {
+		std::lock_guard<std::mutex> lock(room_lock);
+		room.notify_one();
+	}
+}
+
+// Number of frames waiting to be acknowledged
+size_t SendWindow::in_flight(void) const
+{
+	return sent - acknowledged;
+}
+
+// Stop the sender waiting for room; nothing more can be added.
+void SendWindow::close(void)
+{
+	std::lock_guard<std::mutex> lock(room_lock);
+	closed = true;
+	room.notify_all();
+}
+
+SendWindowStats SendWindow::stats(void) const
+{
+	return { sent.load(),
+		 acknowledged.load(),
+		 timeouts.load(),
+		 fast_retransmits.load(),
+		 nack_retransmits.load(),
+		 nack_waits.load(),
+		 credit_waits.load(),
+		 credit_probes.load(),
+		 (double)srtt / ns_per_ms,
+		 (double)rto / ns_per_ms };
+}
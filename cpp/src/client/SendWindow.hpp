@@ -0,0 +1,190 @@
+/*======================================================================
+COIS-4310H - SendWindow
+Name: SendWindow.hpp
+Purpose: The frames a client has sent the server that it hasn't yet had
+	an ACK for, kept to be sent again until it does. A fixed ring of
+	slots, indexed by 64 bit sequence number, that no more than capacity
+	sequence numbers can be ahead of the oldest unacknowledged frame in;
+	the sender waits for room when it is full, and when the credit the
+	server has granted (see set_credit) is used up, sending a frame now
+	and then regardless so the server can grant more (like TCP's persist
+	timer).
+
+	Frames are sent again on a NACK (or once the wait it asks for has
+	passed, for one the server held back), when their retransmission timeout
+	passes, and (fast retransmit) when the oldest is still waiting after
+	fast_retransmit_acks later frames have been acknowledged. The
+	timeout is worked out from the round trip times measured, as TCP
+	does (RFC 6298, with Karn's rule that frames sent more than once
+	aren't measured), and doubles every time it passes without an ACK.
+
+	Only two threads may use it; the one sending frames (add), and the
+	one reading from the server (everything else). They share it without
+	a lock, each slot being handed from one to the other and back.
+
+Compilation: Please use the provided Make file that will make both the
+	client and the server.
+----------------------------------------------------------------------*/
+
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+#include "BufferPool.hpp"
+
+// Counters of a SendWindow, for benchmarks and statistics
+struct SendWindowStats {
+	uint64_t sent;
+	uint64_t acknowledged;
+	uint64_t timeouts;
+	uint64_t fast_retransmits;
+	uint64_t nack_retransmits;
+	// Frames the server held back, asking for them to be sent again
+	// later
+	uint64_t nack_waits;
+	// Times the sender waited for credit (with room in the window), and
+	// sent a frame anyway without it
+	uint64_t credit_waits;
+	uint64_t credit_probes;
+	// Smoothed round trip time, and retransmission timeout (ms)
+	double srtt_ms;
+	double rto_ms;
+};
+
+class SendWindow {
+	struct Slot {
+		// The frame, its sequence number, when it was last sent (ns),
+		// and how many times it has been.
+		PooledBytes frame;
+		uint64_t sequence;
+		int64_t sent_at;
+		uint32_t transmissions;
+		// When it is to be sent again, as the server asked (ns; 0 for
+		// when its timeout passes)
+		int64_t held_until;
+		// Set by the sender once the slot holds a frame, cleared by
+		// the reader once it is acknowledged.
+		std::atomic<bool> live;
+	};
+	std::unique_ptr<Slot[]> slots;
+	const uint64_t mask;
+	// Sends a frame (or sends it again) to the server. Returns false if
+	// it couldn't be sent.
+	std::function<bool(const PooledBytes &)> transmit;
+	// The oldest sequence number that may be unacknowledged (moved on by
+	// the reader), and the one after the newest added (by the sender).
+	std::atomic<uint64_t> base;
+	std::atomic<uint64_t> head;
+	// Whether any frame has been added yet
+	std::atomic<bool> started;
+	// The most frames the server has granted us credit for having
+	// unacknowledged at once (see MessageTypes::CREDIT); all the window
+	// has room for, until it grants any.
+	std::atomic<uint64_t> credit;
+	// For the sender to wait on when the window is full, or out of
+	// credit
+	std::mutex room_lock;
+	std::condition_variable room;
+	std::atomic<bool> waiting_for_room;
+	std::atomic<bool> closed;
+	// Round trip estimates (ns); the reader's alone.
+	int64_t srtt;
+	int64_t rttvar;
+	int64_t rto;
+	// Times frames were acknowledged while the oldest one waited
+	size_t acks_past_base;
+	// (The reader's alone) Every frame before scan_from has been sent
+	// more than once, or acknowledged; those sent more than once (and
+	// maybe since acknowledged) are in resent. Frames sent once time out
+	// in the order they were sent, so only the first of them need be
+	// looked at, however many are waiting. (Those held by the server
+	// are in resent too.)
+	uint64_t scan_from;
+	std::vector<uint64_t> resent;
+	// Counters; sent is the sender's, the rest the reader's.
+	std::atomic<uint64_t> sent;
+	std::atomic<uint64_t> acknowledged;
+	std::atomic<uint64_t> timeouts;
+	std::atomic<uint64_t> fast_retransmits;
+	std::atomic<uint64_t> nack_retransmits;
+	std::atomic<uint64_t> nack_waits;
+	std::atomic<uint64_t> credit_waits;
+	std::atomic<uint64_t> credit_probes;
+	// Whether there is room (and credit) for the frame with the sequence
+	// number.
+	bool has_room(uint64_t sequence) const;
+	// The slot of the unacknowledged frame with that sequence number, if
+	// there is one.
+	Slot *find(uint64_t sequence);
+	// The first frame from scan_from on sent just once, if there is
+	// one, moving scan_from up to it.
+	Slot *first_sent_once(void);
+	// How long the frame in the slot waits for an ACK before it is sent
+	// again (ns).
+	int64_t timeout(const Slot &slot) const;
+	// When the frame in the slot is to be sent again (ns).
+	int64_t due(const Slot &slot) const;
+	// Send the frame in the slot again
+	bool retransmit(Slot &slot, int64_t now);
+	// Take in a round trip time measured
+	void sample(int64_t rtt);
+	// Move base past every frame that has been acknowledged.
+	void advance(void);
+
+    public:
+	// Acknowledgements of later frames before the oldest is sent again
+	static const size_t constexpr fast_retransmit_acks = 3;
+	// How long the sender waits on credit before sending a frame anyway
+	// (ms), so the server can grant more
+	static const int64_t constexpr credit_probe_ms = 50;
+	// Bounds on, and the initial, retransmission timeout (ms)
+	static const int64_t constexpr min_rto_ms = 200;
+	static const int64_t constexpr max_rto_ms = 60000;
+	static const int64_t constexpr initial_rto_ms = 1000;
+	// Most frames there can be room for. (With a server that ACKs the
+	// packet number alone, without the sequence number, no more than
+	// 65536 can be told apart; see extend.)
+	static const size_t constexpr max_capacity = 1 << 20;
+	// Room for capacity frames (rounded up to a power of two, no more
+	// than max_capacity), sent and sent again with transmit.
+	SendWindow(size_t capacity,
+		   std::function<bool(const PooledBytes &)> transmit);
+	// Do not allow assignment operations, and copy construction
+	SendWindow(SendWindow const &) = delete;
+	void operator=(SendWindow const &) = delete;
+	size_t capacity(void) const;
+	// (Sender) Keep the frame, with the sequence number, and send it,
+	// waiting for room in the window first if need be. Sequence numbers
+	// must go up, though some may be skipped (frames not acknowledged).
+	// Returns false if it couldn't be sent, or the window was closed.
+	bool add(uint64_t sequence, PooledBytes &&frame);
+	// (Reader) The sequence number in the window (nearest its middle)
+	// with the packet number as its low 16 bits; for ACKs and NACKs that
+	// have the packet number alone.
+	uint64_t extend(uint16_t packet_number) const;
+	// (Reader) The frame with the sequence number was acknowledged.
+	// Returns false if it wasn't waiting to be.
+	bool ack(uint64_t sequence);
+	// (Reader) The frame with the sequence number was corrupted on the
+	// way, send it again; or held back by the server, send it again
+	// once wait_ms has passed. Returns false if it isn't one we have.
+	bool nack(uint64_t sequence, uint32_t wait_ms = 0);
+	// (Reader) Send every frame whose timeout has passed again. Returns
+	// false if one couldn't be sent.
+	bool retransmit_expired(void);
+	// (Reader) Milliseconds until the next timeout passes (-1 if there
+	// is nothing waiting), e.g. for poll().
+	int next_timeout_ms(void);
+	// (Reader) The server granted credit for that many frames to be
+	// waiting to be acknowledged at once; the sender waits for them to
+	// be, before adding more (but for a frame every credit_probe_ms).
+	void set_credit(uint32_t frames);
+	// Number of frames waiting to be acknowledged
+	size_t in_flight(void) const;
+	// Stop the sender waiting for room; nothing more can be added.
+	void close(void);
+	SendWindowStats stats(void) const;
+};
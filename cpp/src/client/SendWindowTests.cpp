@@ -0,0 +1,184 @@
+/*======================================================================
+COIS-4310H - SendWindowTests
+Name: SendWindowTests.cpp
+Purpose: Test that the SendWindow keeps the frames sent until they are
+	acknowledged, and sends them again when it should; on a NACK (at
+	once, or after the wait the server asked for), after
+	fast_retransmit_acks later ACKs, and when their timeout passes, the
+	timeout doubling each time. Also that packet numbers are extended
+	to the right sequence number across a 16 bit wrap, and that close()
+	wakes a sender waiting for room or for credit.
+
+Usage: ./SendWindowTests
+	(No output means the tests passed)
+	if there are assertion errors, the tests failed.
+
+Description of Parameters
+	None
+
+Creation: Please use the provided Make file that will make both the
+	client and the server.
+----------------------------------------------------------------------*/
+
+#include <cassert>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include "SendWindow.hpp"
+
+// Sequence numbers of the frames transmitted, in the order they were
+static std::vector<uint64_t> transmitted;
+
+static bool transmit(const PooledBytes &frame)
+{
+	uint64_t sequence = 0;
+	for (uint8_t byte : frame)
+		sequence = sequence << 8 | byte;
+	transmitted.push_back(sequence);
+	return true;
+}
+
+// A frame holding its sequence number
+static PooledBytes frame_for(uint64_t sequence)
+{
+	PooledBytes frame(8);
+	for (size_t i = 0; i < 8; ++i)
+		frame[i] = sequence >> (56 - 8 * i);
+	return frame;
+}
+
+static void sleep_ms(int64_t ms)
+{
+	std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+int main(void)
+{
+	// Room for a power of two frames
+	SendWindow window(5, transmit);
+	assert(window.capacity() == 8);
+	for (uint64_t sequence = 100; sequence < 104; ++sequence)
+		assert(window.add(sequence, frame_for(sequence)));
+	assert(transmitted == std::vector<uint64_t>({ 100, 101, 102, 103 }));
+	assert(window.in_flight() == 4);
+	// ACKs and NACKs of frames out of the window, or acknowledged
+	// already, are passed over.
+	assert(window.ack(101));
+	assert(!window.ack(101));
+	assert(!window.ack(99) && !window.ack(104));
+	assert(!window.nack(99) && !window.nack(101) && !window.nack(104));
+	assert(transmitted.size() == 4);
+	// A NACK sends the frame again at once.
+	assert(window.nack(102));
+	assert(transmitted.back() == 102 && transmitted.size() == 5);
+	for (uint64_t sequence : { 100, 102, 103 })
+		assert(window.ack(sequence));
+	SendWindowStats stats = window.stats();
+	assert(window.in_flight() == 0);
+	assert(stats.sent == 4 && stats.acknowledged == 4);
+	assert(stats.nack_retransmits == 1 && stats.timeouts == 0);
+	assert(window.next_timeout_ms() == -1);
+
+	// The oldest frame is sent again after fast_retransmit_acks later
+	// frames are acknowledged, and only then.
+	for (uint64_t sequence = 104; sequence < 109; ++sequence)
+		window.add(sequence, frame_for(sequence));
+	transmitted.clear();
+	assert(window.ack(105) && window.ack(106));
+	assert(transmitted.empty());
+	assert(window.ack(107));
+	assert(transmitted == std::vector<uint64_t>({ 104 }));
+	assert(window.stats().fast_retransmits == 1);
+	assert(window.ack(104) && window.ack(108));
+
+	// Timeouts; the round trips measured so far bring the timeout down
+	// to min_rto_ms. It doubles every time it passes.
+	assert(window.stats().rto_ms == SendWindow::min_rto_ms);
+	window.add(109, frame_for(109));
+	int timeout = window.next_timeout_ms();
+	assert(timeout > SendWindow::min_rto_ms - 20 &&
+	       timeout <= SendWindow::min_rto_ms);
+	transmitted.clear();
+	assert(window.retransmit_expired() && transmitted.empty());
+	sleep_ms(SendWindow::min_rto_ms + 10);
+	assert(window.retransmit_expired());
+	assert(transmitted == std::vector<uint64_t>({ 109 }));
+	assert(window.stats().timeouts == 1);
+	timeout = window.next_timeout_ms();
+	assert(timeout > 2 * SendWindow::min_rto_ms - 20 &&
+	       timeout <= 2 * SendWindow::min_rto_ms);
+	assert(window.retransmit_expired() && transmitted.size() == 1);
+	assert(window.ack(109));
+
+	// A frame the server held back is sent again once the wait it asked
+	// for has passed; not as a timeout.
+	window.add(110, frame_for(110));
+	transmitted.clear();
+	assert(window.nack(110, 30));
+	assert(transmitted.empty() && window.next_timeout_ms() <= 30);
+	sleep_ms(35);
+	assert(window.retransmit_expired());
+	assert(transmitted == std::vector<uint64_t>({ 110 }));
+	stats = window.stats();
+	assert(stats.nack_waits == 1 && stats.timeouts == 1);
+	assert(window.ack(110));
+
+	// Packet numbers (the low 16 bits alone) are taken to be the frame
+	// nearest the middle of the window, across a wrap.
+	SendWindow wrapping(64, transmit);
+	const uint64_t first = 3 * 65536 - 6;
+	for (uint64_t sequence = first; sequence < first + 12; ++sequence)
+		wrapping.add(sequence, frame_for(sequence));
+	assert(wrapping.extend(65530) == first);
+	assert(wrapping.extend(65535) == 3 * 65536 - 1);
+	assert(wrapping.extend(0) == 3 * 65536);
+	assert(wrapping.extend(5) == first + 11);
+	assert(wrapping.ack(wrapping.extend(2)));
+	assert(!wrapping.ack(3 * 65536 + 2));
+
+	// close() wakes a sender waiting for room in the window...
+	SendWindow full(2, transmit);
+	full.add(0, frame_for(0));
+	full.add(1, frame_for(1));
+	std::atomic<bool> added(true);
+	std::atomic<bool> returned(false);
+	std::thread sender([&] {
+		added = full.add(2, frame_for(2));
+		returned = true;
+	});
+	sleep_ms(20);
+	assert(!returned);
+	full.close();
+	sender.join();
+	assert(!added);
+	assert(!full.add(3, frame_for(3)));
+
+	// ...and one waiting for credit, before it would send the frame
+	// anyway. Without closing, it does so after credit_probe_ms.
+	SendWindow credited(8, transmit);
+	credited.set_credit(1);
+	credited.add(0, frame_for(0));
+	transmitted.clear();
+	auto start = std::chrono::steady_clock::now();
+	assert(credited.add(1, frame_for(1)));
+	assert(std::chrono::steady_clock::now() - start >=
+	       std::chrono::milliseconds(SendWindow::credit_probe_ms));
+	assert(transmitted == std::vector<uint64_t>({ 1 }));
+	stats = credited.stats();
+	assert(stats.credit_waits == 1 && stats.credit_probes == 1);
+	returned = false;
+	start = std::chrono::steady_clock::now();
+	sender = std::thread([&] {
+		added = credited.add(2, frame_for(2));
+		returned = true;
+	});
+	sleep_ms(10);
+	assert(!returned);
+	credited.close();
+	sender.join();
+	assert(!added);
+	assert(std::chrono::steady_clock::now() - start <
+	       std::chrono::milliseconds(SendWindow::credit_probe_ms));
+	assert(transmitted.size() == 1);
+}
@@ -0,0 +1,191 @@
+/*======================================================================
+COIS-4310H - ClientRegistry Header
+Name: ClientRegistry.hpp
+Purpose: Map of logged in clients by username, split into shards that
+	each have their own rwlock. A PM lookup, or a login or logout, only
+	locks the shard the username hashes to, so traffic to different
+	users doesn't bounce one lock's cache line between every thread,
+	and a login only waits on the readers of its own shard. The locks
+	prefer writers, so a steady stream of readers can't starve logins
+	and logouts.
+
+	Everything handed to a callback is only valid while the callback
+	runs (under the shard's lock).
+
+	Usernames are passed in as NameViews (straight out of a received
+	header, or from a string), and the map keeps them in fixed size
+	keys, so looking a client up never allocates.
+
+Compilation: Please use the provided Make file that will make both the
+	client and the server.
+----------------------------------------------------------------------*/
+
+#pragma once
+#include <iostream>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <unordered_map>
+#include <pthread.h>
+#include "MessageHeaderView.hpp"
+
+template <typename Client> class ClientRegistry {
+	// A username as stored in the map. Names are at most username_len
+	// bytes, all that fits in a header.
+	struct Key {
+		char chars[username_len];
+		size_t len;
+		explicit Key(const NameView &name)
+			: len(std::min(name.size(), (size_t)username_len))
+		{
+			std::memcpy(chars, name.data(), len);
+		}
+		NameView name(void) const
+		{
+			return NameView(chars, len);
+		}
+		bool operator==(const Key &other) const
+		{
+			return name() == other.name();
+		}
+	};
+	struct KeyHash {
+		size_t operator()(const Key &key) const
+		{
+			return key.name().hash();
+		}
+	};
+	struct Shard {
+		pthread_rwlock_t lock;
+		std::unordered_map<Key, Client, KeyHash> clients;
+		// Keep the next shard's lock off of this shard's cache lines.
+		char padding[64];
+	};
+	std::vector<Shard> shards;
+	// Number of clients in every shard, kept outside of the locks.
+	std::atomic<size_t> client_count;
+
+	Shard &shard_of(const Key &key)
+	{
+		// The high bits, the map buckets by the low ones.
+		return shards[(key.name().hash() >> (sizeof(size_t) * 4)) %
+			      shards.size()];
+	}
+	static void read_lock(Shard &shard)
+	{
+		if (pthread_rwlock_rdlock(&shard.lock) != 0) {
+			std::cerr << "Unable to lock the rwlock for reading."
+				  << std::endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+	static void write_lock(Shard &shard)
+	{
+		if (pthread_rwlock_wrlock(&shard.lock) != 0) {
+			std::cerr << "Unable to lock the rwlock for writing."
+				  << std::endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+	static void unlock(Shard &shard)
+	{
+		if (pthread_rwlock_unlock(&shard.lock) != 0) {
+			std::cerr << "Unable to unlock the rwlock." << std::endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+
+    public:
+	// prefer_writers can be turned off to get the default (reader
+	// preferring) rwlocks, for comparison in benchmarks.
+	ClientRegistry(size_t shard_count, bool prefer_writers = true)
+		: shards(shard_count), client_count(0)
+	{
+		pthread_rwlockattr_t attributes;
+		pthread_rwlockattr_init(&attributes);
+		if (prefer_writers)
+			pthread_rwlockattr_setkind_np(
+				&attributes,
+				PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+		for (auto &shard : shards)
+			pthread_rwlock_init(&shard.lock, &attributes);
+		pthread_rwlockattr_destroy(&attributes);
+	}
+	~ClientRegistry(void)
+	{
+		for (auto &shard : shards)
+			pthread_rwlock_destroy(&shard.lock);
+	}
+	// Do not allow assignment operations, and copy construction
+	ClientRegistry(ClientRegistry const &) = delete;
+	void operator=(ClientRegistry const &) = delete;
+
+	size_t shard_count(void)
+	{
+		return shards.size();
+	}
+	// Number of logged in clients (may be out of date by the time
+	// it is used).
+	size_t size(void)
+	{
+		return client_count;
+	}
+	// Call found(client) on the user's client, if they are logged in.
+	// Returns false if they aren't.
+	template <typename Found>
+	bool find(const NameView &username, Found found)
+	{
+		Key key(username);
+		Shard &shard = shard_of(key);
+		read_lock(shard);
+		auto client_it = shard.clients.find(key);
+		bool exists = (client_it != shard.clients.end());
+		if (exists)
+			found(client_it->second);
+		unlock(shard);
+		return exists;
+	}
+	// Call visit(username, client) on every client in the shard.
+	template <typename Visit>
+	void for_each_in_shard(size_t index, Visit visit)
+	{
+		Shard &shard = shards[index];
+		read_lock(shard);
+		for (auto &user : shard.clients)
+			visit(user.first.name(), user.second);
+		unlock(shard);
+	}
+	// Add the client made by make() for username, unless the username is
+	// already taken, and call added(client) before anyone else can see
+	// it. Returns the added client (which stays put until it is erased),
+	// or nullptr if the username was taken and make wasn't called.
+	template <typename Make, typename Added>
+	Client *insert(const NameView &username, Make make, Added added)
+	{
+		Client *client = nullptr;
+		Key key(username);
+		Shard &shard = shard_of(key);
+		write_lock(shard);
+		if (shard.clients.find(key) == shard.clients.end()) {
+			client = &(shard.clients.insert(std::make_pair(key, make()))
+					   .first->second);
+			++client_count;
+			added(*client);
+		}
+		unlock(shard);
+		return client;
+	}
+	// Remove (and destruct) the user's client. Returns false if they
+	// weren't logged in.
+	bool erase(const NameView &username)
+	{
+		Key key(username);
+		Shard &shard = shard_of(key);
+		write_lock(shard);
+		bool erased = shard.clients.erase(key) > 0;
+		if (erased)
+			--client_count;
+		unlock(shard);
+		return erased;
+	}
+};
@@ -0,0 +1,107 @@
+/*======================================================================
+COIS-4310H - Connection
+Name: Connection.cpp
+Purpose: Read state of a single client connection served by one of the
+	reactors (epoll or io_uring). The reactor reads whatever bytes the
+	socket has into the connection's FrameReader, which gathers them into
+	complete messages, and each one is passed to the login procedure, and
+	then to the MessagingClient of the connection.
+
+Compilation: Please use the provided Make file that will make both the
+	client and the server.
+
+Requires the shared MessageLayer Class that is used in to create
+a shared header for transit.
+----------------------------------------------------------------------*/
+
+#include <iostream>
+#include <algorithm>
+extern "C" {
+#include <unistd.h>
+}
+#include "Server.hpp"
+#include "SharedClients.hpp"
+#include "Connection.hpp"
+
+Connection::Connection(int client_socket, QueueWriter *writer)
+	: client(nullptr), writer(writer), client_socket(client_socket),
+	  waiting_writable(false)
+{
+}
+
+// Log the client out (if they got that far) and close the socket.
+Connection::~Connection(void)
+{
+	if (client != nullptr) {
+		// Keep our own copy, the client object is destroyed on log out.
+		std::string username = client->get_username();
+		SharedClients::get_instance().log_out_user(username);
+	}
+	close(client_socket);
+}
+
+// One read of as much as the socket has (see FrameReader::read_from).
+ssize_t Connection::read_from_socket(void)
+{
+	return reader.read_from(client_socket);
+}
+
+// Act on every complete message read in so far.
+// Returns false when the connection should be closed.
+bool Connection::process_messages(void)
+{
+	FrameView frame;
+	while (reader.next(frame)) {
+		if (!frame.valid) {
+			// Nobody logs in with a bad header.
+			if (client == nullptr) {
+				std::cerr << "Initial Client header sum is bad."
+					  << std::endl;
+				return false;
+			}
+			std::cerr << "Client message header sum is bad."
+				  << std::endl;
+			continue;
+		}
+		if (!on_message(frame))
+			return false;
+	}
+	// Held back ACKs go out before the reactor waits for more.
+	if (client != nullptr)
+		client->flush_acks();
+	return true;
+}
+
+// Take in bytes read from the socket some other way, acting on every
+// message they complete. Returns false when the connection should be
+// closed.
+bool Connection::receive(const uint8_t *data, size_t len)
+{
+	reader.feed(data, len);
+	return process_messages();
+}
+
+// Act on a message that has finished arriving.
+// Returns false when the connection should be closed.
+bool Connection::on_message(const FrameView &frame)
+{
+	// The first message must be a login request.
+	if (client == nullptr) {
+		MessageHeader header;
+		std::copy(frame.header.data(),
+			  frame.header.data() + header.size(), header.begin());
+		client = log_in_client(client_socket,
+				       MessageLayer(std::move(header)), writer);
+		if (client == nullptr)
+			return false;
+		client->announce_login();
+		return true;
+	}
+	return client->handle_message(frame.header, frame.data_packet);
+}
+
+// The logged in client (nullptr until the client has logged in).
+MessagingClient *Connection::get_client(void)
+{
+	return client;
+}
@@ -0,0 +1,56 @@
+/*======================================================================
+COIS-4310H - Connection Header
+Name: Connection.hpp
+Purpose: Read state of a single client connection served by one of the
+	reactors (epoll or io_uring). The reactor reads whatever bytes the
+	socket has into the connection's FrameReader, which gathers them into
+	complete messages, and each one is passed to the login procedure, and
+	then to the MessagingClient of the connection.
+
+Compilation: Please use the provided Make file that will make both the
+	client and the server.
+
+Requires the shared MessageLayer Class that is used in to create
+a shared header for transit.
+----------------------------------------------------------------------*/
+
+#pragma once
+#include "FrameReader.hpp"
+// Forward declared to avoid circular dependency
+class MessagingClient;
+class QueueWriter;
+
+class Connection {
+	// Messages arriving on the socket
+	FrameReader reader;
+	// Set once the client has successfully logged in.
+	MessagingClient *client;
+	// Reactor thread that writes this connection's outbound frames.
+	QueueWriter *writer;
+	// Act on a message that has finished arriving.
+	// Returns false when the connection should be closed.
+	bool on_message(const FrameView &frame);
+
+    public:
+	const int client_socket;
+	// Whether the socket buffer filled up, and we are waiting for it to
+	// become writable before writing the rest of the outbound queue.
+	bool waiting_writable;
+	Connection(int client_socket, QueueWriter *writer);
+	// Log the client out (if they got that far) and close the socket.
+	~Connection(void);
+	// Do not allow assignment operations, and copy construction
+	Connection(Connection const &) = delete;
+	void operator=(Connection const &) = delete;
+	// One read of as much as the socket has (see FrameReader::read_from).
+	ssize_t read_from_socket(void);
+	// Act on every complete message read in so far.
+	// Returns false when the connection should be closed.
+	bool process_messages(void);
+	// Take in bytes read from the socket some other way, acting on every
+	// message they complete. Returns false when the connection should be
+	// closed.
+	bool receive(const uint8_t *data, size_t len);
+	// The logged in client (nullptr until the client has logged in).
+	MessagingClient *get_client(void);
+};
@@ -0,0 +1,285 @@
+/*======================================================================
+COIS-4310H - EpollReactor
+Name: EpollReactor.cpp
+Purpose: Serve every connected client from a small fixed set of threads.
+	Each reactor thread owns an epoll instance and the non-blocking
+	client sockets handed to it, and passes whatever each socket has to
+	read on to its Connection. The thread is also the writer of its
+	clients' outbound queues, writing each of them out once per loop
+	(and waiting on EPOLLOUT for sockets whose buffer is full).
+
+Compilation: Please use the provided Make file that will make both the
+	client and the server.
+
+Requires the shared MessageLayer Class that is used in to create
+a shared header for transit.
+----------------------------------------------------------------------*/
+
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <unordered_map>
+#include <cerrno>
+#include <cstring>
+extern "C" {
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+}
+#include "Server.hpp"
+#include "Connection.hpp"
+#include "MessagingClient.hpp"
+#include "EpollReactor.hpp"
+
+// Maximum number of events pulled from epoll in one go
+static const int constexpr max_events = 64;
+
+// State of one reactor thread; its epoll instance, and the connections
+// it serves.
+struct EpollReactor::Thread : public QueueWriter {
+	int epoll_fd = -1;
+	// The accept loop, and other threads with frames for our clients,
+	// wake us by writing to event_fd. (Registered with a nullptr
+	// data.ptr, every other event carries its Connection.)
+	int event_fd = -1;
+	uint64_t event_count;
+	// Connections owned by this thread, by socket
+	std::unordered_map<int, Connection *> connections;
+	// Sockets whose outbound queue has frames waiting, to be written
+	// before the next epoll_wait. Queued by this thread itself.
+	std::vector<int> woken;
+	// Handed over by other threads, under handoff_lock.
+	std::mutex handoff_lock;
+	std::vector<int> new_sockets;
+	std::vector<int> remote_woken;
+
+	// Create the epoll instance and its wake up eventfd.
+	// Returns false if either can't be made.
+	bool setup(void)
+	{
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (epoll_fd < 0 || event_fd < 0)
+			return false;
+		epoll_event event;
+		event.events = EPOLLIN;
+		event.data.ptr = nullptr;
+		return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_fd, &event) == 0;
+	}
+
+	// Let the thread know it has something handed over to it.
+	void notify(void)
+	{
+		uint64_t one = 1;
+		if (write(event_fd, &one, sizeof(one)) != sizeof(one)) {
+			std::cerr << "Unable to wake an epoll reactor thread."
+				  << std::endl;
+		}
+	}
+
+	// The client's outbound queue has frames waiting; write them out
+	// before the next wait. (Called under the SharedClients rwlock, so
+	// the client can't be logged out from under us.)
+	void wake(MessagingClient *client) override
+	{
+		int client_socket = client->get_client_socket();
+		if (current_thread == this) {
+			woken.push_back(client_socket);
+			return;
+		}
+		bool was_empty;
+		{
+			std::lock_guard<std::mutex> lock(handoff_lock);
+			was_empty = remote_woken.empty();
+			remote_woken.push_back(client_socket);
+		}
+		// Already woken for the sockets queued before this one.
+		if (was_empty)
+			notify();
+	}
+
+	// Take on the connections and wake ups handed over by other threads.
+	void take_handoffs(void)
+	{
+		++io_stats.syscalls;
+		// Nonblocking, several wake ups may have been read in one go.
+		if (read(event_fd, &event_count, sizeof(event_count)) < 0)
+			return;
+		std::vector<int> sockets;
+		{
+			std::lock_guard<std::mutex> lock(handoff_lock);
+			sockets.swap(new_sockets);
+			woken.insert(woken.end(), remote_woken.begin(),
+				     remote_woken.end());
+			remote_woken.clear();
+		}
+		for (int client_socket : sockets) {
+			Connection *conn = new Connection(client_socket, this);
+			epoll_event event;
+			event.events = EPOLLIN | EPOLLRDHUP;
+			event.data.ptr = conn;
+			if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket,
+				      &event) < 0) {
+				std::cerr
+					<< "Unable to add a client socket to epoll."
+					<< std::endl;
+				delete conn;
+				continue;
+			}
+			connections[client_socket] = conn;
+		}
+	}
+
+	// Read everything the socket has for us, and act on each complete
+	// message. Returns false when the connection should be closed.
+	bool on_readable(Connection &conn)
+	{
+		while (true) {
+			++io_stats.syscalls;
+			// Straight into the connection's own buffer, where a
+			// partial message is kept until the rest arrives.
+			ssize_t read_size = conn.read_from_socket();
+			if (read_size == 0) {
+				// The client hung up on us.
+				return false;
+			} else if (read_size < 0) {
+				if (errno == EINTR)
+					continue;
+				// Drained the socket, wait for the next event.
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					return true;
+				std::cerr << "Client socket is closed, or error."
+					  << std::endl;
+				return false;
+			}
+			if (!conn.process_messages())
+				return false;
+		}
+	}
+
+	// Write as much of the connection's outbound queue as the socket
+	// will take, waiting on EPOLLOUT for the rest.
+	// Returns false when the connection should be closed.
+	bool on_writable(Connection &conn)
+	{
+		MessagingClient *client = conn.get_client();
+		if (client == nullptr)
+			return true;
+		OutboundQueue::Status status =
+			client->get_outbound_queue().write_to(
+				conn.client_socket, false);
+		if (status == OutboundQueue::FAILED) {
+			std::cerr << "Unable to send a message to a client socket."
+				  << std::endl;
+			return false;
+		}
+		bool blocked = (status == OutboundQueue::BLOCKED);
+		if (blocked == conn.waiting_writable)
+			return true;
+		conn.waiting_writable = blocked;
+		epoll_event event;
+		event.events = EPOLLIN | EPOLLRDHUP | (blocked ? EPOLLOUT : 0);
+		event.data.ptr = &conn;
+		++io_stats.syscalls;
+		return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn.client_socket,
+				 &event) == 0;
+	}
+
+	// Write out the outbound queues of every woken socket. A socket
+	// waiting on EPOLLOUT is left to that.
+	void write_woken(void)
+	{
+		for (size_t i = 0; i < woken.size(); ++i) {
+			auto conn_it = connections.find(woken[i]);
+			// Closed since it was woken
+			if (conn_it == connections.end())
+				continue;
+			Connection *conn = conn_it->second;
+			if (!conn->waiting_writable && !on_writable(*conn))
+				close_connection(conn);
+		}
+		woken.clear();
+	}
+
+	// Log the client out (if they got that far) and close the
+	// connection.
+	void close_connection(Connection *conn)
+	{
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->client_socket, nullptr);
+		connections.erase(conn->client_socket);
+		delete conn;
+	}
+};
+
+// The reactor thread running on the calling thread (if it is one)
+thread_local EpollReactor::Thread *EpollReactor::current_thread = nullptr;
+
+// Start thread_count reactor threads, each waiting on their own epoll
+// instance for client sockets to become readable.
+EpollReactor::EpollReactor(size_t thread_count) : next_thread(0)
+{
+	for (size_t i = 0; i < thread_count; ++i) {
+		Thread *thread = new Thread();
+		if (!thread->setup()) {
+			std::cerr << "Unable to create an epoll instance."
+				  << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		threads.push_back(thread);
+		// The reactor threads live for as long as the server does.
+		std::thread(&EpollReactor::run, thread).detach();
+	}
+}
+
+// Hand a freshly accepted non-blocking client socket to one of the
+// reactor threads. Returns false if it couldn't be handed off.
+bool EpollReactor::add_connection(int client_socket)
+{
+	Thread *thread = threads[next_thread++ % threads.size()];
+	// From here on the connection belongs to the reactor thread.
+	{
+		std::lock_guard<std::mutex> lock(thread->handoff_lock);
+		thread->new_sockets.push_back(client_socket);
+	}
+	thread->notify();
+	return true;
+}
+
+// Event loop run by each reactor thread.
+void EpollReactor::run(Thread *thread)
+{
+	current_thread = thread;
+	epoll_event events[max_events];
+	while (true) {
+		++io_stats.syscalls;
+		int event_count =
+			epoll_wait(thread->epoll_fd, events, max_events, -1);
+		if (event_count < 0) {
+			if (errno == EINTR)
+				continue;
+			std::cerr << "Error waiting on epoll: "
+				  << std::strerror(errno) << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		for (int i = 0; i < event_count; ++i) {
+			Connection *conn = (Connection *)events[i].data.ptr;
+			if (conn == nullptr) {
+				thread->take_handoffs();
+				continue;
+			}
+			// Room in the socket buffer for more of the queue
+			if ((events[i].events & EPOLLOUT) &&
+			    !thread->on_writable(*conn)) {
+				thread->close_connection(conn);
+				continue;
+			}
+			// Anything left to read is handled before a hang up,
+			// the client may have sent a DISCONNECT before closing.
+			if ((events[i].events & ~EPOLLOUT) &&
+			    !thread->on_readable(*conn))
+				thread->close_connection(conn);
+		}
+		// Write out everything queued while handling the events.
+		thread->write_woken();
+	}
+}
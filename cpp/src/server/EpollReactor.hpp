@@ -0,0 +1,46 @@
+/*======================================================================
+COIS-4310H - EpollReactor Header
+Name: EpollReactor.hpp
+Purpose: Serve every connected client from a small fixed set of threads.
+	Each reactor thread owns an epoll instance and the non-blocking
+	client sockets handed to it, and passes whatever each socket has to
+	read on to its Connection. The thread is also the writer of its
+	clients' outbound queues, writing each of them out once per loop
+	(and waiting on EPOLLOUT for sockets whose buffer is full).
+
+Compilation: Please use the provided Make file that will make both the
+	client and the server.
+
+Requires the shared MessageLayer Class that is used in to create
+a shared header for transit.
+----------------------------------------------------------------------*/
+
+#pragma once
+#include <atomic>
+#include <vector>
+#include <cstdint>
+
+class EpollReactor {
+	// State of one reactor thread; its epoll instance, and the
+	// connections it serves. Only ever touched by that thread (apart
+	// from the hand off of new connections, and outbound queue wake ups).
+	struct Thread;
+	std::vector<Thread *> threads;
+	// The reactor thread running on the calling thread (if it is one)
+	static thread_local Thread *current_thread;
+	// Round robin counter for spreading new connections over the threads.
+	std::atomic<size_t> next_thread;
+	// Event loop run by each reactor thread.
+	static void run(Thread *thread);
+
+    public:
+	// Start thread_count reactor threads, each waiting on their own epoll
+	// instance for client sockets to become readable.
+	EpollReactor(size_t thread_count);
+	// Do not allow assignment operations, and copy construction
+	EpollReactor(EpollReactor const &) = delete;
+	void operator=(EpollReactor const &) = delete;
+	// Hand a freshly accepted non-blocking client socket to one of the
+	// reactor threads. Returns false if it couldn't be handed off.
+	bool add_connection(int client_socket);
+};
@@ -0,0 +1,98 @@
+/*======================================================================
+COIS-4310H - FanOutPool
+Name: FanOutPool.cpp
+Purpose: Small pool of worker threads that splits one job (e.g. queueing
+	a broadcast for every user in the room) into parts, and runs them in
+	parallel. The calling thread works on the parts too, and returns
+	once every part is done, so whatever the job uses (the message on
+	the caller's stack) outlives it. No lock is held for the whole job;
+	a broadcast's parts each read lock one shard of the client registry
+	at a time, while queueing for its clients (see
+	SharedClients::send_to_all).
+
+Compilation: Please use the provided Make file that will make both the
+	client and the server.
+----------------------------------------------------------------------*/
+
+#include <algorithm>
+#include "FanOutPool.hpp"
+
+FanOutPool::FanOutPool(void) : workers(0)
+{
+}
+
+// Start worker_count worker threads (on top of the calling thread of
+// each run()). They live for as long as the server does.
+void FanOutPool::start(size_t worker_count)
+{
+	std::lock_guard<std::mutex> lock(pool_lock);
+	for (size_t i = 0; i < worker_count; ++i)
+		std::thread(&FanOutPool::work_loop, this).detach();
+	workers += worker_count;
+}
+
+// Number of threads a job can be spread over (the caller included).
+size_t FanOutPool::parallelism(void)
+{
+	std::lock_guard<std::mutex> lock(pool_lock);
+	return workers + 1;
+}
+
+// Claim the next part of the job at the front of the queue,
+// dropping the job from the queue once its last part is claimed.
+// (pool_lock must be held)
+size_t FanOutPool::claim_part(Job &job)
+{
+	size_t part = job.next_part++;
+	if (job.next_part == job.parts)
+		jobs.erase(std::find(jobs.begin(), jobs.end(), &job));
+	return part;
+}
+
+// Run the claimed part, and let the caller know once the job is done.
+void FanOutPool::run_part(Job &job, size_t part)
+{
+	job.work(part);
+	std::lock_guard<std::mutex> lock(pool_lock);
+	// The caller frees the job once it sees this, so it must not be
+	// touched after the lock is released.
+	if (++job.finished_parts == job.parts)
+		job.finished.notify_one();
+}
+
+// Loop run by each worker thread.
+void FanOutPool::work_loop(void)
+{
+	while (true) {
+		Job *job;
+		size_t part;
+		{
+			std::unique_lock<std::mutex> lock(pool_lock);
+			jobs_waiting.wait(lock, [this] { return !jobs.empty(); });
+			job = jobs.front();
+			part = claim_part(*job);
+		}
+		run_part(*job, part);
+	}
+}
+
+// Run work(0) .. work(parts - 1), spread over the workers and the
+// calling thread, and return once all of them are done.
+void FanOutPool::run(size_t parts, const std::function<void(size_t)> &work)
+{
+	if (parts == 0)
+		return;
+	Job job(work, parts);
+	std::unique_lock<std::mutex> lock(pool_lock);
+	jobs.push_back(&job);
+	jobs_waiting.notify_all();
+	// Work on our own job rather than sitting idle.
+	while (job.next_part < job.parts) {
+		size_t part = claim_part(job);
+		lock.unlock();
+		run_part(job, part);
+		lock.lock();
+	}
+	job.finished.wait(lock,
+			  [&job] { return job.finished_parts == job.parts; });
+}
@@ -0,0 +1,68 @@
+/*======================================================================
+COIS-4310H - FanOutPool Header
+Name: FanOutPool.hpp
+Purpose: Small pool of worker threads that splits one job (e.g. queueing
+	a broadcast for every user in the room) into parts, and runs them in
+	parallel. The calling thread works on the parts too, and returns
+	once every part is done, so whatever the job uses (the message on
+	the caller's stack) outlives it. No lock is held for the whole job;
+	a broadcast's parts each read lock one shard of the client registry
+	at a time, while queueing for its clients (see
+	SharedClients::send_to_all).
+
+Compilation: Please use the provided Make file that will make both the
+	client and the server.
+----------------------------------------------------------------------*/
+
+#pragma once
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+
+class FanOutPool {
+	// One call to run(), and how far along its parts are.
+	struct Job {
+		const std::function<void(size_t)> &work;
+		size_t parts;
+		// Next part to be claimed, and how many have finished.
+		size_t next_part;
+		size_t finished_parts;
+		std::condition_variable finished;
+		Job(const std::function<void(size_t)> &work, size_t parts)
+			: work(work), parts(parts), next_part(0),
+			  finished_parts(0)
+		{
+		}
+	};
+	std::mutex pool_lock;
+	// Signalled when a job with unclaimed parts arrives.
+	std::condition_variable jobs_waiting;
+	// Jobs with parts still to be claimed.
+	std::deque<Job *> jobs;
+	// Number of worker threads started
+	size_t workers;
+	// Claim the next part of the job at the front of the queue,
+	// dropping the job from the queue once its last part is claimed.
+	// (pool_lock must be held)
+	size_t claim_part(Job &job);
+	// Run the claimed part, and let the caller know once the job is done.
+	void run_part(Job &job, size_t part);
+	// Loop run by each worker thread.
+	void work_loop(void);
+
+    public:
+	FanOutPool(void);
+	// Do not allow assignment operations, and copy construction
+	FanOutPool(FanOutPool const &) = delete;
+	void operator=(FanOutPool const &) = delete;
+	// Start worker_count worker threads (on top of the calling thread of
+	// each run()). They live for as long as the server does.
+	void start(size_t worker_count);
+	// Number of threads a job can be spread over (the caller included).
+	size_t parallelism(void);
+	// Run work(0) .. work(parts - 1), spread over the workers and the
+	// calling thread, and return once all of them are done.
+	void run(size_t parts, const std::function<void(size_t)> &work);
+};
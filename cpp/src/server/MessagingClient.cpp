@@ -15,23 +15,36 @@ a shared header for transit.
 ----------------------------------------------------------------------*/
 
 #include <iostream>
+#include <thread>
+#include <chrono>
+#include <algorithm>
 #include "Server.hpp"
 #include "MessagingClient.hpp"
 #include "SharedClients.hpp"
 extern "C" {
 #include <unistd.h>
+#include <sys/socket.h>
 }
 
 // Initialize a Messaging client, with a client_socket to read information
 // from, and offer up to other instances through the get_client_socket() method.
 // When the message layer ml is passed to constructor, MessageingClient takes
-// ownership of that object.
+// ownership of that object. It holds the login response, whose version is
+// the one used for everything sent to the client.
+// Frames for this client are written by the passed writer, or by a writer
+// thread of its own started in client() if writer is nullptr.
 MessagingClient::MessagingClient(int client_socket, uint16_t packet_number,
 				 const std::string &our_username,
-				 MessageLayer &&ml)
+				 MessageLayer &&ml, QueueWriter *writer)
 	: client_socket(client_socket), our_username(our_username),
 	  packet_number(packet_number), ml(std::move(ml)),
-	  sc(SharedClients::get_instance())
+	  version(this->ml.get_version_number()),
+	  sc(SharedClients::get_instance()), outbound(new OutboundQueue()),
+	  writer(writer), newest_accepted(UINT16_MAX), pending_ack_ranges(0),
+	  pending_ack_count(0),
+	  pending_acks_sequenced(false), credit_granted(UINT32_MAX),
+	  credit_due(false), deepest_recipient(0), throttled(false),
+	  throttle_noticed(0)
 {
 }
 
@@ -41,10 +54,49 @@ MessagingClient::MessagingClient(MessagingClient &&client)
 	: client_socket(client.client_socket),
 	  our_username(std::move(client.our_username)),
 	  packet_number(client.packet_number), ml(std::move(client.ml)),
-	  sc(SharedClients::get_instance())
+	  version(client.version), sc(SharedClients::get_instance()),
+	  outbound(std::move(client.outbound)), writer(client.writer),
+	  accepted(std::move(client.accepted)),
+	  newest_accepted(client.newest_accepted),
+	  sequence_gate(std::move(client.sequence_gate)),
+	  pending_acks(client.pending_acks),
+	  pending_ack_ranges(client.pending_ack_ranges),
+	  pending_ack_count(client.pending_ack_count),
+	  pending_acks_sequenced(client.pending_acks_sequenced),
+	  credit_granted(client.credit_granted),
+	  credit_due(client.credit_due),
+	  deepest_recipient(client.deepest_recipient),
+	  rate_limiter(client.rate_limiter), throttled(client.throttled),
+	  throttle_noticed(client.throttle_noticed)
 {
 }
 
+// Whether the frame (with a packet number alone) has been passed on
+// already, and is being sent again.
+bool MessagingClient::already_accepted(
+	const MessageHeaderView &recv_header) const
+{
+	return !accepted.empty() && accepted[recv_header.get_packet_number()];
+}
+
+// Remember that the frame has been passed on (see already_accepted).
+// Packet numbers half a wrap ahead of the newest are forgotten, ready to
+// come round again.
+void MessagingClient::accept_once(const MessageHeaderView &recv_header)
+{
+	uint16_t packet_number = recv_header.get_packet_number();
+	if (accepted.empty())
+		accepted.resize(UINT16_MAX + 1, false);
+	if (accepted[packet_number])
+		return;
+	accepted[packet_number] = true;
+	for (uint16_t forget = newest_accepted + 1;
+	     (uint16_t)(packet_number - forget) < 32768; ++forget)
+		accepted[(uint16_t)(forget + 32768)] = false;
+	if ((uint16_t)(packet_number - newest_accepted) < 32768)
+		newest_accepted = packet_number;
+}
+
 // I sent error messages enough to make a function to do just that.
 bool MessagingClient::send_error_message(const std::string &message)
 {
@@ -53,41 +105,202 @@ bool MessagingClient::send_error_message(const std::string &message)
 	// Set the required header information
 	MessageHeader &header =
 		ml.set_message_type(MessageTypes::ERROR)
-			.set_version_number(MessagingClient::version)
+			.set_version_number(version)
 			.set_packet_number(
 				increment_packet_number(packet_number))
 			.set_dest_username(our_username)
 			.set_data_packet_length(message.length())
 			.build();
-	auto message_to_send = build_message(header, message);
-	return sc.send_to_client(our_username, message_to_send);
+	return send(build_frame(header, message));
 }
 
-// Send verification message back to the client (ACK or NACK)
+// Send verification message back to the client (ACK or NACK) for the
+// frame received, with its sequence number if it has one.
 bool MessagingClient::send_verification_message(
-	const MessageTypes &type, const uint16_t &packet_number_recv)
+	const MessageTypes &type, const MessageHeaderView &recv_header)
 {
 	// Make sepearate message layer, as to not overwrite the header
 	// of the message we are trying to verify
 	MessageLayer v_ml;
 	// Set message type and send
+	v_ml.set_message_type(type)
+		.set_version_number(version)
+		.set_packet_number(recv_header.get_packet_number())
+		.set_dest_username(our_username)
+		.set_data_packet_length(0);
+	if (recv_header.get_frame_flags() & frame_flag_sequence)
+		v_ml.set_sequence_number(recv_header.get_sequence_number());
+	MessageHeader &header = v_ml.build();
+	return send(build_frame<std::array<uint8_t, 0> >(header, {}));
+}
+
+// NACK the frame (which has a sequence number), asking for it to be sent
+// again in wait_ms.
+bool MessagingClient::send_retry(const MessageHeaderView &recv_header,
+				 uint32_t wait_ms)
+{
+	RetryPacket retry_packet = build_retry(wait_ms);
+	MessageLayer v_ml;
 	MessageHeader &header =
-		v_ml.set_message_type(type)
-			.set_version_number(MessagingClient::version)
-			.set_packet_number(packet_number_recv)
+		v_ml.set_message_type(MessageTypes::NACK)
+			.set_version_number(version)
+			.set_packet_number(recv_header.get_packet_number())
+			.set_sequence_number(recv_header.get_sequence_number())
 			.set_dest_username(our_username)
-			.set_data_packet_length(0)
+			.calculate_data_packet_checksum(retry_packet)
+			.set_data_packet_length(retry_packet.size())
 			.build();
-	auto verification_message =
-		build_message<std::array<uint8_t, 0> >(header, {});
-	return sc.send_to_client(our_username, verification_message);
+	return send(build_frame(header, retry_packet));
 }
 
-// Main client loop, one for each connected client.
-void MessagingClient::client(void)
+// ACK the frame; at once, or (if the client understands ACK ranges) along
+// with others, when the frames read so far run out or ack_every are
+// waiting.
+void MessagingClient::acknowledge(const MessageHeaderView &recv_header)
+{
+	uint8_t flags = recv_header.get_frame_flags();
+	if (!(flags & frame_flag_ack_ranges)) {
+		send_verification_message(MessageTypes::ACK, recv_header);
+		return;
+	}
+	bool sequenced = flags & frame_flag_sequence;
+	uint64_t sequence = sequenced ? recv_header.get_sequence_number() :
+					recv_header.get_packet_number();
+	// The ACKs sent together are all of one kind, and (as only the low 16
+	// bits of each are sent) within 32767 of the first.
+	if (pending_ack_ranges > 0 &&
+	    (sequenced != pending_acks_sequenced ||
+	     sequence - pending_acks[0].first + 32767 > 65534))
+		flush_acks();
+	pending_acks_sequenced = sequenced;
+	// Frames usually come one after the other, extending the last range.
+	AckRange *last = pending_ack_ranges > 0 ?
+				 &pending_acks[pending_ack_ranges - 1] :
+				 nullptr;
+	if (last != nullptr &&
+	    (sequenced ? last->last + 1 : (uint16_t)(last->last + 1)) ==
+		    sequence) {
+		last->last = sequence;
+	} else {
+		if (pending_ack_ranges == pending_acks.size())
+			flush_acks();
+		pending_acks[pending_ack_ranges++] = { sequence, sequence };
+	}
+	if (++pending_ack_count >= ack_every)
+		flush_acks();
+}
+
+// Send the ACKs held back, if there are any, and the client's credit if
+// it has changed. Called once every complete message read in so far has
+// been handled.
+bool MessagingClient::flush_acks(void)
+{
+	// After the ACKs; the credit counts from the oldest frame the client
+	// is still waiting on an ACK for.
+	if (pending_ack_ranges == 0)
+		return credit_due ? grant_credit() : true;
+	MessageLayer v_ml;
+	v_ml.set_message_type(MessageTypes::ACK)
+		.set_version_number(version)
+		.set_dest_username(our_username)
+		.set_data_packet_length(0);
+	// The ranges are told apart from others with the same low 16 bits
+	// by being nearest the first.
+	if (pending_acks_sequenced)
+		v_ml.set_sequence_number(pending_acks[0].first);
+	else
+		v_ml.set_packet_number(pending_acks[0].first);
+	MessageHeader &header =
+		v_ml.set_ack_ranges(pending_acks.data(), pending_ack_ranges)
+			.build();
+	pending_ack_ranges = 0;
+	pending_ack_count = 0;
+	bool sent = send(build_frame<std::array<uint8_t, 0> >(header, {}));
+	if (credit_due)
+		sent = grant_credit() && sent;
+	return sent;
+}
+
+// The credit for a client whose frames are waiting behind depth others
+// for their recipients; half the room left before their queues are half
+// full (where broadcasts are shed), if that's less than max_credit.
+// Rounded down to a power of two, so it only changes as the queues fill
+// or drain.
+uint32_t MessagingClient::credit_for(size_t depth)
+{
+	size_t soft_limit = outbound_budget.frames / 2;
+	if (depth >= soft_limit)
+		return 0;
+	size_t credit = std::min<size_t>((soft_limit - depth) / 2, max_credit);
+	uint32_t rounded = 1;
+	while (rounded * 2 <= credit)
+		rounded *= 2;
+	return credit == 0 ? 0 : rounded;
+}
+
+// Grant the client credit for what it sent lately, if it has changed;
+// none while their messages are held back.
+bool MessagingClient::grant_credit(void)
+{
+	uint32_t credit = throttled ? 0 : credit_for(deepest_recipient);
+	credit_due = false;
+	deepest_recipient = 0;
+	if (credit == credit_granted)
+		return true;
+	credit_granted = credit;
+	CreditPacket credit_packet = build_credit(credit);
+	MessageLayer v_ml;
+	MessageHeader &header =
+		v_ml.set_message_type(MessageTypes::CREDIT)
+			.set_version_number(version)
+			.set_source_username("server")
+			.set_dest_username(our_username)
+			.calculate_data_packet_checksum(credit_packet)
+			.set_data_packet_length(credit_packet.size())
+			.build();
+	return send(build_frame(header, credit_packet));
+}
+
+// Hold back a message of message_bytes over the rate limits (see
+// RateLimiter), or behind one held back (see SequenceGate); neither
+// passed on nor acknowledged, it is NACKed, to be sent again. A client
+// that sends sequence numbers is asked to wait first; until the tokens
+// come in for it, and for those ahead of it. While they are over the
+// limits, a client that keeps to its credit is granted none (sending a
+// frame now and then to find out), and the client is told, no more than
+// once a second.
+void MessagingClient::hold_back(const MessageHeaderView &recv_header,
+				size_t message_bytes, bool over_limits)
+{
+	if (recv_header.get_frame_flags() & frame_flag_sequence) {
+		credit_due = true;
+		// Those ahead of it (not yet passed on) go first.
+		uint64_t ahead = recv_header.get_sequence_number() -
+				 sequence_gate.next();
+		size_t frames = std::min<uint64_t>(ahead, max_credit) + 1;
+		uint32_t wait = rate_limiter.retry_after_ms(
+			frames, frames * message_bytes);
+		wait = std::min(std::max(wait, min_retry_ms), max_retry_ms);
+		send_retry(recv_header, wait);
+	} else {
+		send_verification_message(MessageTypes::NACK, recv_header);
+	}
+	if (!over_limits || throttled)
+		return;
+	throttled = true;
+	auto since_epoch = std::chrono::steady_clock::now().time_since_epoch();
+	int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			      since_epoch)
+			      .count();
+	if (now - throttle_noticed < 1000000000)
+		return;
+	throttle_noticed = now;
+	send_error_message(throttled_error);
+}
+
+// Let the rest of the room know that we have entered.
+void MessagingClient::announce_login(void)
 {
-	std::cout << "Started Receiving thread for client: " << our_username
-		  << std::endl;
 	// Retrieve our message header for writing
 	MessageHeader &header = ml.get_internal_header();
 	// Send out a message that I have logged in
@@ -99,161 +312,233 @@ void MessagingClient::client(void)
 	header.fill(0);
 	// Fill out header and build.
 	ml.set_message_type(MessageTypes::MESSAGE)
-		.set_version_number(MessagingClient::version)
+		.set_version_number(version)
 		.set_packet_number(increment_packet_number(packet_number))
 		.set_source_username("server")
 		.set_dest_username("all")
 		.set_data_packet_length(login_message.length())
 		.build();
-	sc.send_to_all(our_username, build_message(header, login_message));
+	VersionedFrame announcement(build_frame(header, login_message));
+	sc.send_to_all(our_username, announcement);
+}
+
+// Main client loop, one for each connected client.
+// (Thread per connection mode; the epoll reactor calls handle_message
+// directly as messages arrive.)
+void MessagingClient::client(FrameReader &reader)
+{
+	std::cout << "Started Receiving thread for client: " << our_username
+		  << std::endl;
+	// Everything sent to this client is written by its own writer thread
+	std::thread writer_thread(&MessagingClient::write_loop, this);
+	announce_login();
+	FrameView frame;
 	// The main receive loop
-	while (true) {
-		// Re-clean the header after sending our login message
-		header.fill(0);
-		// Wait for a new message from the client
-		ssize_t read_size =
-			read(client_socket, header.data(), header.size());
+	bool connected = true;
+	while (connected) {
+		// Act on every complete message we have so far
+		while (connected && reader.next(frame)) {
+			// Is the header with a valid sum?
+			if (!frame.valid) {
+				std::cerr << "Client message header sum is bad."
+					  << std::endl;
+				continue;
+			}
+			connected =
+				handle_message(frame.header, frame.data_packet);
+		}
+		if (!connected)
+			break;
+		// Before waiting on the client, who may be waiting on them.
+		flush_acks();
+		// Wait for more from the client, as much as there is.
+		++io_stats.syscalls;
 		// Check whether the socket had an error on read
-		if (read_size <= 0) {
+		if (reader.read_from(client_socket) <= 0) {
 			std::cerr << "Client socket is closed, or error."
 				  << std::endl;
-			return;
-			// Make sure we read in enough data to make up a header
-		} else if (read_size < (ssize_t)header.size()) {
-			std::cerr
-				<< "Unable to read enough bytes for a full header."
-				<< std::endl;
-			continue;
+			break;
 		}
-		// Parse the header
-		ml.verify_checksum();
-		// Is the header with a valid sum?
-		if (!ml.valid) {
-			std::cerr << "Client message header sum is bad."
+	}
+	// Let the writer thread finish off what is queued for us, and wait
+	// for it before the caller logs us out.
+	outbound->close();
+	writer_thread.join();
+}
+
+// Drain the outbound queue until the client goes away.
+// (Thread per client mode)
+void MessagingClient::write_loop(void)
+{
+	while (outbound->wait_for_frames()) {
+		if (outbound->write_to(client_socket, true) ==
+		    OutboundQueue::FAILED) {
+			std::cerr << "Unable to send a message to a client socket."
 				  << std::endl;
-			continue;
-		}
-		// Create a vector to hold the second data package if needed
-		std::vector<uint8_t> data_package(ml.get_data_packet_length());
-		switch (ml.get_message_type()) {
-		// Another login request? But you're logged in.
-		case MessageTypes::LOGIN: {
-			send_error_message("You already logged in, dingus.\0");
-			break;
+			outbound->close();
+			return;
 		}
-		// Client is sending me an error?
-		case MessageTypes::ERROR: {
-			continue;
+	}
+}
+
+// Act on one complete message sent from the client. The header must
+// already have had its checksum verified, and data_package must hold
+// the whole data packet that followed it.
+// Returns false when the client is disconnecting.
+bool MessagingClient::handle_message(const MessageHeaderView &recv_header,
+				     const DataPacketView &data_package)
+{
+	// Retrieve our message header for writing replies
+	MessageHeader &header = ml.get_internal_header();
+	switch (recv_header.get_message_type()) {
+	// Another login request? But you're logged in.
+	case MessageTypes::LOGIN: {
+		send_error_message("You already logged in, dingus.\0");
+		break;
+	}
+	// Client is sending me an error?
+	case MessageTypes::ERROR: {
+		break;
+	}
+	// Who message
+	case MessageTypes::WHO: {
+		// Special string with a null terminator in it
+		auto usernames = sc.get_logged_in_users();
+		// Header clear
+		header.fill(0);
+		// Set the required header information
+		ml.set_message_type(MessageTypes::WHO)
+			.set_version_number(version)
+			.set_packet_number(
+				increment_packet_number(packet_number))
+			.set_source_username("server")
+			.set_dest_username(our_username)
+			// Not +1, null terminator is included in
+			// the string.
+			.set_data_packet_length(usernames.size())
+			.build();
+		send(build_frame(header, usernames));
+		break;
+	}
+	// Message ACK from client?
+	case MessageTypes::ACK: {
+		break;
+	}
+	// Actual Message or Broadcast, or a chunk of a file being sent
+	case MessageTypes::MESSAGE:
+	case MessageTypes::FILE_CHUNK: {
+		bool sequenced =
+			recv_header.get_frame_flags() & frame_flag_sequence;
+		uint64_t sequence = recv_header.get_sequence_number();
+		if (sequenced)
+			sequence_gate.start(sequence);
+		// verify the data packet checksum, and respond
+		// appropriately; those after it wait for it to come again.
+		if (!(recv_header.verify_data_packet_checksum(data_package))) {
+			std::cerr << "Received corrupted message from: "
+				  << our_username << ". Sending NACK."
+				  << std::endl;
+			if (sequenced)
+				sequence_gate.hold(sequence);
+			send_verification_message(MessageTypes::NACK,
+						  recv_header);
 			break;
 		}
-		// Who message
-		case MessageTypes::WHO: {
-			// Special string with a null terminator in it
-			auto usernames = sc.get_logged_in_users();
-			// Header clear
-			header.fill(0);
-			// Set the required header information
-			ml.set_message_type(MessageTypes::WHO)
-				.set_version_number(MessagingClient::version)
-				.set_packet_number(
-					increment_packet_number(packet_number))
-				.set_source_username("server")
-				.set_dest_username(our_username)
-				// Not +1, null terminator is included in
-				// the string.
-				.set_data_packet_length(usernames.size())
-				.build();
-			sc.send_to_client(our_username,
-					  build_message(header, usernames));
+		// Whether it is passed on, or held back; over their rate or
+		// the server's (checked before anything is done with it), or
+		// behind one that is.
+		SequenceGate::Verdict verdict;
+		if (sequenced)
+			verdict = sequence_gate.check(sequence, rate_limiter,
+						      data_package.size());
+		else if (already_accepted(recv_header))
+			verdict = SequenceGate::COPY;
+		else if (rate_limiter.admit(data_package.size()))
+			verdict = SequenceGate::PASS;
+		else
+			verdict = SequenceGate::HOLD;
+		// Already passed on; the client didn't hear our ACK in time.
+		// ACKed again, and not counted against their rate.
+		if (verdict == SequenceGate::COPY) {
+			acknowledge(recv_header);
 			break;
 		}
-		// Message ACK from client?
-		case MessageTypes::ACK: {
-			continue;
+		if (verdict != SequenceGate::PASS) {
+			hold_back(recv_header, data_package.size(),
+				  verdict == SequenceGate::HOLD);
 			break;
 		}
-		// Actual Message or Broadcast
-		case MessageTypes::MESSAGE: {
-			// Read in the data portion of the header
-			ssize_t read_size =
-				read(client_socket, data_package.data(),
-				     data_package.size());
-			// verify the data packet checksum, and respond
-			// appropriately
-			if (!(ml.verify_data_packet_checksum(data_package))) {
-				std::cerr << "Received corrupted message from: "
-					  << our_username << ". Sending NACK."
-					  << std::endl;
-				send_verification_message(
-					MessageTypes::NACK,
-					ml.get_packet_number());
-				continue;
-			}
-			send_verification_message(MessageTypes::ACK,
-						  ml.get_packet_number());
-			// Check whether the socket had an error on read
-			if (read_size <= 0) {
-				std::cerr
-					<< "Client socket is closed, or error."
-					<< std::endl;
-				return;
-				// Make sure we read in enough data to make up the data packet
-			} else if (read_size < (ssize_t)data_package.size()) {
-				std::cerr
-					<< "Unable to read enough bytes for the whole data package."
-					<< std::endl;
-				continue;
+		throttled = false;
+		acknowledge(recv_header);
+		if (!sequenced)
+			accept_once(recv_header);
+		// Check whether this is a broadcast or a PM, straight from
+		// the received header.
+		NameView dest_username = recv_header.get_dest_username();
+		// Passed on as it came, unless the recipient uses another
+		// header version.
+		VersionedFrame message(build_frame(recv_header, data_package));
+		// How far behind the recipients are
+		size_t depth = 0;
+		// This is a broadcast message
+		if (dest_username == "all") {
+			sc.send_to_all(our_username, message, &depth);
+			// This is a PM
+		} else {
+			// Send it off to the client, sending off an error
+			// to the sender if they don't exist.
+			if (!(sc.send_to_client(dest_username, message,
+						&depth))) {
+				send_error_message(missing_user_error(
+					dest_username.str()));
 			}
-			// Check whether this is a broadcast or a PM
-			std::string dest_username = ml.get_dest_username();
-			// This is a broadcast message
-			if (dest_username == "all") {
-				sc.send_to_all(our_username,
-					       build_message(header,
-							     data_package));
-				// This is a PM
-			} else {
-				// Send it off to the client, sending off an error
-				// to the sender if they don't exist.
-				if (!(sc.send_to_client(
-					    dest_username,
-					    build_message(header,
-							  data_package)))) {
-					send_error_message(
-						std::string()
-							.append("User: ")
-							.append(dest_username)
-							.append(" does not exist.\0"));
-				}
-			}
-			break;
-		}
-		// Disconnect Message
-		case MessageTypes::DISCONNECT: {
-			std::string leave_message;
-			leave_message.append("User: ")
-				.append(our_username)
-				.append(" disconnected from the room.\0");
-			// Clear the header
-			header.fill(0);
-			// Set the header information
-			ml.set_message_type(MessageTypes::MESSAGE)
-				.set_version_number(MessagingClient::version)
-				.set_packet_number(
-					increment_packet_number(packet_number))
-				.set_source_username("server")
-				.set_dest_username("all")
-				.set_data_packet_length(leave_message.size())
-				.build();
-			sc.send_to_all(our_username,
-				       build_message(header, leave_message));
-			// Return and allow login_procedure to finish
-			// and clean up this client.
-			return;
-			break;
 		}
+		// Clients with sequence numbers are granted credit from
+		// it (with the ACKs).
+		if (sequenced) {
+			credit_due = true;
+			deepest_recipient = std::max(deepest_recipient, depth);
 		}
+		break;
+	}
+	// Request to another user to start their channel over; passed on
+	// like a PM, without an ACK (nothing is lost if it doesn't arrive,
+	// the client asks again). Counted against the sender's rate like
+	// any message, and dropped if over it.
+	case MessageTypes::RESYNC: {
+		if (data_package.size() > resync_packet_max ||
+		    !(recv_header.verify_data_packet_checksum(data_package)) ||
+		    !rate_limiter.admit(data_package.size()))
+			break;
+		VersionedFrame request(build_frame(recv_header, data_package));
+		sc.send_to_client(recv_header.get_dest_username(), request);
+		break;
+	}
+	// Disconnect Message
+	case MessageTypes::DISCONNECT: {
+		std::string leave_message;
+		leave_message.append("User: ")
+			.append(our_username)
+			.append(" disconnected from the room.\0");
+		// Clear the header
+		header.fill(0);
+		// Set the header information
+		ml.set_message_type(MessageTypes::MESSAGE)
+			.set_version_number(version)
+			.set_packet_number(
+				increment_packet_number(packet_number))
+			.set_source_username("server")
+			.set_dest_username("all")
+			.set_data_packet_length(leave_message.size())
+			.build();
+		VersionedFrame departure(build_frame(header, leave_message));
+		sc.send_to_all(our_username, departure);
+		// Return and allow the caller to finish
+		// and clean up this client.
+		return false;
+	}
 	}
+	return true;
 }
 
 // Called by other instances (within send_to_all, and send_to_client)
@@ -265,3 +550,51 @@ int MessagingClient::get_client_socket(void)
 {
 	return client_socket;
 }
+
+// Username this client logged in with.
+const std::string &MessagingClient::get_username(void)
+{
+	return our_username;
+}
+
+// Header version everything sent to this client uses.
+uint8_t MessagingClient::get_version(void)
+{
+	return version;
+}
+
+// Queue a frame to be written to this client, waking the writer if
+// needed. Never blocks. Returns false if the frame had to be dropped;
+// shed because the client is falling behind, or with the client if they
+// are too far behind to keep. If depth is passed, it is set to the frames
+// waiting once the frame is queued.
+bool MessagingClient::send(const Frame &frame, size_t *depth)
+{
+	bool wake_writer;
+	switch (outbound->push(frame, wake_writer)) {
+	case OutboundQueue::QUEUED:
+		break;
+	case OutboundQueue::CUT_OFF:
+		std::cerr << "Outbound queue for client: " << our_username
+			  << " is full, disconnecting them." << std::endl;
+		// Their reader sees the connection end, and logs them out
+		// as usual; a writer stuck on the socket gives up.
+		shutdown(client_socket, SHUT_RDWR);
+		return false;
+	default:
+		return false;
+	}
+	if (depth != nullptr)
+		*depth = outbound->depth();
+	// The writer thread in thread per client mode is woken by the queue.
+	if (wake_writer && writer != nullptr)
+		writer->wake(this);
+	return true;
+}
+
+// The frames waiting to be written to this client.
+// (Used by the writer)
+OutboundQueue &MessagingClient::get_outbound_queue(void)
+{
+	return *outbound;
+}
@@ -15,7 +15,14 @@ a shared header for transit.
 ----------------------------------------------------------------------*/
 
 #pragma once
+#include <array>
+#include <memory>
+#include <vector>
 #include "MessageLayer.hpp"
+#include "FrameReader.hpp"
+#include "OutboundQueue.hpp"
+#include "RateLimiter.hpp"
+#include "SequenceGate.hpp"
 // Forward declared to avoid circular dependency
 class SharedClients;
 
@@ -27,24 +34,123 @@ class MessagingClient {
 	// interesting values.
 	uint16_t packet_number;
 	MessageLayer ml;
+	// Header version the client logged in with (see
+	// MessageLayer::reply_version). Everything sent to them uses it.
+	const uint8_t version;
 	// Shared clients instance for talking to other connected clients.
 	SharedClients &sc;
+	// Frames waiting to be written to this client, and who writes them.
+	// (nullptr means this client's own writer thread; thread per
+	// client mode.)
+	std::unique_ptr<OutboundQueue> outbound;
+	QueueWriter *writer;
+	// A frame the client sends again because our ACK was slow in coming
+	// is ACKed again, but not passed on twice.
+	// For a client whose frames have packet numbers alone; those of the
+	// frames passed on lately (made room for at the first), and the
+	// newest of them.
+	std::vector<bool> accepted;
+	uint16_t newest_accepted;
+	// For a client whose frames have sequence numbers; which have been
+	// passed on, and which are to wait (passed on in order).
+	SequenceGate sequence_gate;
+	// Whether the frame (with a packet number alone) has been passed on
+	// already, and is being sent again.
+	bool already_accepted(const MessageHeaderView &recv_header) const;
+	// Remember that the frame has been passed on. Packet numbers half a
+	// wrap ahead of the newest are forgotten, ready to come round again.
+	void accept_once(const MessageHeaderView &recv_header);
+	// ACKs held back to be sent together (to a client that understands
+	// ACK ranges), how many frames they are for, and whether they are
+	// for frames with sequence numbers.
+	std::array<AckRange, max_ack_ranges> pending_acks;
+	size_t pending_ack_ranges;
+	size_t pending_ack_count;
+	bool pending_acks_sequenced;
+	// ACK the frame; at once, or (if the client understands ACK ranges)
+	// along with others, when the frames read so far run out or
+	// ack_every are waiting.
+	void acknowledge(const MessageHeaderView &recv_header);
+	// Credit last granted the client (UINT32_MAX before the first),
+	// whether frames with sequence numbers have been passed on since, and
+	// the most frames then waiting for any of their recipients.
+	uint32_t credit_granted;
+	bool credit_due;
+	size_t deepest_recipient;
+	// Grant the client credit (see credit_for) for what it sent lately,
+	// if it has changed; none while their messages are held back.
+	bool grant_credit(void);
+	// The client's share of the rate limits; whether their last message
+	// was held back for being over them, and when they were last told
+	// (ns).
+	RateLimiter rate_limiter;
+	bool throttled;
+	int64_t throttle_noticed;
+	// Hold back a message of message_bytes, over the rate limits or
+	// behind one that is; NACKed rather than passed on.
+	void hold_back(const MessageHeaderView &recv_header,
+		       size_t message_bytes, bool over_limits);
+	// Drain the outbound queue until the client goes away.
+	// (Thread per client mode)
+	void write_loop(void);
 	// Send error messages to the client
 	bool send_error_message(const std::string &message);
-	// Send verification message back to the client (ACK or NACK)
+	// Send verification message back to the client (ACK or NACK) for
+	// the frame received, with its sequence number if it has one.
 	bool send_verification_message(const MessageTypes &type,
-				       const uint16_t &packet_number_recv);
+				       const MessageHeaderView &recv_header);
+	// NACK the frame (which has a sequence number), asking for it to be
+	// sent again in wait_ms.
+	bool send_retry(const MessageHeaderView &recv_header, uint32_t wait_ms);
 
     public:
-	// MessageHeader Version
-	static const int version = 3;
-
+	// Most frames an ACK is held back for
+	static const size_t constexpr ack_every = 16;
+	// Most frames a client is granted credit for
+	static const uint32_t constexpr max_credit = 1024;
+	// Least and most a client is asked to wait before sending a frame
+	// held back again (ms)
+	static const uint32_t constexpr min_retry_ms = 10;
+	static const uint32_t constexpr max_retry_ms = 1000;
+	// The credit for a client whose frames are waiting behind depth
+	// others for their recipients; half the room left before their
+	// queues are half full (where broadcasts are shed), if that's less
+	// than max_credit. Rounded down to a power of two, so it only changes
+	// as the queues fill or drain.
+	static uint32_t credit_for(size_t depth);
 	MessagingClient(int client_socket, uint16_t packet_number,
-			const std::string &our_username, MessageLayer &&ml);
+			const std::string &our_username, MessageLayer &&ml,
+			QueueWriter *writer);
 	MessagingClient(MessagingClient &&client);
 	// Handled by the thread that creates and runs this object on
-	// accept. Handles messages sent to the server from the client.
-	void client(void);
+	// accept. Handles messages sent to the server from the client,
+	// starting with any still in the reader the login came through.
+	void client(FrameReader &reader);
+	// Let the rest of the room know that we have entered.
+	void announce_login(void);
+	// Act on one complete message sent from the client. The header must
+	// already have had its checksum verified, and data_package must hold
+	// the whole data packet that followed it.
+	// Returns false when the client is disconnecting.
+	bool handle_message(const MessageHeaderView &recv_header,
+			    const DataPacketView &data_package);
+	// Send the ACKs held back, if there are any, and the client's credit
+	// if it has changed. Called once every complete message read in so
+	// far has been handled.
+	bool flush_acks(void);
+	// Username this client logged in with.
+	const std::string &get_username(void);
+	// Header version everything sent to this client uses.
+	uint8_t get_version(void);
+	// Queue a frame to be written to this client, waking the writer if
+	// needed. Never blocks. Returns false if the frame had to be dropped.
+	// If depth is passed, it is set to the frames waiting once the frame
+	// is queued.
+	// Accessed through rwlock from other threads
+	bool send(const Frame &frame, size_t *depth = nullptr);
+	// The frames waiting to be written to this client.
+	// (Used by the writer)
+	OutboundQueue &get_outbound_queue(void);
 	// Ability to retrieve the socket fd of another thread.
 	// Accessed through rwlock from other threads
 	int get_client_socket(void);
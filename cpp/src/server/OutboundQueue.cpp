@@ -0,0 +1,424 @@
+/*======================================================================
+COIS-4310H - OutboundQueue
+Name: OutboundQueue.cpp
+Purpose: Bounded queue of frames waiting to be written to one client.
+	Senders only ever push onto the queue (which never blocks), and a
+	single writer drains it, coalescing every waiting frame into one
+	writev style system call; each frame's header and data packet as
+	separate pieces, wherever they are kept. The writer is whoever owns
+	the client's socket: the reactor thread it belongs to, or in thread
+	per client mode a writer thread started alongside the client's
+	receive thread.
+
+	Each queue has a budget of frames and bytes, so a client that stops
+	reading can't hold on to more than its share of the server's memory.
+	Once it has used half its budget, broadcasts to it are shed, and
+	the messages sent to it directly are copied out of the (much larger)
+	receive buffers they arrived in, which they would otherwise keep
+	from being reused; once it has used all of it, the broadcasts still
+	waiting are thrown out to make room; and if there still isn't room,
+	the client is cut off.
+
+	Frames wait in one of two lanes. The server's own replies (ACKs,
+	NACKs, CREDIT, WHO and ERRORs, see frame_class) are written ahead of
+	the messages and file chunks passed on from other clients, so a
+	client's ACKs don't wait behind a backlog of broadcasts; but for
+	every control_burst control frames at least one bulk frame goes, so
+	the bulk lane is never starved. How long frames of each class waited
+	is kept in queue_latency.
+
+Compilation: Please use the provided Make file that will make both the
+	client and the server.
+----------------------------------------------------------------------*/
+
+#include <cerrno>
+#include <climits>
+#include <chrono>
+#include <algorithm>
+extern "C" {
+#include <sys/socket.h>
+}
+#include "Server.hpp"
+#include "OutboundQueue.hpp"
+
+OutboundBudget outbound_budget = { 4096, 8 * 1024 * 1024 };
+ShedStats shed_stats;
+LatencyHistogram queue_latency[FRAME_CLASSES];
+
+static int64_t now_ns(void)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		       std::chrono::steady_clock::now().time_since_epoch())
+		.count();
+}
+
+// The class of a frame, from its message type. Messages, file chunks and
+// RESYNCs are passed on from other clients, in the order they were sent;
+// the rest are the server's own.
+FrameClass frame_class(const OutboundFrame &frame)
+{
+	switch (frame.get_header()[message_type_begin]) {
+	case MessageTypes::MESSAGE:
+	case MessageTypes::FILE_CHUNK:
+	case MessageTypes::RESYNC:
+		return BULK_FRAMES;
+	default:
+		return CONTROL_FRAMES;
+	}
+}
+
+void LatencyHistogram::record(int64_t waited_ns)
+{
+	uint64_t us = waited_ns > 0 ? waited_ns / 1000 : 0;
+	size_t bucket = 0;
+	while (us > 0 && bucket < buckets - 1) {
+		us >>= 1;
+		++bucket;
+	}
+	counts[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+// Whether the frame is a broadcast (the first to be shed)
+static bool is_broadcast(const OutboundFrame &frame)
+{
+	return NameView::from_field(frame.get_header().data() +
+				    dest_username_begin) == "all";
+}
+
+// The frame with a copy of its data packet, in a buffer of its own
+static Frame copy_frame(const OutboundFrame &frame)
+{
+	size_t length = frame.get_data_packet_length();
+	SharedBytes data_packet;
+	if (length > 0) {
+		std::shared_ptr<uint8_t> copied =
+			BufferPool::make_shared(length);
+		std::copy(frame.get_data_packet(),
+			  frame.get_data_packet() + length, copied.get());
+		data_packet = std::move(copied);
+	}
+	return make_frame(frame.get_header().data(), std::move(data_packet),
+			  length);
+}
+
+OutboundFrame::OutboundFrame(const uint8_t *header, SharedBytes data_packet,
+			     size_t data_packet_length)
+	: data_packet(std::move(data_packet)),
+	  data_packet_length(data_packet_length)
+{
+	std::copy(header, header + this->header.size(), this->header.begin());
+}
+
+const MessageHeader &OutboundFrame::get_header(void) const
+{
+	return header;
+}
+
+const uint8_t *OutboundFrame::get_data_packet(void) const
+{
+	return data_packet.get();
+}
+
+size_t OutboundFrame::get_data_packet_length(void) const
+{
+	return data_packet_length;
+}
+
+// Bytes in the whole message
+size_t OutboundFrame::size(void) const
+{
+	return header.size() + data_packet_length;
+}
+
+// Point iov at what is left of the message after the first offset bytes.
+// Returns the number of iovecs used (at most 2).
+size_t OutboundFrame::gather(size_t offset, iovec *iov) const
+{
+	size_t count = 0;
+	if (offset < header.size()) {
+		iov[count++] = { (void *)(header.data() + offset),
+				 header.size() - offset };
+		offset = 0;
+	} else {
+		offset -= header.size();
+	}
+	if (offset < data_packet_length)
+		iov[count++] = { (void *)(data_packet.get() + offset),
+				 data_packet_length - offset };
+	return count;
+}
+
+// Encode frame again for clients using another header version. Only the
+// header changes, the data packet is shared with the original. Its
+// checksum is recalculated only if it was good to begin with.
+static Frame encode_for_version(const Frame &frame, uint8_t version)
+{
+	MessageLayer ml;
+	std::copy(frame->get_header().begin(), frame->get_header().end(),
+		  ml.get_internal_header().begin());
+	DataPacketView data_package(frame->get_data_packet(),
+				    frame->get_data_packet_length());
+	bool data_packet_checksum_good =
+		ml.verify_data_packet_checksum(data_package);
+	ml.set_version_number(version);
+	if (data_packet_checksum_good)
+		ml.calculate_data_packet_checksum(data_package);
+	return make_frame(ml.build().data(),
+			  SharedBytes(frame, frame->get_data_packet()),
+			  frame->get_data_packet_length());
+}
+
+VersionedFrame::VersionedFrame(const Frame &original)
+	: original(original),
+	  original_version(original->get_header()[header_version_begin])
+{
+}
+
+// The frame for a client using the passed header version (one returned
+// by MessageLayer::reply_version).
+const Frame &VersionedFrame::for_version(uint8_t version)
+{
+	if (version == original_version ||
+	    version < header_version_sha256 || version > header_version_xxh3)
+		return original;
+	size_t index = version - header_version_sha256;
+	std::call_once(encoded[index], [&] {
+		frames[index] = encode_for_version(original, version);
+	});
+	return frames[index];
+}
+
+OutboundQueue::OutboundQueue(void)
+	: queued_frames(0), queued_bytes(0), queued_broadcasts(0),
+	  gathered_frames(), gathered_written(0), depth_frames(0),
+	  front_written(0), writing_lane(CONTROL_FRAMES), control_streak(0),
+	  writer_scheduled(false), closed(false), cut_off(false)
+{
+}
+
+// Whether frame would take the queue past the share of the budget
+// (1 for all of it, 2 for half...)
+bool OutboundQueue::over_budget(const Frame &frame, size_t share) const
+{
+	return queued_frames >= outbound_budget.frames / share ||
+	       queued_bytes + frame->size() > outbound_budget.bytes / share;
+}
+
+// Throw out the broadcasts the writer hasn't got to yet. Frames it has
+// gathered are left be; it may be writing them as we speak.
+void OutboundQueue::evict_broadcasts(void)
+{
+	auto &bulk = lanes[BULK_FRAMES];
+	size_t first = std::max<size_t>(
+		gathered_frames[BULK_FRAMES],
+		front_written > 0 && writing_lane == BULK_FRAMES);
+	if (first >= bulk.size())
+		return;
+	auto kept = std::remove_if(
+		bulk.begin() + first, bulk.end(), [this](const QueuedFrame &q) {
+			if (!is_broadcast(*q.frame))
+				return false;
+			queued_bytes -= q.frame->size();
+			--queued_frames;
+			--queued_broadcasts;
+			++shed_stats.broadcasts_evicted;
+			return true;
+		});
+	bulk.erase(kept, bulk.end());
+	depth_frames.store(queued_frames, std::memory_order_relaxed);
+}
+
+// Add a frame to the back of the queue, or shed it if the client is over
+// budget. CUT_OFF is returned, once, when the client has fallen too far
+// behind to keep; the queue is closed, and the caller must disconnect
+// them. wake_writer is set when the writer was idle, and must be woken
+// to write the frame.
+OutboundQueue::Pushed OutboundQueue::push(const Frame &frame,
+					  bool &wake_writer)
+{
+	std::lock_guard<std::mutex> lock(queue_lock);
+	wake_writer = false;
+	if (closed) {
+		if (cut_off)
+			++shed_stats.frames_abandoned;
+		return CLOSED;
+	}
+	bool broadcast = is_broadcast(*frame);
+	bool compact = false;
+	// Always allow one frame, however big, into an empty queue.
+	if (queued_frames > 0) {
+		// Falling behind; only what was sent to them directly from
+		// here on, each copied out of the buffer it arrived in.
+		if (over_budget(frame, 2)) {
+			if (broadcast) {
+				++shed_stats.broadcasts_shed;
+				return SHED;
+			}
+			compact = true;
+		}
+		if (over_budget(frame, 1) && queued_broadcasts > 0)
+			evict_broadcasts();
+		// Nothing left to shed. Give up on them, rather than hold
+		// on to any more for a client that isn't reading.
+		if (over_budget(frame, 1)) {
+			closed = true;
+			cut_off = true;
+			frames_waiting.notify_all();
+			++shed_stats.clients_cut_off;
+			shed_stats.frames_abandoned += queued_frames + 1;
+			return CUT_OFF;
+		}
+	}
+	lanes[frame_class(*frame)].push_back(
+		{ compact ? copy_frame(*frame) : frame, now_ns() });
+	++queued_frames;
+	queued_bytes += frame->size();
+	queued_broadcasts += broadcast;
+	depth_frames.store(queued_frames, std::memory_order_relaxed);
+	if (!writer_scheduled) {
+		writer_scheduled = true;
+		wake_writer = true;
+		frames_waiting.notify_one();
+	}
+	return QUEUED;
+}
+
+// (Writer only) gather up the waiting frames for writev, control frames
+// first. Returns the number of iovecs at gathered(). If there are none
+// the queue is drained, and the next push will wake the writer again.
+size_t OutboundQueue::gather(void)
+{
+	std::lock_guard<std::mutex> lock(queue_lock);
+	iov.clear();
+	gathered_lanes.clear();
+	gathered_written = 0;
+	gathered_frames[CONTROL_FRAMES] = 0;
+	gathered_frames[BULK_FRAMES] = 0;
+	if (queued_frames == 0) {
+		writer_scheduled = false;
+		return 0;
+	}
+	// Frames are only ever popped by the writer, and the ones gathered
+	// are never evicted, so the pointers stay good after the lock is
+	// released.
+	size_t offset = front_written;
+	size_t streak = control_streak;
+	iovec pieces[2];
+	while (iov.size() + 2 <= IOV_MAX) {
+		bool control = gathered_frames[CONTROL_FRAMES] <
+			       lanes[CONTROL_FRAMES].size();
+		bool bulk = gathered_frames[BULK_FRAMES] <
+			    lanes[BULK_FRAMES].size();
+		FrameClass next;
+		// The frame part way written goes on first.
+		if (offset > 0)
+			next = writing_lane;
+		else if (control && (!bulk || streak < control_burst))
+			next = CONTROL_FRAMES;
+		else if (bulk)
+			next = BULK_FRAMES;
+		else
+			break;
+		auto &lane = lanes[next];
+		size_t count =
+			lane[gathered_frames[next]++].frame->gather(offset,
+								  pieces);
+		iov.insert(iov.end(), pieces, pieces + count);
+		gathered_lanes.push_back(next);
+		offset = 0;
+		streak = next == CONTROL_FRAMES ? streak + 1 : 0;
+	}
+	return iov.size();
+}
+
+const iovec *OutboundQueue::gathered(void)
+{
+	return iov.data();
+}
+
+// (Writer only) drop what the last write managed to send of the frames
+// gathered.
+void OutboundQueue::consume(size_t written)
+{
+	std::lock_guard<std::mutex> lock(queue_lock);
+	int64_t now = now_ns();
+	while (written > 0 && gathered_written < gathered_lanes.size()) {
+		FrameClass from = (FrameClass)gathered_lanes[gathered_written];
+		auto &lane = lanes[from];
+		const Frame &front = lane.front().frame;
+		size_t remaining = front->size() - front_written;
+		if (written < remaining) {
+			front_written += written;
+			writing_lane = from;
+			return;
+		}
+		written -= remaining;
+		queued_bytes -= front->size();
+		queued_broadcasts -= is_broadcast(*front);
+		queue_latency[from].record(now - lane.front().queued_at);
+		--gathered_frames[from];
+		lane.pop_front();
+		--queued_frames;
+		++gathered_written;
+		depth_frames.store(queued_frames, std::memory_order_relaxed);
+		front_written = 0;
+		if (from == CONTROL_FRAMES)
+			++control_streak;
+		else
+			control_streak = 0;
+		++io_stats.frames_delivered;
+	}
+}
+
+// (Writer only) write as much of the queue to the socket as it will
+// take, without blocking unless blocking is set.
+OutboundQueue::Status OutboundQueue::write_to(int client_socket,
+					      bool blocking)
+{
+	while (true) {
+		size_t count = gather();
+		if (count == 0)
+			return DRAINED;
+		msghdr message = {};
+		message.msg_iov = iov.data();
+		message.msg_iovlen = count;
+		++io_stats.syscalls;
+		ssize_t written =
+			sendmsg(client_socket, &message,
+				MSG_NOSIGNAL | (blocking ? 0 : MSG_DONTWAIT));
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			// The writer stays scheduled, and picks up where it
+			// left off once the socket is writable.
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return BLOCKED;
+			return FAILED;
+		}
+		consume(written);
+	}
+}
+
+// (Thread per client writer only) wait until there are frames to
+// write. Returns false once the queue is closed and empty.
+bool OutboundQueue::wait_for_frames(void)
+{
+	std::unique_lock<std::mutex> lock(queue_lock);
+	frames_waiting.wait(lock,
+			    [this] { return queued_frames > 0 || closed; });
+	return queued_frames > 0;
+}
+
+// Refuse any more frames, and let a waiting writer finish up.
+void OutboundQueue::close(void)
+{
+	std::lock_guard<std::mutex> lock(queue_lock);
+	closed = true;
+	frames_waiting.notify_all();
+}
+
+// Frames waiting (as of lately; it may change at any time)
+size_t OutboundQueue::depth(void) const
+{
+	return depth_frames.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,262 @@
+/*======================================================================
+COIS-4310H - OutboundQueue Header
+Name: OutboundQueue.hpp
+Purpose: Bounded queue of frames waiting to be written to one client.
+	Senders only ever push onto the queue (which never blocks), and a
+	single writer drains it, coalescing every waiting frame into one
+	writev style system call; each frame's header and data packet as
+	separate pieces, wherever they are kept. The writer is whoever owns
+	the client's socket: the reactor thread it belongs to, or in thread
+	per client mode a writer thread started alongside the client's
+	receive thread.
+	Messages that go to clients using different header versions are
+	passed around as a VersionedFrame, encoded once per version.
+
+	Each queue has a budget of frames and bytes, so a client that stops
+	reading can't hold on to more than its share of the server's memory.
+	Once it has used half its budget, broadcasts to it are shed, and
+	the messages sent to it directly are copied out of the (much larger)
+	receive buffers they arrived in, which they would otherwise keep
+	from being reused; once it has used all of it, the broadcasts still
+	waiting are thrown out to make room; and if there still isn't room,
+	the client is cut off.
+
+	Frames wait in one of two lanes. The server's own replies (ACKs,
+	NACKs, CREDIT, WHO and ERRORs, see frame_class) are written ahead of
+	the messages and file chunks passed on from other clients, so a
+	client's ACKs don't wait behind a backlog of broadcasts; but for
+	every control_burst control frames at least one bulk frame goes, so
+	the bulk lane is never starved. How long frames of each class waited
+	is kept in queue_latency.
+
+Compilation: Please use the provided Make file that will make both the
+	client and the server.
+----------------------------------------------------------------------*/
+
+#pragma once
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <condition_variable>
+extern "C" {
+#include <sys/uio.h>
+}
+#include "MessageLayer.hpp"
+#include "FrameReader.hpp"
+// Forward declared to avoid circular dependency
+class MessagingClient;
+
+// A complete message ready to be written; its own copy of the header,
+// and the data packet wherever it is kept. A data packet passed on from
+// another client stays in the receive buffer it arrived in (see
+// DataPacketView::share), and the two parts are written out as separate
+// iovecs, so the data packet is never copied in behind the header.
+class OutboundFrame {
+	MessageHeader header;
+	SharedBytes data_packet;
+	size_t data_packet_length;
+
+    public:
+	OutboundFrame(const uint8_t *header, SharedBytes data_packet,
+		      size_t data_packet_length);
+	const MessageHeader &get_header(void) const;
+	const uint8_t *get_data_packet(void) const;
+	size_t get_data_packet_length(void) const;
+	// Bytes in the whole message
+	size_t size(void) const;
+	// Point iov at what is left of the message after the first offset
+	// bytes. Returns the number of iovecs used (at most 2).
+	size_t gather(size_t offset, iovec *iov) const;
+};
+
+// Shared, so the same frame can wait in many clients' queues.
+using Frame = std::shared_ptr<const OutboundFrame>;
+
+// A frame (and its reference count) in a buffer from the BufferPool
+inline Frame make_frame(const uint8_t *header, SharedBytes data_packet,
+			size_t data_packet_length)
+{
+	return std::allocate_shared<OutboundFrame>(
+		PoolAllocator<OutboundFrame>(), header, std::move(data_packet),
+		data_packet_length);
+}
+
+// Build a message straight into a frame; the header and a copy of the
+// data packet. The bytes are never copied again however many queues the
+// frame ends up in.
+template <typename T>
+Frame build_frame(const MessageHeader &message_header, const T &message)
+{
+	SharedBytes data_packet;
+	if (message.size() > 0) {
+		std::shared_ptr<uint8_t> copied =
+			BufferPool::make_shared(message.size());
+		std::copy(message.begin(), message.end(), copied.get());
+		data_packet = std::move(copied);
+	}
+	return make_frame(message_header.data(), std::move(data_packet),
+			  message.size());
+}
+
+// Build a frame from a header viewed where it was received, and its data
+// packet, which is shared rather than copied when it can be.
+inline Frame build_frame(const MessageHeaderView &message_header,
+			 const DataPacketView &data_packet)
+{
+	return make_frame(message_header.data(), data_packet.share(),
+			  data_packet.size());
+}
+
+// A message ready to go to clients using any of the header versions. The
+// frame for a version other than the original's is only encoded the first
+// time a client using that version needs it (by whichever thread gets
+// there first), and is then shared like any other frame.
+class VersionedFrame {
+	Frame original;
+	uint8_t original_version;
+	// Frames for versions 3 (SHA-256), 4 (CRC32C) and 5 (xxHash3)
+	Frame frames[3];
+	std::once_flag encoded[3];
+
+    public:
+	explicit VersionedFrame(const Frame &original);
+	// Do not allow assignment operations, and copy construction
+	VersionedFrame(VersionedFrame const &) = delete;
+	void operator=(VersionedFrame const &) = delete;
+	// The frame for a client using the passed header version (one
+	// returned by MessageLayer::reply_version).
+	const Frame &for_version(uint8_t version);
+};
+
+// Priority classes of frames waiting to be written; each has its own lane
+// in a queue, control frames going first.
+enum FrameClass { CONTROL_FRAMES = 0, BULK_FRAMES, FRAME_CLASSES };
+// The class of a frame, from its message type
+FrameClass frame_class(const OutboundFrame &frame);
+
+// How long frames waited in clients' queues, from being queued until the
+// last of them was written; counts in power of two buckets, the first
+// holding waits under 1 us, and bucket i those from 2^(i-1) us.
+struct LatencyHistogram {
+	static const size_t constexpr buckets = 32;
+	std::atomic<uint64_t> counts[buckets];
+	void record(int64_t waited_ns);
+};
+// For each FrameClass, since the counts were last taken (see Server.cpp)
+extern LatencyHistogram queue_latency[FRAME_CLASSES];
+
+// Most frames, and bytes, each client may have waiting to be written.
+// (4096 frames and 8 MiB unless the server is told otherwise.)
+struct OutboundBudget {
+	size_t frames;
+	size_t bytes;
+};
+extern OutboundBudget outbound_budget;
+
+// Counters for the frames shed from clients' queues, and the clients cut
+// off, since the server started.
+struct ShedStats {
+	// Broadcasts not queued for a client past half its budget
+	std::atomic<uint64_t> broadcasts_shed;
+	// Broadcasts thrown out of a full queue to make room
+	std::atomic<uint64_t> broadcasts_evicted;
+	// Frames thrown away with a client that was cut off
+	std::atomic<uint64_t> frames_abandoned;
+	std::atomic<uint64_t> clients_cut_off;
+};
+extern ShedStats shed_stats;
+
+// Something that drains clients' outbound queues onto their sockets.
+class QueueWriter {
+    public:
+	virtual ~QueueWriter(void)
+	{
+	}
+	// Called (by any thread) when the client's queue has gone from idle
+	// to having frames waiting. Must not block.
+	virtual void wake(MessagingClient *client) = 0;
+};
+
+// A frame waiting in a queue, and when it was queued (ns)
+struct QueuedFrame {
+	Frame frame;
+	int64_t queued_at;
+};
+
+class OutboundQueue {
+	std::mutex queue_lock;
+	// Signalled when a frame arrives for an idle writer, or on close.
+	std::condition_variable frames_waiting;
+	// A lane for each FrameClass
+	std::deque<QueuedFrame, PoolAllocator<QueuedFrame> >
+		lanes[FRAME_CLASSES];
+	size_t queued_frames;
+	size_t queued_bytes;
+	// Broadcasts among the frames
+	size_t queued_broadcasts;
+	// Frames at the front of each lane the writer has gathered up, and
+	// may be in the middle of writing; they are never thrown out.
+	size_t gathered_frames[FRAME_CLASSES];
+	// The lane each frame gathered came from, in the order they are
+	// written, and how many of them have been.
+	std::vector<uint8_t> gathered_lanes;
+	size_t gathered_written;
+	// The number of frames, for anyone to read without the lock
+	std::atomic<size_t> depth_frames;
+	// How much of the frame at the front of the writing lane has already
+	// been written.
+	size_t front_written;
+	FrameClass writing_lane;
+	// Control frames written since the last bulk frame
+	size_t control_streak;
+	// Whether the writer has been woken for the frames waiting, and will
+	// keep going until the queue is drained.
+	bool writer_scheduled;
+	bool closed;
+	// Closed because the client fell too far behind
+	bool cut_off;
+	// Frames (two iovecs each) gathered up for the writer's next system
+	// call.
+	std::vector<iovec> iov;
+	// Whether frame would take the queue past the share of the budget
+	bool over_budget(const Frame &frame, size_t share) const;
+	// Throw out the broadcasts the writer hasn't got to yet.
+	void evict_broadcasts(void);
+
+    public:
+	// Control frames written in a row, while bulk frames wait, before
+	// one of them goes
+	static const size_t constexpr control_burst = 64;
+	// Result of a call to write_to
+	enum Status { DRAINED, BLOCKED, FAILED };
+	// Result of a call to push
+	enum Pushed { QUEUED, SHED, CUT_OFF, CLOSED };
+	OutboundQueue(void);
+	// Add a frame to the back of its lane, or shed it if the client is
+	// over budget (see above). CUT_OFF is returned, once, when the client
+	// has fallen too far behind to keep; the queue is closed, and the
+	// caller must disconnect them. wake_writer is set when the writer was
+	// idle, and must be woken to write the frame.
+	Pushed push(const Frame &frame, bool &wake_writer);
+	// (Writer only) gather up the waiting frames for writev, control
+	// frames first. Returns the number of iovecs at gathered(). If there
+	// are none the queue is drained, and the next push will wake the
+	// writer again.
+	size_t gather(void);
+	const iovec *gathered(void);
+	// (Writer only) drop what the last write managed to send of the
+	// frames gathered.
+	void consume(size_t written);
+	// (Writer only) write as much of the queue to the socket as it will
+	// take, without blocking unless blocking is set.
+	Status write_to(int client_socket, bool blocking);
+	// (Thread per client writer only) wait until there are frames to
+	// write. Returns false once the queue is closed and empty.
+	bool wait_for_frames(void);
+	// Refuse any more frames, and let a waiting writer finish up.
+	void close(void);
+	// Frames waiting (as of lately; it may change at any time)
+	size_t depth(void) const;
+};
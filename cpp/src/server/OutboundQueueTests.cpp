@@ -0,0 +1,198 @@
+/*======================================================================
+COIS-4310H - OutboundQueueTests
+Name: OutboundQueueTests.cpp
+Purpose: Test that a client's OutboundQueue keeps to its budget; that
+	broadcasts are shed past half of it, and messages sent to the client
+	directly are copied out of the buffers they arrived in, that
+	broadcasts are evicted to make room in a full queue, and that a
+	client with nothing left to evict is cut off. Also that control
+	frames are written ahead of bulk ones, but no more than
+	control_burst of them in a row while bulk frames wait, and that what
+	gather and consume hand the writer adds up.
+
+Usage: ./OutboundQueueTests
+	(No output means the tests passed)
+	if there are assertion errors, the tests failed.
+
+Description of Parameters
+	None
+
+Creation: Please use the provided Make file that will make both the
+	client and the server.
+----------------------------------------------------------------------*/
+
+#include <cassert>
+#include <vector>
+#include <string>
+#include "OutboundQueue.hpp"
+#include "Server.hpp"
+
+// Defined by the server proper, counted by the OutboundQueue.
+IoStats io_stats;
+
+// Bytes in each bulk frame's data packet (control frames have none)
+static const size_t constexpr data_bytes = 100;
+static const size_t constexpr header_bytes =
+	std::tuple_size<MessageHeader>::value;
+
+// An ACK, from the server
+static Frame control_frame(void)
+{
+	MessageLayer ml;
+	MessageHeader &header = ml.set_message_type(MessageTypes::ACK)
+					.set_dest_username("bob")
+					.set_data_packet_length(0)
+					.build();
+	return build_frame<std::array<uint8_t, 0> >(header, {});
+}
+
+// A message passed on to bob, or to everyone
+static Frame bulk_frame(const std::string &dest)
+{
+	std::vector<uint8_t> data(data_bytes, 'm');
+	MessageLayer ml;
+	MessageHeader &header = ml.set_message_type(MessageTypes::MESSAGE)
+					.set_source_username("alice")
+					.set_dest_username(dest)
+					.set_data_packet_length(data.size())
+					.build();
+	return build_frame(header, data);
+}
+
+static OutboundQueue::Pushed push(OutboundQueue &queue, const Frame &frame)
+{
+	bool wake_writer;
+	return queue.push(frame, wake_writer);
+}
+
+// The message types of the frames gathered, in the order they are to be
+// written, and the bytes in them.
+static std::vector<uint8_t> gathered_types(OutboundQueue &queue,
+					   size_t &bytes)
+{
+	std::vector<uint8_t> types;
+	size_t count = queue.gather();
+	const iovec *iov = queue.gathered();
+	bytes = 0;
+	for (size_t i = 0; i < count; ++i) {
+		const uint8_t *piece = (const uint8_t *)iov[i].iov_base;
+		bytes += iov[i].iov_len;
+		if (iov[i].iov_len == header_bytes)
+			types.push_back(piece[message_type_begin]);
+	}
+	return types;
+}
+
+int main(void)
+{
+	outbound_budget = { 16, 1 << 20 };
+	// The first frame into an idle queue wakes the writer; no more do,
+	// until it has drained it.
+	OutboundQueue queue;
+	bool wake_writer;
+	assert(queue.push(bulk_frame("bob"), wake_writer) ==
+		       OutboundQueue::QUEUED &&
+	       wake_writer);
+	assert(queue.push(bulk_frame("all"), wake_writer) ==
+		       OutboundQueue::QUEUED &&
+	       !wake_writer);
+	// Past half the budget, broadcasts are shed, and messages to the
+	// client are copied out of the buffer they came in.
+	Frame direct[8];
+	for (size_t i = 2; i < 8; ++i) {
+		direct[i] = bulk_frame("bob");
+		assert(push(queue, direct[i]) == OutboundQueue::QUEUED);
+	}
+	assert(push(queue, bulk_frame("all")) == OutboundQueue::SHED);
+	assert(shed_stats.broadcasts_shed == 1);
+	Frame late = bulk_frame("bob");
+	assert(push(queue, late) == OutboundQueue::QUEUED);
+	assert(queue.depth() == 9);
+	size_t count = queue.gather();
+	assert(count == 18);
+	const iovec *iov = queue.gathered();
+	assert(iov[15].iov_base == direct[7]->get_data_packet());
+	assert(iov[17].iov_base != late->get_data_packet());
+	assert(iov[17].iov_len == data_bytes);
+	// A write that stops part way through a frame picks up where it
+	// left off.
+	queue.consume(header_bytes + data_bytes + 10);
+	assert(queue.depth() == 8);
+	queue.gather();
+	assert(queue.gathered()[0].iov_len == header_bytes - 10);
+	queue.consume(8 * (header_bytes + data_bytes) - 10);
+	assert(queue.depth() == 0);
+	assert(queue.gather() == 0);
+	assert(queue.push(control_frame(), wake_writer) ==
+		       OutboundQueue::QUEUED &&
+	       wake_writer);
+
+	// A full queue evicts the broadcasts the writer hasn't gathered to
+	// make room; those it has are kept.
+	OutboundQueue full;
+	push(full, bulk_frame("all"));
+	assert(full.gather() == 2);
+	for (size_t i = 0; i < 3; ++i)
+		assert(push(full, bulk_frame("all")) == OutboundQueue::QUEUED);
+	while (full.depth() < outbound_budget.frames)
+		assert(push(full, bulk_frame("bob")) == OutboundQueue::QUEUED);
+	assert(push(full, bulk_frame("bob")) == OutboundQueue::QUEUED);
+	assert(shed_stats.broadcasts_evicted == 3);
+	assert(full.depth() == outbound_budget.frames - 2);
+	// With nothing left to evict, the client is cut off; every frame
+	// waiting, and the one that didn't fit, is abandoned.
+	full.consume(header_bytes + data_bytes);
+	while (full.depth() < outbound_budget.frames)
+		assert(push(full, bulk_frame("bob")) == OutboundQueue::QUEUED);
+	assert(push(full, control_frame()) == OutboundQueue::CUT_OFF);
+	assert(shed_stats.clients_cut_off == 1);
+	assert(shed_stats.frames_abandoned == outbound_budget.frames + 1);
+	assert(push(full, bulk_frame("bob")) == OutboundQueue::CLOSED);
+	assert(shed_stats.frames_abandoned == outbound_budget.frames + 2);
+
+	// Control frames go ahead of bulk ones...
+	outbound_budget = { 4096, 8 << 20 };
+	OutboundQueue lanes;
+	push(lanes, bulk_frame("bob"));
+	push(lanes, bulk_frame("all"));
+	push(lanes, control_frame());
+	push(lanes, control_frame());
+	size_t bytes;
+	assert(gathered_types(lanes, bytes) ==
+	       std::vector<uint8_t>({ MessageTypes::ACK, MessageTypes::ACK,
+				      MessageTypes::MESSAGE,
+				      MessageTypes::MESSAGE }));
+	assert(bytes == 4 * header_bytes + 2 * data_bytes);
+	lanes.consume(bytes);
+	assert(lanes.depth() == 0);
+	// ...but no more than control_burst of them in a row, while bulk
+	// frames wait.
+	const size_t burst = OutboundQueue::control_burst;
+	for (size_t i = 0; i < burst + 10; ++i)
+		push(lanes, control_frame());
+	push(lanes, bulk_frame("bob"));
+	push(lanes, bulk_frame("bob"));
+	std::vector<uint8_t> types = gathered_types(lanes, bytes);
+	assert(types.size() == burst + 12);
+	for (size_t i = 0; i < types.size(); ++i) {
+		bool bulk = i == burst || i == burst + 11;
+		assert(types[i] ==
+		       (bulk ? MessageTypes::MESSAGE : MessageTypes::ACK));
+	}
+	lanes.consume(bytes);
+	// The count carries over from one write to the next.
+	for (size_t i = 0; i < burst; ++i)
+		push(lanes, control_frame());
+	lanes.consume(gathered_types(lanes, bytes).size() * header_bytes);
+	push(lanes, control_frame());
+	push(lanes, bulk_frame("bob"));
+	assert(gathered_types(lanes, bytes) ==
+	       std::vector<uint8_t>({ MessageTypes::MESSAGE,
+				      MessageTypes::ACK }));
+	lanes.consume(bytes);
+	assert(lanes.depth() == 0 && lanes.gather() == 0);
+
+	// Every frame written was counted.
+	assert(io_stats.frames_delivered ==
+	       9 + 1 + 4 + (burst + 12) + (burst + 2));
+}
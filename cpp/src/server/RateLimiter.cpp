@@ -0,0 +1,169 @@
+/*======================================================================
+COIS-4310H - RateLimiter
+Name: RateLimiter.cpp
+Purpose: Token buckets on the messages (MESSAGE and FILE_CHUNK frames)
+	and bytes a second that each user, and every user together, may
+	send through the server. A message is checked against them as it is
+	received, before it is passed on to anyone; one over either rate is
+	held back (see MessagingClient::handle_message).
+
+	Each bucket is a single atomic: the time it will next be full
+	(GCRA, the generic cell rate algorithm), that taking tokens pushes
+	further into the future. Taking them is one compare and swap, so
+	the server's buckets, shared by every receiving thread, need no
+	lock; and a user's, only ever taken from by their own, is never
+	contended.
+
+Compilation: Please use the provided Make file that will make both the
+	client and the server.
+----------------------------------------------------------------------*/
+
+#include <chrono>
+#include <algorithm>
+#include "RateLimiter.hpp"
+
+RateLimits rate_limits = { 0, 0, 0, 0 };
+ThrottleStats throttle_stats;
+
+static const int64_t constexpr ns_per_second = 1000000000;
+static const int64_t constexpr ns_per_ms = 1000000;
+
+// The server's buckets, shared by every user
+static TokenBucket global_messages;
+static TokenBucket global_bytes;
+// Whether any rate is limited at all
+static bool any_limits = false;
+
+static int64_t now_ns(void)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		       std::chrono::steady_clock::now().time_since_epoch())
+		.count();
+}
+
+TokenBucket::TokenBucket(uint64_t per_second)
+	: full_at(0), per_second(per_second)
+{
+}
+
+// Copied as it stands (when a client is moved)
+TokenBucket::TokenBucket(const TokenBucket &bucket)
+	: full_at(bucket.full_at.load()), per_second(bucket.per_second)
+{
+}
+
+// Start over, full, gaining per_second tokens a second.
+void TokenBucket::set_rate(uint64_t per_second)
+{
+	this->per_second = per_second;
+	full_at.store(0);
+}
+
+bool TokenBucket::limited(void) const
+{
+	return per_second > 0;
+}
+
+// Take the tokens at time now (ns), if the bucket has them. A bucket that
+// is full always has them, however many they are.
+bool TokenBucket::take(uint64_t tokens, int64_t now)
+{
+	if (per_second == 0)
+		return true;
+	// Time the bucket takes to gain them back
+	int64_t cost = tokens * ns_per_second / per_second;
+	int64_t was = full_at.load(std::memory_order_relaxed);
+	int64_t then;
+	do {
+		// A second's worth at most may be taken ahead.
+		then = std::max(was, now) + cost;
+		if (was > now && then - now > ns_per_second)
+			return false;
+	} while (!full_at.compare_exchange_weak(was, then,
+						std::memory_order_relaxed));
+	return true;
+}
+
+// How long from time now (ns) until the tokens can be taken; 0 if they
+// can be already.
+int64_t TokenBucket::wait(uint64_t tokens, int64_t now) const
+{
+	int64_t was = full_at.load(std::memory_order_relaxed);
+	if (per_second == 0 || was <= now)
+		return 0;
+	int64_t cost = tokens * ns_per_second / per_second;
+	return std::max<int64_t>(was + cost - now - ns_per_second, 0);
+}
+
+// Put back tokens taken.
+void TokenBucket::give_back(uint64_t tokens)
+{
+	if (per_second > 0)
+		full_at.fetch_sub(tokens * ns_per_second / per_second,
+				  std::memory_order_relaxed);
+}
+
+// The buckets of a new user, at rate_limits' user rates.
+RateLimiter::RateLimiter(void)
+	: messages(rate_limits.user_messages), bytes(rate_limits.user_bytes)
+{
+}
+
+// Take a message of the passed bytes from the user's buckets and the
+// server's. Returns false, taking nothing, if any of them is out of
+// tokens; the message is counted in throttle_stats.
+bool RateLimiter::admit(size_t message_bytes)
+{
+	if (!any_limits)
+		return true;
+	int64_t now = now_ns();
+	if (!messages.take(1, now)) {
+		++throttle_stats.over_user_rate;
+	} else if (!bytes.take(message_bytes, now)) {
+		messages.give_back(1);
+		++throttle_stats.over_user_rate;
+	} else if (!global_messages.take(1, now)) {
+		messages.give_back(1);
+		bytes.give_back(message_bytes);
+		++throttle_stats.over_global_rate;
+	} else if (!global_bytes.take(message_bytes, now)) {
+		global_messages.give_back(1);
+		messages.give_back(1);
+		bytes.give_back(message_bytes);
+		++throttle_stats.over_global_rate;
+	} else {
+		return true;
+	}
+	++throttle_stats.messages_throttled;
+	throttle_stats.bytes_throttled += message_bytes;
+	return false;
+}
+
+// How long until the passed messages, of message_bytes all told, could be
+// admitted one after the other (ms, rounded up); 0 if they could be now.
+uint32_t RateLimiter::retry_after_ms(size_t messages,
+				     size_t message_bytes) const
+{
+	if (!any_limits)
+		return 0;
+	int64_t now = now_ns();
+	int64_t wait = std::max(
+		std::max(this->messages.wait(messages, now),
+			 bytes.wait(message_bytes, now)),
+		std::max(global_messages.wait(messages, now),
+			 global_bytes.wait(message_bytes, now)));
+	return (uint32_t)std::min<int64_t>(
+		(wait + ns_per_ms - 1) / ns_per_ms, UINT32_MAX);
+}
+
+// Set up the server's buckets from rate_limits. Called once, before any
+// client logs in.
+void start_rate_limits(void)
+{
+	global_messages.set_rate(rate_limits.global_messages);
+	global_bytes.set_rate(rate_limits.global_bytes);
+	any_limits = rate_limits.user_messages > 0 ||
+		     rate_limits.user_bytes > 0 ||
+		     rate_limits.global_messages > 0 ||
+		     rate_limits.global_bytes > 0;
+}
@@ -0,0 +1,93 @@
+/*======================================================================
+COIS-4310H - RateLimiter Header
+Name: RateLimiter.hpp
+Purpose: Token buckets on the messages (MESSAGE and FILE_CHUNK frames)
+	and bytes a second that each user, and every user together, may
+	send through the server. A message is checked against them as it is
+	received, before it is passed on to anyone; one over either rate is
+	held back (see MessagingClient::handle_message).
+
+	Each bucket is a single atomic: the time it will next be full
+	(GCRA, the generic cell rate algorithm), that taking tokens pushes
+	further into the future. Taking them is one compare and swap, so
+	the server's buckets, shared by every receiving thread, need no
+	lock; and a user's, only ever taken from by their own, is never
+	contended.
+
+Compilation: Please use the provided Make file that will make both the
+	client and the server.
+----------------------------------------------------------------------*/
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+// Most messages, and bytes of them, each user and every user together
+// may send a second; 0 for no limit (the default). Each may also send a
+// second's worth at once, after a second of sending nothing.
+struct RateLimits {
+	uint64_t user_messages;
+	uint64_t user_bytes;
+	uint64_t global_messages;
+	uint64_t global_bytes;
+};
+extern RateLimits rate_limits;
+
+// Counters for the messages held back by the rate limits, since the
+// server started.
+struct ThrottleStats {
+	std::atomic<uint64_t> messages_throttled;
+	std::atomic<uint64_t> bytes_throttled;
+	// Of them, those over the user's own rates, and over the server's
+	std::atomic<uint64_t> over_user_rate;
+	std::atomic<uint64_t> over_global_rate;
+};
+extern ThrottleStats throttle_stats;
+
+class TokenBucket {
+	// When the bucket will next be full (ns, on the steady clock), if
+	// nothing more is taken
+	std::atomic<int64_t> full_at;
+	// Tokens it gains a second (0 for no limit), and holds at most
+	uint64_t per_second;
+
+    public:
+	explicit TokenBucket(uint64_t per_second = 0);
+	// Copied as it stands (when a client is moved)
+	TokenBucket(const TokenBucket &bucket);
+	void operator=(TokenBucket const &) = delete;
+	// Start over, full, gaining per_second tokens a second.
+	void set_rate(uint64_t per_second);
+	bool limited(void) const;
+	// Take the tokens at time now (ns), if the bucket has them. A bucket
+	// that is full always has them, however many they are.
+	bool take(uint64_t tokens, int64_t now);
+	// How long from time now (ns) until the tokens can be taken; 0 if
+	// they can be already.
+	int64_t wait(uint64_t tokens, int64_t now) const;
+	// Put back tokens taken.
+	void give_back(uint64_t tokens);
+};
+
+// The buckets of one user, checked along with the server's.
+class RateLimiter {
+	TokenBucket messages;
+	TokenBucket bytes;
+
+    public:
+	// The buckets of a new user, at rate_limits' user rates.
+	RateLimiter(void);
+	// Take a message of the passed bytes from the user's buckets and the
+	// server's. Returns false, taking nothing, if any of them is out of
+	// tokens; the message is counted in throttle_stats.
+	bool admit(size_t message_bytes);
+	// How long until the passed messages, of message_bytes all told,
+	// could be admitted one after the other (ms, rounded up); 0 if they
+	// could be now.
+	uint32_t retry_after_ms(size_t messages, size_t message_bytes) const;
+};
+
+// Set up the server's buckets from rate_limits. Called once, before
+// any client logs in.
+void start_rate_limits(void);
@@ -0,0 +1,112 @@
+/*======================================================================
+COIS-4310H - RateLimiterTests
+Name: RateLimiterTests.cpp
+Purpose: Test that a TokenBucket lets tokens be taken while it has
+	them, and no more (however many, from one that is full), that it
+	fills again at its rate, and that tokens given back can be taken
+	again. Also that a RateLimiter admitting a message takes nothing
+	from any bucket when a later one refuses it.
+
+Usage: ./RateLimiterTests
+	(No output means the tests passed)
+	if there are assertion errors, the tests failed.
+
+Description of Parameters
+	None
+
+Creation: Please use the provided Make file that will make both the
+	client and the server.
+----------------------------------------------------------------------*/
+
+#include <cassert>
+#include "RateLimiter.hpp"
+
+static const int64_t constexpr ns_per_ms = 1000000;
+static const int64_t constexpr ns_per_second = 1000 * ns_per_ms;
+
+int main(void)
+{
+	// A bucket with no rate never runs out.
+	TokenBucket unlimited;
+	assert(!unlimited.limited());
+	for (int i = 0; i < 1000; ++i)
+		assert(unlimited.take(1 << 20, 0));
+	assert(unlimited.wait(1 << 20, 0) == 0);
+
+	// A full bucket has 10 tokens a second; it runs out after taking
+	// them, and gains one back every 100 ms.
+	int64_t now = 10 * ns_per_second;
+	TokenBucket bucket(10);
+	assert(bucket.limited());
+	for (int i = 0; i < 10; ++i)
+		assert(bucket.take(1, now));
+	assert(!bucket.take(1, now));
+	assert(bucket.wait(1, now) == 100 * ns_per_ms);
+	assert(bucket.wait(3, now + 100 * ns_per_ms) == 200 * ns_per_ms);
+	assert(!bucket.take(1, now + 99 * ns_per_ms));
+	assert(bucket.take(1, now + 100 * ns_per_ms));
+	assert(!bucket.take(1, now + 100 * ns_per_ms));
+	// After a second of taking nothing, it is full again.
+	now += 1100 * ns_per_ms;
+	assert(bucket.wait(10, now) == 0);
+	assert(bucket.take(10, now));
+	assert(!bucket.take(1, now));
+	// Tokens given back can be taken again, and no more.
+	bucket.give_back(4);
+	assert(bucket.wait(4, now) == 0);
+	assert(bucket.take(4, now));
+	assert(!bucket.take(1, now));
+	// A full bucket gives however many are asked for, all at once; then
+	// has none until they are gained back.
+	now += 2 * ns_per_second;
+	assert(bucket.take(50, now));
+	assert(!bucket.take(1, now + 3 * ns_per_second));
+	assert(bucket.take(1, now + 4 * ns_per_second + 100 * ns_per_ms));
+	// Setting the rate starts it over, full.
+	bucket.set_rate(2);
+	assert(bucket.take(2, now));
+	assert(!bucket.take(1, now));
+
+	// No limits set; every message is admitted.
+	start_rate_limits();
+	RateLimiter unthrottled;
+	for (int i = 0; i < 1000; ++i)
+		assert(unthrottled.admit(1 << 16));
+	assert(unthrottled.retry_after_ms(1000, 1 << 26) == 0);
+
+	// 10 messages, and 1000 bytes, a second for each user. A 900 byte
+	// message leaves room for no more than 100 bytes; 200 byte ones are
+	// refused on the bytes, and the message token each took first is
+	// given back, so 9 more small ones (10 in all) are admitted.
+	rate_limits = { 10, 1000, 0, 0 };
+	start_rate_limits();
+	RateLimiter user;
+	assert(user.admit(900));
+	for (int i = 0; i < 5; ++i)
+		assert(!user.admit(200));
+	assert(throttle_stats.messages_throttled == 5);
+	assert(throttle_stats.bytes_throttled == 5 * 200);
+	assert(throttle_stats.over_user_rate == 5);
+	for (int i = 0; i < 9; ++i)
+		assert(user.admit(1));
+	assert(!user.admit(1));
+	assert(throttle_stats.over_user_rate == 6);
+	uint32_t retry_ms = user.retry_after_ms(1, 1);
+	assert(retry_ms > 0 && retry_ms <= 100);
+
+	// The same, refused by the server's bytes bucket after the user's
+	// buckets have been taken from; they, and the server's messages
+	// bucket, are given back what was taken.
+	rate_limits = { 10, 0, 20, 1000 };
+	start_rate_limits();
+	RateLimiter other;
+	assert(other.admit(900));
+	for (int i = 0; i < 5; ++i)
+		assert(!other.admit(200));
+	assert(throttle_stats.over_global_rate == 5);
+	for (int i = 0; i < 9; ++i)
+		assert(other.admit(1));
+	assert(!other.admit(1));
+	assert(throttle_stats.over_user_rate == 7);
+	assert(throttle_stats.messages_throttled == 12);
+}
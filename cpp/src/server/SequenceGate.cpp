@@ -0,0 +1,106 @@
+/*======================================================================
+COIS-4310H - SequenceGate
+Name: SequenceGate.cpp
+Purpose: Decides, for each frame a client sends with a sequence number
+	(MESSAGE and FILE_CHUNK), whether it is passed on now, held back to
+	be sent again, or is a copy of one passed on already (see
+	MessagingClient::handle_message).
+
+	Frames are passed on in the order the client sent them; once one is
+	held back (over the rate limits, or corrupted on the way), every
+	frame after it is too, until it comes again and is passed on. Those
+	held back behind it aren't counted against the rate limits, so it is
+	the first of them that the tokens go to. (Channels, see CryptoLayer,
+	can't be decrypted out of order.)
+
+Compilation: Please use the provided Make file that will make both the
+	client and the server.
+----------------------------------------------------------------------*/
+
+#include "MessageLayer.hpp"
+#include "SequenceGate.hpp"
+
+SequenceGate::SequenceGate(void)
+	: started(false), passed_below(0), holding(false), held_through(0)
+{
+}
+
+// The client's sequence numbers start with its first frame, whether or
+// not it arrived whole. Does nothing after the first.
+void SequenceGate::start(uint64_t sequence)
+{
+	if (started)
+		return;
+	passed_below = sequence;
+	started = true;
+}
+
+// Remember that the frame has been passed on.
+void SequenceGate::pass(uint64_t sequence)
+{
+	// As they nearly always come
+	if (sequence == passed_below && passed_above.empty()) {
+		++passed_below;
+		return;
+	}
+	if (!passed_above.insert(sequence).second)
+		return;
+	// A client that never fills a gap can't have us remember every
+	// frame after it.
+	if (passed_above.size() > UINT16_MAX)
+		passed_below = *passed_above.begin();
+	while (!passed_above.empty() &&
+	       *passed_above.begin() == passed_below) {
+		passed_above.erase(passed_above.begin());
+		++passed_below;
+	}
+}
+
+// What to do with a whole frame, of message_bytes, with the sequence
+// number; if it is to be passed on, it is taken from the limiter first.
+SequenceGate::Verdict SequenceGate::check(uint64_t sequence,
+					  RateLimiter &limiter,
+					  size_t message_bytes)
+{
+	if (sequence_before(sequence, passed_below) ||
+	    passed_above.count(sequence) > 0)
+		return COPY;
+	// Waiting behind one held back; not counted against the limits.
+	if (holding && sequence != passed_below) {
+		hold(sequence);
+		return WAIT;
+	}
+	if (!limiter.admit(message_bytes)) {
+		hold(sequence);
+		return HOLD;
+	}
+	pass(sequence);
+	if (holding && sequence_before(held_through, passed_below))
+		holding = false;
+	return PASS;
+}
+
+// Hold back the frame (e.g. one corrupted on the way), and every frame
+// after it until it is passed on.
+void SequenceGate::hold(uint64_t sequence)
+{
+	// A copy of one passed on already holds nothing up.
+	if (sequence_before(sequence, passed_below) ||
+	    passed_above.count(sequence) > 0)
+		return;
+	if (!holding || sequence_before(held_through, sequence))
+		held_through = sequence;
+	holding = true;
+}
+
+// The oldest frame not yet passed on; the next one that can be, while
+// frames are held back.
+uint64_t SequenceGate::next(void) const
+{
+	return passed_below;
+}
+
+bool SequenceGate::is_holding(void) const
+{
+	return holding;
+}
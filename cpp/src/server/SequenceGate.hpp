@@ -0,0 +1,70 @@
+/*======================================================================
+COIS-4310H - SequenceGate Header
+Name: SequenceGate.hpp
+Purpose: Decides, for each frame a client sends with a sequence number
+	(MESSAGE and FILE_CHUNK), whether it is passed on now, held back to
+	be sent again, or is a copy of one passed on already (see
+	MessagingClient::handle_message).
+
+	Frames are passed on in the order the client sent them; once one is
+	held back (over the rate limits, or corrupted on the way), every
+	frame after it is too, until it comes again and is passed on. Those
+	held back behind it aren't counted against the rate limits, so it is
+	the first of them that the tokens go to. (Channels, see CryptoLayer,
+	can't be decrypted out of order.)
+
+Compilation: Please use the provided Make file that will make both the
+	client and the server.
+----------------------------------------------------------------------*/
+
+#pragma once
+#include <set>
+#include <cstdint>
+#include <cstddef>
+#include "RateLimiter.hpp"
+
+class SequenceGate {
+	// Whether the client's first frame has come; every frame before
+	// passed_below has been passed on, and those after it that have been
+	// are in passed_above (frames passed on while an earlier one was
+	// sent again after a NACK, by a client of an older version, may
+	// leave gaps for a while).
+	bool started;
+	uint64_t passed_below;
+	std::set<uint64_t> passed_above;
+	// Whether frames are being held back, and the newest of them; the
+	// rest wait until every one up to it has been passed on.
+	bool holding;
+	uint64_t held_through;
+	// Remember that the frame has been passed on.
+	void pass(uint64_t sequence);
+
+    public:
+	enum Verdict {
+		// Pass it on (and ACK it); remembered as passed on
+		PASS,
+		// Passed on already, it is being sent again; ACK it alone
+		COPY,
+		// Hold it back, neither passed on nor ACKed; it is over the
+		// rate limits
+		HOLD,
+		// Hold it back too; it is behind one held back
+		WAIT,
+	};
+	SequenceGate(void);
+	// The client's sequence numbers start with its first frame, whether
+	// or not it arrived whole. Does nothing after the first.
+	void start(uint64_t sequence);
+	// What to do with a whole frame, of message_bytes, with the sequence
+	// number; if it is to be passed on, it is taken from the limiter
+	// first.
+	Verdict check(uint64_t sequence, RateLimiter &limiter,
+		      size_t message_bytes);
+	// Hold back the frame (e.g. one corrupted on the way), and every
+	// frame after it until it is passed on.
+	void hold(uint64_t sequence);
+	// The oldest frame not yet passed on; the next one that can be,
+	// while frames are held back.
+	uint64_t next(void) const;
+	bool is_holding(void) const;
+};
@@ -0,0 +1,91 @@
+/*======================================================================
+COIS-4310H - SequenceGateTests
+Name: SequenceGateTests.cpp
+Purpose: Test that a client's frames are passed on in the order they
+	were sent, however they come again after some are held back (over
+	the rate limits, or corrupted on the way), that those waiting behind
+	one held back aren't counted against the limits, and that copies of
+	frames passed on are told apart.
+
+Usage: ./SequenceGateTests
+	(No output means the tests passed)
+	if there are assertion errors, the tests failed.
+
+Description of Parameters
+	None
+
+Creation: Please use the provided Make file that will make both the
+	client and the server.
+----------------------------------------------------------------------*/
+
+#include <cassert>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include "SequenceGate.hpp"
+
+int main(void)
+{
+	// No limits; a frame corrupted on the way holds up those after it
+	// until it comes again.
+	start_rate_limits();
+	RateLimiter unlimited;
+	SequenceGate gate;
+	gate.start(1000);
+	assert(gate.check(1000, unlimited, 100) == SequenceGate::PASS);
+	gate.hold(1001);
+	assert(gate.is_holding());
+	assert(gate.check(1002, unlimited, 100) == SequenceGate::WAIT);
+	assert(gate.check(1000, unlimited, 100) == SequenceGate::COPY);
+	assert(gate.check(1001, unlimited, 100) == SequenceGate::PASS);
+	// Still held up; 1002 has to come again too.
+	assert(gate.is_holding());
+	assert(gate.check(1003, unlimited, 100) == SequenceGate::WAIT);
+	assert(gate.check(1002, unlimited, 100) == SequenceGate::PASS);
+	assert(gate.check(1003, unlimited, 100) == SequenceGate::PASS);
+	assert(!gate.is_holding() && gate.next() == 1004);
+	// A corrupted copy of one passed on holds nothing up.
+	gate.hold(1002);
+	assert(!gate.is_holding());
+	assert(gate.check(1004, unlimited, 100) == SequenceGate::PASS);
+
+	// 100 messages a second; a client sending 150 at once has the first
+	// 100 passed on, the 101st held back, and the rest wait behind it,
+	// without taking any tokens.
+	rate_limits = { 100, 0, 0, 0 };
+	start_rate_limits();
+	RateLimiter limiter;
+	SequenceGate limited;
+	const uint64_t frames = 150;
+	std::vector<uint64_t> passed;
+	limited.start(0);
+	for (uint64_t sequence = 0; sequence < frames; ++sequence) {
+		SequenceGate::Verdict verdict =
+			limited.check(sequence, limiter, 100);
+		if (verdict == SequenceGate::PASS)
+			passed.push_back(sequence);
+		else if (sequence == 100)
+			assert(verdict == SequenceGate::HOLD);
+		else
+			assert(verdict == SequenceGate::WAIT);
+	}
+	assert(passed.size() == 100);
+	assert(throttle_stats.messages_throttled == 1);
+	// The client sends what was held back again, newest first (as if
+	// it had given up waiting on them in the wrong order), until every
+	// one has been passed on; they are passed on in the order they were
+	// first sent.
+	while (passed.size() < frames) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		for (uint64_t sequence = frames; sequence-- > passed.size();) {
+			if (limited.check(sequence, limiter, 100) ==
+			    SequenceGate::PASS)
+				passed.push_back(sequence);
+		}
+	}
+	for (uint64_t sequence = 0; sequence < frames; ++sequence)
+		assert(passed[sequence] == sequence);
+	assert(!limited.is_holding());
+	// And those passed on are copies, if they come again.
+	assert(limited.check(120, limiter, 100) == SequenceGate::COPY);
+}
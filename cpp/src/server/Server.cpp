@@ -3,12 +3,46 @@ COIS-4310H Assignment 1 - Server
 Name: Server.cpp
 Written By:  Adam Melaney & Trevor Gilbert 
 Purpose: This is a server for a messenger application, that will use one
-	thread for each client connecting.
+	thread for each client connecting, or a small fixed set of epoll
+	reactor threads that multiplex every client connection.
 
-Usage: ./MessageServer
+Usage: ./MessageServer [--epoll [threads] | --io_uring [threads]]
+		       [--fan_out threads] [--huge_pages]
+		       [--queue_frames frames] [--queue_bytes bytes]
+		       [--user_messages rate] [--user_bytes rate]
+		       [--global_messages rate] [--global_bytes rate]
 
 Description of Parameters
-	None
+	--epoll: Serve clients from epoll reactor threads instead of one
+		thread per client. The number of reactor threads defaults
+		to the number of hardware threads.
+	--io_uring: Serve clients from io_uring reactor threads, which
+		batch their socket reads (into registered buffers) and
+		writes. Falls back to --epoll if the kernel doesn't
+		support io_uring.
+	--fan_out: Number of worker threads that help queue broadcasts
+		to rooms of 512 or more users. Defaults to one less than
+		the number of hardware threads.
+	--huge_pages: Carve the buffers messages are received and sent
+		in out of 2 MiB huge pages (see BufferPool).
+	--queue_frames, --queue_bytes: Most frames (default 4096) and
+		bytes (default 8 MiB) that may wait to be written to any one
+		client. Past half of either, broadcasts to the client are
+		shed; at the limit, the broadcasts waiting are thrown out to
+		make room, and if there still isn't any the client is
+		disconnected (see OutboundQueue).
+	--user_messages, --user_bytes: Most messages, and bytes of them,
+		each user may send a second (no limit by default). Those
+		over it are held back, and the user is told (see
+		RateLimiter).
+	--global_messages, --global_bytes: The same, for every user
+		together.
+
+	Sending SIGUSR1 prints (and resets) counters of the system calls
+	made per message delivered, and how long control and bulk frames
+	waited in clients' queues; and prints the buffer pool's hit rate
+	and memory use, the frames shed from slow clients' queues, and the
+	messages held back by the rate limits, since the server started.
 
 Creation: Please use the provided Make file that will make both the
 client and the server.
@@ -19,17 +53,135 @@ a shared header for transit.
 
 #include <iostream>
 #include <thread>
+#include <memory>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
 #include <csignal>
+#include <stdexcept>
 extern "C" {
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 }
+#include "Server.hpp"
 #include "SharedClients.hpp"
+#include "OutboundQueue.hpp"
+#include "RateLimiter.hpp"
+#include "BufferPool.hpp"
+#include "EpollReactor.hpp"
+#include "UringReactor.hpp"
 
 // The server socket file descriptor. Global to this translation unit
 // so that the cleanup signal handler can close it.
 static int server_socket_fd;
 
+// System call and delivery counters for the client I/O paths
+IoStats io_stats;
+
+// Most bytes written to a client's socket that may wait there unsent.
+// Past it, frames wait in the client's outbound queue instead, where
+// control frames can still go ahead of them (see OutboundQueue).
+static const int constexpr unsent_limit = 64 * 1024;
+
+// Upper bound (us) of the bucket of the histogram (see LatencyHistogram)
+// that the passed share of the counts falls in.
+static uint64_t latency_bound(const uint64_t *counts, uint64_t total,
+			      double share)
+{
+	uint64_t seen = 0;
+	if (total == 0)
+		return 0;
+	for (size_t i = 0; i < LatencyHistogram::buckets; ++i) {
+		seen += counts[i];
+		if (seen > 0 && seen >= share * total)
+			return (uint64_t)1 << i;
+	}
+	return (uint64_t)1 << (LatencyHistogram::buckets - 1);
+}
+
+// Print how long frames of the class waited in clients' queues since the
+// last time, and start counting again.
+static bool print_queue_latency(const char *name, LatencyHistogram &latency)
+{
+	uint64_t counts[LatencyHistogram::buckets];
+	uint64_t total = 0;
+	for (size_t i = 0; i < LatencyHistogram::buckets; ++i)
+		total += counts[i] = latency.counts[i].exchange(0);
+	unsigned long long p50 = latency_bound(counts, total, 0.5);
+	unsigned long long p99 = latency_bound(counts, total, 0.99);
+	unsigned long long max = latency_bound(counts, total, 1);
+	char report[160];
+	int len = snprintf(report, sizeof(report),
+			   "Queue latency (%s): %llu frames, p50 < %llu us, "
+			   "p99 < %llu us, max < %llu us\n",
+			   name, (unsigned long long)total, p50, p99, max);
+	return len > 0 && write(STDOUT_FILENO, report, len) >= 0;
+}
+
+// Print the I/O counters gathered since the last time they were printed,
+// and start counting again. Called by the stats thread on SIGUSR1 (see
+// report_stats), never from a signal handler.
+static void print_io_stats(void)
+{
+	uint64_t syscalls = io_stats.syscalls.exchange(0);
+	uint64_t frames = io_stats.frames_delivered.exchange(0);
+	char report[160];
+	int len = snprintf(report, sizeof(report),
+			   "I/O stats: %llu syscalls, %llu frames delivered, "
+			   "%.3f syscalls per delivered frame\n",
+			   (unsigned long long)syscalls,
+			   (unsigned long long)frames,
+			   frames ? (double)syscalls / frames : 0.0);
+	if (len > 0 && write(STDOUT_FILENO, report, len) < 0)
+		return;
+	if (!print_queue_latency("control", queue_latency[CONTROL_FRAMES]) ||
+	    !print_queue_latency("bulk", queue_latency[BULK_FRAMES]))
+		return;
+	BufferPoolStats pool = BufferPool::stats();
+	len = snprintf(report, sizeof(report),
+		       "Buffer pool: %llu requests, %.1f%% hits, %llu KiB held, "
+		       "%llu KiB peak\n",
+		       (unsigned long long)pool.requests,
+		       pool.requests ? 100.0 * pool.hits / pool.requests : 0.0,
+		       (unsigned long long)pool.held_bytes / 1024,
+		       (unsigned long long)pool.peak_held_bytes / 1024);
+	if (len > 0 && write(STDOUT_FILENO, report, len) < 0)
+		return;
+	len = snprintf(report, sizeof(report),
+		       "Shed: %llu broadcasts shed, %llu evicted, %llu frames "
+		       "abandoned with %llu clients cut off\n",
+		       (unsigned long long)shed_stats.broadcasts_shed,
+		       (unsigned long long)shed_stats.broadcasts_evicted,
+		       (unsigned long long)shed_stats.frames_abandoned,
+		       (unsigned long long)shed_stats.clients_cut_off);
+	if (len > 0 && write(STDOUT_FILENO, report, len) < 0)
+		return;
+	len = snprintf(report, sizeof(report),
+		       "Throttled: %llu messages (%llu bytes) held back, %llu "
+		       "over their user's rate, %llu over the server's\n",
+		       (unsigned long long)throttle_stats.messages_throttled,
+		       (unsigned long long)throttle_stats.bytes_throttled,
+		       (unsigned long long)throttle_stats.over_user_rate,
+		       (unsigned long long)throttle_stats.over_global_rate);
+	if (len > 0 && write(STDOUT_FILENO, report, len) < 0)
+		return;
+}
+
+// The stats thread; print the counters each time SIGUSR1 arrives. Every
+// other thread has it blocked, so it is only ever taken here.
+static void report_stats(sigset_t mask)
+{
+	int signum;
+	while (sigwait(&mask, &signum) == 0)
+		print_io_stats();
+}
+
 // On exit, this function is called to close the server_socket_fd
 // and destroy the rwlock.
 void cleanup_on_exit(int signum)
@@ -39,73 +191,77 @@ void cleanup_on_exit(int signum)
 	exit(signum);
 }
 
-// Increment and overflow packet numbers in a defined way.
-// this will be useful for the coming assignments to deal
-// with 'packet' loss.
+// Increment and overflow packet numbers in a defined way; wrapping from
+// 65535 round to 0, so they compare with packet_number_before.
 uint16_t &increment_packet_number(uint16_t &num)
 {
-	num = (num + 1) % UINT16_MAX;
+	++num;
 	return num;
 }
 
-// Setup the login procedure, which requires a write to the
-// client_objects map. This function is called in a new thread
-// whenever a new client connects to the server. It logs the client
-// in, and lets them know if they were successful or not.
-
-// If they successfully log in, a MessagingClient is made, and the client()
-// method is executed, which waits for more messages from the client
-// (the main loop).
+// Send the entire passed buffer down the socket.
+// Returns false if the socket has an error, or is non-blocking (a
+// reactor thread's) and its buffer is full; a reactor thread never waits
+// on one client's socket, so the caller drops the connection.
+bool send_all(int client_socket, const void *data, size_t len)
+{
+	const uint8_t *position = (const uint8_t *)data;
+	while (len > 0) {
+		++io_stats.syscalls;
+		ssize_t sent = send(client_socket, position, len, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		position += sent;
+		len -= sent;
+	}
+	++io_stats.frames_delivered;
+	return true;
+}
 
-// If they failed to login, the failure message will be sent to the
-// client, and their socket will be closed, then this thread will exit.
-static void login_procedure(int client_socket)
+// Log in the client whose first header has been read into ml.
+// On success the login response has been queued for writer to send
+// (nullptr for a writer thread of the client's own), and the newly added
+// MessagingClient is returned. On failure nullptr is returned, and the
+// caller is responsible for closing the client socket.
+MessagingClient *log_in_client(int client_socket, MessageLayer &&ml,
+			       QueueWriter *writer)
 {
 	// Packet numbers for the login sequence
 	uint16_t login_packet_number = 1;
-	// See if the client is trying to login:
-	MessageHeader header;
-	// zero out the header
-	header.fill(0);
-	// Read in what is supposed to be a login request...
-	if (read(client_socket, header.data(), header.size()) <
-	    (ssize_t)(header.size())) {
-		std::cerr << "Initial Client header is too short; or error."
-			  << std::endl;
-		close(client_socket);
-		return;
-	}
-	// Pass the header to the message layer
-	MessageLayer ml(std::move(header));
-	// variable 'header' no longer valid after move.
 	// Is the header with a valid sum?
 	if (!ml.valid) {
 		std::cerr << "Initial Client header sum is bad." << std::endl;
-		close(client_socket);
-		return;
+		return nullptr;
 	}
 	// Is the header a login request message?
 	if (ml.get_message_type() != 0) {
 		std::cerr << "Message is not a login request." << std::endl;
-		close(client_socket);
-		return;
+		return nullptr;
 	}
 	// Were good. Pull the username.
 	std::string username = ml.get_source_username();
+	// Answer in the header version the client uses, if we can.
+	uint8_t version = MessageLayer::reply_version(ml.get_version_number());
 	// Build the login response message early, so we can move
 	// the MessageLayer to MessagingClient on creation.
 	ml.get_internal_header().fill(0);
-	MessageHeader login_response =
-		ml.set_version_number(MessagingClient::version)
+	MessageHeader &login_header =
+		ml.set_version_number(version)
 			.set_packet_number(login_packet_number)
 			.set_message_type(MessageTypes::LOGIN)
 			.set_dest_username(username)
-			.build_cpy();
+			.build();
+	Frame login_response =
+		build_frame<std::array<uint8_t, 0> >(login_header, {});
 	// Get the instance of SharedClients (Singleton)
 	SharedClients &sc = SharedClients::get_instance();
 	// Add the user to the system
 	MessagingClient *messaging_client = sc.add_new_user(
-		username, client_socket, login_packet_number, std::move(ml));
+		username, client_socket, login_packet_number, std::move(ml),
+		writer, login_response);
 	// Make sure we didn't find a duplicate username while
 	// we were within the write lock:
 	// if this statement is entered, it means that ml wasn't moved
@@ -122,7 +278,7 @@ static void login_procedure(int client_socket)
 		std::string error_message = "Invalid username to login with.\0";
 		MessageHeader &header =
 			ml.set_message_type(MessageTypes::ERROR)
-				.set_version_number(MessagingClient::version)
+				.set_version_number(version)
 				.set_packet_number(login_packet_number)
 				.set_dest_username(username)
 				.set_data_packet_length(error_message.length())
@@ -130,44 +286,173 @@ static void login_procedure(int client_socket)
 		// build the data portion of the message, and combine it
 		// with the header.
 		auto message_to_send = build_message(header, error_message);
-		// Send off the error message to the client
-		if (send(client_socket, message_to_send.data(),
-			 message_to_send.size(),
-			 0) < (ssize_t)message_to_send.size()) {
+		// Send off the error message to the client; not waited on,
+		// if their socket buffer is full (they are dropped anyway).
+		if (!send_all(client_socket, message_to_send.data(),
+			      message_to_send.size())) {
 			std::cerr << "Error sending login error to client."
 				  << std::endl;
 		}
 		// Goodbye duplicate client.
-		close(client_socket);
-		return;
+		return nullptr;
 	}
-	// The client was able to successfully login.
-	// Send back the login verification we built before the write lock began
-	if (send(client_socket, login_response.data(), login_response.size(),
-		 0) < (ssize_t)login_response.size()) {
-		std::cerr
-			<< "Unable to send back the login verification message."
-			<< std::endl;
+	// The client was able to successfully login, and the login
+	// verification we built before the write lock began is on its way.
+	return messaging_client;
+}
+
+// Setup the login procedure, which requires a write to the
+// client_objects map. This function is called in a new thread
+// whenever a new client connects to the server. It logs the client
+// in, and lets them know if they were successful or not.
+
+// If they successfully log in, a MessagingClient is made, and the client()
+// method is executed, which waits for more messages from the client
+// (the main loop).
+
+// If they failed to login, the failure message will be sent to the
+// client, and their socket will be closed, then this thread will exit.
+static void login_procedure(int client_socket)
+{
+	// See if the client is trying to login:
+	// Messages from the client, however they are split up across reads.
+	FrameReader reader;
+	FrameView frame;
+	// Read in what is supposed to be a login request...
+	while (!reader.next(frame)) {
+		++io_stats.syscalls;
+		if (reader.read_from(client_socket) <= 0) {
+			std::cerr
+				<< "Initial Client header is too short; or error."
+				<< std::endl;
+			close(client_socket);
+			return;
+		}
+	}
+	// Pass a copy of the header to the message layer
+	MessageHeader header;
+	std::copy(frame.header.data(), frame.header.data() + header.size(),
+		  header.begin());
+	// variable 'header' no longer valid after move.
+	MessagingClient *messaging_client = log_in_client(
+		client_socket, MessageLayer(std::move(header)), nullptr);
+	if (messaging_client == nullptr) {
 		close(client_socket);
 		return;
 	}
+	// Keep our own copy, the client object is destroyed on log out.
+	std::string username = messaging_client->get_username();
 	// This thread becomes the client thread in MessagingClient.
 	// Begin receiving messages from the client.
-	messaging_client->client();
+	messaging_client->client(reader);
 	// When we return to here, it means we are done with the
 	// connection to this client.
 	// remove the client from the system
-	sc.log_out_user(username);
+	SharedClients::get_instance().log_out_user(username);
 	// Close the client connection.
 	close(client_socket);
 }
 
+// Print how to run the server.
+static void usage(const char *program)
+{
+	std::cerr << "Usage: " << program
+		  << " [--epoll [threads] | --io_uring [threads]]"
+		     " [--fan_out threads] [--huge_pages]"
+		     " [--queue_frames frames] [--queue_bytes bytes]"
+		     " [--user_messages rate] [--user_bytes rate]"
+		     " [--global_messages rate] [--global_bytes rate]"
+		  << std::endl;
+}
+
+// The number passed to an option. Prints how to run the server, and
+// exits, if it isn't one (all of it), or is too large to hold.
+static uint64_t number_argument(const char *program, const char *number)
+{
+	try {
+		size_t length;
+		uint64_t value = std::stoull(number, &length);
+		if (number[length] == '\0')
+			return value;
+	} catch (const std::invalid_argument &) {
+	} catch (const std::out_of_range &) {
+	}
+	usage(program);
+	exit(EXIT_FAILURE);
+}
+
 // Set up the server socket to listen to client connections,
-// and spawn new threads for each new accepted client connection.
-int main(void)
+// and either spawn new threads for each new accepted client connection,
+// or hand them to the epoll reactor threads.
+int main(int argc, char **argv)
 {
+	// Number of reactor threads. 0 means one thread per client.
+	size_t reactor_threads = 0;
+	// Serve the reactor threads' sockets through io_uring instead of epoll
+	bool use_io_uring = false;
+	// Broadcast fan out workers, besides the sending thread
+	size_t hardware_threads = std::thread::hardware_concurrency();
+	size_t fan_out_threads =
+		hardware_threads > 1 ? hardware_threads - 1 : 0;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--epoll" || arg == "--io_uring") {
+			use_io_uring = (arg == "--io_uring");
+			reactor_threads = std::thread::hardware_concurrency();
+			// Optional thread count following the flag
+			if (i + 1 < argc && std::isdigit(argv[i + 1][0]))
+				reactor_threads =
+					number_argument(argv[0], argv[++i]);
+			if (reactor_threads == 0)
+				reactor_threads = 1;
+		} else if (arg == "--fan_out" && i + 1 < argc &&
+			   std::isdigit(argv[i + 1][0])) {
+			fan_out_threads = number_argument(argv[0], argv[++i]);
+		} else if (arg == "--queue_frames" && i + 1 < argc &&
+			   std::isdigit(argv[i + 1][0])) {
+			outbound_budget.frames =
+				number_argument(argv[0], argv[++i]);
+		} else if (arg == "--queue_bytes" && i + 1 < argc &&
+			   std::isdigit(argv[i + 1][0])) {
+			outbound_budget.bytes =
+				number_argument(argv[0], argv[++i]);
+		} else if (arg == "--user_messages" && i + 1 < argc &&
+			   std::isdigit(argv[i + 1][0])) {
+			rate_limits.user_messages =
+				number_argument(argv[0], argv[++i]);
+		} else if (arg == "--user_bytes" && i + 1 < argc &&
+			   std::isdigit(argv[i + 1][0])) {
+			rate_limits.user_bytes =
+				number_argument(argv[0], argv[++i]);
+		} else if (arg == "--global_messages" && i + 1 < argc &&
+			   std::isdigit(argv[i + 1][0])) {
+			rate_limits.global_messages =
+				number_argument(argv[0], argv[++i]);
+		} else if (arg == "--global_bytes" && i + 1 < argc &&
+			   std::isdigit(argv[i + 1][0])) {
+			rate_limits.global_bytes =
+				number_argument(argv[0], argv[++i]);
+		} else if (arg == "--huge_pages") {
+			if (!BufferPool::use_huge_pages())
+				std::cerr
+					<< "No huge pages reserved, asking for transparent huge pages instead."
+					<< std::endl;
+		} else {
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
 	// Attach our cleanup handler to SIGINT
 	signal(SIGINT, cleanup_on_exit);
+	// Leave SIGUSR1 to the stats thread. Blocked before any other thread
+	// is started, so every one of them (they inherit it) leaves it too.
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+	std::thread(report_stats, mask).detach();
+	// A client disappearing mid send shouldn't take the server with it.
+	signal(SIGPIPE, SIG_IGN);
 	// Server socket setup loosely followed from:
 	//     https://www.geeksforgeeks.org/socket-programming-cc/
 	// Build the socket to listen on
@@ -205,27 +490,72 @@ int main(void)
 		std::cerr << "Error binding to address." << std::endl;
 		exit(EXIT_FAILURE);
 	}
-	// Set up listener for new connections
-	if (listen(server_socket_fd, 5) < 0) {
+	// Set up listener for new connections. Use the largest backlog the
+	// system allows, so bursts of connecting clients aren't refused.
+	if (listen(server_socket_fd, SOMAXCONN) < 0) {
 		std::cerr << "Error trying to listen for connections on socket."
 			  << std::endl;
 		exit(EXIT_FAILURE);
 	}
+	SharedClients::get_instance().start_fan_out(fan_out_threads);
+	start_rate_limits();
+	// Start up the reactor threads if we are multiplexing clients.
+	std::unique_ptr<UringReactor> uring;
+	std::unique_ptr<EpollReactor> reactor;
+	if (use_io_uring) {
+		uring.reset(UringReactor::create(reactor_threads));
+		if (uring)
+			std::cout << "Starting " << reactor_threads
+				  << " io_uring reactor threads." << std::endl;
+		else
+			std::cerr << "io_uring is not available, falling back "
+				     "to epoll."
+				  << std::endl;
+	}
+	if (reactor_threads > 0 && !uring) {
+		std::cout << "Starting " << reactor_threads
+			  << " epoll reactor threads." << std::endl;
+		reactor.reset(new EpollReactor(reactor_threads));
+	}
 	// Accept and accommodate the incoming connections
 	socklen_t addr_len = sizeof(sockaddr_in);
 	while (true) {
-		// Accept a client connection
-		int new_client_socket = accept(server_socket_fd,
-					       (sockaddr *)&address, &addr_len);
+		// Accept a client connection. Epoll reactor sockets are
+		// non-blocking, the reactor threads must never block in read.
+		// (io_uring waits on blocking sockets for us.)
+		int new_client_socket =
+			accept4(server_socket_fd, (sockaddr *)&address,
+				&addr_len, reactor ? SOCK_NONBLOCK : 0);
 		// Make sure the client connection is valid
 		if (new_client_socket < 0) {
+			// Out of file descriptors, or the client gave up
+			// before we got to it. Keep serving everyone else.
+			if (errno == EMFILE || errno == ENFILE ||
+			    errno == ECONNABORTED || errno == EINTR) {
+				std::cerr << "Unable to accept a connection: "
+					  << std::strerror(errno) << std::endl;
+				continue;
+			}
 			std::cerr
 				<< "Error trying to accept connections on server socket."
 				<< std::endl;
 			exit(EXIT_FAILURE);
 		}
-		// Set up the client thread for this connection.
-		std::thread(login_procedure, new_client_socket).detach();
+		setsockopt(new_client_socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+			   &unsent_limit, sizeof(unsent_limit));
+		if (uring) {
+			// Hand the connection to one of the io_uring threads.
+			if (!uring->add_connection(new_client_socket))
+				close(new_client_socket);
+		} else if (reactor) {
+			// Hand the connection to one of the reactor threads.
+			if (!reactor->add_connection(new_client_socket))
+				close(new_client_socket);
+		} else {
+			// Set up the client thread for this connection.
+			std::thread(login_procedure, new_client_socket)
+				.detach();
+		}
 	}
 	return 0;
 }
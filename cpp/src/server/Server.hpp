@@ -16,8 +16,35 @@ a shared header for transit.
 #pragma once
 #include <vector>
 #include <string>
+#include <atomic>
+#include "MessageLayer.hpp"
+// Forward declared to avoid circular dependency
+class MessagingClient;
+class QueueWriter;
 
-// Increment and overflow packet numbers in a defined way.
-// this will be useful for the coming assignments to deal
-// with 'packet' loss.
+// Counters for the system calls made moving client messages in and out
+// of the server, and the frames delivered to clients by them.
+// Printed (and reset) when the server receives SIGUSR1.
+struct IoStats {
+	std::atomic<uint64_t> syscalls;
+	std::atomic<uint64_t> frames_delivered;
+};
+extern IoStats io_stats;
+
+// Increment and overflow packet numbers in a defined way; wrapping from
+// 65535 round to 0, so they compare with packet_number_before.
 uint16_t &increment_packet_number(uint16_t &num);
+
+// Send the entire passed buffer down the socket.
+// Returns false if the socket has an error, or is non-blocking (a
+// reactor thread's) and its buffer is full; a reactor thread never
+// waits on one client's socket, so the caller drops the connection.
+bool send_all(int client_socket, const void *data, size_t len);
+
+// Log in the client whose first header has been read into ml.
+// On success the login response has been queued for writer to send
+// (nullptr for a writer thread of the client's own), and the newly added
+// MessagingClient is returned. On failure nullptr is returned, and the
+// caller is responsible for closing the client socket.
+MessagingClient *log_in_client(int client_socket, MessageLayer &&ml,
+			       QueueWriter *writer);
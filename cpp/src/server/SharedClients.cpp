@@ -12,22 +12,24 @@ a shared header for transit.
 ----------------------------------------------------------------------*/
 
 #include <iostream>
-extern "C" {
-#include <sys/socket.h>
-}
+#include <sstream>
+#include <atomic>
+#include <algorithm>
 
 #include "SharedClients.hpp"
 
-SharedClients::SharedClients(void)
-{
-	// Initialize the client_objects rwlock
-	pthread_rwlock_init(&client_objects_lock, nullptr);
-}
+// Rooms with fewer recipients than this have broadcasts queued by the
+// sender's thread alone; waking the fan out workers costs more than it
+// saves.
+static const size_t constexpr min_parallel_fan_out = 512;
 
-SharedClients::~SharedClients(void)
+// Number of shards the client_objects map is split into. Plenty to
+// keep any two threads from often wanting the same shard.
+static const size_t constexpr client_object_shards = 64;
+
+SharedClients::SharedClients(void)
+	: client_objects(client_object_shards), fan_out(new FanOutPool())
 {
-	// destroy the rwlock
-	pthread_rwlock_destroy(&client_objects_lock);
 }
 
 SharedClients &SharedClients::get_instance(void)
@@ -39,108 +41,115 @@ SharedClients &SharedClients::get_instance(void)
 
 // Send a message to another client by username
 // return false if we weren't able to send it to the recipient
-// (if they don't exist.)
-bool SharedClients::send_to_client(const std::string &dest_username,
-				   const std::vector<uint8_t> &message)
+// (if they don't exist, or their outbound queue is full.)
+// The message is only queued, the client's writer sends it.
+bool SharedClients::send_to_client(const NameView &dest_username,
+				   const Frame &message)
 {
-	// Open the lock for reading
-	if (pthread_rwlock_rdlock(&client_objects_lock) != 0) {
-		std::cerr << "Unable to lock the rwlock for reading."
-			  << std::endl;
-		exit(EXIT_FAILURE);
-	}
-
+	bool send_success = false;
 	// Check if the user exists. If it does,
-	// send them the message.
-	auto client_fd_it = client_objects.find(dest_username);
-	bool send_success = true;
-	if (client_fd_it != client_objects.end()) {
-		// get the file discriptor for the client we are sending
-		// a message to.
-		int client_fd = (client_fd_it->second).get_client_socket();
-		// Send the message
-		if (send(client_fd, message.data(), message.size(), 0) <
-		    (ssize_t)message.size()) {
-			std::cerr
-				<< "Unable to send a message to a client socket."
-				<< std::endl;
-			send_success = false;
-		}
-	} else {
-		send_success = false;
-	}
+	// queue the message for them.
+	client_objects.find(dest_username, [&](MessagingClient &client) {
+		// Queueing never blocks, so a slow client can't hold up the
+		// lock (and everyone waiting on it).
+		send_success = client.send(message);
+	});
+	return send_success;
+}
 
-	// Close the lock for reading
-	if (pthread_rwlock_unlock(&client_objects_lock) != 0) {
-		std::cerr << "Unable to unlock the rwlock after reading."
-			  << std::endl;
-		exit(EXIT_FAILURE);
-	}
+// Same again, for a message that may need encoding in the header
+// version the recipient uses. If depth is passed, it is set to the frames
+// waiting for the recipient once the message is queued.
+bool SharedClients::send_to_client(const NameView &dest_username,
+				   VersionedFrame &message, size_t *depth)
+{
+	bool send_success = false;
+	client_objects.find(dest_username, [&](MessagingClient &client) {
+		send_success = client.send(
+			message.for_version(client.get_version()), depth);
+	});
 	return send_success;
 }
 
+// Raise most to value, if it is less.
+static void raise_to(std::atomic<size_t> &most, size_t value)
+{
+	size_t seen = most.load();
+	while (value > seen && !most.compare_exchange_weak(seen, value))
+		;
+}
+
 // Send a message to all connected clients except for ourselves.
 // Using the passed username field to omit ourselves.
-// (return false if we weren't able to send the message to one
+// (return false if we weren't able to queue the message for one
 // of the clients.)
-bool SharedClients::send_to_all(const std::string &sender_username,
-				const std::vector<uint8_t> &message)
+// Clients using the same header version share the one frame. In large
+// rooms the queueing is split over the fan out worker threads.
+// If deepest is passed, it is set to the most frames waiting for any
+// client the message was queued for.
+bool SharedClients::send_to_all(const NameView &sender_username,
+				VersionedFrame &message, size_t *deepest)
 {
-	// Open the lock for reading
-	if (pthread_rwlock_rdlock(&client_objects_lock) != 0) {
-		std::cerr << "Unable to lock the rwlock for reading."
-			  << std::endl;
-		exit(EXIT_FAILURE);
-	}
-	bool send_success = true;
-	// Send the message to each client
-	for (auto &user : client_objects) {
-		// Don't send it to ourselves
-		if (user.first != sender_username) {
-			int client_fd = (user.second).get_client_socket();
-			// Send the message
-			if (send(client_fd, message.data(), message.size(), 0) <
-			    (ssize_t)message.size()) {
-				std::cerr
-					<< "Unable to send a message to a client socket."
-					<< std::endl;
-				send_success = false;
-			}
+	std::atomic<bool> send_success(true);
+	std::atomic<size_t> deepest_queued(0);
+	// Split the shards between the parts; each shard is only locked
+	// while its own clients are being queued for.
+	size_t shards = client_objects.shard_count();
+	size_t parts = 1;
+	if (client_objects.size() >= min_parallel_fan_out)
+		parts = std::min(fan_out->parallelism(), shards);
+	auto queue_part = [&](size_t part) {
+		size_t end = shards * (part + 1) / parts;
+		for (size_t shard = shards * part / parts; shard < end;
+		     ++shard) {
+			// Queue the message for each client in the shard
+			client_objects.for_each_in_shard(
+				shard, [&](const NameView &username,
+					   MessagingClient &client) {
+					// Don't send it to ourselves
+					if (username == sender_username)
+						return;
+					auto &frame = message.for_version(
+						client.get_version());
+					size_t depth;
+					if (!client.send(frame, &depth))
+						send_success = false;
+					else
+						raise_to(deepest_queued, depth);
+				});
 		}
-	}
-	// Close the lock for reading
-	if (pthread_rwlock_unlock(&client_objects_lock) != 0) {
-		std::cerr << "Unable to unlock the rwlock after reading."
-			  << std::endl;
-		exit(EXIT_FAILURE);
-	}
+	};
+	if (parts == 1)
+		queue_part(0);
+	else
+		fan_out->run(parts, queue_part);
+	if (deepest != nullptr)
+		*deepest = deepest_queued;
 	return send_success;
 }
 
+// Start worker_count threads to help send_to_all with large rooms.
+void SharedClients::start_fan_out(size_t worker_count)
+{
+	fan_out->start(worker_count);
+}
+
 // Get CSV list of logged in users from the client_objects
 // hash map.
 std::string SharedClients::get_logged_in_users(void)
 {
 	// String stream to build the CSV message within
 	std::stringstream usernames;
-	// Open the lock for reading
-	if (pthread_rwlock_rdlock(&client_objects_lock) != 0) {
-		std::cerr << "Unable to lock the rwlock for reading."
-			  << std::endl;
-		exit(EXIT_FAILURE);
-	}
 	// Add all the usernames to CSV string
-	for (auto &user : client_objects) {
-		usernames << user.first << ", ";
+	for (size_t shard = 0; shard < client_objects.shard_count(); ++shard) {
+		client_objects.for_each_in_shard(
+			shard, [&](const NameView &username,
+				   MessagingClient &) {
+				usernames << username << ", ";
+			});
 	}
 	// add null terminator
 	usernames << '\0';
-	// Close the lock for reading
-	if (pthread_rwlock_unlock(&client_objects_lock) != 0) {
-		std::cerr << "Unable to unlock the rwlock after reading."
-			  << std::endl;
-		exit(EXIT_FAILURE);
-	}
 	// Turn the stream into a string and return it.
 	return usernames.str();
 }
@@ -151,56 +160,32 @@ std::string SharedClients::get_logged_in_users(void)
 MessagingClient *SharedClients::add_new_user(const std::string &username,
 					     int client_socket,
 					     int login_packet_number,
-					     MessageLayer &&ml)
+					     MessageLayer &&ml,
+					     QueueWriter *writer,
+					     const Frame &login_response)
 {
 	// Create a MessagingClient, and try to insert it into the shared
-	// HashMap.
-	MessagingClient *messaging_client = nullptr;
-	// Lock the wrlock for writing, allowing us to add this new user
-	// to the system.
-	if (pthread_rwlock_wrlock(&client_objects_lock) != 0) {
-		std::cerr << "Unable to lock the rwlock for writing."
-			  << std::endl;
-		exit(EXIT_FAILURE);
-	}
-	// Only add it, if it doesn't already exist.
-	if (client_objects.find(username) == client_objects.end()) {
-		client_objects.insert(std::make_pair(
-			username,
-			MessagingClient(client_socket, login_packet_number,
-					username, std::move(ml))));
-		// variable 'ml' no longer valid after move, if this branch
-		// was executed.
-		// Cannot copy a client object. Only reference it and move it.
-		// It is owned by client_objects, and we are now borrowing it.
-		messaging_client = &(client_objects.at(username));
-	}
-	// Unlock the rwlock, we are done writing now.
-	if (pthread_rwlock_unlock(&client_objects_lock) != 0) {
-		std::cerr << "Unable to unlock the rwlock after writing."
-			  << std::endl;
-		exit(EXIT_FAILURE);
-	}
-	return messaging_client;
+	// HashMap. Only add it, if it doesn't already exist.
+	// Cannot copy a client object. Only reference it and move it.
+	// It is owned by client_objects, and we are now borrowing it.
+	return client_objects.insert(
+		username,
+		[&] {
+			// variable 'ml' no longer valid after move, if the
+			// user was added.
+			return MessagingClient(client_socket,
+					       login_packet_number, username,
+					       std::move(ml), writer);
+		},
+		[&](MessagingClient &client) {
+			// Queue the login response while nobody else can see
+			// the user yet, so it is the first frame they receive.
+			client.send(login_response);
+		});
 }
 
-bool SharedClients::log_out_user(const std::string &username)
+bool SharedClients::log_out_user(const NameView &username)
 {
-	bool success = false;
-	// Lock the client_objects hashmap, to remove this exiting
-	// client from the system.
-	if (pthread_rwlock_wrlock(&client_objects_lock) != 0) {
-		std::cerr << "Unable to lock the rwlock for writing."
-			  << std::endl;
-		exit(EXIT_FAILURE);
-	}
 	// Remove and destruct the object for this client.
-	success = client_objects.erase(username);
-	// Were done writing now, unlock the write lock.
-	if (pthread_rwlock_unlock(&client_objects_lock) != 0) {
-		std::cerr << "Unable to unlock the rwlock after writing."
-			  << std::endl;
-		exit(EXIT_FAILURE);
-	}
-	return success;
+	return client_objects.erase(username);
 }
@@ -12,19 +12,20 @@ a shared header for transit.
 ----------------------------------------------------------------------*/
 
 #pragma once
-#include <pthread.h>
-#include <unordered_map>
-
 #include "MessagingClient.hpp"
+#include "ClientRegistry.hpp"
+#include "FanOutPool.hpp"
 
 class SharedClients {
 	// client_objects map accessable from all client threads
 	// Thread safe access from the functions implemented in this file
-	// using posix rw_locks.
-	pthread_rwlock_t client_objects_lock;
-	std::unordered_map<std::string, MessagingClient> client_objects;
+	// using a posix rw_lock per shard of the map.
+	ClientRegistry<MessagingClient> client_objects;
+	// Workers that share the queueing of broadcasts to large rooms.
+	// Never freed; its detached workers wait on it until the server
+	// exits (destroying it from exit() would hang on them).
+	FanOutPool *fan_out;
 	SharedClients(void);
-	~SharedClients(void);
 
     public:
 	// Do not allow assignment operations, and copy construction
@@ -34,25 +35,39 @@ class SharedClients {
 	static SharedClients &get_instance(void);
 	// Send a message to another client by username
 	// return false if we weren't able to send it to the recipient
-	// (if they don't exist.)
-	bool send_to_client(const std::string &dest_username,
-			    const std::vector<uint8_t> &message);
+	// (if they don't exist, or their outbound queue is full.)
+	// The message is only queued, the client's writer sends it.
+	bool send_to_client(const NameView &dest_username,
+			    const Frame &message);
+	// Same again, for a message that may need encoding in the header
+	// version the recipient uses. If depth is passed, it is set to the
+	// frames waiting for the recipient once the message is queued.
+	bool send_to_client(const NameView &dest_username,
+			    VersionedFrame &message, size_t *depth = nullptr);
 	// Send a message to all connected clients except for ourselves.
 	// Using the passed username field to omit ourselves.
-	// (return false if we weren't able to send the message to one
+	// (return false if we weren't able to queue the message for one
 	// of the clients.)
-	bool send_to_all(const std::string &sender_username,
-			 const std::vector<uint8_t> &message);
+	// Clients using the same header version share the one frame. In large
+	// rooms the queueing is split over the fan out worker threads.
+	// If deepest is passed, it is set to the most frames waiting for any
+	// client the message was queued for.
+	bool send_to_all(const NameView &sender_username,
+			 VersionedFrame &message, size_t *deepest = nullptr);
+	// Start worker_count threads to help send_to_all with large rooms.
+	void start_fan_out(size_t worker_count);
 	// Get CSV list of logged in users from the client_objects
 	// hash map.
 	std::string get_logged_in_users(void);
 	// Add a logged in user to the client_objects map,
 	// and return a pointer to the newly created MessagingClient
-	// object.
+	// object. Frames for the user are written by writer (nullptr for
+	// a writer thread of their own), starting with login_response.
 	MessagingClient *add_new_user(const std::string &username,
 				      int client_socket,
 				      int login_packet_number,
-				      MessageLayer &&ml);
+				      MessageLayer &&ml, QueueWriter *writer,
+				      const Frame &login_response);
 	// Log out a user from the server
-	bool log_out_user(const std::string &username);
+	bool log_out_user(const NameView &username);
 };
@@ -0,0 +1,520 @@
+/*======================================================================
+COIS-4310H - UringReactor
+Name: UringReactor.cpp
+Purpose: io_uring alternative to the EpollReactor. Each reactor thread
+	owns an io_uring instance with one registered (fixed) buffer,
+	carved into receive slots for its client sockets. Socket reads are
+	kept queued on the ring, and completions from many clients are
+	reaped per system call. The thread is also the writer of its
+	clients' outbound queues; each queue with frames waiting is written
+	with a single writev submitted alongside everything else, so a
+	broadcast to N users costs one io_uring_enter instead of N send()s.
+
+	Only reads use the registered buffer; sends are unregistered. The
+	frames waiting in a queue are in BufferPool buffers, which aren't
+	registered with the ring, and are written straight from there with
+	IORING_OP_WRITEV rather than copied into a fixed buffer for
+	WRITE_FIXED.
+
+	liburing isn't required, the ring is driven through the raw system
+	calls and the kernel's shared memory layout in linux/io_uring.h.
+
+Compilation: Please use the provided Make file that will make both the
+	client and the server.
+
+Requires the shared MessageLayer Class that is used in to create
+a shared header for transit.
+----------------------------------------------------------------------*/
+
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <unordered_map>
+#include <cerrno>
+#include <cstring>
+extern "C" {
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+}
+#include "Server.hpp"
+#include "Connection.hpp"
+#include "MessagingClient.hpp"
+#include "UringReactor.hpp"
+
+// Submission queue entries per ring. Writing out more queues than this
+// in one go takes more than one submission.
+static const unsigned constexpr ring_entries = 4096;
+// Number and size of the fixed receive slots of each ring. Connections
+// beyond this read into their own (unregistered) buffer.
+static const size_t constexpr receive_slots = 1024;
+static const size_t constexpr receive_slot_size = 4096;
+
+// Tags held in the low bits of each submission's user_data.
+// Reads carry a pointer to their Reader (low bits clear), and writes
+// a pointer to their Reader tagged with tag_write.
+static const uint64_t constexpr tag_mask = 3;
+static const uint64_t constexpr tag_wakeup = 1;
+static const uint64_t constexpr tag_write = 2;
+
+static int io_uring_setup(unsigned entries, io_uring_params *params)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int ring_fd, unsigned to_submit,
+			  unsigned min_complete, unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit,
+			    min_complete, flags, nullptr, 0);
+}
+
+static int io_uring_register(int ring_fd, unsigned opcode, void *arg,
+			     unsigned nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg,
+			    nr_args);
+}
+
+// A connection being read by a ring, and the buffer its reads land in.
+struct Reader {
+	Connection conn;
+	// Receive slot within the registered buffer, or no_slot if the
+	// connection reads into its own buffer.
+	static const size_t constexpr no_slot = (size_t)-1;
+	size_t slot;
+	std::vector<uint8_t> own_buffer;
+	// Whether a writev of the outbound queue is in flight, and whether
+	// the connection is done with (and is freed once it completes).
+	bool writing;
+	bool closing;
+
+	Reader(int client_socket, size_t slot, QueueWriter *writer)
+		: conn(client_socket, writer), slot(slot), writing(false),
+		  closing(false)
+	{
+		if (slot == no_slot)
+			own_buffer.resize(receive_slot_size);
+	}
+};
+
+// One io_uring instance, and the connections it reads from.
+struct UringReactor::Ring : public QueueWriter {
+	int ring_fd = -1;
+	// Submission queue, shared with the kernel
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	io_uring_sqe *sqes;
+	unsigned sq_entries;
+	// Submissions queued but not yet handed to the kernel
+	unsigned to_submit = 0;
+	// Completion queue, shared with the kernel
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	io_uring_cqe *cqes;
+	// The registered buffer, carved into receive slots.
+	uint8_t *buffers = nullptr;
+	size_t buffers_size = 0;
+	std::vector<size_t> free_slots;
+	// Connections owned by this ring, by socket
+	std::unordered_map<int, Reader *> readers;
+	// Sockets whose outbound queue has frames waiting, to be written
+	// in the next submission. Queued by this thread itself.
+	std::vector<int> woken;
+	// The accept loop hands over new connections through new_sockets,
+	// other threads hand over wake ups through remote_woken, and both
+	// wake the ring by writing to event_fd.
+	int event_fd = -1;
+	uint64_t event_count;
+	std::mutex handoff_lock;
+	std::vector<int> new_sockets;
+	std::vector<int> remote_woken;
+
+	// Create the ring, map its queues, and register its buffer.
+	// Returns false if the kernel isn't having any of it.
+	bool setup(void)
+	{
+		io_uring_params params;
+		std::memset(&params, 0, sizeof(params));
+		ring_fd = io_uring_setup(ring_entries, &params);
+		if (ring_fd < 0)
+			return false;
+		size_t sq_size = params.sq_off.array +
+				 params.sq_entries * sizeof(unsigned);
+		size_t cq_size = params.cq_off.cqes +
+				 params.cq_entries * sizeof(io_uring_cqe);
+		bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+		if (single_mmap)
+			sq_size = cq_size = std::max(sq_size, cq_size);
+		uint8_t *sq = (uint8_t *)mmap(nullptr, sq_size,
+					      PROT_READ | PROT_WRITE,
+					      MAP_SHARED | MAP_POPULATE,
+					      ring_fd, IORING_OFF_SQ_RING);
+		if (sq == MAP_FAILED)
+			return false;
+		uint8_t *cq = sq;
+		if (!single_mmap) {
+			cq = (uint8_t *)mmap(nullptr, cq_size,
+					     PROT_READ | PROT_WRITE,
+					     MAP_SHARED | MAP_POPULATE, ring_fd,
+					     IORING_OFF_CQ_RING);
+			if (cq == MAP_FAILED)
+				return false;
+		}
+		sqes = (io_uring_sqe *)mmap(
+			nullptr, params.sq_entries * sizeof(io_uring_sqe),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring_fd, IORING_OFF_SQES);
+		if (sqes == MAP_FAILED)
+			return false;
+		sq_head = (unsigned *)(sq + params.sq_off.head);
+		sq_tail = (unsigned *)(sq + params.sq_off.tail);
+		sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+		sq_array = (unsigned *)(sq + params.sq_off.array);
+		sq_entries = params.sq_entries;
+		cq_head = (unsigned *)(cq + params.cq_off.head);
+		cq_tail = (unsigned *)(cq + params.cq_off.tail);
+		cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+		cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+		// One registered buffer holds every receive slot, so all of
+		// them can be used with READ_FIXED.
+		buffers_size = receive_slots * receive_slot_size;
+		buffers = (uint8_t *)mmap(nullptr, buffers_size,
+					  PROT_READ | PROT_WRITE,
+					  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (buffers == MAP_FAILED) {
+			buffers = nullptr;
+			return false;
+		}
+		iovec registered = { .iov_base = buffers,
+				     .iov_len = buffers_size };
+		if (io_uring_register(ring_fd, IORING_REGISTER_BUFFERS,
+				      &registered, 1) < 0)
+			return false;
+		for (size_t slot = receive_slots; slot > 0; --slot)
+			free_slots.push_back(slot - 1);
+		event_fd = eventfd(0, EFD_CLOEXEC);
+		return event_fd >= 0;
+	}
+
+	// Release everything setup() managed to acquire.
+	// (Only used when setup fails; running rings live as long as the
+	// server.)
+	void teardown(void)
+	{
+		if (buffers != nullptr)
+			munmap(buffers, buffers_size);
+		if (ring_fd >= 0)
+			close(ring_fd);
+		if (event_fd >= 0)
+			close(event_fd);
+	}
+
+	// Claim the next submission queue entry, handing what we have to
+	// the kernel first if the queue is full.
+	io_uring_sqe *get_sqe(void)
+	{
+		unsigned tail = *sq_tail;
+		while (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >=
+		       sq_entries)
+			submit(0);
+		unsigned index = tail & *sq_mask;
+		io_uring_sqe *sqe = &sqes[index];
+		std::memset(sqe, 0, sizeof(*sqe));
+		sq_array[index] = index;
+		__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+		++to_submit;
+		return sqe;
+	}
+
+	// Hand every queued submission to the kernel, and wait for at least
+	// wait_for completions.
+	void submit(unsigned wait_for)
+	{
+		while (true) {
+			++io_stats.syscalls;
+			int submitted = io_uring_enter(
+				ring_fd, to_submit, wait_for,
+				wait_for > 0 ? IORING_ENTER_GETEVENTS : 0);
+			if (submitted >= 0) {
+				to_submit -= submitted;
+				return;
+			}
+			// Interrupted, or the completion queue needs reaping
+			// before the kernel takes any more.
+			if (errno == EINTR || errno == EBUSY || errno == EAGAIN)
+				return;
+			std::cerr << "Error entering io_uring: "
+				  << std::strerror(errno) << std::endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// Pop the next completion, if there is one.
+	bool next_cqe(io_uring_cqe &cqe)
+	{
+		unsigned head = *cq_head;
+		if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+			return false;
+		cqe = cqes[head & *cq_mask];
+		__atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+		return true;
+	}
+
+	// Queue a read of whatever the reader's socket has next.
+	void queue_read(Reader *reader)
+	{
+		io_uring_sqe *sqe = get_sqe();
+		sqe->fd = reader->conn.client_socket;
+		sqe->user_data = (uint64_t)reader;
+		if (reader->slot == Reader::no_slot) {
+			sqe->opcode = IORING_OP_READ;
+			sqe->addr = (uint64_t)reader->own_buffer.data();
+		} else {
+			sqe->opcode = IORING_OP_READ_FIXED;
+			sqe->addr = (uint64_t)(buffers + reader->slot *
+							 receive_slot_size);
+			sqe->buf_index = 0;
+		}
+		sqe->len = receive_slot_size;
+	}
+
+	// Queue a writev of whatever is waiting in the reader's outbound
+	// queue, if anything is.
+	void queue_write(Reader *reader)
+	{
+		MessagingClient *client = reader->conn.get_client();
+		if (client == nullptr)
+			return;
+		OutboundQueue &outbound = client->get_outbound_queue();
+		size_t count = outbound.gather();
+		reader->writing = (count > 0);
+		if (count == 0)
+			return;
+		// The iovecs stay put until we gather again, once this
+		// write has completed.
+		io_uring_sqe *sqe = get_sqe();
+		sqe->opcode = IORING_OP_WRITEV;
+		sqe->fd = reader->conn.client_socket;
+		sqe->addr = (uint64_t)outbound.gathered();
+		sqe->len = count;
+		sqe->user_data = (uint64_t)reader | tag_write;
+	}
+
+	// Queue a read of the eventfd, completing when the accept loop
+	// hands us new connections.
+	void queue_wakeup(void)
+	{
+		io_uring_sqe *sqe = get_sqe();
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = event_fd;
+		sqe->addr = (uint64_t)&event_count;
+		sqe->len = sizeof(event_count);
+		sqe->user_data = tag_wakeup;
+	}
+
+	// The client's outbound queue has frames waiting; write them out
+	// in the next submission. (Called under the SharedClients rwlock,
+	// so the client can't be logged out from under us.)
+	void wake(MessagingClient *client) override
+	{
+		int client_socket = client->get_client_socket();
+		if (current_ring == this) {
+			woken.push_back(client_socket);
+			return;
+		}
+		bool was_empty;
+		{
+			std::lock_guard<std::mutex> lock(handoff_lock);
+			was_empty = remote_woken.empty();
+			remote_woken.push_back(client_socket);
+		}
+		// Already woken for the sockets queued before this one.
+		if (was_empty)
+			notify();
+	}
+
+	// Let the ring know it has something handed over to it.
+	void notify(void)
+	{
+		uint64_t one = 1;
+		if (write(event_fd, &one, sizeof(one)) != sizeof(one)) {
+			std::cerr << "Unable to wake an io_uring reactor thread."
+				  << std::endl;
+		}
+	}
+
+	// Take on the connections and wake ups handed over by other threads.
+	void take_handoffs(void)
+	{
+		std::vector<int> sockets;
+		{
+			std::lock_guard<std::mutex> lock(handoff_lock);
+			sockets.swap(new_sockets);
+			woken.insert(woken.end(), remote_woken.begin(),
+				     remote_woken.end());
+			remote_woken.clear();
+		}
+		for (int client_socket : sockets) {
+			size_t slot = Reader::no_slot;
+			if (!free_slots.empty()) {
+				slot = free_slots.back();
+				free_slots.pop_back();
+			}
+			Reader *reader = new Reader(client_socket, slot, this);
+			readers[client_socket] = reader;
+			queue_read(reader);
+		}
+		queue_wakeup();
+	}
+
+	// Queue writes of the outbound queues of every woken socket that
+	// doesn't already have one in flight.
+	void write_woken(void)
+	{
+		for (int client_socket : woken) {
+			auto reader_it = readers.find(client_socket);
+			// Closed since it was woken
+			if (reader_it == readers.end())
+				continue;
+			Reader *reader = reader_it->second;
+			if (!reader->writing && !reader->closing)
+				queue_write(reader);
+		}
+		woken.clear();
+	}
+
+	// Handle the completion of a read (or the connection failing).
+	void on_read(Reader *reader, int result)
+	{
+		bool keep = true;
+		if (result == -EINTR || result == -EAGAIN) {
+			keep = true;
+		} else if (result <= 0) {
+			// The client hung up on us, or the socket has an error.
+			keep = false;
+		} else {
+			uint8_t *data = reader->slot == Reader::no_slot ?
+						reader->own_buffer.data() :
+						buffers + reader->slot *
+								  receive_slot_size;
+			keep = reader->conn.receive(data, result);
+		}
+		if (keep && !reader->closing) {
+			queue_read(reader);
+			return;
+		}
+		reader->closing = true;
+		// Wait for the write in flight before letting go of the
+		// queue it is writing from.
+		if (!reader->writing)
+			close_reader(reader);
+	}
+
+	// Handle the completion of a write of the outbound queue.
+	void on_write(Reader *reader, int result)
+	{
+		reader->writing = false;
+		if (reader->closing) {
+			close_reader(reader);
+			return;
+		}
+		if (result < 0 && result != -EINTR && result != -EAGAIN) {
+			std::cerr << "Unable to send a message to a client socket."
+				  << std::endl;
+			// Ends the read in flight, which closes the connection.
+			reader->closing = true;
+			shutdown(reader->conn.client_socket, SHUT_RDWR);
+			return;
+		}
+		MessagingClient *client = reader->conn.get_client();
+		if (result > 0)
+			client->get_outbound_queue().consume(result);
+		// Keep going until the queue is drained.
+		queue_write(reader);
+	}
+
+	// Log the client out (if they got that far), and close the socket.
+	void close_reader(Reader *reader)
+	{
+		readers.erase(reader->conn.client_socket);
+		if (reader->slot != Reader::no_slot)
+			free_slots.push_back(reader->slot);
+		delete reader;
+	}
+};
+
+// The ring owned by the calling reactor thread (if it is one)
+thread_local UringReactor::Ring *UringReactor::current_ring = nullptr;
+
+UringReactor::UringReactor(void) : next_ring(0)
+{
+}
+
+// Set up thread_count io_uring instances, and start a reactor thread
+// for each. Returns nullptr if the kernel doesn't support io_uring
+// (or the fixed buffers), so the caller can fall back to epoll.
+UringReactor *UringReactor::create(size_t thread_count)
+{
+	UringReactor *reactor = new UringReactor();
+	for (size_t i = 0; i < thread_count; ++i) {
+		Ring *ring = new Ring();
+		if (!ring->setup()) {
+			std::cerr << "Unable to set up io_uring: "
+				  << std::strerror(errno) << std::endl;
+			ring->teardown();
+			delete ring;
+			for (Ring *set_up : reactor->rings) {
+				set_up->teardown();
+				delete set_up;
+			}
+			delete reactor;
+			return nullptr;
+		}
+		reactor->rings.push_back(ring);
+	}
+	// The reactor threads live for as long as the server does.
+	for (Ring *ring : reactor->rings)
+		std::thread(&UringReactor::run, ring).detach();
+	return reactor;
+}
+
+// Hand a freshly accepted (blocking) client socket to one of the
+// reactor threads. Returns false if it couldn't be handed off.
+bool UringReactor::add_connection(int client_socket)
+{
+	Ring *ring = rings[next_ring++ % rings.size()];
+	{
+		std::lock_guard<std::mutex> lock(ring->handoff_lock);
+		ring->new_sockets.push_back(client_socket);
+	}
+	ring->notify();
+	return true;
+}
+
+// Event loop run by each reactor thread.
+void UringReactor::run(Ring *ring)
+{
+	current_ring = ring;
+	ring->queue_wakeup();
+	io_uring_cqe cqe;
+	while (true) {
+		// Submit whatever the last round queued up, and wait for
+		// something to happen.
+		ring->submit(1);
+		while (ring->next_cqe(cqe)) {
+			uint64_t tag = cqe.user_data & tag_mask;
+			Reader *reader = (Reader *)(cqe.user_data & ~tag_mask);
+			if (cqe.user_data == tag_wakeup)
+				ring->take_handoffs();
+			else if (tag == tag_write)
+				ring->on_write(reader, cqe.res);
+			else
+				ring->on_read(reader, cqe.res);
+		}
+		// Write out everything queued while handling the completions.
+		ring->write_woken();
+	}
+}
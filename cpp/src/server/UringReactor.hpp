@@ -0,0 +1,56 @@
+/*======================================================================
+COIS-4310H - UringReactor Header
+Name: UringReactor.hpp
+Purpose: io_uring alternative to the EpollReactor. Each reactor thread
+	owns an io_uring instance with one registered (fixed) buffer,
+	carved into receive slots for its client sockets. Socket reads are
+	kept queued on the ring, and completions from many clients are
+	reaped per system call. The thread is also the writer of its
+	clients' outbound queues; each queue with frames waiting is written
+	with a single writev submitted alongside everything else, so a
+	broadcast to N users costs one io_uring_enter instead of N send()s.
+
+	Only reads use the registered buffer; sends are unregistered. The
+	frames waiting in a queue are in BufferPool buffers, which aren't
+	registered with the ring, and are written straight from there with
+	IORING_OP_WRITEV rather than copied into a fixed buffer for
+	WRITE_FIXED.
+
+Compilation: Please use the provided Make file that will make both the
+	client and the server.
+
+Requires the shared MessageLayer Class that is used in to create
+a shared header for transit.
+----------------------------------------------------------------------*/
+
+#pragma once
+#include <atomic>
+#include <vector>
+#include <cstddef>
+
+class UringReactor {
+	// One io_uring instance, and the connections it reads from.
+	// Only ever touched by the reactor thread that owns it (apart from
+	// the hand off of new connections, and outbound queue wake ups).
+	struct Ring;
+	std::vector<Ring *> rings;
+	// The ring owned by the calling reactor thread (if it is one)
+	static thread_local Ring *current_ring;
+	// Round robin counter for spreading new connections over the threads.
+	std::atomic<size_t> next_ring;
+	UringReactor(void);
+	// Event loop run by each reactor thread.
+	static void run(Ring *ring);
+
+    public:
+	// Set up thread_count io_uring instances, and start a reactor thread
+	// for each. Returns nullptr if the kernel doesn't support io_uring
+	// (or the fixed buffers), so the caller can fall back to epoll.
+	static UringReactor *create(size_t thread_count);
+	// Do not allow assignment operations, and copy construction
+	UringReactor(UringReactor const &) = delete;
+	void operator=(UringReactor const &) = delete;
+	// Hand a freshly accepted (blocking) client socket to one of the
+	// reactor threads. Returns false if it couldn't be handed off.
+	bool add_connection(int client_socket);
+};
@@ -0,0 +1,345 @@
+/*======================================================================
+COIS-4310H - BufferPool
+Name: BufferPool.cpp
+Purpose: Size classed pool of the buffers that frames are built and
+	received in (powers of two, 64 bytes up to 128 KiB, enough for the
+	largest frame). Each thread keeps a cache of free buffers of each
+	class, so most buffers are handed out and taken back without a lock
+	or a trip to malloc. Buffers are often freed by a different thread
+	than took them (a frame is built by the sender's thread, and let go
+	by the recipient's writer), so a thread with too many of a class
+	passes half of them on to a shared depot, where a thread that has
+	run out picks them up again.
+
+	Optionally the buffers are carved out of 2 MiB huge pages (see
+	use_huge_pages), cutting TLB misses when many large buffers are in
+	play. Memory taken for huge pages is kept by the pool for reuse, and
+	never given back.
+
+Compilation: Please use the provided Make file that will make both the
+	client and the server.
+----------------------------------------------------------------------*/
+
+#include <atomic>
+#include <mutex>
+#include <new>
+extern "C" {
+#include <sys/mman.h>
+}
+#include "BufferPool.hpp"
+
+// Number of size classes, 64 bytes to 128 KiB
+static const size_t constexpr class_count = 12;
+// Size of a huge page, and so of each chunk of the huge page arena
+static const size_t constexpr huge_page_size = 2 * 1024 * 1024;
+// Free buffers a thread keeps of each class (at least 8, or up to 64 KiB
+// worth), and the depot of each class keeps (at least 64, or up to 8 MiB
+// worth, unless huge page backed).
+static const size_t constexpr cache_bytes = 64 * 1024;
+static const size_t constexpr depot_bytes = 8 * 1024 * 1024;
+// Requests a thread counts up before adding them to the totals
+static const size_t constexpr stats_batch = 256;
+
+// A free buffer, linked to the next free one of its class
+struct FreeBuffer {
+	FreeBuffer *next;
+};
+
+// Free buffers passed between threads, one depot per class
+struct Depot {
+	std::mutex lock;
+	FreeBuffer *head;
+	size_t count;
+};
+static Depot depots[class_count];
+
+static std::atomic<uint64_t> total_requests(0);
+static std::atomic<uint64_t> total_hits(0);
+static std::atomic<uint64_t> held_bytes(0);
+static std::atomic<uint64_t> peak_held_bytes(0);
+
+// Huge page arena; the chunk buffers are being carved from
+static bool huge_pages = false;
+static std::mutex arena_lock;
+static uint8_t *arena_next = nullptr;
+static size_t arena_left = 0;
+
+// Size class of a buffer of size bytes (no more than max_class_size)
+static size_t class_index(size_t size)
+{
+	if (size <= BufferPool::min_class_size)
+		return 0;
+	// Round up to a power of two, 64 (2^6) being class 0.
+	return (64 - __builtin_clzll(size - 1)) - 6;
+}
+
+static size_t index_size(size_t index)
+{
+	return BufferPool::min_class_size << index;
+}
+
+static size_t cache_limit(size_t index)
+{
+	size_t limit = cache_bytes / index_size(index);
+	return limit < 8 ? 8 : limit;
+}
+
+static size_t depot_limit(size_t index)
+{
+	size_t limit = depot_bytes / index_size(index);
+	return limit < 64 ? 64 : limit;
+}
+
+// Count bytes taken by the pool, and keep track of the most it has had.
+static void add_held(uint64_t bytes)
+{
+	uint64_t held = held_bytes.fetch_add(bytes) + bytes;
+	uint64_t peak = peak_held_bytes.load();
+	while (held > peak && !peak_held_bytes.compare_exchange_weak(peak, held))
+		;
+}
+
+// Map a 2 MiB chunk for the arena. Returns nullptr if there are no huge
+// pages to be had; a chunk of normal pages is then mapped on a huge page
+// boundary, for the kernel to back with transparent huge pages.
+static uint8_t *map_chunk(bool &huge)
+{
+	huge = true;
+	void *chunk = mmap(nullptr, huge_page_size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (chunk != MAP_FAILED)
+		return (uint8_t *)chunk;
+	huge = false;
+	// Twice the size, so there's a whole aligned chunk within it
+	chunk = mmap(nullptr, 2 * huge_page_size, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (chunk == MAP_FAILED)
+		throw std::bad_alloc();
+	uintptr_t start = (uintptr_t)chunk;
+	uintptr_t aligned =
+		(start + huge_page_size - 1) & ~(uintptr_t)(huge_page_size - 1);
+	if (aligned > start)
+		munmap(chunk, aligned - start);
+	if (aligned + huge_page_size < start + 2 * huge_page_size)
+		munmap((void *)(aligned + huge_page_size),
+		       start + huge_page_size - aligned);
+	madvise((void *)aligned, huge_page_size, MADV_HUGEPAGE);
+	return (uint8_t *)aligned;
+}
+
+// Take a new buffer of the class from the arena or the heap.
+static void *backing_allocate(size_t index)
+{
+	size_t size = index_size(index);
+	if (!huge_pages) {
+		add_held(size);
+		return ::operator new(size);
+	}
+	std::lock_guard<std::mutex> lock(arena_lock);
+	if (arena_left < size) {
+		// The rest of the chunk is left unused
+		bool huge;
+		arena_next = map_chunk(huge);
+		arena_left = huge_page_size;
+		add_held(huge_page_size);
+	}
+	void *buffer = arena_next;
+	arena_next += size;
+	arena_left -= size;
+	return buffer;
+}
+
+// Add the count buffers linked from head (up to tail) to the class's
+// depot. Heap buffers beyond what the depot keeps are freed.
+static void depot_put(size_t index, FreeBuffer *head, FreeBuffer *tail,
+		      size_t count)
+{
+	Depot &depot = depots[index];
+	FreeBuffer *excess = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(depot.lock);
+		tail->next = depot.head;
+		depot.head = head;
+		depot.count += count;
+		while (!huge_pages && depot.count > depot_limit(index)) {
+			FreeBuffer *buffer = depot.head;
+			depot.head = buffer->next;
+			--depot.count;
+			buffer->next = excess;
+			excess = buffer;
+		}
+	}
+	while (excess != nullptr) {
+		FreeBuffer *buffer = excess;
+		excess = buffer->next;
+		::operator delete(buffer);
+		held_bytes -= index_size(index);
+	}
+}
+
+// Take up to count buffers of the class from its depot. Returns the
+// first, linked to the rest, and sets taken.
+static FreeBuffer *depot_take(size_t index, size_t count, size_t &taken)
+{
+	Depot &depot = depots[index];
+	std::lock_guard<std::mutex> lock(depot.lock);
+	FreeBuffer *head = depot.head;
+	FreeBuffer *tail = nullptr;
+	taken = 0;
+	for (FreeBuffer *buffer = head; buffer != nullptr && taken < count;
+	     buffer = buffer->next) {
+		tail = buffer;
+		++taken;
+	}
+	if (tail == nullptr)
+		return nullptr;
+	depot.head = tail->next;
+	depot.count -= taken;
+	tail->next = nullptr;
+	return head;
+}
+
+// Set once a thread's cache has been destroyed at thread exit; buffers
+// let go after that go straight to the depot.
+static thread_local bool cache_gone = false;
+
+// A thread's free buffers of each class
+struct ThreadCache {
+	FreeBuffer *heads[class_count];
+	size_t counts[class_count];
+	// Requests and hits not yet added to the totals
+	uint64_t requests;
+	uint64_t hits;
+	ThreadCache(void) : requests(0), hits(0)
+	{
+		for (size_t i = 0; i < class_count; ++i) {
+			heads[i] = nullptr;
+			counts[i] = 0;
+		}
+	}
+	// Hand every free buffer on for other threads to use.
+	~ThreadCache(void)
+	{
+		flush_stats();
+		for (size_t i = 0; i < class_count; ++i)
+			spill(i, counts[i]);
+		cache_gone = true;
+	}
+	void flush_stats(void)
+	{
+		total_requests += requests;
+		total_hits += hits;
+		requests = hits = 0;
+	}
+	// Pass count of the free buffers of the class to the depot.
+	void spill(size_t index, size_t count)
+	{
+		if (count == 0)
+			return;
+		FreeBuffer *head = heads[index];
+		FreeBuffer *tail = head;
+		for (size_t i = 1; i < count; ++i)
+			tail = tail->next;
+		heads[index] = tail->next;
+		counts[index] -= count;
+		depot_put(index, head, tail, count);
+	}
+};
+static thread_local ThreadCache cache;
+
+// A buffer of at least size bytes
+void *BufferPool::allocate(size_t size)
+{
+	if (size > max_class_size) {
+		// Not pooled
+		add_held(size);
+		return ::operator new(size);
+	}
+	size_t index = class_index(size);
+	if (cache_gone)
+		return backing_allocate(index);
+	ThreadCache &local = cache;
+	if (++local.requests == stats_batch)
+		local.flush_stats();
+	if (local.heads[index] == nullptr) {
+		// Restock from buffers let go by other threads
+		local.heads[index] = depot_take(index, cache_limit(index) / 2,
+						local.counts[index]);
+		if (local.heads[index] == nullptr)
+			return backing_allocate(index);
+	}
+	++local.hits;
+	FreeBuffer *buffer = local.heads[index];
+	local.heads[index] = buffer->next;
+	--local.counts[index];
+	return buffer;
+}
+
+// Give back a buffer from allocate, of the size asked for.
+void BufferPool::release(void *buffer, size_t size)
+{
+	if (buffer == nullptr)
+		return;
+	if (size > max_class_size) {
+		::operator delete(buffer);
+		held_bytes -= size;
+		return;
+	}
+	size_t index = class_index(size);
+	FreeBuffer *free_buffer = (FreeBuffer *)buffer;
+	if (cache_gone) {
+		depot_put(index, free_buffer, free_buffer, 1);
+		return;
+	}
+	ThreadCache &local = cache;
+	free_buffer->next = local.heads[index];
+	local.heads[index] = free_buffer;
+	// Too many, let other threads have half of them.
+	if (++local.counts[index] > cache_limit(index))
+		local.spill(index, local.counts[index] / 2);
+}
+
+// Bytes actually set aside for a buffer of size bytes (the size of its
+// class), all of which may be used.
+size_t BufferPool::class_size(size_t size)
+{
+	return size > max_class_size ? size : index_size(class_index(size));
+}
+
+// Gives a buffer back to the pool, for shared_ptr
+struct BufferReleaser {
+	size_t size;
+	void operator()(uint8_t *buffer) const
+	{
+		BufferPool::release(buffer, size);
+	}
+};
+
+// A buffer of size bytes, given back to the pool when the last pointer
+// to it goes. The reference count comes from the pool too.
+std::shared_ptr<uint8_t> BufferPool::make_shared(size_t size)
+{
+	return std::shared_ptr<uint8_t>((uint8_t *)allocate(size),
+					BufferReleaser{ size },
+					PoolAllocator<uint8_t>());
+}
+
+// Carve buffers out of 2 MiB huge pages from now on. Must be called
+// before the first buffer is taken. Returns false if the kernel has no
+// huge pages to give (transparent huge pages are asked for instead).
+bool BufferPool::use_huge_pages(void)
+{
+	std::lock_guard<std::mutex> lock(arena_lock);
+	bool huge;
+	arena_next = map_chunk(huge);
+	arena_left = huge_page_size;
+	add_held(huge_page_size);
+	huge_pages = true;
+	return huge;
+}
+
+BufferPoolStats BufferPool::stats(void)
+{
+	return { total_requests.load(), total_hits.load(), held_bytes.load(),
+		 peak_held_bytes.load() };
+}
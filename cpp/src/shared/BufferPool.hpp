@@ -0,0 +1,100 @@
+/*======================================================================
+COIS-4310H - BufferPool
+Name: BufferPool.hpp
+Purpose: Size classed pool of the buffers that frames are built and
+	received in (powers of two, 64 bytes up to 128 KiB, enough for the
+	largest frame). Each thread keeps a cache of free buffers of each
+	class, so most buffers are handed out and taken back without a lock
+	or a trip to malloc. Buffers are often freed by a different thread
+	than took them (a frame is built by the sender's thread, and let go
+	by the recipient's writer), so a thread with too many of a class
+	passes half of them on to a shared depot, where a thread that has
+	run out picks them up again.
+
+	Optionally the buffers are carved out of 2 MiB huge pages (see
+	use_huge_pages), cutting TLB misses when many large buffers are in
+	play. Memory taken for huge pages is kept by the pool for reuse, and
+	never given back.
+
+Compilation: Please use the provided Make file that will make both the
+	client and the server.
+----------------------------------------------------------------------*/
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Counters of the pool, summed over every thread (requests and hits are
+// gathered from each thread's cache every so often, so are a little
+// behind).
+struct BufferPoolStats {
+	// Buffers asked for, and how many of those were already in the pool
+	uint64_t requests;
+	uint64_t hits;
+	// Memory the pool has taken (buffers in use or free in the pool),
+	// and the most it has had at once.
+	uint64_t held_bytes;
+	uint64_t peak_held_bytes;
+};
+
+class BufferPool {
+    public:
+	// Smallest and largest size classes. Larger buffers are not pooled.
+	static const size_t constexpr min_class_size = 64;
+	static const size_t constexpr max_class_size = 128 * 1024;
+	// A buffer of at least size bytes
+	static void *allocate(size_t size);
+	// Give back a buffer from allocate, of the size asked for.
+	static void release(void *buffer, size_t size);
+	// Bytes actually set aside for a buffer of size bytes (the size of
+	// its class), all of which may be used.
+	static size_t class_size(size_t size);
+	// A buffer of size bytes, given back to the pool when the last
+	// pointer to it goes. The reference count comes from the pool too.
+	static std::shared_ptr<uint8_t> make_shared(size_t size);
+	// Carve buffers out of 2 MiB huge pages from now on. Must be called
+	// before the first buffer is taken. Returns false if the kernel has
+	// no huge pages to give (transparent huge pages are asked for
+	// instead).
+	static bool use_huge_pages(void);
+	static BufferPoolStats stats(void);
+};
+
+// Standard allocator handing out buffers from the BufferPool, for the
+// containers and reference counts that frames live in.
+template <typename T>
+struct PoolAllocator {
+	using value_type = T;
+	PoolAllocator(void)
+	{
+	}
+	template <typename U>
+	PoolAllocator(const PoolAllocator<U> &)
+	{
+	}
+	T *allocate(size_t count)
+	{
+		return (T *)BufferPool::allocate(count * sizeof(T));
+	}
+	void deallocate(T *memory, size_t count)
+	{
+		BufferPool::release(memory, count * sizeof(T));
+	}
+};
+
+template <typename T, typename U>
+bool operator==(const PoolAllocator<T> &, const PoolAllocator<U> &)
+{
+	return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const PoolAllocator<T> &, const PoolAllocator<U> &)
+{
+	return false;
+}
+
+// Bytes (e.g. a whole message) in a pooled buffer
+using PooledBytes = std::vector<uint8_t, PoolAllocator<uint8_t> >;
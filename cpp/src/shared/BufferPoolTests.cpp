@@ -0,0 +1,75 @@
+/*======================================================================
+COIS-4310H - BufferPoolTests
+Name: BufferPoolTests.cpp
+Purpose: Test that the BufferPool hands buffers back out once they are
+	let go, whichever thread lets them go, that buffers are big enough
+	and don't overlap, and that its counters add up.
+
+Usage: ./BufferPoolTests
+	(No output means the tests passed)
+	if there are assertion errors, the tests failed.
+
+Description of Parameters
+	None
+
+Creation: Please use the provided Make file that will make both the
+	client and the server.
+----------------------------------------------------------------------*/
+
+#include <cassert>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include "BufferPool.hpp"
+
+int main(void)
+{
+	// Sizes round up to their class
+	assert(BufferPool::class_size(1) == 64);
+	assert(BufferPool::class_size(64) == 64);
+	assert(BufferPool::class_size(65) == 128);
+	assert(BufferPool::class_size(166 + 65535) == 128 * 1024);
+	assert(BufferPool::class_size(200000) == 200000);
+	// A buffer let go is the next one handed out of its class
+	void *first = BufferPool::allocate(300);
+	BufferPool::release(first, 300);
+	assert(BufferPool::allocate(500) == first);
+	BufferPool::release(first, 500);
+	// Buffers of every size are whole, and apart from each other
+	std::vector<std::pair<uint8_t *, size_t> > buffers;
+	for (size_t size = 1; size <= 300000; size = size * 3 + 1) {
+		uint8_t *buffer = (uint8_t *)BufferPool::allocate(size);
+		std::memset(buffer, (int)buffers.size(), size);
+		buffers.push_back(std::make_pair(buffer, size));
+	}
+	for (size_t i = 0; i < buffers.size(); ++i) {
+		for (size_t j = 0; j < buffers[i].second; ++j)
+			assert(buffers[i].first[j] == (uint8_t)i);
+		BufferPool::release(buffers[i].first, buffers[i].second);
+	}
+	// Buffers let go by another thread (more than it keeps for itself)
+	// come back to this one.
+	std::vector<void *> taken;
+	for (size_t i = 0; i < 4000; ++i)
+		taken.push_back(BufferPool::allocate(1024));
+	std::thread([&] {
+		for (void *buffer : taken)
+			BufferPool::release(buffer, 1024);
+	}).join();
+	BufferPoolStats before = BufferPool::stats();
+	for (size_t i = 0; i < 4000; ++i)
+		taken[i] = BufferPool::allocate(1024);
+	for (void *buffer : taken)
+		BufferPool::release(buffer, 1024);
+	// Shared buffers go back to the pool with their reference counts
+	for (size_t i = 0; i < 10000; ++i)
+		*BufferPool::make_shared(i % 3000 + 1) = 1;
+	// This thread's counts are added to the totals every so often
+	for (size_t i = 0; i < 2048; ++i)
+		BufferPool::release(BufferPool::allocate(64), 64);
+	BufferPoolStats after = BufferPool::stats();
+	assert(after.requests > before.requests);
+	assert(after.hits - before.hits > 0.9 * (after.requests - before.requests));
+	assert(after.held_bytes <= after.peak_held_bytes);
+	assert(after.peak_held_bytes >= 4000 * 1024);
+}
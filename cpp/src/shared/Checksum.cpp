@@ -0,0 +1,358 @@
+/*======================================================================
+COIS-4310H - Checksum
+Name: Checksum.cpp
+Purpose: The integrity checksums a MessageLayer header can be built with;
+	SHA-256 (header versions up to 3), CRC32C (hardware accelerated with
+	SSE4.2 where the CPU allows) and xxHash3 (64 bit). The checksums
+	only catch corruption, message contents are authenticated by the
+	CryptoLayer, so the fast non cryptographic ones are just as good.
+
+	xxHash3 follows the reference implementation by Yann Collet
+	(https://github.com/Cyan4973/xxHash), for the default secret and
+	no seed, and produces the same values as XXH3_64bits().
+
+Compilation: Please use the provided Make file that will make both the
+	client and the server.
+----------------------------------------------------------------------*/
+
+#include <cstring>
+#include "Checksum.hpp"
+#include "Sha256.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CHECKSUM_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+// Reflected CRC32C (Castagnoli) polynomial
+static const uint32_t constexpr crc32c_polynomial = 0x82f63b78;
+
+// Byte at a time CRC32C table, for CPUs without the instruction
+struct Crc32cTable {
+	uint32_t entries[256];
+	Crc32cTable(void)
+	{
+		for (uint32_t i = 0; i < 256; ++i) {
+			uint32_t crc = i;
+			for (int bit = 0; bit < 8; ++bit)
+				crc = (crc >> 1) ^ (crc & 1 ? crc32c_polynomial : 0);
+			entries[i] = crc;
+		}
+	}
+};
+
+static uint32_t crc32c_portable(uint32_t crc, const uint8_t *data, size_t len)
+{
+	static const Crc32cTable table;
+	for (size_t i = 0; i < len; ++i)
+		crc = table.entries[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#ifdef CHECKSUM_X86
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_sse42(uint32_t crc, const uint8_t *data, size_t len)
+{
+#ifdef __x86_64__
+	uint64_t crc64 = crc;
+	for (; len >= 8; len -= 8, data += 8) {
+		uint64_t word;
+		std::memcpy(&word, data, 8);
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+	crc = (uint32_t)crc64;
+#endif
+	for (; len >= 4; len -= 4, data += 4) {
+		uint32_t word;
+		std::memcpy(&word, data, 4);
+		crc = _mm_crc32_u32(crc, word);
+	}
+	for (; len > 0; --len, ++data)
+		crc = _mm_crc32_u8(crc, *data);
+	return crc;
+}
+#endif
+
+// Whether the CRC32C instruction (SSE4.2) is used.
+bool Checksum::crc32c_accelerated(void)
+{
+#ifdef CHECKSUM_X86
+	// Only detected once (thread safe static initialization)
+	static const bool sse42 = [] {
+		unsigned eax, ebx, ecx, edx;
+		return __get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+		       (ecx & bit_SSE4_2);
+	}();
+	return sse42;
+#else
+	return false;
+#endif
+}
+
+// CRC32C (Castagnoli) of len bytes of data, continuing from crc.
+uint32_t Checksum::crc32c(const void *data, size_t len, uint32_t crc)
+{
+	const uint8_t *bytes = (const uint8_t *)data;
+#ifdef CHECKSUM_X86
+	if (crc32c_accelerated())
+		return ~crc32c_sse42(~crc, bytes, len);
+#endif
+	return ~crc32c_portable(~crc, bytes, len);
+}
+
+// The xxHash3 default secret
+alignas(64) static const uint8_t xxh3_secret[192] = {
+	0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c,
+	0xf7, 0x21, 0xad, 0x1c, 0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb,
+	0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f, 0xcb, 0x79, 0xe6, 0x4e,
+	0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+	0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6,
+	0x81, 0x3a, 0x26, 0x4c, 0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb,
+	0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3, 0x71, 0x64, 0x48, 0x97,
+	0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+	0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7,
+	0xc7, 0x0b, 0x4f, 0x1d, 0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31,
+	0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64, 0xea, 0xc5, 0xac, 0x83,
+	0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+	0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26,
+	0x29, 0xd4, 0x68, 0x9e, 0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc,
+	0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce, 0x45, 0xcb, 0x3a, 0x8f,
+	0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+static const uint64_t constexpr prime32_1 = 0x9E3779B1U;
+static const uint64_t constexpr prime32_2 = 0x85EBCA77U;
+static const uint64_t constexpr prime32_3 = 0xC2B2AE3DU;
+static const uint64_t constexpr prime64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t constexpr prime64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t constexpr prime64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t constexpr prime64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t constexpr prime64_5 = 0x27D4EB2F165667C5ULL;
+static const uint64_t constexpr prime_mx1 = 0x165667919E3779F9ULL;
+static const uint64_t constexpr prime_mx2 = 0x9FB21C651E98DF25ULL;
+
+static inline uint64_t read64(const uint8_t *p)
+{
+	uint64_t value;
+	std::memcpy(&value, p, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	value = __builtin_bswap64(value);
+#endif
+	return value;
+}
+
+static inline uint32_t read32(const uint8_t *p)
+{
+	uint32_t value;
+	std::memcpy(&value, p, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	value = __builtin_bswap32(value);
+#endif
+	return value;
+}
+
+static inline uint64_t rotl64(uint64_t x, int n)
+{
+	return (x << n) | (x >> (64 - n));
+}
+
+// 64x64 bit multiply, folding the 128 bit product down to 64 bits
+static inline uint64_t mul128_fold64(uint64_t a, uint64_t b)
+{
+	unsigned __int128 product = (unsigned __int128)a * b;
+	return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+static inline uint64_t xxh64_avalanche(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= prime64_2;
+	h ^= h >> 29;
+	h *= prime64_3;
+	return h ^ (h >> 32);
+}
+
+static inline uint64_t xxh3_avalanche(uint64_t h)
+{
+	h ^= h >> 37;
+	h *= prime_mx1;
+	return h ^ (h >> 32);
+}
+
+static inline uint64_t xxh3_rrmxmx(uint64_t h, uint64_t len)
+{
+	h ^= rotl64(h, 49) ^ rotl64(h, 24);
+	h *= prime_mx2;
+	h ^= (h >> 35) + len;
+	h *= prime_mx2;
+	return h ^ (h >> 28);
+}
+
+static inline uint64_t xxh3_mix16(const uint8_t *input, const uint8_t *secret)
+{
+	return mul128_fold64(read64(input) ^ read64(secret),
+			     read64(input + 8) ^ read64(secret + 8));
+}
+
+// Up to 16 bytes
+static uint64_t xxh3_0to16(const uint8_t *input, size_t len)
+{
+	const uint8_t *secret = xxh3_secret;
+	if (len > 8) {
+		uint64_t low = read64(input) ^
+			       (read64(secret + 24) ^ read64(secret + 32));
+		uint64_t high = read64(input + len - 8) ^
+				(read64(secret + 40) ^ read64(secret + 48));
+		return xxh3_avalanche(len + __builtin_bswap64(low) + high +
+				      mul128_fold64(low, high));
+	}
+	if (len >= 4) {
+		uint64_t input64 = read32(input + len - 4) +
+				   ((uint64_t)read32(input) << 32);
+		return xxh3_rrmxmx(input64 ^ (read64(secret + 8) ^
+					      read64(secret + 16)),
+				   len);
+	}
+	if (len > 0) {
+		uint32_t combined = ((uint32_t)input[0] << 16) |
+				    ((uint32_t)input[len >> 1] << 24) |
+				    (uint32_t)input[len - 1] |
+				    ((uint32_t)len << 8);
+		return xxh64_avalanche(combined ^ (uint64_t)(read32(secret) ^
+							     read32(secret + 4)));
+	}
+	return xxh64_avalanche(read64(secret + 56) ^ read64(secret + 64));
+}
+
+// 17 to 128 bytes
+static uint64_t xxh3_17to128(const uint8_t *input, size_t len)
+{
+	const uint8_t *secret = xxh3_secret;
+	uint64_t acc = len * prime64_1;
+	size_t rounds = (len - 1) / 32;
+	for (size_t i = 0; i <= rounds; ++i) {
+		acc += xxh3_mix16(input + 16 * i, secret + 32 * i);
+		acc += xxh3_mix16(input + len - 16 * (i + 1),
+				  secret + 32 * i + 16);
+	}
+	return xxh3_avalanche(acc);
+}
+
+// 129 to 240 bytes
+static uint64_t xxh3_129to240(const uint8_t *input, size_t len)
+{
+	const uint8_t *secret = xxh3_secret;
+	uint64_t acc = len * prime64_1;
+	for (size_t i = 0; i < 8; ++i)
+		acc += xxh3_mix16(input + 16 * i, secret + 16 * i);
+	acc = xxh3_avalanche(acc);
+	uint64_t acc_end = xxh3_mix16(input + len - 16, secret + 136 - 17);
+	for (size_t i = 8; i < len / 16; ++i)
+		acc_end += xxh3_mix16(input + 16 * i, secret + 16 * (i - 8) + 3);
+	return xxh3_avalanche(acc + acc_end);
+}
+
+// Mix one 64 byte stripe into the accumulators
+static inline void xxh3_accumulate(uint64_t acc[8], const uint8_t *stripe,
+				   const uint8_t *secret)
+{
+	for (size_t lane = 0; lane < 8; ++lane) {
+		uint64_t value = read64(stripe + lane * 8);
+		uint64_t key = value ^ read64(secret + lane * 8);
+		acc[lane ^ 1] += value;
+		acc[lane] += (key & 0xffffffff) * (key >> 32);
+	}
+}
+
+static inline void xxh3_scramble(uint64_t acc[8], const uint8_t *secret)
+{
+	for (size_t lane = 0; lane < 8; ++lane) {
+		uint64_t value = acc[lane];
+		value ^= value >> 47;
+		value ^= read64(secret + lane * 8);
+		acc[lane] = value * prime32_1;
+	}
+}
+
+// More than 240 bytes
+static uint64_t xxh3_long(const uint8_t *input, size_t len)
+{
+	const uint8_t *secret = xxh3_secret;
+	const size_t secret_size = sizeof(xxh3_secret);
+	const size_t stripes_per_block = (secret_size - 64) / 8;
+	const size_t block_len = 64 * stripes_per_block;
+	uint64_t acc[8] = { prime32_3, prime64_1, prime64_2, prime64_3,
+			    prime64_4, prime32_2, prime64_5, prime32_1 };
+	size_t blocks = (len - 1) / block_len;
+	for (size_t block = 0; block < blocks; ++block) {
+		for (size_t s = 0; s < stripes_per_block; ++s)
+			xxh3_accumulate(acc, input + block * block_len + s * 64,
+					secret + s * 8);
+		xxh3_scramble(acc, secret + secret_size - 64);
+	}
+	// The last partial block, and the last stripe (which may overlap it)
+	size_t stripes = ((len - 1) - block_len * blocks) / 64;
+	for (size_t s = 0; s < stripes; ++s)
+		xxh3_accumulate(acc, input + blocks * block_len + s * 64,
+				secret + s * 8);
+	xxh3_accumulate(acc, input + len - 64, secret + secret_size - 64 - 7);
+	// Merge the accumulators
+	uint64_t result = len * prime64_1;
+	for (size_t i = 0; i < 4; ++i)
+		result += mul128_fold64(acc[2 * i] ^ read64(secret + 11 + 16 * i),
+					acc[2 * i + 1] ^
+						read64(secret + 11 + 16 * i + 8));
+	return xxh3_avalanche(result);
+}
+
+// xxHash3 (64 bit, no seed) of len bytes of data.
+uint64_t Checksum::xxh3(const void *data, size_t len)
+{
+	const uint8_t *input = (const uint8_t *)data;
+	if (len <= 16)
+		return xxh3_0to16(input, len);
+	if (len <= 128)
+		return xxh3_17to128(input, len);
+	if (len <= 240)
+		return xxh3_129to240(input, len);
+	return xxh3_long(input, len);
+}
+
+// Write the checksum of len bytes of data to the 32 byte checksum
+// field at field.
+void Checksum::calculate(ChecksumAlgorithm algorithm, const void *data,
+			 size_t len, uint8_t *field)
+{
+	uint64_t value;
+	size_t value_size;
+	switch (algorithm) {
+	case CHECKSUM_CRC32C:
+		value = crc32c(data, len);
+		value_size = 4;
+		break;
+	case CHECKSUM_XXH3:
+		value = xxh3(data, len);
+		value_size = 8;
+		break;
+	default:
+		Sha256::hash(data, len, field);
+		return;
+	}
+	// Big endian at the start of the field, followed by zeros.
+	std::memset(field, 0, checksum_size);
+	for (size_t i = 0; i < value_size; ++i)
+		field[i] = (uint8_t)(value >> ((value_size - 1 - i) * 8));
+}
+
+const char *Checksum::name(ChecksumAlgorithm algorithm)
+{
+	switch (algorithm) {
+	case CHECKSUM_CRC32C:
+		return "crc32c";
+	case CHECKSUM_XXH3:
+		return "xxh3";
+	default:
+		return "sha256";
+	}
+}
@@ -0,0 +1,40 @@
+/*======================================================================
+COIS-4310H - Checksum
+Name: Checksum.hpp
+Purpose: The integrity checksums a MessageLayer header can be built with;
+	SHA-256 (header versions up to 3), CRC32C (hardware accelerated with
+	SSE4.2 where the CPU allows) and xxHash3 (64 bit). The checksums
+	only catch corruption, message contents are authenticated by the
+	CryptoLayer, so the fast non cryptographic ones are just as good.
+
+	Every checksum is stored in a 32 byte checksum field of the header;
+	the shorter ones big endian at the start, followed by zeros.
+
+Compilation: Please use the provided Make file that will make both the
+	client and the server.
+----------------------------------------------------------------------*/
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// Number of bytes in a header checksum field
+static const size_t constexpr checksum_size = 32;
+
+// The checksum algorithms, as selected by the header version
+enum ChecksumAlgorithm { CHECKSUM_SHA256 = 0, CHECKSUM_CRC32C, CHECKSUM_XXH3 };
+
+class Checksum {
+    public:
+	// CRC32C (Castagnoli) of len bytes of data, continuing from crc.
+	static uint32_t crc32c(const void *data, size_t len, uint32_t crc = 0);
+	// xxHash3 (64 bit, no seed) of len bytes of data.
+	static uint64_t xxh3(const void *data, size_t len);
+	// Write the checksum of len bytes of data to the 32 byte checksum
+	// field at field.
+	static void calculate(ChecksumAlgorithm algorithm, const void *data,
+			      size_t len, uint8_t *field);
+	// Whether the CRC32C instruction (SSE4.2) is used.
+	static bool crc32c_accelerated(void);
+	static const char *name(ChecksumAlgorithm algorithm);
+};
@@ -1,4 +1,10 @@
 #include <iostream>
+#include <algorithm>
+extern "C" {
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+}
 #include "CryptoLayer.hpp"
 
 namespace Crypto
@@ -6,16 +12,23 @@ namespace Crypto
 // Simple salt to use in password derivation
 static const constexpr uint8_t salt[] = "(Q*&^#$lkjdashfg";
 
+// Initialize libsodium, the first time through only (sodium_init() is
+// safe to call again, but not free). Returns false if it couldn't be.
+static bool sodium_ready(void)
+{
+	static const bool ready = sodium_init() >= 0;
+	if (!ready)
+		std::cerr << "Unable to initialize libsodium.\n";
+	return ready;
+}
+
 // Take the passed password, and turn it into a proper symmetric key for use
 // with xchacha20. Returns false on failure. (As element 0 of the tuple)
 std::tuple<bool, StreamKey>
 derive_key_from_password(const std::string &password)
 {
-	// Initialize libsodium
-	if (sodium_init() < 0) {
-		std::cerr << "Unable to initialize libsodium.\n";
+	if (!sodium_ready())
 		return std::make_pair(false, StreamKey());
-	}
 	StreamKey key;
 	key.fill(0);
 	// Derive the key using crypto_pwhash
@@ -34,59 +47,137 @@ derive_key_from_password(const std::string &password)
 	return std::make_pair(true, std::move(key));
 }
 
+// Each entry in the key cache; the name the key is kept under, followed by
+// the key.
+static const size_t constexpr cache_id_size = crypto_generichash_BYTES;
+static const size_t constexpr cache_entry_size =
+	cache_id_size + crypto_secretstream_xchacha20poly1305_KEYBYTES;
+
+// Open the key cache, making it if it doesn't exist. Returns -1 if it
+// can't be opened, or isn't safe to keep keys in.
+static int open_key_cache(const std::string &cache_path)
+{
+	int cache = open(cache_path.c_str(),
+			 O_RDWR | O_CREAT | O_APPEND | O_NOFOLLOW | O_CLOEXEC,
+			 0600);
+	if (cache < 0)
+		return -1;
+	struct stat status;
+	if (fstat(cache, &status) < 0 || !S_ISREG(status.st_mode) ||
+	    status.st_uid != geteuid() || (status.st_mode & 077) != 0) {
+		std::cerr << "Not using the key cache " << cache_path
+			  << ", others may be able to read it.\n";
+		close(cache);
+		return -1;
+	}
+	return cache;
+}
+
+// Look the key kept under id up in the open key cache. Returns false if
+// it isn't there.
+static bool find_cached_key(int cache, const uint8_t *id, StreamKey &key)
+{
+	uint8_t entry[cache_entry_size];
+	bool found = false;
+	for (off_t at = 0;
+	     !found && pread(cache, entry, cache_entry_size, at) ==
+			       (ssize_t)cache_entry_size;
+	     at += cache_entry_size) {
+		if (sodium_memcmp(entry, id, cache_id_size) == 0) {
+			std::copy(entry + cache_id_size,
+				  entry + cache_entry_size, key.begin());
+			found = true;
+		}
+	}
+	sodium_memzero(entry, cache_entry_size);
+	return found;
+}
+
+// Take the passed password, and turn it into a key as above, looking it up
+// in the key cache at cache_path first, and adding it there if it had to
+// be derived.
+std::tuple<bool, StreamKey>
+derive_key_from_password(const std::string &password,
+			 const std::string &cache_path)
+{
+	if (!sodium_ready())
+		return std::make_pair(false, StreamKey());
+	int cache = open_key_cache(cache_path);
+	if (cache < 0)
+		return derive_key_from_password(password);
+	// The key is kept under a hash of the password, keyed with the salt
+	uint8_t entry[cache_entry_size];
+	crypto_generichash(entry, cache_id_size,
+			   (const uint8_t *)password.data(), password.size(),
+			   salt, sizeof(salt) - 1);
+	StreamKey key;
+	if (find_cached_key(cache, entry, key)) {
+		close(cache);
+		return std::make_pair(true, std::move(key));
+	}
+	auto derived = derive_key_from_password(password);
+	if (std::get<0>(derived)) {
+		std::copy(std::get<1>(derived).begin(),
+			  std::get<1>(derived).end(), entry + cache_id_size);
+		if (write(cache, entry, cache_entry_size) !=
+		    (ssize_t)cache_entry_size)
+			std::cerr << "Unable to add the key to the key cache "
+				  << cache_path << ".\n";
+		sodium_memzero(entry, cache_entry_size);
+	}
+	close(cache);
+	return derived;
+}
+
+// Encrypt len bytes of clear text as a whole stream in a single chunk,
+// into cipher_txt (room for encrypted_size(len) bytes). Nothing is
+// allocated. Returns false on failure.
+bool encrypt(const uint8_t *clear_txt, size_t len, const StreamKey &enc_key,
+	     uint8_t *cipher_txt)
+{
+	StreamEncryptor encryptor;
+	return encryptor.begin(enc_key, cipher_txt) &&
+	       encryptor.push(clear_txt, len, true,
+			      cipher_txt + stream_header_size);
+}
+
+// Decrypt a whole stream in a single chunk, len bytes of cipher text, into
+// clear_txt (room for len bytes), and set clear_len to its length. Nothing
+// is allocated. Returns false if it is corrupt or forged.
+bool decrypt(const uint8_t *cipher_txt, size_t len, const StreamKey &dec_key,
+	     uint8_t *clear_txt, size_t &clear_len)
+{
+	// Make sure there's at least a header and an (empty) chunk
+	if (len < encrypted_size(0))
+		return false;
+	StreamDecryptor decryptor;
+	bool final;
+	// We only ever encrypted 1 chunk, so the tag had better be final.
+	if (!decryptor.begin(dec_key, cipher_txt) ||
+	    !decryptor.pull(cipher_txt + stream_header_size,
+			    len - stream_header_size, clear_txt, final) ||
+	    !final)
+		return false;
+	clear_len = len - encrypted_size(0);
+	return true;
+}
+
 // Take the passed cipher text and password, and return whether we were
 // successful or failed, as the first element of a tuple. If we were successful
 // the second element in the tuple will be the successfully decrypted cleartext.
+// (The cipher text must be a whole stream in a single chunk.)
 std::tuple<bool, std::string> decrypt(const std::vector<uint8_t> &cipher_txt,
 				      const StreamKey &dec_key)
 {
-	// Initialize libsodium
-	if (sodium_init() < 0) {
-		std::cerr << "Unable to initialize libsodium.\n";
-		return std::make_pair(false, std::string());
-	}
-	// Pull the header from the ciphertext
-	std::array<uint8_t, crypto_secretstream_xchacha20poly1305_HEADERBYTES>
-		header;
-	// Pull the header from the ciphertext
-	for (size_t it = 0;
-	     it < crypto_secretstream_xchacha20poly1305_HEADERBYTES; ++it) {
-		header[it] = cipher_txt[it];
-	}
-	// set up the state
-	crypto_secretstream_xchacha20poly1305_state dec_state;
-	if (crypto_secretstream_xchacha20poly1305_init_pull(
-		    &dec_state, header.data(), dec_key.data()) != 0) {
-		std::cerr << "Error setting up the header in decryption.\n";
-		return std::make_pair(false, std::string());
-	}
-	// Begin decryption process
-	std::vector<uint8_t> clear_txt(
-		cipher_txt.size() -
-		crypto_secretstream_xchacha20poly1305_ABYTES -
-		crypto_secretstream_xchacha20poly1305_HEADERBYTES);
-	unsigned long long out_buffer_length;
-	unsigned char tag;
-	// Decrypt the message
-	if (crypto_secretstream_xchacha20poly1305_pull(
-		    &dec_state, clear_txt.data(), &out_buffer_length, &tag,
-		    cipher_txt.data() +
-			    crypto_secretstream_xchacha20poly1305_HEADERBYTES,
-		    cipher_txt.size() -
-			    crypto_secretstream_xchacha20poly1305_HEADERBYTES,
-		    nullptr, 0) != 0) {
+	std::string clear_txt(cipher_txt.size(), '\0');
+	size_t clear_len;
+	if (!decrypt(cipher_txt.data(), cipher_txt.size(), dec_key,
+		     (uint8_t *)&clear_txt[0], clear_len)) {
 		std::cerr << "Error while trying to decrypt message.\n";
 		return std::make_pair(false, std::string());
 	}
-	// We only ever encrypted 1 chunk (This is a stream cipher)
-	// So tag better be final.
-	if (tag != crypto_secretstream_xchacha20poly1305_TAG_FINAL) {
-		std::cerr << "Error. Tag is messed up in decryption.\n";
-		return std::make_pair(false, std::string());
-	}
-	// Package up the cleartext into a string, and return.
-	return std::make_pair(true,
-			      std::string(clear_txt.begin(), clear_txt.end()));
+	clear_txt.resize(clear_len);
+	return std::make_pair(true, std::move(clear_txt));
 }
 
 // Take the passed clear text and password, and return whether we were
@@ -95,40 +186,187 @@ std::tuple<bool, std::string> decrypt(const std::vector<uint8_t> &cipher_txt,
 std::tuple<bool, std::vector<uint8_t> > encrypt(const std::string &clear_txt,
 						const StreamKey &enc_key)
 {
-	// Initialize libsodium
-	if (sodium_init() < 0) {
-		std::cerr << "Unable to initialize libsodium.\n";
-		return std::make_pair(false, std::vector<uint8_t>());
-	}
-	// Begin the encryption process
-	std::vector<uint8_t> cipher_txt;
-	// Create the encryption header and state
-	crypto_secretstream_xchacha20poly1305_state enc_state;
-	std::array<uint8_t, crypto_secretstream_xchacha20poly1305_HEADERBYTES>
-		header;
-	if (crypto_secretstream_xchacha20poly1305_init_push(
-		    &enc_state, header.data(), enc_key.data()) != 0) {
-		std::cerr
-			<< "Error. Unable to initialize header in encrypt function.\n";
-		return std::make_pair(false, std::vector<uint8_t>());
-	}
-	// Put the header at the start of the cipher_txt vector
-	cipher_txt.insert(cipher_txt.end(), header.begin(), header.end());
-	// Encrypt the string, and put it in the message
-	std::vector<uint8_t> enc_buff(
-		clear_txt.size() +
-		crypto_secretstream_xchacha20poly1305_ABYTES);
-	unsigned long long enc_buff_len;
-	if (crypto_secretstream_xchacha20poly1305_push(
-		    &enc_state, enc_buff.data(), &enc_buff_len,
-		    (const unsigned char *)clear_txt.data(), clear_txt.size(),
-		    nullptr, 0,
-		    crypto_secretstream_xchacha20poly1305_TAG_FINAL) != 0) {
+	// The header, followed by the whole message as one chunk
+	std::vector<uint8_t> cipher_txt(encrypted_size(clear_txt.size()));
+	if (!encrypt((const uint8_t *)clear_txt.data(), clear_txt.size(),
+		     enc_key, cipher_txt.data())) {
 		std::cerr << "Error. Unable to encrypt message.\n";
 		return std::make_pair(false, std::vector<uint8_t>());
 	}
-	cipher_txt.insert(cipher_txt.end(), enc_buff.begin(), enc_buff.end());
 	// Were done here.
 	return std::make_pair(true, std::move(cipher_txt));
 }
+
+// Start a new stream encrypted with the passed key, and write its header
+// (stream_header_size bytes) to header. Returns false on failure.
+bool StreamEncryptor::begin(const StreamKey &enc_key, uint8_t *header)
+{
+	if (!sodium_ready())
+		return false;
+	return crypto_secretstream_xchacha20poly1305_init_push(
+		       &state, header, enc_key.data()) == 0;
+}
+
+// Encrypt the next len bytes (up to max_chunk_size) of the stream into
+// cipher_txt, which must have room for len + chunk_overhead bytes. final
+// marks the last chunk. Returns false on failure.
+bool StreamEncryptor::push(const uint8_t *clear_txt, size_t len, bool final,
+			   uint8_t *cipher_txt)
+{
+	unsigned char tag =
+		final ? crypto_secretstream_xchacha20poly1305_TAG_FINAL :
+			crypto_secretstream_xchacha20poly1305_TAG_MESSAGE;
+	return crypto_secretstream_xchacha20poly1305_push(
+		       &state, cipher_txt, nullptr, clear_txt, len, nullptr, 0,
+		       tag) == 0;
+}
+
+StreamDecryptor::StreamDecryptor(void) : finished(false)
+{
+}
+
+// Start decrypting the stream with the passed header (the first
+// stream_header_size bytes of it). Returns false on failure.
+bool StreamDecryptor::begin(const StreamKey &dec_key, const uint8_t *header)
+{
+	if (!sodium_ready())
+		return false;
+	finished = false;
+	return crypto_secretstream_xchacha20poly1305_init_pull(
+		       &state, header, dec_key.data()) == 0;
+}
+
+// Decrypt the next chunk of the stream, len bytes of cipher text, into
+// clear_txt (which must have room for len - chunk_overhead bytes). final
+// is set if it was the last chunk. Returns false if the chunk is corrupt,
+// forged or out of order, or the stream has already ended.
+bool StreamDecryptor::pull(const uint8_t *cipher_txt, size_t len,
+			   uint8_t *clear_txt, bool &final)
+{
+	if (finished || len < chunk_overhead)
+		return false;
+	unsigned char tag;
+	if (crypto_secretstream_xchacha20poly1305_pull(&state, clear_txt,
+						       nullptr, &tag,
+						       cipher_txt, len,
+						       nullptr, 0) != 0)
+		return false;
+	// Anything but a plain chunk or the end of the stream (e.g. a rekey,
+	// which the encryptor never sends) isn't ours.
+	if (tag != crypto_secretstream_xchacha20poly1305_TAG_MESSAGE &&
+	    tag != crypto_secretstream_xchacha20poly1305_TAG_FINAL)
+		return false;
+	final = finished =
+		tag == crypto_secretstream_xchacha20poly1305_TAG_FINAL;
+	return true;
+}
+
+// Whether the final chunk has been decrypted
+bool StreamDecryptor::done(void) const
+{
+	return finished;
+}
+
+ChannelEncryptor::ChannelEncryptor(void) : chunks(0), started(false)
+{
+}
+
+// Start the channel over with the next chunk
+void ChannelEncryptor::restart(void)
+{
+	started = false;
+}
+
+// Whether the next chunk starts the channel (over), with the new stream's
+// header in front of it.
+bool ChannelEncryptor::starting(void) const
+{
+	return !started;
+}
+
+// Bytes the next chunk takes, once encrypted, if it is len bytes of clear
+// text (with the stream header, if starting).
+size_t ChannelEncryptor::encrypted_size(size_t len) const
+{
+	return (started ? 0 : stream_header_size) + len + chunk_overhead;
+}
+
+// Encrypt the next chunk, len bytes of clear text, into cipher_txt (room
+// for encrypted_size(len) bytes), starting the stream first if need be.
+// end marks the last chunk of a message. Returns false on failure.
+bool ChannelEncryptor::push(const StreamKey &enc_key, const uint8_t *clear_txt,
+			    size_t len, bool end, uint8_t *cipher_txt)
+{
+	if (!started) {
+		if (!sodium_ready() ||
+		    crypto_secretstream_xchacha20poly1305_init_push(
+			    &state, cipher_txt, enc_key.data()) != 0)
+			return false;
+		cipher_txt += stream_header_size;
+		chunks = 0;
+		started = true;
+	}
+	unsigned char tag =
+		end ? crypto_secretstream_xchacha20poly1305_TAG_PUSH :
+		      crypto_secretstream_xchacha20poly1305_TAG_MESSAGE;
+	if (crypto_secretstream_xchacha20poly1305_push(&state, cipher_txt,
+						       nullptr, clear_txt, len,
+						       nullptr, 0, tag) != 0)
+		return false;
+	// Both ends rekey after the same chunk, without saying so.
+	if (++chunks % channel_rekey_interval == 0)
+		crypto_secretstream_xchacha20poly1305_rekey(&state);
+	return true;
+}
+
+ChannelDecryptor::ChannelDecryptor(void) : chunks(0), synced(false)
+{
+}
+
+// Decrypt the next chunk of the channel, len bytes of cipher text, into
+// clear_txt (room for len bytes), and set clear_len to its length. start
+// is set for a chunk that starts the channel (over), with the stream
+// header in front of it. end is set for the last chunk of a message.
+// Returns false if the chunk is corrupt, forged or out of order, or we
+// have lost our place in the channel, until it is started over.
+bool ChannelDecryptor::pull(const StreamKey &dec_key, const uint8_t *cipher_txt,
+			    size_t len, bool start, uint8_t *clear_txt,
+			    size_t &clear_len, bool &end)
+{
+	if (start) {
+		synced = len >= stream_header_size && sodium_ready() &&
+			 crypto_secretstream_xchacha20poly1305_init_pull(
+				 &state, cipher_txt, dec_key.data()) == 0;
+		if (!synced)
+			return false;
+		cipher_txt += stream_header_size;
+		len -= stream_header_size;
+		chunks = 0;
+	}
+	if (!synced || len < chunk_overhead) {
+		synced = false;
+		return false;
+	}
+	unsigned char tag;
+	if (crypto_secretstream_xchacha20poly1305_pull(&state, clear_txt,
+						       nullptr, &tag,
+						       cipher_txt, len,
+						       nullptr, 0) != 0 ||
+	    (tag != crypto_secretstream_xchacha20poly1305_TAG_MESSAGE &&
+	     tag != crypto_secretstream_xchacha20poly1305_TAG_PUSH)) {
+		synced = false;
+		return false;
+	}
+	clear_len = len - chunk_overhead;
+	end = tag == crypto_secretstream_xchacha20poly1305_TAG_PUSH;
+	if (++chunks % channel_rekey_interval == 0)
+		crypto_secretstream_xchacha20poly1305_rekey(&state);
+	return true;
+}
+
+// Whether we are following the channel
+bool ChannelDecryptor::in_sync(void) const
+{
+	return synced;
+}
 } // namespace Crypto
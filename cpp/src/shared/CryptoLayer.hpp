@@ -2,6 +2,7 @@
 extern "C" {
 #include <sodium.h>
 }
+#include <array>
 #include <string>
 #include <vector>
 #include <tuple>
@@ -11,19 +12,158 @@ namespace Crypto
 using StreamKey =
 	std::array<uint8_t, crypto_secretstream_xchacha20poly1305_KEYBYTES>;
 
+// Bytes of the header at the start of an encrypted stream, and the bytes
+// added to each chunk of clear text when it is encrypted.
+static const size_t constexpr stream_header_size =
+	crypto_secretstream_xchacha20poly1305_HEADERBYTES;
+static const size_t constexpr chunk_overhead =
+	crypto_secretstream_xchacha20poly1305_ABYTES;
+// Most clear text encrypted as one chunk. An encrypted chunk, even with
+// the stream header in front of it, fits in a single data packet.
+static const size_t constexpr max_chunk_size = 32768;
+
+// Encrypts a stream of clear text (of any length) one chunk at a time, so
+// only a chunk of it need be held at once. Every chunk but the last is
+// tagged TAG_MESSAGE, and the last TAG_FINAL; a stream that is cut short,
+// or has chunks dropped, reordered or spliced in, won't decrypt.
+class StreamEncryptor {
+	crypto_secretstream_xchacha20poly1305_state state;
+
+    public:
+	// Start a new stream encrypted with the passed key, and write its
+	// header (stream_header_size bytes) to header. Returns false on
+	// failure.
+	bool begin(const StreamKey &enc_key, uint8_t *header);
+	// Encrypt the next len bytes (up to max_chunk_size) of the stream
+	// into cipher_txt, which must have room for len + chunk_overhead
+	// bytes. final marks the last chunk. Returns false on failure.
+	bool push(const uint8_t *clear_txt, size_t len, bool final,
+		  uint8_t *cipher_txt);
+};
+
+// Decrypts a stream from a StreamEncryptor one chunk at a time.
+class StreamDecryptor {
+	crypto_secretstream_xchacha20poly1305_state state;
+	// Whether the final chunk has been decrypted
+	bool finished;
+
+    public:
+	StreamDecryptor(void);
+	// Start decrypting the stream with the passed header (the first
+	// stream_header_size bytes of it). Returns false on failure.
+	bool begin(const StreamKey &dec_key, const uint8_t *header);
+	// Decrypt the next chunk of the stream, len bytes of cipher text,
+	// into clear_txt (which must have room for len - chunk_overhead
+	// bytes). final is set if it was the last chunk. Returns false if
+	// the chunk is corrupt, forged or out of order, or the stream has
+	// already ended.
+	bool pull(const uint8_t *cipher_txt, size_t len, uint8_t *clear_txt,
+		  bool &final);
+	// Whether the final chunk has been decrypted
+	bool done(void) const;
+};
+
+// Chunks sent on a channel between each rekeying of its stream
+static const uint64_t constexpr channel_rekey_interval = 1024;
+
+// The sending end of a channel; a session's messages, one after another,
+// encrypted as the chunks of a single stream, so the stream's set up and
+// its header are paid for once rather than with every message. The last
+// chunk of each message is tagged TAG_PUSH, and the rest TAG_MESSAGE.
+// Both ends rekey the stream after every channel_rekey_interval chunks.
+// The channel can be restarted (with a new stream, and header) whenever a
+// receiver has lost its place in it, or joined part way through.
+class ChannelEncryptor {
+	crypto_secretstream_xchacha20poly1305_state state;
+	// Chunks sent since the stream started
+	uint64_t chunks;
+	bool started;
+
+    public:
+	ChannelEncryptor(void);
+	// Start the channel over with the next chunk
+	void restart(void);
+	// Whether the next chunk starts the channel (over), with the new
+	// stream's header in front of it.
+	bool starting(void) const;
+	// Bytes the next chunk takes, once encrypted, if it is len bytes of
+	// clear text (with the stream header, if starting).
+	size_t encrypted_size(size_t len) const;
+	// Encrypt the next chunk, len bytes of clear text, into cipher_txt
+	// (room for encrypted_size(len) bytes), starting the stream first if
+	// need be. end marks the last chunk of a message. Returns false on
+	// failure.
+	bool push(const StreamKey &enc_key, const uint8_t *clear_txt,
+		  size_t len, bool end, uint8_t *cipher_txt);
+};
+
+// The receiving end of a channel from a ChannelEncryptor
+class ChannelDecryptor {
+	crypto_secretstream_xchacha20poly1305_state state;
+	// Chunks received since the stream started
+	uint64_t chunks;
+	// Whether we are following the stream; not until it starts, nor
+	// after a chunk fails to decrypt (e.g. one was lost in between).
+	bool synced;
+
+    public:
+	ChannelDecryptor(void);
+	// Decrypt the next chunk of the channel, len bytes of cipher text,
+	// into clear_txt (room for len bytes), and set clear_len to its
+	// length. start is set for a chunk that starts the channel (over),
+	// with the stream header in front of it. end is set for the last
+	// chunk of a message. Returns false if the chunk is corrupt, forged
+	// or out of order, or we have lost our place in the channel, until
+	// it is started over.
+	bool pull(const StreamKey &dec_key, const uint8_t *cipher_txt,
+		  size_t len, bool start, uint8_t *clear_txt,
+		  size_t &clear_len, bool &end);
+	// Whether we are following the channel
+	bool in_sync(void) const;
+};
+
 // Take the passed password, and turn it into a proper symmetric key for use
 // with xchacha20. Returns false on failure. (As element 0 of the tuple)
 std::tuple<bool, StreamKey>
 derive_key_from_password(const std::string &password);
+// The same, but the key is looked up first in the key cache at cache_path,
+// by a hash of the password and salt, and only derived (and then added to
+// the cache) if it isn't there; the slow derivation is done once, not on
+// every start. The cache holds keys, so it must belong to us and be
+// readable by no one else (it is created that way). If it isn't, it is
+// left alone and the key is derived as usual.
+std::tuple<bool, StreamKey>
+derive_key_from_password(const std::string &password,
+			 const std::string &cache_path);
+
+// Bytes a whole stream in a single chunk takes, once encrypted, if it is
+// len bytes of clear text.
+static inline size_t constexpr encrypted_size(size_t len)
+{
+	return stream_header_size + len + chunk_overhead;
+}
+// Encrypt len bytes of clear text as a whole stream in a single chunk,
+// into cipher_txt (room for encrypted_size(len) bytes). Nothing is
+// allocated. Returns false on failure.
+bool encrypt(const uint8_t *clear_txt, size_t len, const StreamKey &enc_key,
+	     uint8_t *cipher_txt);
+// Decrypt a whole stream in a single chunk, len bytes of cipher text, into
+// clear_txt (room for len bytes), and set clear_len to its length. Nothing
+// is allocated. Returns false if it is corrupt or forged.
+bool decrypt(const uint8_t *cipher_txt, size_t len, const StreamKey &dec_key,
+	     uint8_t *clear_txt, size_t &clear_len);
 
 // Take the passed cipher text and password, and return whether we were
 // successful or failed, as the first element of a tuple. If we were successful
 // the second element in the tuple will be the successfully decrypted cleartext.
+// (The cipher text must be a whole stream in a single chunk.)
 std::tuple<bool, std::string> decrypt(const std::vector<uint8_t> &cipher_txt,
 				      const StreamKey &dec_key);
 // Take the passed clear text and password, and return whether we were
 // successful or failed, as the first element of a tuple. If we were successful
 // the second element in the tuple will be the successfully encrypted cleartext.
+// (A whole stream in a single chunk; clear text too big for one data packet
+// is encrypted with a StreamEncryptor instead.)
 std::tuple<bool, std::vector<uint8_t> > encrypt(const std::string &clear_txt,
 						const StreamKey &enc_key);
 } // namespace Crypto
@@ -1,6 +1,11 @@
 #include "CryptoLayer.hpp"
 #include <cassert>
 #include <iostream>
+#include <algorithm>
+extern "C" {
+#include <unistd.h>
+#include <sys/stat.h>
+}
 
 int main(void)
 {
@@ -16,6 +21,143 @@ int main(void)
 	auto dec_banana = Crypto::decrypt(std::get<1>(enc_banana),
 					  std::get<1>(key_deriv));
 	assert(std::get<0>(dec_banana));
+	assert(std::get<1>(dec_banana) == banana);
+	// Into buffers of our own, the same as the above
+	uint8_t span_cipher[Crypto::encrypted_size(6)];
+	uint8_t span_clear[sizeof(span_cipher)];
+	size_t span_len;
+	assert(Crypto::encrypt((const uint8_t *)banana.data(), banana.size(),
+			       std::get<1>(key_deriv), span_cipher));
+	assert(Crypto::decrypt(span_cipher, sizeof(span_cipher),
+			       std::get<1>(key_deriv), span_clear, span_len) &&
+	       std::string((char *)span_clear, span_len) == banana);
+	span_cipher[30] ^= 1;
+	assert(!Crypto::decrypt(span_cipher, sizeof(span_cipher),
+				std::get<1>(key_deriv), span_clear, span_len));
+	// Stream a message much bigger than one chunk (or data packet)
+	// through chunk by chunk, the last chunk a short one.
+	const Crypto::StreamKey &key = std::get<1>(key_deriv);
+	std::string big(5 * Crypto::max_chunk_size + 123, '\0');
+	for (size_t i = 0; i < big.size(); ++i)
+		big[i] = (char)(i * 31 + 7);
+	std::vector<std::vector<uint8_t> > chunks;
+	uint8_t stream_header[Crypto::stream_header_size];
+	Crypto::StreamEncryptor encryptor;
+	assert(encryptor.begin(key, stream_header));
+	for (size_t at = 0; at < big.size(); at += Crypto::max_chunk_size) {
+		size_t len = std::min(Crypto::max_chunk_size, big.size() - at);
+		chunks.emplace_back(len + Crypto::chunk_overhead);
+		assert(encryptor.push((const uint8_t *)big.data() + at, len,
+				      at + len == big.size(),
+				      chunks.back().data()));
+	}
+	assert(chunks.size() == 6);
+	Crypto::StreamDecryptor decryptor;
+	assert(decryptor.begin(key, stream_header));
+	std::string streamed;
+	std::vector<uint8_t> clear(Crypto::max_chunk_size);
+	for (size_t i = 0; i < chunks.size(); ++i) {
+		bool final;
+		assert(decryptor.pull(chunks[i].data(), chunks[i].size(),
+				      clear.data(), final));
+		assert(final == (i + 1 == chunks.size()));
+		streamed.append((char *)clear.data(),
+				chunks[i].size() - Crypto::chunk_overhead);
+	}
+	assert(decryptor.done());
+	assert(streamed == big);
+	// Nothing may follow the final chunk
+	bool final;
+	assert(!decryptor.pull(chunks[0].data(), chunks[0].size(), clear.data(),
+			       final));
+	// Chunks out of order, or tampered with, don't decrypt
+	assert(decryptor.begin(key, stream_header));
+	assert(!decryptor.pull(chunks[1].data(), chunks[1].size(), clear.data(),
+			       final));
+	assert(decryptor.begin(key, stream_header));
+	chunks[0][100] ^= 1;
+	assert(!decryptor.pull(chunks[0].data(), chunks[0].size(), clear.data(),
+			       final));
+	// A stream cut short never reaches its final chunk, so a whole
+	// message decrypt of its first chunk fails.
+	chunks[0][100] ^= 1;
+	std::vector<uint8_t> truncated(sizeof(stream_header) +
+				       chunks[0].size());
+	std::copy(stream_header, stream_header + sizeof(stream_header),
+		  truncated.begin());
+	std::copy(chunks[0].begin(), chunks[0].end(),
+		  truncated.begin() + sizeof(stream_header));
+	assert(!std::get<0>(Crypto::decrypt(truncated, key)));
+	// Too short to hold even a header
+	assert(!std::get<0>(Crypto::decrypt(std::vector<uint8_t>(10), key)));
+	// The key cache gives the same key as deriving it, from the cache
+	// once it's there, and is only used if nobody else can read it.
+	std::string cache_path =
+		"/tmp/CryptoTestsKeyCache." + std::to_string(getpid());
+	unlink(cache_path.c_str());
+	for (size_t i = 0; i < 2; ++i) {
+		auto cached = Crypto::derive_key_from_password(password,
+								cache_path);
+		assert(std::get<0>(cached) && std::get<1>(cached) == key);
+	}
+	auto other = Crypto::derive_key_from_password("other", cache_path);
+	assert(std::get<0>(other) && std::get<1>(other) != key);
+	struct stat status;
+	assert(stat(cache_path.c_str(), &status) == 0 &&
+	       (status.st_mode & 0777) == 0600 && status.st_size == 2 * 64);
+	chmod(cache_path.c_str(), 0644);
+	auto unsafe = Crypto::derive_key_from_password(password, cache_path);
+	assert(std::get<0>(unsafe) && std::get<1>(unsafe) == key);
+	unlink(cache_path.c_str());
+	// A channel carries message after message, through rekeying, with
+	// the stream header only on the first chunk.
+	Crypto::ChannelEncryptor sending;
+	Crypto::ChannelDecryptor receiving;
+	Crypto::ChannelDecryptor late;
+	std::vector<uint8_t> cipher(Crypto::stream_header_size + 100 +
+				    Crypto::chunk_overhead);
+	size_t clear_len;
+	bool end;
+	for (size_t i = 0; i < 3 * Crypto::channel_rekey_interval; ++i) {
+		std::string message = "message " + std::to_string(i);
+		bool starting = sending.starting();
+		assert(starting == (i == 0));
+		size_t size = sending.encrypted_size(message.size());
+		assert(size == message.size() + Crypto::chunk_overhead +
+				       (starting ? Crypto::stream_header_size : 0));
+		assert(sending.push(key, (const uint8_t *)message.data(),
+				    message.size(), i % 3 != 0, cipher.data()));
+		assert(receiving.pull(key, cipher.data(), size, starting,
+				      clear.data(), clear_len, end));
+		assert(end == (i % 3 != 0) &&
+		       std::string((char *)clear.data(), clear_len) == message);
+		// Joining part way through, there's no following it
+		assert(i == 0 || (!late.pull(key, cipher.data(), size, starting,
+					     clear.data(), clear_len, end) &&
+				  !late.in_sync()));
+	}
+	// A lost chunk loses the receiver its place, until the channel is
+	// started over.
+	assert(sending.push(key, (const uint8_t *)"lost", 4, true,
+			    cipher.data()));
+	assert(sending.push(key, (const uint8_t *)"next", 4, true,
+			    cipher.data()));
+	assert(!receiving.pull(key, cipher.data(), 4 + Crypto::chunk_overhead,
+			       false, clear.data(), clear_len, end));
+	assert(!receiving.in_sync());
+	sending.restart();
+	size_t resync_size = sending.encrypted_size(6);
+	assert(sending.starting() &&
+	       resync_size == 6 + Crypto::chunk_overhead +
+				      Crypto::stream_header_size);
+	assert(sending.push(key, (const uint8_t *)"resync", 6, true,
+			    cipher.data()));
+	for (Crypto::ChannelDecryptor *decryptor : { &receiving, &late }) {
+		assert(decryptor->pull(key, cipher.data(), resync_size, true,
+				       clear.data(), clear_len, end));
+		assert(decryptor->in_sync() && end &&
+		       std::string((char *)clear.data(), clear_len) == "resync");
+	}
 	// Print out the result for fun
 	std::cout << std::get<1>(dec_banana) << "\n";
 	return 0;
@@ -0,0 +1,184 @@
+/*======================================================================
+COIS-4310H - FrameReader
+Name: FrameReader.cpp
+Purpose: Incremental decoder of the message stream coming in on one
+	connection. Each read takes as much as the socket has (or bytes
+	read elsewhere are fed in), and every complete frame (header and
+	data packet) in the buffer is then handed out in turn as a view of
+	the bytes where they sit. A partial frame at the end of the buffer
+	is kept, and wrapped back around to the start of the buffer before
+	the next read, so a frame split across reads is never lost and is
+	always contiguous when it completes. When several headers arrive in
+	one read their checksums are verified together (see
+	MessageLayer::verify_checksums).
+
+Compilation: Please use the provided Make file that will make both the
+	client and the server.
+----------------------------------------------------------------------*/
+
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+extern "C" {
+#include <unistd.h>
+}
+#include "FrameReader.hpp"
+
+// Least amount of free space a read is given
+static const size_t constexpr min_read_size = 4096;
+
+// Data packet length field of the header at header
+static size_t data_packet_length(const uint8_t *header)
+{
+	return (header[data_packet_length_begin] << 8) |
+	       header[data_packet_length_begin + 1];
+}
+
+FrameReader::FrameReader(size_t initial_capacity)
+	: capacity(BufferPool::class_size(initial_capacity)),
+	  begin(0), end(0), batch_next(0), reads(0), frames(0)
+{
+	buffer = BufferPool::make_shared(capacity);
+}
+
+// Make room for at least want more bytes after end, wrapping what is
+// unread back around to the start of the buffer (growing it if that is
+// not enough, or moving to a new one if the buffer is shared).
+void FrameReader::make_room(size_t want)
+{
+	size_t unread = end - begin;
+	// Data packets handed out from the buffer are still held, the bytes
+	// before begin mustn't be written over.
+	bool shared = !buffer.unique();
+	if (unread == 0 && !shared) {
+		// Nothing to keep, start over at the front for free.
+		begin = end = 0;
+		batch_offsets.clear();
+	}
+	if (capacity - end >= want)
+		return;
+	if (unread + want > capacity || shared) {
+		size_t grown = unread + want > capacity ?
+				       BufferPool::class_size(std::max(
+					       unread + want, capacity * 2)) :
+				       capacity;
+		std::shared_ptr<uint8_t> fresh = BufferPool::make_shared(grown);
+		std::memcpy(fresh.get(), buffer.get() + begin, unread);
+		buffer = std::move(fresh);
+		capacity = grown;
+	} else {
+		std::memmove(buffer.get(), buffer.get() + begin, unread);
+	}
+	begin = 0;
+	end = unread;
+	// The headers checked up front have moved
+	batch_offsets.clear();
+}
+
+// One read() of as much as the socket has, up to the free space in the
+// buffer. Returns what read() does (bytes read, 0 when the peer has hung
+// up, -1 with errno set on error).
+ssize_t FrameReader::read_from(int socket)
+{
+	// Make sure the frame in progress (if it says how long it is) fits,
+	// so every read brings it closer to complete.
+	size_t want = min_read_size;
+	size_t unread = end - begin;
+	if (unread >= MessageHeaderView::size()) {
+		size_t frame_size = MessageHeaderView::size() +
+				    data_packet_length(buffer.get() + begin);
+		if (frame_size > unread)
+			want = std::max(want, frame_size - unread);
+	}
+	make_room(want);
+	ssize_t read_size;
+	do {
+		read_size = read(socket, buffer.get() + end, capacity - end);
+		++reads;
+	} while (read_size < 0 && errno == EINTR);
+	if (read_size > 0)
+		end += read_size;
+	return read_size;
+}
+
+// Take in bytes read some other way (e.g. into an io_uring buffer).
+void FrameReader::feed(const uint8_t *data, size_t len)
+{
+	make_room(len);
+	std::memcpy(buffer.get() + end, data, len);
+	end += len;
+}
+
+// Whether the header at offset has a good checksum.
+bool FrameReader::header_valid(size_t offset)
+{
+	// Skip any guesses that turned out wrong
+	while (batch_next < batch_offsets.size() &&
+	       batch_offsets[batch_next] < offset)
+		++batch_next;
+	if (batch_next < batch_offsets.size() &&
+	    batch_offsets[batch_next] == offset)
+		return batch_valid[batch_next];
+	// Not checked yet; check it along with every other header lying
+	// whole in the buffer. Each header says how far it is to the next.
+	// These are only guesses, a bad header (or length) throws them off,
+	// and the header at the end of a wrong guess is checked afresh.
+	batch_offsets.clear();
+	batch_headers.clear();
+	batch_next = 0;
+	for (size_t next = offset; next + MessageHeaderView::size() <= end;
+	     next += MessageHeaderView::size() +
+		     data_packet_length(buffer.get() + next)) {
+		batch_offsets.push_back(next);
+		batch_headers.push_back(buffer.get() + next);
+	}
+	MessageLayer::verify_checksums(batch_headers.data(),
+				       batch_headers.size(), batch_valid);
+	return batch_valid[0];
+}
+
+// Take the next complete frame from the buffer. Returns false if there
+// isn't a whole one waiting.
+bool FrameReader::next(FrameView &frame)
+{
+	if (end - begin < MessageHeaderView::size())
+		return false;
+	const uint8_t *header = buffer.get() + begin;
+	if (!header_valid(begin)) {
+		// Take just the header, there's no knowing how long a data
+		// packet it really has.
+		frame.header = MessageHeaderView(header);
+		frame.data_packet = DataPacketView();
+		frame.valid = false;
+		begin += MessageHeaderView::size();
+		++frames;
+		return true;
+	}
+	size_t length = data_packet_length(header);
+	if (end - begin < MessageHeaderView::size() + length)
+		return false;
+	frame.header = MessageHeaderView(header);
+	frame.data_packet = DataPacketView(header + MessageHeaderView::size(),
+					   length, &buffer);
+	frame.valid = true;
+	begin += MessageHeaderView::size() + length;
+	++frames;
+	return true;
+}
+
+// Number of bytes received but not yet handed out as frames
+size_t FrameReader::buffered(void) const
+{
+	return end - begin;
+}
+
+// Number of read() calls made, and frames handed out
+uint64_t FrameReader::read_count(void) const
+{
+	return reads;
+}
+
+uint64_t FrameReader::frame_count(void) const
+{
+	return frames;
+}
@@ -0,0 +1,147 @@
+/*======================================================================
+COIS-4310H - FrameReader
+Name: FrameReader.hpp
+Purpose: Incremental decoder of the message stream coming in on one
+	connection. Each read takes as much as the socket has (or bytes
+	read elsewhere are fed in), and every complete frame (header and
+	data packet) in the buffer is then handed out in turn as a view of
+	the bytes where they sit. A partial frame at the end of the buffer
+	is kept, and wrapped back around to the start of the buffer before
+	the next read, so a frame split across reads is never lost and is
+	always contiguous when it completes. When several headers arrive in
+	one read their checksums are verified together (see
+	MessageLayer::verify_checksums).
+
+	Frame views are only good until the next read_from or feed, unless
+	their data packet is shared (DataPacketView::share); the buffer is
+	then left to whoever still holds it, and reading carries on in a
+	fresh one.
+
+Compilation: Please use the provided Make file that will make both the
+	client and the server.
+----------------------------------------------------------------------*/
+
+#pragma once
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <sys/types.h>
+#include "MessageHeaderView.hpp"
+#include "BufferPool.hpp"
+
+// Bytes kept alive for as long as anybody holds on to them
+using SharedBytes = std::shared_ptr<const uint8_t>;
+
+// A data packet where it sits in a buffer. Enough of a container (data,
+// size, begin and end) to be checksummed and built into messages.
+class DataPacketView {
+	const uint8_t *bytes;
+	size_t length;
+	// The buffer the bytes are in, if it can be shared.
+	const std::shared_ptr<uint8_t> *buffer;
+
+    public:
+	DataPacketView(void) : bytes(nullptr), length(0), buffer(nullptr)
+	{
+	}
+	DataPacketView(const uint8_t *bytes, size_t length,
+		       const std::shared_ptr<uint8_t> *buffer = nullptr)
+		: bytes(bytes), length(length), buffer(buffer)
+	{
+	}
+	const uint8_t *data(void) const
+	{
+		return bytes;
+	}
+	size_t size(void) const
+	{
+		return length;
+	}
+	const uint8_t *begin(void) const
+	{
+		return bytes;
+	}
+	const uint8_t *end(void) const
+	{
+		return bytes + length;
+	}
+	// A copy of the data packet
+	std::vector<uint8_t> copy(void) const
+	{
+		return std::vector<uint8_t>(bytes, bytes + length);
+	}
+	// The data packet, kept where it is for as long as the returned
+	// pointer is held (copied if the buffer it is in can't be shared).
+	SharedBytes share(void) const
+	{
+		if (buffer != nullptr)
+			return SharedBytes(*buffer, bytes);
+		std::shared_ptr<uint8_t> copied = BufferPool::make_shared(length);
+		std::copy(bytes, bytes + length, copied.get());
+		return copied;
+	}
+};
+
+// One frame handed out by a FrameReader
+struct FrameView {
+	MessageHeaderView header;
+	DataPacketView data_packet;
+	// Whether the header's checksum is good. A bad header's data packet
+	// length can't be trusted, so only the header is taken from the
+	// stream, and the data packet is left empty.
+	bool valid;
+	FrameView(void) : header(nullptr), valid(false)
+	{
+	}
+};
+
+class FrameReader {
+	// From the BufferPool, and shared with the holders of any data
+	// packets taken from it (see DataPacketView::share).
+	std::shared_ptr<uint8_t> buffer;
+	size_t capacity;
+	// Bytes [begin, end) of the buffer have been received, but not yet
+	// handed out as frames.
+	size_t begin;
+	size_t end;
+	// Headers found whole in the buffer, by offset, checked up front
+	// together, and whether each one is valid.
+	std::vector<size_t> batch_offsets;
+	std::vector<const uint8_t *> batch_headers;
+	std::vector<bool> batch_valid;
+	size_t batch_next;
+	// Counters, for benchmarks and statistics
+	uint64_t reads;
+	uint64_t frames;
+	// Make room for at least want more bytes after end, wrapping what
+	// is unread back around to the start of the buffer (growing it if
+	// that is not enough, or moving to a new one if the buffer is
+	// shared).
+	void make_room(size_t want);
+	// Whether the header at offset has a good checksum.
+	bool header_valid(size_t offset);
+
+    public:
+	// Largest frame there can be; a header and 65535 bytes of data.
+	static const size_t constexpr max_frame_size = 166 + 65535;
+	// The buffer starts out with room for initial_capacity bytes, and
+	// grows as needed to hold the largest frame.
+	explicit FrameReader(size_t initial_capacity = 16384);
+	// Do not allow assignment operations, and copy construction
+	FrameReader(FrameReader const &) = delete;
+	void operator=(FrameReader const &) = delete;
+	// One read() of as much as the socket has, up to the free space in
+	// the buffer. Returns what read() does (bytes read, 0 when the peer
+	// has hung up, -1 with errno set on error).
+	ssize_t read_from(int socket);
+	// Take in bytes read some other way (e.g. into an io_uring buffer).
+	void feed(const uint8_t *data, size_t len);
+	// Take the next complete frame from the buffer. Returns false if
+	// there isn't a whole one waiting.
+	bool next(FrameView &frame);
+	// Number of bytes received but not yet handed out as frames
+	size_t buffered(void) const;
+	// Number of read() calls made, and frames handed out
+	uint64_t read_count(void) const;
+	uint64_t frame_count(void) const;
+};
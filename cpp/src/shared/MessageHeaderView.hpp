@@ -0,0 +1,222 @@
+/*======================================================================
+COIS-4310H - MessageHeaderView
+Name: MessageHeaderView.hpp
+Purpose: Read only, non owning view of a message header wherever it
+	already sits (a receive buffer, a MessageLayer, a frame); the
+	getters of MessageLayer without copying the 166 bytes, and with the
+	usernames handed out as NameViews into the header rather than as
+	newly allocated strings. Nothing here touches the heap, so the
+	server can parse and route a message without allocating.
+
+	A view is only good for as long as the bytes it looks at.
+
+Compilation: Please use the provided Make file that will make both the
+	client and the server.
+----------------------------------------------------------------------*/
+
+#pragma once
+#include <cstring>
+#include <string>
+#include <ostream>
+#include "MessageLayer.hpp"
+
+// A name (username) that isn't owned or null terminated; std::string_view
+// for the names in headers.
+class NameView {
+	const char *chars;
+	size_t len;
+
+    public:
+	NameView(void) : chars(""), len(0)
+	{
+	}
+	NameView(const char *chars, size_t len) : chars(chars), len(len)
+	{
+	}
+	// Null terminated
+	NameView(const char *chars) : chars(chars), len(std::strlen(chars))
+	{
+	}
+	NameView(const std::string &name) : chars(name.data()), len(name.size())
+	{
+	}
+	// The name in a username field of a header; up to its first null
+	// terminator, or all 32 bytes if there isn't one.
+	static NameView from_field(const uint8_t *field)
+	{
+		const char *name = (const char *)field;
+		const void *end = std::memchr(name, '\0', username_len);
+		return NameView(name, end == nullptr ?
+					      username_len :
+					      (const char *)end - name);
+	}
+	const char *data(void) const
+	{
+		return chars;
+	}
+	size_t size(void) const
+	{
+		return len;
+	}
+	bool empty(void) const
+	{
+		return len == 0;
+	}
+	// A copy that owns its characters (allocates).
+	std::string str(void) const
+	{
+		return std::string(chars, len);
+	}
+	bool operator==(const NameView &other) const
+	{
+		return len == other.len && std::memcmp(chars, other.chars, len) == 0;
+	}
+	bool operator!=(const NameView &other) const
+	{
+		return !(*this == other);
+	}
+	// FNV-1a, the same for a name wherever it is stored.
+	size_t hash(void) const
+	{
+		uint64_t hash = 0xcbf29ce484222325ULL;
+		for (size_t i = 0; i < len; ++i) {
+			hash ^= (uint8_t)chars[i];
+			hash *= 0x100000001b3ULL;
+		}
+		return (size_t)hash;
+	}
+};
+
+inline std::ostream &operator<<(std::ostream &out, const NameView &name)
+{
+	return out.write(name.data(), name.size());
+}
+
+class MessageHeaderView {
+	const uint8_t *header;
+
+	uint16_t read_u16(size_t begin) const
+	{
+		return (uint16_t)((header[begin] << 8) | header[begin + 1]);
+	}
+
+    public:
+	// View the 166 byte header at header.
+	explicit MessageHeaderView(const uint8_t *header) : header(header)
+	{
+	}
+	MessageHeaderView(const MessageHeader &header) : header(header.data())
+	{
+	}
+	// The header's bytes
+	const uint8_t *data(void) const
+	{
+		return header;
+	}
+	static size_t size(void)
+	{
+		return std::tuple_size<MessageHeader>::value;
+	}
+	uint16_t get_packet_number(void) const
+	{
+		return read_u16(packet_number_begin);
+	}
+	uint8_t get_version_number(void) const
+	{
+		return header[header_version_begin];
+	}
+	NameView get_source_username(void) const
+	{
+		return NameView::from_field(header + source_username_begin);
+	}
+	NameView get_dest_username(void) const
+	{
+		return NameView::from_field(header + dest_username_begin);
+	}
+	uint8_t get_message_type(void) const
+	{
+		return header[message_type_begin];
+	}
+	uint16_t get_data_packet_length(void) const
+	{
+		return read_u16(data_packet_length_begin);
+	}
+	// Whether more frames of the same message follow this one.
+	bool get_more_fragments(void) const
+	{
+		return header[frame_flags_begin] & frame_flag_more_fragments;
+	}
+	// All of the frame flags (frame_flag_...)
+	uint8_t get_frame_flags(void) const
+	{
+		return header[frame_flags_begin];
+	}
+	// The frame's 64 bit sequence number; the packet number, if it
+	// hasn't one.
+	uint64_t get_sequence_number(void) const
+	{
+		uint64_t sequence = 0;
+		if (header[frame_flags_begin] & frame_flag_sequence)
+			for (size_t i = sequence_high_begin;
+			     i <= sequence_high_end; ++i)
+				sequence = (sequence << 8) | header[i];
+		return (sequence << 16) | get_packet_number();
+	}
+	// The ranges of sequence numbers an ACK acknowledges, copied into
+	// ranges (room for max_ack_ranges), each extended to the 64 bit
+	// sequence number nearest the ACK's own. Returns how many there are;
+	// 0 if the ACK is for its own sequence number alone.
+	size_t get_ack_ranges(AckRange *ranges) const
+	{
+		if (!(header[frame_flags_begin] & frame_flag_ack_ranges))
+			return 0;
+		size_t count = std::min<size_t>(header[ack_range_count_begin],
+						max_ack_ranges);
+		uint64_t reference = get_sequence_number();
+		for (size_t i = 0; i < count; ++i) {
+			ranges[i].first = extend_packet_number(
+				read_u16(ack_ranges_begin + 4 * i), reference);
+			ranges[i].last = extend_packet_number(
+				read_u16(ack_ranges_begin + 4 * i + 2),
+				reference);
+		}
+		return count;
+	}
+	// Whether the header's checksum is good.
+	bool verify_checksum(void) const
+	{
+		uint8_t field[checksum_size];
+		Checksum::calculate(MessageLayer::checksum_algorithm(
+					    get_version_number()),
+				    header, header_checksum_begin, field);
+		return std::equal(field, field + checksum_size,
+				  header + header_checksum_begin);
+	}
+	// Whether the passed data packet matches the checksum in the header.
+	template <typename T>
+	bool verify_data_packet_checksum(const T &data_packet_container) const
+	{
+		uint8_t field[checksum_size];
+		Checksum::calculate(MessageLayer::checksum_algorithm(
+					    get_version_number()),
+				    data_packet_container.data(),
+				    data_packet_container.size(), field);
+		return std::equal(field, field + checksum_size,
+				  header + data_packet_checksum_begin);
+	}
+};
+
+// Build a message from a viewed header and a container (see
+// build_message).
+template <typename T>
+std::vector<uint8_t> build_message(const MessageHeaderView &message_header,
+				   const T &message)
+{
+	std::vector<uint8_t> message_to_send;
+	message_to_send.reserve(message_header.size() + message.size());
+	message_to_send.insert(message_to_send.end(), message_header.data(),
+			       message_header.data() + message_header.size());
+	message_to_send.insert(message_to_send.end(), message.begin(),
+			       message.end());
+	return message_to_send;
+}
@@ -24,9 +24,9 @@ extern "C" {
 // the checksum section of the header.
 void MessageLayer::calculate_header_sum(void)
 {
-	picosha2::hash256(header.begin(),
-			  header.begin() + header_checksum_begin,
-			  header.begin() + header_checksum_begin, header.end());
+	Checksum::calculate(checksum_algorithm(), header.data(),
+			    header_checksum_begin,
+			    header.data() + header_checksum_begin);
 }
 
 // Verify the checksum of the header's contents against
@@ -36,9 +36,8 @@ bool MessageLayer::verify_header_sum(void)
 {
 	// Hash the content of the header, and place it in the checksum buffer
 	// to check whether it is valid.
-	picosha2::hash256(header.begin(),
-			  header.begin() + header_checksum_begin,
-			  checksum.begin(), checksum.end());
+	Checksum::calculate(checksum_algorithm(), header.data(),
+			    header_checksum_begin, checksum.data());
 	// Make sure the checksums match
 	return std::equal(header.begin() + header_checksum_begin, header.end(),
 			  checksum.begin());
@@ -94,6 +93,57 @@ void MessageLayer::verify_checksum(void)
 	valid = verify_header_sum();
 }
 
+// Verify the checksums of count headers at once (headers[i] points to
+// the i'th), hashing them together with Sha256::hash_many.
+// valid[i] is set to whether the i'th header's checksum is good.
+void MessageLayer::verify_checksums(const uint8_t *const *headers,
+				   size_t count, std::vector<bool> &valid)
+{
+	// SHA-256 headers are hashed a chunk at a time, so the digests can
+	// live on the stack. The fast checksums are simply checked one by one.
+	static const size_t constexpr chunk = 64;
+	const uint8_t *sha256_headers[chunk];
+	size_t sha256_index[chunk];
+	uint8_t digests[chunk * sha256_digest_size];
+	uint8_t field[checksum_size];
+	valid.resize(count);
+	for (size_t first = 0; first < count; first += chunk) {
+		size_t in_chunk = std::min(chunk, count - first);
+		size_t sha256_count = 0;
+		for (size_t i = first; i < first + in_chunk; ++i) {
+			ChecksumAlgorithm algorithm = checksum_algorithm(
+				headers[i][header_version_begin]);
+			if (algorithm == CHECKSUM_SHA256) {
+				sha256_headers[sha256_count] = headers[i];
+				sha256_index[sha256_count++] = i;
+				continue;
+			}
+			Checksum::calculate(algorithm, headers[i],
+					    header_checksum_begin, field);
+			valid[i] = std::equal(
+				headers[i] + header_checksum_begin,
+				headers[i] + header_checksum_end + 1, field);
+		}
+		Sha256::hash_many(sha256_headers, sha256_count,
+				  header_checksum_begin, digests);
+		for (size_t i = 0; i < sha256_count; ++i)
+			valid[sha256_index[i]] = std::equal(
+				sha256_headers[i] + header_checksum_begin,
+				sha256_headers[i] + header_checksum_end + 1,
+				digests + i * sha256_digest_size);
+	}
+}
+
+// Same again, for count headers one after the other in memory.
+void MessageLayer::verify_checksums(const MessageHeader *headers, size_t count,
+				   std::vector<bool> &valid)
+{
+	std::vector<const uint8_t *> pointers(count);
+	for (size_t i = 0; i < count; ++i)
+		pointers[i] = headers[i].data();
+	verify_checksums(pointers.data(), count, valid);
+}
+
 // Retrieve the first 2 bytes from the header
 // and convert them to host format and return
 uint16_t MessageLayer::get_packet_number(void)
@@ -120,6 +170,34 @@ MessageLayer &MessageLayer::set_version_number(uint8_t v_num)
 	return (*this);
 }
 
+// Checksum algorithm used by headers of the passed version.
+ChecksumAlgorithm MessageLayer::checksum_algorithm(uint8_t version)
+{
+	switch (version) {
+	case header_version_crc32c:
+		return CHECKSUM_CRC32C;
+	case header_version_xxh3:
+		return CHECKSUM_XXH3;
+	default:
+		return CHECKSUM_SHA256;
+	}
+}
+
+// Checksum algorithm used by the header's version
+ChecksumAlgorithm MessageLayer::checksum_algorithm(void)
+{
+	return checksum_algorithm(get_version_number());
+}
+
+// The version to reply to a peer using the passed version with;
+// their own if we support it, or else version 3 (SHA-256).
+uint8_t MessageLayer::reply_version(uint8_t version)
+{
+	if (version == header_version_crc32c || version == header_version_xxh3)
+		return version;
+	return header_version_sha256;
+}
+
 // Internal function for setting usernames within
 // the header
 // Specific function, making sure the length is never longer than
@@ -208,6 +286,79 @@ MessageLayer &MessageLayer::set_data_packet_length(uint16_t data_packet_len)
 	return (*this);
 }
 
+// Whether more frames of the same message follow this one (see
+// frame_flag_more_fragments).
+bool MessageLayer::get_more_fragments(void)
+{
+	return header[frame_flags_begin] & frame_flag_more_fragments;
+}
+
+MessageLayer &MessageLayer::set_more_fragments(bool more)
+{
+	if (more)
+		header[frame_flags_begin] |= frame_flag_more_fragments;
+	else
+		header[frame_flags_begin] &= ~frame_flag_more_fragments;
+	return (*this);
+}
+
+// All of the frame flags (frame_flag_...) at once
+uint8_t MessageLayer::get_frame_flags(void)
+{
+	return header[frame_flags_begin];
+}
+
+MessageLayer &MessageLayer::set_frame_flags(uint8_t flags)
+{
+	header[frame_flags_begin] = flags;
+	return (*this);
+}
+
+// The frame's 64 bit sequence number; the packet number, if it hasn't one.
+uint64_t MessageLayer::get_sequence_number(void)
+{
+	uint64_t sequence = 0;
+	if (header[frame_flags_begin] & frame_flag_sequence)
+		for (size_t i = sequence_high_begin; i <= sequence_high_end;
+		     ++i)
+			sequence = (sequence << 8) | header[i];
+	return (sequence << 16) | get_packet_number();
+}
+
+// Set the packet number to the low 16 bits of the sequence number, and
+// keep the rest, setting frame_flag_sequence.
+MessageLayer &MessageLayer::set_sequence_number(uint64_t sequence)
+{
+	set_packet_number((uint16_t)sequence);
+	sequence >>= 16;
+	for (size_t i = sequence_high_end; i >= sequence_high_begin; --i) {
+		header[i] = sequence & 0xff;
+		sequence >>= 8;
+	}
+	header[frame_flags_begin] |= frame_flag_sequence;
+	return (*this);
+}
+
+// Make an ACK for the count (no more than max_ack_ranges) ranges, setting
+// frame_flag_ack_ranges. Each range must be within 32767 of the sequence
+// number (or packet number) set.
+MessageLayer &MessageLayer::set_ack_ranges(const AckRange *ranges,
+					   size_t count)
+{
+	count = std::min(count, max_ack_ranges);
+	header[frame_flags_begin] |= frame_flag_ack_ranges;
+	header[ack_range_count_begin] = (uint8_t)count;
+	uint8_t *range = header.data() + ack_ranges_begin;
+	// Only the low 16 bits of each
+	for (size_t i = 0; i < count; ++i, range += 4) {
+		range[0] = (ranges[i].first >> 8) & 0xff;
+		range[1] = ranges[i].first & 0xff;
+		range[2] = (ranges[i].last >> 8) & 0xff;
+		range[3] = ranges[i].last & 0xff;
+	}
+	return (*this);
+}
+
 // calculate the checksum for the header, and return a reference to
 // the internal header of the MessageLayer.
 // (last function called in builder pattern when setting the attributes)
@@ -233,15 +384,6 @@ MessageHeader MessageLayer::build_cpy(void)
 // added safety.
 std::string build_string_safe(const char *str, size_t len)
 {
-	std::string username_str = "";
-	for (size_t i = 0; i < len; ++i) {
-		// While there are still characters to add, continue.
-		// Otherwise stop.
-		if (str[i] != '\0') {
-			username_str.push_back(str[i]);
-		} else {
-			break;
-		}
-	}
-	return username_str;
+	// Up to the null terminator, in one allocation.
+	return std::string(str, strnlen(str, len));
 }
@@ -15,13 +15,45 @@ Creation: Please use the provided Make file that will make both the
 #include <vector>
 #include <string>
 #include <array>
+#include <algorithm>
 
-// From GitHub, MIT licenced
-// SHA256 hashing function
-#include "picosha2.hpp"
+// SHA256 hashing function (hardware accelerated where the CPU allows)
+#include "Sha256.hpp"
+// Faster integrity checksums for the newer header versions
+#include "Checksum.hpp"
 
-// Message Type enumeration
-enum MessageTypes { LOGIN = 0, ERROR, WHO, ACK, MESSAGE, DISCONNECT, NACK };
+// Message Type enumeration. FILE_CHUNK carries a piece of a file, routed
+// (and acknowledged) like a MESSAGE. RESYNC asks the destination to start
+// its channel to us (or the room) over, and is passed on without an ACK.
+// CREDIT, from the server, grants a client that sends sequence numbers
+// the most frames it may send ahead of the server's ACKs (see
+// build_credit). A NACK to such a client, for a frame held back, may say
+// how long to wait before sending it again (see build_retry).
+enum MessageTypes {
+	LOGIN = 0,
+	ERROR,
+	WHO,
+	ACK,
+	MESSAGE,
+	DISCONNECT,
+	NACK,
+	FILE_CHUNK,
+	RESYNC,
+	CREDIT
+};
+// Most bytes in a RESYNC's data packet; "all" for the channel to the
+// room, or nothing for the one to us.
+static const size_t constexpr resync_packet_max = 3;
+// The ERROR the server sends a client whose messages it is holding back
+// for a while, for sending them faster than it allows
+static const char *const throttled_error =
+	"You are sending too fast; your messages are being held back.";
+// The ERROR the server sends a client that sent a message (or a chunk of
+// a file) to a user who isn't logged in
+static inline std::string missing_user_error(const std::string &username)
+{
+	return "User: " + username + " does not exist.";
+}
 // Maximum username length
 static const uint32_t constexpr username_len = 32;
 
@@ -44,9 +76,112 @@ static const uint32_t constexpr future_use_begin = 102;
 static const uint32_t constexpr future_use_end = 133;
 static const uint32_t constexpr header_checksum_begin = 134;
 static const uint32_t constexpr header_checksum_end = 165;
+// Flags about the frame, in the first byte of the future use field
+static const uint32_t constexpr frame_flags_begin = future_use_begin;
+
+// Largest data packet one frame can carry
+static const size_t constexpr max_data_packet_length = 65535;
+// Frame flag; more frames of the same message follow this one. A message
+// too big for one data packet is sent as several frames in a row, all
+// from the same source to the same destination, the last of which has
+// the flag clear.
+static const uint8_t constexpr frame_flag_more_fragments = 0x01;
+// Frame flag; the data packet is the next chunk of the sender's channel to
+// the destination (see Crypto::ChannelEncryptor), rather than a message
+// encrypted on its own.
+static const uint8_t constexpr frame_flag_channel = 0x02;
+// Frame flag; the channel starts (over) with this frame, and its data
+// packet begins with the header of the channel's new stream.
+static const uint8_t constexpr frame_flag_channel_start = 0x04;
+// Frame flag; on an ACK, the future use field holds ranges of packet
+// numbers acknowledged together (see AckRange), rather than the ACK being
+// for its own packet number alone. On a frame a client sends, the client
+// understands ACKs like that, so the server may hold on to its ACK and
+// send it along with others.
+static const uint8_t constexpr frame_flag_ack_ranges = 0x08;
+// Frame flag; the frame has a 64 bit sequence number, the packet number
+// being its low 16 bits and the rest being kept at the end of the future
+// use field (see set_sequence_number). An ACK or NACK for such a frame has
+// the same. Peers that don't know of them see the packet number alone.
+static const uint8_t constexpr frame_flag_sequence = 0x10;
+// Number of ACK ranges, followed by the ranges (4 bytes each), after the
+// frame flags.
+static const uint32_t constexpr ack_range_count_begin = frame_flags_begin + 1;
+static const uint32_t constexpr ack_ranges_begin = ack_range_count_begin + 1;
+// The high 48 bits of the sequence number
+static const uint32_t constexpr sequence_high_begin = 128;
+static const uint32_t constexpr sequence_high_end = future_use_end;
+// Most ranges one ACK can carry
+static const size_t constexpr max_ack_ranges =
+	(sequence_high_begin - ack_ranges_begin) / 4;
+
+// Sequence numbers first to last (inclusive) acknowledged by one ACK.
+// Only the low 16 bits of each are sent, so every range of an ACK must be
+// within 32767 of the ACK's own sequence number (or packet number).
+struct AckRange {
+	uint64_t first;
+	uint64_t last;
+};
+
+// Whether packet number a comes before b, allowing for them wrapping
+// around (serial number arithmetic, RFC 1982); true if b is less than half
+// a wrap ahead of a.
+inline bool packet_number_before(uint16_t a, uint16_t b)
+{
+	return (int16_t)(uint16_t)(a - b) < 0;
+}
+// Same again, for 64 bit sequence numbers
+inline bool sequence_before(uint64_t a, uint64_t b)
+{
+	return (int64_t)(a - b) < 0;
+}
+// The sequence number nearest reference (within 32768 of it) whose low 16
+// bits are packet_number.
+inline uint64_t extend_packet_number(uint16_t packet_number, uint64_t reference)
+{
+	return reference +
+	       (int16_t)(uint16_t)(packet_number - (uint16_t)reference);
+}
+
+// The data packet of a CREDIT frame; the number of frames granted (32 bit,
+// network byte order).
+using CreditPacket = std::array<uint8_t, 4>;
+inline CreditPacket build_credit(uint32_t frames)
+{
+	return { { (uint8_t)(frames >> 24), (uint8_t)(frames >> 16),
+		   (uint8_t)(frames >> 8), (uint8_t)frames } };
+}
+// The frames granted by the data packet of a CREDIT frame (which must be
+// as long as a CreditPacket).
+inline uint32_t read_credit(const uint8_t *data_packet)
+{
+	return (uint32_t)data_packet[0] << 24 | (uint32_t)data_packet[1] << 16 |
+	       (uint32_t)data_packet[2] << 8 | data_packet[3];
+}
+// The data packet of a NACK for a frame held back by the server (over the
+// rate limits, or behind one that is); how long to wait before sending it
+// again (ms). Laid out like a CreditPacket.
+using RetryPacket = CreditPacket;
+inline RetryPacket build_retry(uint32_t ms)
+{
+	return build_credit(ms);
+}
+// The wait asked for by the data packet of a NACK (which must be as long
+// as a RetryPacket).
+inline uint32_t read_retry(const uint8_t *data_packet)
+{
+	return read_credit(data_packet);
+}
 
 using MessageHeader = std::array<uint8_t, 166>;
 
+// Header versions. The version decides which algorithm the header and data
+// packet checksums are calculated with; SHA-256 for version 3 (and every
+// version before it), CRC32C for 4 and xxHash3 for 5.
+static const uint8_t constexpr header_version_sha256 = 3;
+static const uint8_t constexpr header_version_crc32c = 4;
+static const uint8_t constexpr header_version_xxh3 = 5;
+
 class MessageLayer {
 	// Message header for communications between the client and server.
 	// 166 bytes
@@ -62,6 +197,8 @@ class MessageLayer {
 	// the checksum stored in the header. If they aren't the same
 	// there is something amiss within the header.
 	bool verify_header_sum(void);
+	// Checksum algorithm used by the header's version
+	ChecksumAlgorithm checksum_algorithm(void);
 	// Internal function for setting usernames within
 	// the header
 	// Specific function, making sure the length is never longer than
@@ -93,6 +230,14 @@ class MessageLayer {
 	// Being able to verify the checksum at any time is very useful for the
 	// reuse of the MessageLayer.
 	void verify_checksum(void);
+	// Verify the checksums of count headers at once (headers[i] points to
+	// the i'th), hashing them together with Sha256::hash_many.
+	// valid[i] is set to whether the i'th header's checksum is good.
+	static void verify_checksums(const uint8_t *const *headers,
+				     size_t count, std::vector<bool> &valid);
+	// Same again, for count headers one after the other in memory.
+	static void verify_checksums(const MessageHeader *headers, size_t count,
+				     std::vector<bool> &valid);
 	// Retrieve the first 2 bytes from the header
 	// and convert them to host format and return
 	uint16_t get_packet_number(void);
@@ -101,6 +246,11 @@ class MessageLayer {
 	MessageLayer &set_packet_number(uint16_t p_num);
 	uint8_t get_version_number(void);
 	MessageLayer &set_version_number(uint8_t v_num);
+	// Checksum algorithm used by headers of the passed version.
+	static ChecksumAlgorithm checksum_algorithm(uint8_t version);
+	// The version to reply to a peer using the passed version with;
+	// their own if we support it, or else version 3 (SHA-256).
+	static uint8_t reply_version(uint8_t version);
 	// Index into header to the start of the source username,
 	// and pull the correct number of bytes (up to 32)
 	std::string get_source_username(void);
@@ -122,19 +272,34 @@ class MessageLayer {
 	// convert the passed short to network byte order
 	// and put it in it's place within the header.
 	MessageLayer &set_data_packet_length(uint16_t data_packet_len);
+	// Whether more frames of the same message follow this one (see
+	// frame_flag_more_fragments).
+	bool get_more_fragments(void);
+	MessageLayer &set_more_fragments(bool more);
+	// All of the frame flags (frame_flag_...) at once
+	uint8_t get_frame_flags(void);
+	MessageLayer &set_frame_flags(uint8_t flags);
+	// The frame's 64 bit sequence number; the packet number, if it
+	// hasn't one.
+	uint64_t get_sequence_number(void);
+	// Set the packet number to the low 16 bits of the sequence number,
+	// and keep the rest, setting frame_flag_sequence.
+	MessageLayer &set_sequence_number(uint64_t sequence);
+	// Make an ACK for the count (no more than max_ack_ranges) ranges,
+	// setting frame_flag_ack_ranges. Each range must be within 32767 of
+	// the sequence number (or packet number) set.
+	MessageLayer &set_ack_ranges(const AckRange *ranges, size_t count);
 
 	// Calculate the checksum of the data packet, and store it in
 	// the appropriate place in the header
-	// The +1's are because C++ iterators are exclusive
 	template <typename T>
 	MessageLayer &
 	calculate_data_packet_checksum(const T &data_packet_container)
 	{
-		picosha2::hash256(data_packet_container.begin(),
-				  data_packet_container.end(),
-				  header.begin() + data_packet_checksum_begin,
-				  header.begin() +
-					  (data_packet_checksum_end + 1));
+		Checksum::calculate(checksum_algorithm(),
+				    data_packet_container.data(),
+				    data_packet_container.size(),
+				    header.data() + data_packet_checksum_begin);
 		return (*this);
 	}
 
@@ -143,9 +308,10 @@ class MessageLayer {
 	template <typename T>
 	bool verify_data_packet_checksum(const T &data_packet_container)
 	{
-		picosha2::hash256(data_packet_container.begin(),
-				  data_packet_container.end(), checksum.begin(),
-				  checksum.end());
+		Checksum::calculate(checksum_algorithm(),
+				    data_packet_container.data(),
+				    data_packet_container.size(),
+				    checksum.data());
 		// Make sure the checksums match
 		return std::equal(header.begin() + data_packet_checksum_begin,
 				  header.begin() +
@@ -168,12 +334,13 @@ class MessageLayer {
 // added safety.
 std::string build_string_safe(const char *str, size_t len);
 // Template function to build a message from a container and a header
-template <typename T>
-std::vector<uint8_t> build_message(const MessageHeader &message_header,
-				   const T &message)
+// (into a std::vector of bytes, or another container of them such as
+// PooledBytes).
+template <typename T, typename Bytes = std::vector<uint8_t> >
+Bytes build_message(const MessageHeader &message_header, const T &message)
 {
 	// construct the entire message to send
-	std::vector<uint8_t> message_to_send;
+	Bytes message_to_send;
 	// Reserve the message to be the correct size
 	message_to_send.reserve(message_header.size() + message.size());
 	// Put the header in first
@@ -18,8 +18,29 @@ Creation: Please use the provided Make file that will make both the
 ----------------------------------------------------------------------*/
 
 #include <cassert>
+#include <cstdlib>
 #include <iostream>
+#include <new>
 #include "MessageLayer.hpp"
+#include "MessageHeaderView.hpp"
+#include "FrameReader.hpp"
+
+// Count heap allocations, to check the header views never make any.
+static size_t allocations = 0;
+
+void *operator new(size_t size)
+{
+	++allocations;
+	void *memory = std::malloc(size == 0 ? 1 : size);
+	if (memory == nullptr)
+		throw std::bad_alloc();
+	return memory;
+}
+
+void operator delete(void *memory) noexcept
+{
+	std::free(memory);
+}
 
 int main(void)
 {
@@ -61,4 +82,233 @@ int main(void)
 	assert(header_5.verify_data_packet_checksum(message));
 	assert(!(header_5.verify_data_packet_checksum<std::string>(
 		"banana soup\0")));
+	// The more fragments flag is covered by the header checksum, and
+	// can be cleared again when the header is reused.
+	MessageLayer fragment;
+	fragment.set_more_fragments(true).set_data_packet_length(
+		max_data_packet_length);
+	MessageLayer fragment_received(fragment.build_cpy());
+	assert(fragment_received.valid && fragment_received.get_more_fragments());
+	assert(MessageHeaderView(fragment.get_internal_header())
+		       .get_more_fragments());
+	assert(fragment_received.get_data_packet_length() == 65535);
+	fragment.get_internal_header()[frame_flags_begin] ^=
+		frame_flag_more_fragments;
+	MessageLayer fragment_tampered(fragment.get_internal_header());
+	assert(!fragment_tampered.valid);
+	fragment.set_more_fragments(true).set_more_fragments(false);
+	assert(!fragment.get_more_fragments());
+	assert(!MessageHeaderView(fragment.build()).get_more_fragments());
+	// Batch verification picks out exactly the corrupted headers
+	std::vector<MessageHeader> batch;
+	for (uint16_t i = 0; i < 70; ++i)
+		batch.push_back(MessageLayer()
+					.set_packet_number(i)
+					.set_source_username("BananaSoup")
+					.set_data_packet_length(i)
+					.build_cpy());
+	batch[3][packet_number_begin] ^= 1;
+	batch[69][header_checksum_end] ^= 1;
+	std::vector<const uint8_t *> headers;
+	for (auto &batch_header : batch)
+		headers.push_back(batch_header.data());
+	std::vector<bool> valid;
+	MessageLayer::verify_checksums(headers.data(), headers.size(), valid);
+	assert(valid.size() == batch.size());
+	for (size_t i = 0; i < batch.size(); ++i)
+		assert(valid[i] == (i != 3 && i != 69));
+	MessageLayer::verify_checksums(batch.data(), 5, valid);
+	assert(valid.size() == 5 && valid[2] && !valid[3]);
+	// Known answers for the fast checksums
+	assert(Checksum::crc32c("123456789", 9) == 0xe3069283);
+	assert(Checksum::xxh3("", 0) == 0x2d06800538d394c2ULL);
+	assert(Checksum::xxh3("abc", 3) == 0x78af5f94892f3950ULL);
+	std::vector<uint8_t> pattern(3000);
+	for (size_t i = 0; i < pattern.size(); ++i)
+		pattern[i] = (uint8_t)(i % 251);
+	assert(Checksum::xxh3(pattern.data(), 200) == 0xf42a8864feaf0703ULL);
+	assert(Checksum::xxh3(pattern.data(), 3000) == 0x1b846747012c24aaULL);
+	// Every header version builds and verifies with its own algorithm,
+	// and a header is no good read as another version.
+	const uint8_t versions[] = { header_version_sha256,
+				     header_version_crc32c,
+				     header_version_xxh3 };
+	std::vector<MessageHeader> mixed;
+	for (uint8_t version : versions) {
+		assert(MessageLayer::reply_version(version) == version);
+		MessageLayer versioned;
+		versioned.set_version_number(version)
+			.set_source_username("BananaSoup")
+			.set_data_packet_length(message.size())
+			.calculate_data_packet_checksum(message);
+		MessageLayer received(versioned.build_cpy());
+		assert(received.valid);
+		assert(received.verify_data_packet_checksum(message));
+		assert(!received.verify_data_packet_checksum<std::string>(
+			"banana soup\0"));
+		mixed.push_back(versioned.build_cpy());
+		received.set_version_number(version == header_version_xxh3 ?
+						    header_version_crc32c :
+						    header_version_xxh3);
+		received.verify_checksum();
+		assert(!received.valid);
+	}
+	// CRC32C is stored big endian at the start of the field
+	uint32_t crc = Checksum::crc32c(message.data(), message.size());
+	assert(mixed[1][data_packet_checksum_begin] == crc >> 24 &&
+	       mixed[1][data_packet_checksum_begin + 3] == (crc & 0xff) &&
+	       mixed[1][data_packet_checksum_end] == 0);
+	// Unknown versions are answered with version 3
+	assert(MessageLayer::reply_version(1) == header_version_sha256);
+	assert(MessageLayer::reply_version(42) == header_version_sha256);
+	// Batches may mix versions
+	mixed.push_back(mixed[2]);
+	mixed[3][future_use_begin] ^= 1;
+	MessageLayer::verify_checksums(mixed.data(), mixed.size(), valid);
+	assert(valid[0] && valid[1] && valid[2] && !valid[3]);
+	// Header views read the same fields in place, without allocating
+	MessageLayer viewed;
+	viewed.set_packet_number(513)
+		.set_version_number(header_version_xxh3)
+		.set_source_username("BananaSoup")
+		.set_dest_username(std::string(40, 'x'))
+		.set_message_type(MessageTypes::MESSAGE)
+		.set_data_packet_length(message.size())
+		.calculate_data_packet_checksum(message);
+	const MessageHeader viewed_header = viewed.build_cpy();
+	size_t allocations_before = allocations;
+	MessageHeaderView view(viewed_header);
+	assert(view.get_packet_number() == 513);
+	assert(view.get_version_number() == header_version_xxh3);
+	assert(view.get_message_type() == MessageTypes::MESSAGE);
+	assert(view.get_data_packet_length() == message.size());
+	assert(view.get_source_username() == "BananaSoup");
+	assert(view.get_source_username() != "BananaSoup2");
+	assert(view.get_source_username().hash() == NameView("BananaSoup").hash());
+	assert(view.get_dest_username().size() == username_len - 1);
+	assert(view.verify_checksum());
+	assert(view.verify_data_packet_checksum(message));
+	assert(allocations == allocations_before);
+	assert(view.get_source_username().str() == viewed.get_source_username());
+	assert(view.get_dest_username().str() == viewed.get_dest_username());
+	// A username filling the whole field has no null terminator
+	MessageHeader full_name = viewed_header;
+	std::memset(full_name.data() + source_username_begin, 'y', username_len);
+	assert(MessageHeaderView(full_name).get_source_username() ==
+	       NameView(std::string(username_len, 'y')));
+	// Messages built from a view match those built from the header
+	assert(build_message(view, message) ==
+	       build_message(viewed_header, message));
+	// Packet and sequence numbers compare across wrapping around, and a
+	// packet number extends to the nearest sequence number.
+	assert(packet_number_before(65530, 3));
+	assert(!packet_number_before(3, 65530));
+	assert(packet_number_before(1, 2) && !packet_number_before(2, 2));
+	assert(sequence_before(UINT64_MAX, 0));
+	assert(!sequence_before(0, UINT64_MAX));
+	assert(extend_packet_number(2, 0x1fffe) == 0x20002);
+	assert(extend_packet_number(65534, 0x20002) == 0x1fffe);
+	assert(extend_packet_number(5, 0x20010) == 0x20005);
+	assert(extend_packet_number(0, 3) == 0);
+	// A sequence number keeps its high bits at the end of the future use
+	// field, and its low 16 as the packet number.
+	uint64_t sequence = 0x123456780002ULL;
+	MessageLayer sequenced;
+	sequenced.set_packet_number(9).set_sequence_number(sequence).build();
+	assert(sequenced.get_packet_number() == 2);
+	assert(sequenced.get_sequence_number() == sequence);
+	assert(MessageHeaderView(sequenced.get_internal_header())
+		       .get_sequence_number() == sequence);
+	assert(view.get_sequence_number() == view.get_packet_number());
+	// An ACK carries ranges (across the low 16 bits wrapping) in the
+	// future use field, or stands for its own sequence number alone.
+	AckRange ranges[max_ack_ranges + 1];
+	for (size_t i = 0; i <= max_ack_ranges; ++i)
+		ranges[i] = { sequence - 6 + 10 * i, sequence - 3 + 10 * i };
+	MessageLayer ack_ml;
+	MessageHeader &ack = ack_ml.set_message_type(MessageTypes::ACK)
+				     .set_version_number(header_version_crc32c)
+				     .set_frame_flags(frame_flag_more_fragments)
+				     .set_sequence_number(sequence + 100)
+				     .set_ack_ranges(ranges, max_ack_ranges + 1)
+				     .build();
+	MessageHeaderView ack_view(ack);
+	AckRange got[max_ack_ranges];
+	assert(ack_view.verify_checksum());
+	assert(ack_view.get_more_fragments());
+	assert(ack_view.get_sequence_number() == sequence + 100);
+	assert(ack_view.get_ack_ranges(got) == max_ack_ranges);
+	for (size_t i = 0; i < max_ack_ranges; ++i)
+		assert(got[i].first == ranges[i].first &&
+		       got[i].last == ranges[i].last);
+	assert((uint16_t)got[0].first == 65532 && (uint16_t)got[1].last == 9);
+	assert(view.get_ack_ranges(got) == 0);
+	// A CREDIT's data packet holds the frames granted
+	CreditPacket credit = build_credit(0x01020304);
+	assert(credit[0] == 1 && credit[3] == 4);
+	assert(read_credit(credit.data()) == 0x01020304);
+	assert(read_credit(build_credit(UINT32_MAX).data()) == UINT32_MAX);
+	// And a NACK's, the wait asked for
+	assert(read_retry(build_retry(1500).data()) == 1500);
+	// A stream of frames (up to the largest there can be, and one with a
+	// bad header) comes out of a FrameReader whole and in order, however
+	// it is split up as it is fed in.
+	std::vector<uint8_t> stream;
+	std::vector<size_t> lengths;
+	for (uint16_t i = 0; i < 60; ++i) {
+		size_t length = i == 7 ? 65535 : (i * 97) % 700;
+		std::vector<uint8_t> data_packet(length, (uint8_t)i);
+		MessageLayer framed;
+		MessageHeader frame_header =
+			framed.set_packet_number(i)
+				.set_version_number(versions[i % 3])
+				.set_data_packet_length(length)
+				.calculate_data_packet_checksum(data_packet)
+				.build_cpy();
+		if (i == 30) {
+			// Only the bad header is dropped from the stream
+			frame_header[packet_number_begin] ^= 1;
+			data_packet.clear();
+		}
+		std::vector<uint8_t> frame = build_message(frame_header,
+							   data_packet);
+		stream.insert(stream.end(), frame.begin(), frame.end());
+		lengths.push_back(data_packet.size());
+	}
+	for (size_t split = 1; split < 5000; split = split * 3 + 1) {
+		FrameReader reader(256);
+		FrameView frame;
+		size_t frames = 0;
+		for (size_t fed = 0; fed < stream.size(); fed += split) {
+			reader.feed(stream.data() + fed,
+				    std::min(split, stream.size() - fed));
+			while (reader.next(frame)) {
+				assert(frame.valid == (frames != 30));
+				assert(frame.data_packet.size() == lengths[frames]);
+				if (frame.valid) {
+					assert(frame.header.get_packet_number() ==
+					       frames);
+					assert(frame.header.verify_data_packet_checksum(
+						frame.data_packet));
+				}
+				++frames;
+			}
+		}
+		assert(frames == lengths.size() && reader.buffered() == 0);
+	}
+	// A shared data packet outlives the reader moving on past it
+	FrameReader sharing(512);
+	FrameView shared_frame;
+	sharing.feed(stream.data(), 166 + lengths[0] + 166 + lengths[1]);
+	assert(sharing.next(shared_frame) && sharing.next(shared_frame));
+	SharedBytes kept = shared_frame.data_packet.share();
+	assert(kept.get() == shared_frame.data_packet.data());
+	for (size_t fed = 0; fed < stream.size(); fed += 300) {
+		sharing.feed(stream.data() + fed,
+			     std::min((size_t)300, stream.size() - fed));
+		while (sharing.next(shared_frame))
+			;
+	}
+	assert(std::all_of(kept.get(), kept.get() + lengths[1],
+			   [](uint8_t byte) { return byte == 1; }));
 }
@@ -0,0 +1,695 @@
+/*======================================================================
+COIS-4310H - Sha256
+Name: Sha256.cpp
+Purpose: SHA-256 for the MessageLayer checksums, using the fastest
+	implementation the CPU supports; the SHA extensions (SHA-NI), AVX2
+	(vectorized message schedule, BMI2 rotates), or portable C++. The
+	backend is picked once, on first use, by CPU feature detection.
+	Every backend produces the same digests as picosha2.
+
+	The SHA-NI rounds follow Intel's "Intel SHA Extensions" white
+	paper. The accelerated backends are compiled for their instruction
+	sets with target attributes, so the rest of the build still runs
+	on any x86-64 (or other) CPU.
+
+Compilation: Please use the provided Make file that will make both the
+	client and the server.
+----------------------------------------------------------------------*/
+
+#include <cstring>
+#include <algorithm>
+#include "Sha256.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA256_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+// Round constants
+alignas(16) static const uint32_t round_constants[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+// Initial hash value
+static const uint32_t initial_state[8] = { 0x6a09e667, 0xbb67ae85,
+					   0x3c6ef372, 0xa54ff53a,
+					   0x510e527f, 0x9b05688c,
+					   0x1f83d9ab, 0x5be0cd19 };
+
+static inline uint32_t rotr(uint32_t x, unsigned n)
+{
+	return (x >> n) | (x << (32 - n));
+}
+
+static inline uint32_t load_be32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+	       ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+// The 64 rounds over an expanded message schedule w.
+// Inlined into each backend, so it gets compiled for their target.
+static inline __attribute__((always_inline)) void
+run_rounds(uint32_t state[8], const uint32_t w[64])
+{
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+	uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+	for (int t = 0; t < 64; ++t) {
+		uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+		uint32_t ch = (e & f) ^ (~e & g);
+		uint32_t t1 = h + s1 + ch + round_constants[t] + w[t];
+		uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+		uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + s0 + maj;
+	}
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+// Portable C++
+static void compress_scalar(uint32_t state[8], const uint8_t *blocks,
+			    size_t count)
+{
+	uint32_t w[64];
+	for (; count > 0; --count, blocks += 64) {
+		for (int t = 0; t < 16; ++t)
+			w[t] = load_be32(blocks + t * 4);
+		for (int t = 16; t < 64; ++t) {
+			uint32_t s0 = rotr(w[t - 15], 7) ^ rotr(w[t - 15], 18) ^
+				      (w[t - 15] >> 3);
+			uint32_t s1 = rotr(w[t - 2], 17) ^ rotr(w[t - 2], 19) ^
+				      (w[t - 2] >> 10);
+			w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+		}
+		run_rounds(state, w);
+	}
+}
+
+#ifdef SHA256_X86
+// Rotate each 32 bit lane right by n
+#define ROTR_EPI32(x, n) \
+	_mm_or_si128(_mm_srli_epi32((x), (n)), _mm_slli_epi32((x), 32 - (n)))
+
+// AVX2: the message schedule is expanded four words at a time in vector
+// registers, and the (inherently serial) rounds use BMI2's rorx.
+__attribute__((target("avx2,bmi2"))) static void
+compress_avx2(uint32_t state[8], const uint8_t *blocks, size_t count)
+{
+	alignas(16) uint32_t w[64];
+	const __m128i byte_swap =
+		_mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2,
+			     3);
+	for (; count > 0; --count, blocks += 64) {
+		__m128i x[4];
+		for (int i = 0; i < 4; ++i) {
+			x[i] = _mm_shuffle_epi8(
+				_mm_loadu_si128((const __m128i *)(blocks +
+								  i * 16)),
+				byte_swap);
+			_mm_store_si128((__m128i *)&w[i * 4], x[i]);
+		}
+		// w[t..t+3] from x = w[t-16..t-1]
+		for (int t = 16; t < 64; t += 4) {
+			__m128i w15 = _mm_alignr_epi8(x[1], x[0], 4);
+			__m128i w7 = _mm_alignr_epi8(x[3], x[2], 4);
+			__m128i s0 = _mm_xor_si128(
+				_mm_xor_si128(ROTR_EPI32(w15, 7),
+					      ROTR_EPI32(w15, 18)),
+				_mm_srli_epi32(w15, 3));
+			__m128i next = _mm_add_epi32(_mm_add_epi32(x[0], s0),
+						     w7);
+			// s1 of w[t-2], w[t-1] for the first two lanes, then
+			// of the just finished w[t], w[t+1] for the last two.
+			__m128i w2 = _mm_srli_si128(x[3], 8);
+			__m128i s1 = _mm_xor_si128(
+				_mm_xor_si128(ROTR_EPI32(w2, 17),
+					      ROTR_EPI32(w2, 19)),
+				_mm_srli_epi32(w2, 10));
+			next = _mm_add_epi32(next, s1);
+			w2 = _mm_slli_si128(next, 8);
+			s1 = _mm_xor_si128(_mm_xor_si128(ROTR_EPI32(w2, 17),
+							 ROTR_EPI32(w2, 19)),
+					   _mm_srli_epi32(w2, 10));
+			next = _mm_add_epi32(next, s1);
+			_mm_store_si128((__m128i *)&w[t], next);
+			x[0] = x[1];
+			x[1] = x[2];
+			x[2] = x[3];
+			x[3] = next;
+		}
+		run_rounds(state, w);
+	}
+}
+
+// SHA-NI: sha256rnds2 does two rounds per instruction, and
+// sha256msg1/sha256msg2 expand the message schedule.
+__attribute__((target("sha,sse4.1"))) static void
+compress_sha_ni(uint32_t state[8], const uint8_t *blocks, size_t count)
+{
+	const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+						 0x0405060700010203ULL);
+	// The instructions want the state as ABEF and CDGH
+	__m128i tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+	__m128i state1 = _mm_loadu_si128((const __m128i *)&state[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xB1); // CDAB
+	state1 = _mm_shuffle_epi32(state1, 0x1B); // EFGH
+	__m128i state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0); // CDGH
+	for (; count > 0; --count, blocks += 64) {
+		__m128i abef_save = state0;
+		__m128i cdgh_save = state1;
+		__m128i msg[4];
+		// Four rounds per group, schedule words for later groups are
+		// worked out alongside.
+		for (int i = 0; i < 16; ++i) {
+			if (i < 4)
+				msg[i] = _mm_shuffle_epi8(
+					_mm_loadu_si128(
+						(const __m128i *)(blocks +
+								  i * 16)),
+					byte_swap);
+			__m128i words = _mm_add_epi32(
+				msg[i % 4],
+				_mm_load_si128((const __m128i
+							*)&round_constants[i * 4]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, words);
+			if (i >= 3 && i < 15) {
+				__m128i &next = msg[(i + 1) % 4];
+				next = _mm_add_epi32(
+					next, _mm_alignr_epi8(msg[i % 4],
+							      msg[(i + 3) % 4],
+							      4));
+				next = _mm_sha256msg2_epu32(next, msg[i % 4]);
+			}
+			words = _mm_shuffle_epi32(words, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, words);
+			if (i >= 1 && i < 13)
+				msg[(i + 3) % 4] = _mm_sha256msg1_epu32(
+					msg[(i + 3) % 4], msg[i % 4]);
+		}
+		state0 = _mm_add_epi32(state0, abef_save);
+		state1 = _mm_add_epi32(state1, cdgh_save);
+	}
+	// Back to ABCD and EFGH
+	tmp = _mm_shuffle_epi32(state0, 0x1B); // FEBA
+	state1 = _mm_shuffle_epi32(state1, 0xB1); // DCHG
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0); // DCBA
+	state1 = _mm_alignr_epi8(state1, tmp, 8); // ABEF
+	_mm_storeu_si128((__m128i *)&state[0], state0);
+	_mm_storeu_si128((__m128i *)&state[4], state1);
+}
+// Multi-buffer hashing; each 32 bit lane of the vectors works on its own
+// message. Messages all have the same length, so their blocks line up.
+
+// Where each lane reads its blocks from. Whole blocks come straight from
+// the message, and the padded final block(s) from a copy in tail.
+struct LaneBlocks {
+	const uint8_t *message;
+	size_t whole_blocks;
+	alignas(16) uint8_t tail[128];
+
+	// Set up the lane for a message of len bytes
+	void start(const uint8_t *lane_message, size_t len)
+	{
+		message = lane_message;
+		whole_blocks = len / 64;
+		size_t tail_len = len % 64;
+		size_t tail_size = tail_len < 56 ? 64 : 128;
+		std::memset(tail, 0, tail_size);
+		std::memcpy(tail, message + whole_blocks * 64, tail_len);
+		tail[tail_len] = 0x80;
+		uint64_t bit_length = (uint64_t)len * 8;
+		for (int i = 0; i < 8; ++i)
+			tail[tail_size - 1 - i] = (uint8_t)(bit_length >> (i * 8));
+	}
+	const uint8_t *block(size_t index) const
+	{
+		if (index < whole_blocks)
+			return message + index * 64;
+		return tail + (index - whole_blocks) * 64;
+	}
+};
+
+// Number of blocks (padding included) in a message of len bytes
+static size_t padded_blocks(size_t len)
+{
+	return (len + 9 + 63) / 64;
+}
+
+// Write the state of every lane out as big endian digests
+static void store_digests(const uint32_t *lane_state, size_t lanes,
+			  size_t count, uint8_t *digests)
+{
+	for (size_t lane = 0; lane < count; ++lane) {
+		uint8_t *digest = digests + lane * sha256_digest_size;
+		for (int i = 0; i < 8; ++i) {
+			uint32_t word = lane_state[i * lanes + lane];
+			digest[i * 4] = (uint8_t)(word >> 24);
+			digest[i * 4 + 1] = (uint8_t)(word >> 16);
+			digest[i * 4 + 2] = (uint8_t)(word >> 8);
+			digest[i * 4 + 3] = (uint8_t)word;
+		}
+	}
+}
+
+// Load 32 bytes at offset into each of the 8 lanes' blocks, and transpose
+// them so w[i] holds (big endian) word i of every lane.
+__attribute__((target("avx2"))) static inline void
+load_words8(const uint8_t *const blocks[8], size_t offset, __m256i w[8])
+{
+	const __m256i byte_swap = _mm256_set_epi8(
+		12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3, 12, 13,
+		14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	__m256i r[8], t[8];
+	for (int i = 0; i < 8; ++i)
+		r[i] = _mm256_shuffle_epi8(
+			_mm256_loadu_si256(
+				(const __m256i *)(blocks[i] + offset)),
+			byte_swap);
+	// 8x8 transpose of 32 bit words
+	for (int i = 0; i < 8; i += 2) {
+		t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+		t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+	}
+	for (int i = 0; i < 8; i += 4) {
+		r[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+		r[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+		r[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+		r[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+	}
+	for (int i = 0; i < 4; ++i) {
+		w[i] = _mm256_permute2x128_si256(r[i], r[i + 4], 0x20);
+		w[i + 4] = _mm256_permute2x128_si256(r[i], r[i + 4], 0x31);
+	}
+}
+
+#define ROTR_EPI32_256(x, n)                      \
+	_mm256_or_si256(_mm256_srli_epi32((x), (n)), \
+			_mm256_slli_epi32((x), 32 - (n)))
+
+// 8 messages at a time with AVX2
+__attribute__((target("avx2"))) static void
+hash8_avx2(LaneBlocks lanes[8], size_t blocks, uint8_t *digests,
+	   size_t count)
+{
+	__m256i state[8];
+	for (int i = 0; i < 8; ++i)
+		state[i] = _mm256_set1_epi32((int)initial_state[i]);
+	for (size_t block = 0; block < blocks; ++block) {
+		const uint8_t *lane_blocks[8];
+		for (int lane = 0; lane < 8; ++lane)
+			lane_blocks[lane] = lanes[lane].block(block);
+		__m256i w[16];
+		load_words8(lane_blocks, 0, w);
+		load_words8(lane_blocks, 32, w + 8);
+		__m256i a = state[0], b = state[1], c = state[2], d = state[3];
+		__m256i e = state[4], f = state[5], g = state[6], h = state[7];
+		for (int t = 0; t < 64; ++t) {
+			if (t >= 16) {
+				__m256i w15 = w[(t + 1) & 15];
+				__m256i w2 = w[(t + 14) & 15];
+				__m256i s0 = _mm256_xor_si256(
+					_mm256_xor_si256(ROTR_EPI32_256(w15, 7),
+							 ROTR_EPI32_256(w15, 18)),
+					_mm256_srli_epi32(w15, 3));
+				__m256i s1 = _mm256_xor_si256(
+					_mm256_xor_si256(ROTR_EPI32_256(w2, 17),
+							 ROTR_EPI32_256(w2, 19)),
+					_mm256_srli_epi32(w2, 10));
+				w[t & 15] = _mm256_add_epi32(
+					_mm256_add_epi32(w[t & 15], s0),
+					_mm256_add_epi32(w[(t + 9) & 15], s1));
+			}
+			__m256i s1 = _mm256_xor_si256(
+				_mm256_xor_si256(ROTR_EPI32_256(e, 6),
+						 ROTR_EPI32_256(e, 11)),
+				ROTR_EPI32_256(e, 25));
+			__m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f),
+						      _mm256_andnot_si256(e, g));
+			__m256i t1 = _mm256_add_epi32(
+				_mm256_add_epi32(_mm256_add_epi32(h, s1), ch),
+				_mm256_add_epi32(
+					_mm256_set1_epi32(
+						(int)round_constants[t]),
+					w[t & 15]));
+			__m256i s0 = _mm256_xor_si256(
+				_mm256_xor_si256(ROTR_EPI32_256(a, 2),
+						 ROTR_EPI32_256(a, 13)),
+				ROTR_EPI32_256(a, 22));
+			__m256i maj = _mm256_or_si256(
+				_mm256_and_si256(a, b),
+				_mm256_and_si256(c, _mm256_or_si256(a, b)));
+			h = g;
+			g = f;
+			f = e;
+			e = _mm256_add_epi32(d, t1);
+			d = c;
+			c = b;
+			b = a;
+			a = _mm256_add_epi32(t1, _mm256_add_epi32(s0, maj));
+		}
+		state[0] = _mm256_add_epi32(state[0], a);
+		state[1] = _mm256_add_epi32(state[1], b);
+		state[2] = _mm256_add_epi32(state[2], c);
+		state[3] = _mm256_add_epi32(state[3], d);
+		state[4] = _mm256_add_epi32(state[4], e);
+		state[5] = _mm256_add_epi32(state[5], f);
+		state[6] = _mm256_add_epi32(state[6], g);
+		state[7] = _mm256_add_epi32(state[7], h);
+	}
+	alignas(32) uint32_t lane_state[8 * 8];
+	for (int i = 0; i < 8; ++i)
+		_mm256_store_si256((__m256i *)&lane_state[i * 8], state[i]);
+	store_digests(lane_state, 8, count, digests);
+}
+
+// 16 messages at a time with AVX-512. (GCC 12's AVX-512 intrinsics trip
+// -Wmaybe-uninitialized on their own internals.)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+__attribute__((target("avx512f,avx2"))) static void
+hash16_avx512(LaneBlocks lanes[16], size_t blocks, uint8_t *digests,
+	      size_t count)
+{
+	__m512i state[8];
+	for (int i = 0; i < 8; ++i)
+		state[i] = _mm512_set1_epi32((int)initial_state[i]);
+	for (size_t block = 0; block < blocks; ++block) {
+		const uint8_t *lane_blocks[16];
+		for (int lane = 0; lane < 16; ++lane)
+			lane_blocks[lane] = lanes[lane].block(block);
+		// Transposed in two halves of 8 lanes
+		__m256i low[16], high[16];
+		load_words8(lane_blocks, 0, low);
+		load_words8(lane_blocks, 32, low + 8);
+		load_words8(lane_blocks + 8, 0, high);
+		load_words8(lane_blocks + 8, 32, high + 8);
+		__m512i w[16];
+		for (int i = 0; i < 16; ++i)
+			w[i] = _mm512_inserti64x4(_mm512_castsi256_si512(low[i]),
+						  high[i], 1);
+		__m512i a = state[0], b = state[1], c = state[2], d = state[3];
+		__m512i e = state[4], f = state[5], g = state[6], h = state[7];
+		for (int t = 0; t < 64; ++t) {
+			if (t >= 16) {
+				__m512i w15 = w[(t + 1) & 15];
+				__m512i w2 = w[(t + 14) & 15];
+				__m512i s0 = _mm512_ternarylogic_epi32(
+					_mm512_ror_epi32(w15, 7),
+					_mm512_ror_epi32(w15, 18),
+					_mm512_srli_epi32(w15, 3), 0x96);
+				__m512i s1 = _mm512_ternarylogic_epi32(
+					_mm512_ror_epi32(w2, 17),
+					_mm512_ror_epi32(w2, 19),
+					_mm512_srli_epi32(w2, 10), 0x96);
+				w[t & 15] = _mm512_add_epi32(
+					_mm512_add_epi32(w[t & 15], s0),
+					_mm512_add_epi32(w[(t + 9) & 15], s1));
+			}
+			// 0x96 is a three way xor, 0xCA e ? f : g (ch), and
+			// 0xE8 the majority of a, b and c (maj).
+			__m512i s1 = _mm512_ternarylogic_epi32(
+				_mm512_ror_epi32(e, 6), _mm512_ror_epi32(e, 11),
+				_mm512_ror_epi32(e, 25), 0x96);
+			__m512i ch = _mm512_ternarylogic_epi32(e, f, g, 0xCA);
+			__m512i t1 = _mm512_add_epi32(
+				_mm512_add_epi32(_mm512_add_epi32(h, s1), ch),
+				_mm512_add_epi32(
+					_mm512_set1_epi32(
+						(int)round_constants[t]),
+					w[t & 15]));
+			__m512i s0 = _mm512_ternarylogic_epi32(
+				_mm512_ror_epi32(a, 2), _mm512_ror_epi32(a, 13),
+				_mm512_ror_epi32(a, 22), 0x96);
+			__m512i maj = _mm512_ternarylogic_epi32(a, b, c, 0xE8);
+			h = g;
+			g = f;
+			f = e;
+			e = _mm512_add_epi32(d, t1);
+			d = c;
+			c = b;
+			b = a;
+			a = _mm512_add_epi32(t1, _mm512_add_epi32(s0, maj));
+		}
+		state[0] = _mm512_add_epi32(state[0], a);
+		state[1] = _mm512_add_epi32(state[1], b);
+		state[2] = _mm512_add_epi32(state[2], c);
+		state[3] = _mm512_add_epi32(state[3], d);
+		state[4] = _mm512_add_epi32(state[4], e);
+		state[5] = _mm512_add_epi32(state[5], f);
+		state[6] = _mm512_add_epi32(state[6], g);
+		state[7] = _mm512_add_epi32(state[7], h);
+	}
+	alignas(64) uint32_t lane_state[8 * 16];
+	for (int i = 0; i < 8; ++i)
+		_mm512_store_si512((__m512i *)&lane_state[i * 16], state[i]);
+	store_digests(lane_state, 16, count, digests);
+}
+#pragma GCC diagnostic pop
+
+// Whether the CPU (and OS) can run the AVX-512 multi-buffer hashing.
+static bool avx512_supported(void)
+{
+	unsigned eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE))
+		return false;
+	if (__get_cpuid_max(0, nullptr) < 7)
+		return false;
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	if (!(ebx & bit_AVX512F) || !(ebx & bit_AVX2))
+		return false;
+	// The OS must save the AVX (0x6) and AVX-512 (0xe0) state.
+	uint32_t xcr0_low, xcr0_high;
+	__asm__("xgetbv" : "=a"(xcr0_low), "=d"(xcr0_high) : "c"(0));
+	return (xcr0_low & 0xe6) == 0xe6;
+}
+
+#endif
+
+// Whether this CPU (and OS) can run the passed backend.
+bool Sha256::supported(Sha256Backend backend)
+{
+	if (backend == SHA256_SCALAR)
+		return true;
+#ifdef SHA256_X86
+	unsigned eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return false;
+	bool ssse3 = ecx & bit_SSSE3;
+	bool sse41 = ecx & bit_SSE4_1;
+	// AVX state must be enabled by the OS, not just the CPU
+	bool avx_enabled = false;
+	if ((ecx & bit_OSXSAVE) && (ecx & bit_AVX)) {
+		uint32_t xcr0_low, xcr0_high;
+		__asm__("xgetbv" : "=a"(xcr0_low), "=d"(xcr0_high) : "c"(0));
+		avx_enabled = (xcr0_low & 0x6) == 0x6;
+	}
+	if (__get_cpuid_max(0, nullptr) < 7)
+		return false;
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	if (backend == SHA256_AVX2)
+		return avx_enabled && (ebx & bit_AVX2) && (ebx & bit_BMI2);
+	if (backend == SHA256_SHA_NI)
+		return ssse3 && sse41 && (ebx & bit_SHA);
+#endif
+	return false;
+}
+
+// The backend picked for this CPU.
+Sha256Backend Sha256::best_backend(void)
+{
+	// Only detected once (thread safe static initialization)
+	static const Sha256Backend best =
+		supported(SHA256_SHA_NI) ? SHA256_SHA_NI :
+		supported(SHA256_AVX2)	 ? SHA256_AVX2 :
+					   SHA256_SCALAR;
+	return best;
+}
+
+const char *Sha256::name(Sha256Backend backend)
+{
+	switch (backend) {
+	case SHA256_SHA_NI:
+		return "sha_ni";
+	case SHA256_AVX2:
+		return "avx2";
+	default:
+		return "scalar";
+	}
+}
+
+Sha256::Compress Sha256::compress_for(Sha256Backend backend)
+{
+#ifdef SHA256_X86
+	if (backend == SHA256_SHA_NI)
+		return compress_sha_ni;
+	if (backend == SHA256_AVX2)
+		return compress_avx2;
+#endif
+	return compress_scalar;
+}
+
+// Start a hash using the best backend for this CPU.
+Sha256::Sha256(void) : Sha256(best_backend())
+{
+}
+
+// Start a hash using the passed backend, which must be supported.
+Sha256::Sha256(Sha256Backend backend) : compress(compress_for(backend))
+{
+	reset();
+}
+
+// Start over, hashing nothing.
+void Sha256::reset(void)
+{
+	std::memcpy(state, initial_state, sizeof(state));
+	buffered = 0;
+	length = 0;
+}
+
+// Hash in len more bytes.
+Sha256 &Sha256::update(const void *data, size_t len)
+{
+	const uint8_t *bytes = (const uint8_t *)data;
+	length += len;
+	// Top up a partial block first
+	if (buffered > 0) {
+		size_t take = std::min(len, sizeof(buffer) - buffered);
+		std::memcpy(buffer + buffered, bytes, take);
+		buffered += take;
+		bytes += take;
+		len -= take;
+		if (buffered < sizeof(buffer))
+			return *this;
+		compress(state, buffer, 1);
+		buffered = 0;
+	}
+	// Whole blocks straight from the input
+	if (len >= 64) {
+		compress(state, bytes, len / 64);
+		bytes += len & ~(size_t)63;
+		len &= 63;
+	}
+	std::memcpy(buffer, bytes, len);
+	buffered = len;
+	return *this;
+}
+
+// Write the digest of everything hashed to digest (32 bytes).
+// reset() must be called before hashing anything else.
+void Sha256::finish(uint8_t *digest)
+{
+	uint64_t bit_length = length * 8;
+	// 0x80, zeros up to 56 bytes into a block, then the bit length
+	uint8_t padding[72] = { 0x80 };
+	size_t padding_len = (buffered < 56 ? 56 : 120) - buffered;
+	for (int i = 0; i < 8; ++i)
+		padding[padding_len + i] = (uint8_t)(bit_length >> (56 - i * 8));
+	update(padding, padding_len + 8);
+	for (int i = 0; i < 8; ++i) {
+		digest[i * 4] = (uint8_t)(state[i] >> 24);
+		digest[i * 4 + 1] = (uint8_t)(state[i] >> 16);
+		digest[i * 4 + 2] = (uint8_t)(state[i] >> 8);
+		digest[i * 4 + 3] = (uint8_t)state[i];
+	}
+}
+
+// Hash len bytes of data into digest, in one go.
+void Sha256::hash(const void *data, size_t len, uint8_t *digest)
+{
+	Sha256 sha;
+	sha.update(data, len);
+	sha.finish(digest);
+}
+
+// Whether hash_many can hash batch messages at once (1, 8 with AVX2 or 16
+// with AVX-512) on this CPU.
+bool Sha256::lanes_supported(size_t batch)
+{
+#ifdef SHA256_X86
+	if (batch == 16)
+		return avx512_supported();
+	if (batch == 8)
+		return supported(SHA256_AVX2);
+#endif
+	return batch == 1;
+}
+
+// Number of messages hash_many is fastest hashing at once on this CPU (1
+// if it hashes them one at a time).
+size_t Sha256::lanes(void)
+{
+	static const size_t lanes = lanes_supported(16)	     ? 16 :
+				    supported(SHA256_SHA_NI) ? 1 :
+				    lanes_supported(8)	     ? 8 :
+							       1;
+	return lanes;
+}
+
+// Hash count messages of len bytes each. The i'th message is at
+// messages[i], and its digest is written to digests + i * 32.
+// batch messages are hashed at once (see lanes()).
+void Sha256::hash_many(const uint8_t *const *messages, size_t count,
+		       size_t len, uint8_t *digests, size_t batch)
+{
+#ifdef SHA256_X86
+	if (batch > 1) {
+		LaneBlocks lane_blocks[16];
+		size_t blocks = padded_blocks(len);
+		// Every lane costs the same, used or not, so a mostly empty
+		// batch is quicker hashed a message at a time.
+		static const size_t min_lanes_divisor =
+			supported(SHA256_SHA_NI) ? 2 : 4;
+		for (size_t first = 0; first < count; first += batch) {
+			size_t in_batch = std::min(batch, count - first);
+			if (in_batch * min_lanes_divisor < batch) {
+				for (size_t i = first; i < count; ++i)
+					hash(messages[i], len,
+					     digests + i * sha256_digest_size);
+				break;
+			}
+			// A short batch fills its spare lanes with copies of
+			// the last message, and throws their digests away.
+			for (size_t lane = 0; lane < batch; ++lane)
+				lane_blocks[lane].start(
+					messages[first +
+						 std::min(lane, in_batch - 1)],
+					len);
+			uint8_t *out = digests + first * sha256_digest_size;
+			if (batch == 16)
+				hash16_avx512(lane_blocks, blocks, out,
+					      in_batch);
+			else
+				hash8_avx2(lane_blocks, blocks, out, in_batch);
+		}
+		return;
+	}
+#endif
+	for (size_t i = 0; i < count; ++i)
+		hash(messages[i], len, digests + i * sha256_digest_size);
+}
@@ -0,0 +1,74 @@
+/*======================================================================
+COIS-4310H - Sha256
+Name: Sha256.hpp
+Purpose: SHA-256 for the MessageLayer checksums, using the fastest
+	implementation the CPU supports; the SHA extensions (SHA-NI), AVX2
+	(vectorized message schedule, BMI2 rotates), or portable C++. The
+	backend is picked once, on first use, by CPU feature detection.
+	Every backend produces the same digests as picosha2.
+
+	Batches of equal length messages (e.g. headers) can be hashed
+	together with hash_many, which runs 8 (AVX2) or 16 (AVX-512)
+	messages through the rounds at once, one per vector lane.
+
+Compilation: Please use the provided Make file that will make both the
+	client and the server.
+----------------------------------------------------------------------*/
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// The SHA-256 implementations, slowest first
+enum Sha256Backend { SHA256_SCALAR = 0, SHA256_AVX2, SHA256_SHA_NI };
+
+// Number of bytes in a SHA-256 digest
+static const size_t constexpr sha256_digest_size = 32;
+
+class Sha256 {
+	// Compression function of the backend in use; consumes count
+	// whole 64 byte blocks into the state.
+	using Compress = void (*)(uint32_t state[8], const uint8_t *blocks,
+				  size_t count);
+	Compress compress;
+	uint32_t state[8];
+	// Partial block waiting for more input
+	uint8_t buffer[64];
+	size_t buffered;
+	// Total bytes hashed so far
+	uint64_t length;
+	static Compress compress_for(Sha256Backend backend);
+
+    public:
+	// Start a hash using the best backend for this CPU.
+	Sha256(void);
+	// Start a hash using the passed backend, which must be supported.
+	explicit Sha256(Sha256Backend backend);
+	// Start over, hashing nothing.
+	void reset(void);
+	// Hash in len more bytes.
+	Sha256 &update(const void *data, size_t len);
+	// Write the digest of everything hashed to digest (32 bytes).
+	// reset() must be called before hashing anything else.
+	void finish(uint8_t *digest);
+
+	// Hash len bytes of data into digest, in one go.
+	static void hash(const void *data, size_t len, uint8_t *digest);
+	// Hash count messages of len bytes each. The i'th message is at
+	// messages[i], and its digest is written to digests + i * 32.
+	// batch messages are hashed at once (see lanes()).
+	static void hash_many(const uint8_t *const *messages, size_t count,
+			      size_t len, uint8_t *digests,
+			      size_t batch = lanes());
+	// Number of messages hash_many is fastest hashing at once on this
+	// CPU (1 if it hashes them one at a time).
+	static size_t lanes(void);
+	// Whether hash_many can hash batch messages at once (1, 8 with
+	// AVX2 or 16 with AVX-512) on this CPU.
+	static bool lanes_supported(size_t batch);
+	// The backend picked for this CPU.
+	static Sha256Backend best_backend(void);
+	// Whether this CPU (and OS) can run the passed backend.
+	static bool supported(Sha256Backend backend);
+	static const char *name(Sha256Backend backend);
+};
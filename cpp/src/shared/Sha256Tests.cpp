@@ -0,0 +1,122 @@
+/*======================================================================
+COIS-4310H - Sha256Tests
+Name: Sha256Tests.cpp
+Purpose: Test that every SHA-256 backend this CPU supports produces the
+	same digests as picosha2, whether the input is hashed in one go or
+	in pieces, and that hash_many agrees with hashing one at a time.
+
+Usage: ./Sha256Tests
+	(No output means the tests passed)
+	if there are assertion errors, the tests failed.
+
+Description of Parameters
+	None
+
+Creation: Please use the provided Make file that will make both the
+	client and the server.
+----------------------------------------------------------------------*/
+
+#include <cassert>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <random>
+#include "Sha256.hpp"
+#include "picosha2.hpp"
+
+static std::string hex_digest(Sha256 &sha, const std::string &message)
+{
+	uint8_t digest[sha256_digest_size];
+	sha.reset();
+	sha.update(message.data(), message.size()).finish(digest);
+	return picosha2::bytes_to_hex_string(digest,
+					     digest + sha256_digest_size);
+}
+
+int main(void)
+{
+	// The best backend is always one that is supported
+	assert(Sha256::supported(Sha256::best_backend()));
+	assert(Sha256::supported(SHA256_SCALAR));
+	std::minstd_rand random(4310);
+	for (int b = SHA256_SCALAR; b <= SHA256_SHA_NI; ++b) {
+		Sha256Backend backend = (Sha256Backend)b;
+		if (!Sha256::supported(backend))
+			continue;
+		Sha256 sha(backend);
+		// Known answers (FIPS 180-2)
+		assert(hex_digest(sha, "") ==
+		       "e3b0c44298fc1c149afbf4c8996fb924"
+		       "27ae41e4649b934ca495991b7852b855");
+		assert(hex_digest(sha, "abc") ==
+		       "ba7816bf8f01cfea414140de5dae2223"
+		       "b00361a396177a9cb410ff61f20015ad");
+		assert(hex_digest(sha, "abcdbcdecdefdefgefghfghighijhijkijkl"
+				       "jklmklmnlmnomnopnopq") ==
+		       "248d6a61d20638b8e5c026930c3e6039"
+		       "a33ce45964ff2167f6ecedd419db06c1");
+		// Every length across a few blocks (and both padding cases),
+		// in one go and in random pieces, against picosha2.
+		for (size_t len = 0; len < 300; ++len) {
+			std::string message(len, '\0');
+			for (auto &c : message)
+				c = (char)random();
+			std::string expected = picosha2::hash256_hex_string(message);
+			assert(hex_digest(sha, message) == expected);
+			uint8_t digest[sha256_digest_size];
+			sha.reset();
+			for (size_t done = 0; done < len;) {
+				size_t piece = std::min(len - done,
+							(size_t)random() % 80);
+				sha.update(message.data() + done, piece);
+				done += piece;
+			}
+			sha.finish(digest);
+			assert(picosha2::bytes_to_hex_string(
+				       digest, digest + sha256_digest_size) ==
+			       expected);
+		}
+	}
+	// The one shot hash uses the best backend
+	uint8_t digest[sha256_digest_size];
+	Sha256::hash("abc", 3, digest);
+	assert(picosha2::bytes_to_hex_string(digest,
+					     digest + sha256_digest_size) ==
+	       "ba7816bf8f01cfea414140de5dae2223"
+	       "b00361a396177a9cb410ff61f20015ad");
+	// Batches, short or spanning several rounds of lanes, of messages
+	// around the block and padding boundaries, and header sized ones.
+	assert(Sha256::lanes_supported(Sha256::lanes()));
+	const size_t batches[] = { 1, 8, 16 };
+	const size_t lengths[] = { 0, 1, 55, 56, 63, 64, 119, 120, 134, 300 };
+	for (size_t batch : batches) {
+		if (!Sha256::lanes_supported(batch))
+			continue;
+		for (size_t len : lengths) {
+			for (size_t count = 0; count <= 40; count += 3) {
+				std::vector<std::string> messages(count);
+				std::vector<const uint8_t *> pointers;
+				for (auto &message : messages) {
+					message.resize(len);
+					for (auto &c : message)
+						c = (char)random();
+					pointers.push_back(
+						(const uint8_t *)message.data());
+				}
+				std::vector<uint8_t> digests(
+					count * sha256_digest_size);
+				Sha256::hash_many(pointers.data(), count, len,
+						  digests.data(), batch);
+				for (size_t i = 0; i < count; ++i) {
+					Sha256::hash(messages[i].data(), len,
+						     digest);
+					assert(std::equal(
+						digest,
+						digest + sha256_digest_size,
+						digests.begin() +
+							i * sha256_digest_size));
+				}
+			}
+		}
+	}
+}